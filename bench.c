@@ -0,0 +1,262 @@
+/*
+ Times the library's main calls over a corpus of ._ files, such as
+ dotUGen writes.
+
+ Usage: dotUBench [-i iterations] dir
+
+ Every call is timed on its own, and the report gives per-call
+ percentiles, throughput over the bytes each call handled and how many
+ allocations it made through the DotU allocator.
+*/
+
+#include "dotu.h"
+#include "dotutable.h"
+#include <dirent.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Allocator that counts what the library asks for */
+static long numAllocs=0;
+
+static void *
+countingAlloc(size_t size, void *ctx){
+	numAllocs++;
+	return malloc(size);
+}
+
+static void
+countingRelease(void *ptr, size_t size, void *ctx){
+	free(ptr);
+}
+
+struct Op {
+	const char * name;
+	double * samples;    /* Nanoseconds per call */
+	long numSamples;
+	long capacity;
+	double bytes;        /* Handled by all the calls together */
+	long allocs;
+};
+
+#define OP_READ    0
+#define OP_SETOFF  1
+#define OP_GET     2
+#define OP_ADD     3
+#define OP_RM      4
+#define OP_WRITE   5
+#define OP_DECODE  6
+#define NUMOPS     7
+
+static struct Op ops[NUMOPS]={
+	{"readDotUFile",NULL,0,0,0,0},
+	{"setOffsets",NULL,0,0,0,0},
+	{"getAttrValue",NULL,0,0,0,0},
+	{"addAttr",NULL,0,0,0,0},
+	{"rmAttr",NULL,0,0,0,0},
+	{"createDotUFileSpecName",NULL,0,0,0,0},
+	{"decodeDotUAttrs",NULL,0,0,0,0}
+};
+
+static struct timespec started;
+static long startAllocs;
+
+static void
+startTimer(void){
+	startAllocs=numAllocs;
+	clock_gettime(CLOCK_MONOTONIC,&started);
+}
+
+static void
+stopTimer(int op, double bytes){
+	struct timespec stopped;
+	struct Op *o=&ops[op];
+
+	clock_gettime(CLOCK_MONOTONIC,&stopped);
+	if(o->numSamples==o->capacity){
+		o->capacity=(o->capacity==0) ? 1024 : o->capacity*2;
+		o->samples=(double*)realloc(o->samples,sizeof(double)*o->capacity);
+		if(o->samples==NULL){
+			fprintf(stderr,"Out of memory.\n");
+			exit(1);
+		}
+	}
+	o->samples[o->numSamples++]=(double)(stopped.tv_sec-started.tv_sec)*1e9+(double)(stopped.tv_nsec-started.tv_nsec);
+	o->bytes+=bytes;
+	o->allocs+=numAllocs-startAllocs;
+}
+
+static int
+compareDoubles(const void *a, const void *b){
+	double x=*(const double*)a;
+	double y=*(const double*)b;
+	return (x>y)-(x<y);
+}
+
+static int
+compareStrings(const void *a, const void *b){
+	return strcmp(*(char * const *)a,*(char * const *)b);
+}
+
+static double
+percentile(const struct Op *o, double p){
+	long i=(long)(p*(double)(o->numSamples-1)+0.5);
+	return o->samples[i];
+}
+
+static void
+report(void){
+	struct Op *o;
+	double total;
+	long i;
+	int op;
+
+	printf("%-24s %8s %9s %9s %9s %9s %9s %9s %9s\n","op","calls","mean_us","p50_us","p90_us","p99_us","max_us","MB/s","allocs");
+	for(op=0;op<NUMOPS;op++){
+		o=&ops[op];
+		if(o->numSamples==0) continue;
+		qsort(o->samples,o->numSamples,sizeof(double),compareDoubles);
+		for(total=0,i=0;i<o->numSamples;i++) total+=o->samples[i];
+		printf("%-24s %8ld %9.2f %9.2f %9.2f %9.2f %9.2f %9.1f %9.2f\n",o->name,o->numSamples,
+		       total/o->numSamples/1e3,percentile(o,0.50)/1e3,percentile(o,0.90)/1e3,percentile(o,0.99)/1e3,
+		       o->samples[o->numSamples-1]/1e3,(total>0) ? o->bytes/(total/1e9)/1e6 : 0.0,
+		       (double)o->allocs/o->numSamples);
+	}
+}
+
+/* The ._ files in dir, sorted */
+static char **
+listCorpus(const char *dir, long *numFiles){
+	DIR *d=opendir(dir);
+	struct dirent *entry;
+	char **names=NULL;
+	long capacity=0;
+
+	*numFiles=0;
+	if(d==NULL) return NULL;
+	while((entry=readdir(d))!=NULL){
+		if(strncmp(entry->d_name,"._",2)!=0) continue;
+		if(*numFiles==capacity){
+			capacity=(capacity==0) ? 1024 : capacity*2;
+			names=(char**)realloc(names,sizeof(char*)*capacity);
+			if(names==NULL) break;
+		}
+		names[*numFiles]=(char*)malloc(strlen(dir)+strlen(entry->d_name)+2);
+		if(names[*numFiles]==NULL) break;
+		sprintf(names[(*numFiles)++],"%s/%s",dir,entry->d_name);
+	}
+	closedir(d);
+	if(names!=NULL) qsort(names,*numFiles,sizeof(char*),compareStrings);
+	return names;
+}
+
+/* Every timed call on one file */
+static int
+benchFile(const char *fileName, const char *outName){
+	struct DotU dotU;
+	struct DotUAttrTable table;
+	struct stat statBuffer;
+	FILE *file;
+	char *image;
+	const struct ExtAttr *attr;
+	char **names;
+	uint32_t *lengths;
+	uint32_t numAttrs,cursor,i;
+	double size;
+
+	if(stat(fileName,&statBuffer)!=0) return -1;
+	size=(double)statBuffer.st_size;
+	startTimer();
+	dotU=readDotUFile(fileName);
+	stopTimer(OP_READ,size);
+	if(dotU.header.magic!=DOTUMAGIC) return -1;
+
+	startTimer();
+	setOffsets(&dotU);
+	stopTimer(OP_SETOFF,size);
+
+	/* Names are copied first, since addAttr and rmAttr may move them */
+	for(numAttrs=0,cursor=0;nextDotUAttr(&dotU,&cursor)!=NULL;numAttrs++);
+	names=(char**)malloc(sizeof(char*)*(numAttrs+1));
+	lengths=(uint32_t*)malloc(sizeof(uint32_t)*(numAttrs+1));
+	if(names==NULL || lengths==NULL) return -1;
+	for(i=0,cursor=0;(attr=nextDotUAttr(&dotU,&cursor))!=NULL;i++){
+		names[i]=(char*)malloc(strlen(attr->name)+1);
+		if(names[i]==NULL) return -1;
+		strcpy(names[i],attr->name);
+		lengths[i]=attr->valueLength;
+	}
+	for(i=0;i<numAttrs;i++){
+		startTimer();
+		getAttrValue(dotU,names[i]);
+		stopTimer(OP_GET,lengths[i]);
+	}
+
+	startTimer();
+	addAttr(&dotU,"com.example.bench","benchmark value");
+	stopTimer(OP_ADD,sizeof("benchmark value"));
+	startTimer();
+	rmAttr(&dotU,"com.example.bench");
+	stopTimer(OP_RM,sizeof("benchmark value"));
+
+	startTimer();
+	createDotUFileSpecName(dotU,fileName,outName);
+	stopTimer(OP_WRITE,size);
+
+	for(i=0;i<numAttrs;i++) free(names[i]);
+	free(names);
+	free(lengths);
+	freeDotU(&dotU);
+
+	/* The column decode, on an image already in memory */
+	image=(char*)malloc(statBuffer.st_size+1);
+	file=fopen(fileName,"rb");
+	if(image==NULL || file==NULL || fread(image,1,statBuffer.st_size,file)!=(size_t)statBuffer.st_size){
+		if(file!=NULL) fclose(file);
+		free(image);
+		return -1;
+	}
+	fclose(file);
+	startTimer();
+	decodeDotUAttrs(image,(uint32_t)statBuffer.st_size,&table);
+	stopTimer(OP_DECODE,size);
+	freeDotUAttrTable(&table);
+	free(image);
+	return 0;
+}
+
+int
+main(int argc, char **argv){
+	struct DotUAllocator counting={countingAlloc,countingRelease,NULL};
+	char outName[MAXDIRNAMESIZE+MAXFILENAMESIZE+2];
+	char **fileNames;
+	long numFiles,iterations=1,failed=0,i,n;
+	int option;
+
+	while((option=getopt(argc,argv,"i:"))!=-1){
+		if(option=='i') iterations=strtol(optarg,NULL,10);
+		else break;
+	}
+	if(optind!=argc-1 || iterations<1){
+		fprintf(stderr,"usage: dotUBench [-i iterations] dir\n");
+		return 2;
+	}
+	fileNames=listCorpus(argv[optind],&numFiles);
+	if(numFiles==0){
+		fprintf(stderr,"No ._ files in %s\n",argv[optind]);
+		return 1;
+	}
+	/* Written back out beside the corpus, where listCorpus won't see it */
+	snprintf(outName,sizeof(outName),"%s/bench-out",argv[optind]);
+	setDotUAllocator(&counting);
+	for(n=0;n<iterations;n++){
+		for(i=0;i<numFiles;i++){
+			if(benchFile(fileNames[i],outName)!=0) failed++;
+		}
+	}
+	remove(outName);
+	printf("%ld files x %ld iterations, %ld failed\n",numFiles,iterations,failed);
+	report();
+	for(i=0;i<numFiles;i++) free(fileNames[i]);
+	free(fileNames);
+	return failed!=0;
+}
@@ -1,13 +1,93 @@
-#include "dotu.h"
+#include "dotupriv.h"
+#include "dotuname.h"
+#include <errno.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+
+static void defaultLogHandler(int level, int code, const char *subject, const char *message, void *ctx);
+
+static int logLevel=DOTU_LOG_ERROR;
+static DotULogHandler logHandler=defaultLogHandler;
+static void *logCtx=NULL;
+
+static void
+defaultLogHandler(int level, int code, const char *subject, const char *message, void *ctx){
+	if(subject!=NULL) fprintf(stderr,"dotu: %s: %s\n",subject,message);
+	else fprintf(stderr,"dotu: %s\n",message);
+}
+
+void
+setDotULogLevel(int level){
+	logLevel=level;
+}
+
+int
+getDotULogLevel(void){
+	return logLevel;
+}
+
+void
+setDotULogHandler(DotULogHandler handler, void *ctx){
+	logHandler=handler;
+	logCtx=ctx;
+}
+
+const char*
+strDotUError(int code){
+	switch(code){
+		case DOTU_OK:        return "Success";
+		case DOTU_ENOTFOUND: return "Not found";
+		case DOTU_EIO:       return "I/O error";
+		case DOTU_ENOMEM:    return "Out of memory";
+		case DOTU_EFORMAT:   return "Not a valid AppleDouble file";
+		case DOTU_EENTRY:    return "Unsupported AppleDouble entry";
+		case DOTU_EINVAL:    return "Invalid argument";
+	}
+	return "Unknown error";
+}
+
+static int
+dotuLog(int level, int code, const char *subject, const char *message){
+	if(level<=logLevel && logHandler!=NULL) logHandler(level,code,subject,message,logCtx);
+	return code;
+}
+
+int
+dotuError(int code, const char *subject, const char *message){
+	return dotuLog(DOTU_LOG_ERROR,code,subject,message);
+}
+
+int
+dotuWarn(int code, const char *subject, const char *message){
+	return dotuLog(DOTU_LOG_WARN,code,subject,message);
+}
+
+void
+dotuTrace(const char *format, ...){
+	char message[512];
+	size_t length;
+	va_list args;
+
+	if(logLevel<DOTU_LOG_DEBUG || logHandler==NULL) return;
+	va_start(args,format);
+	vsnprintf(message,sizeof(message),format,args);
+	va_end(args);
+	/* The handler does its own line endings */
+	length=strlen(message);
+	while(length>0 && message[length-1]=='\n') message[--length]='\0';
+	logHandler(DOTU_LOG_DEBUG,DOTU_OK,NULL,message,logCtx);
+}
 
 
 void 
 printChar(char thisChar){
 	if((thisChar>=48 && thisChar<=125)){
-		if(DEBUG==1) printf("%c",thisChar);
+		printf("%c",thisChar);
 	} 
 	else {
-		if(DEBUG==1) printf("%.2X",thisChar);
+		printf("%.2X",(unsigned char)thisChar);
 	}
 }
 
@@ -25,6 +105,8 @@ bufWrite(char* buf,uint32_t startIndex,char* data,uint32_t length){
 uint32_t 
 toBigEndian(char* charArray, uint32_t numBytes){
 	uint32_t i,total;
+	if(numBytes==4) return DOTU_BE32(charArray);
+	if(numBytes==2) return DOTU_BE16(charArray);
 	total=0;
 	for(i=0;i<numBytes;i++){
 		total = total*256 + (unsigned char) charArray[i];
@@ -48,11 +130,16 @@ toSmallEndian(char* num, uint32_t numBytes){
    the dot-underscore file. */
 uint32_t 
 sizeNeeded(struct DotU dotU){
+	return sizeDotU(&dotU);
+}
+
+uint32_t
+sizeDotU(const struct DotU *dotU){
 	uint32_t max=0;
 	int i;
-	for(i=0;i<dotU.header.numEntries;i++){
-		if(dotU.entry[i].offset+dotU.entry[i].length>max){
-			max = dotU.entry[i].offset+dotU.entry[i].length;
+	for(i=0;i<dotU->header.numEntries;i++){
+		if(dotU->entry[i].offset+dotU->entry[i].length>max){
+			max = dotU->entry[i].offset+dotU->entry[i].length;
 		}
 	}
 	return max;
@@ -78,326 +165,574 @@ attrHdrSize(uint32_t nameLength){
 	return ((sizeof(char)*(11+(uint32_t)nameLength /* +1 */) + bitFilter) & ~bitFilter);
 }
 
-struct DotU 
-readDotUFile(const char *fileName){
-	struct stat statBuffer;
+/* Reads exactly length bytes from fd at offset, retrying short reads */
+static int
+readFully(int fd, char *buf, uint32_t length, uint32_t offset){
+	ssize_t got;
+	uint32_t done=0;
+	while(done<length){
+		got=pread(fd,buf+done,length-done,(off_t)offset+done);
+		if(got<0 && errno==EINTR) continue;
+		if(got<=0) return -1;
+		done+=(uint32_t)got;
+	}
+	return 0;
+}
+
+/* Frees whatever the parse had allocated and marks the DotU bad */
+static int
+badDotU(struct DotU *dotU, int code, const char *reason){
+	dotuArenaRelease(dotU->arena);
+	dotU->arena=NULL;
+	dotU->entry=NULL;
+	dotU->header.numEntries=0;
+	dotU->header.magic=0;
+	return dotuError(code,NULL,reason);
+}
+
+/* Parses an image in place.  The arena's first block takes the entry
+   table and the attr list and, if copying, the copies detachDotU is
+   about to make: names, values and the other entries can't add up to
+   more than the image, plus alignment and a terminator per copy. */
+static int
+parseDotUImage(const char *buf, uint32_t length, uint32_t fileLength, struct DotU *dotU, int copying){
+	char *dotUBuffer=(char *)buf;
 	uint32_t i;
 	uint32_t entryCount,dotUOffset;
-	int fileDescriptor;
-	char *data;
-	FILE *dotUFile;
-	char *dotUBuffer;
-	int readChar;
-	uint32_t fileLength;
-	
-	struct DotU dotU;
+	struct DotUEntry *entry;
 	struct ExtAttr *attrs;
-	char *entryName;
-	char *entryValue;
-	uint32_t charNum;
 	uint8_t entryNameLength;
 	uint32_t entryValueLength;
 	uint32_t entryHeaderOffset;
 	uint32_t entryValueOffset;
-	char attrFlags[2];
+	uint32_t limit,numAttrs;
+	int seenFinder=0,seenResource=0;
 
-	dotU.header.magic=0; /* If it's a bad dotU, magic will be != to DOTUMAGIC */
-	
-	/* Note: Using fstat() to obtain size based on advice from
-	 https://www.securecoding.cert.org/confluence/display/seccode/FIO19-C.+Do+not+use+fseek%28%29+and+ftell%28%29+to+compute+the+size+of+a+file
-	*/
-	
-	if(DEBUG==1) printf("Opening File\n"); /* DEBUG PRINT */
-	fileDescriptor = open(fileName,O_RDONLY);
-	if(fileDescriptor==-1){
-		printf("Error locating dot underscore file.\n");
-		return dotU;
-	}
-		
-	dotUFile = fdopen(fileDescriptor, "rb");
-	if(dotUFile==NULL){
-		printf("Error opening dot underscore file.\n");
-		return dotU;
-	}
-	
-	if(fstat(fileDescriptor, &statBuffer)==-1){
-		printf("Error getting dot underscore file stat.\n");
-		return dotU;
-	}
-	
-	fileLength = statBuffer.st_size;
-	dotUBuffer = (char*)malloc(sizeof(char)*fileLength);
-	printf("Creating buffer of size: %li\n",fileLength);
-	if(dotUBuffer==NULL){
-		printf("Error allocating dot underscore file buffer.\n");
-		return dotU;
-	}
-	
-	if(DEBUG==1) printf("Reading File\n"); /* DEBUG PRINT */
+	memset(dotU,0,sizeof(struct DotU)); /* If it's a bad dotU, magic will be != to DOTUMAGIC */
+	dotU->base=dotUBuffer;
+	dotU->baseLength=length;
+	dotU->backing=DOTU_BORROWED;
+
+	if(length<26) return badDotU(dotU,DOTU_EFORMAT,"File is not an AppleDouble encoded file.");
 
-	for (i = 0; (readChar = getc(dotUFile)) != EOF && i < fileLength; dotUBuffer[i++] = readChar) /* DEBUG ONLY  printChar(readChar) */;
-	fclose(dotUFile);
-	
 	/* Fill dotU struct */
-	if(DEBUG==1) printf("Setting up header\n"); /* DEBUG PRINT */
+	DOTU_TRACE(("Setting up header\n")); /* DEBUG PRINT */
 	/* dotU header */
-	dotU.header.magic      = (uint32_t) toBigEndian(&dotUBuffer[0],4);
-	if(dotU.header.magic != DOTUMAGIC){
-		printf("File is not an AppleDouble encoded file.\n");
-		return dotU;
+	dotU->header.magic      = (uint32_t) toBigEndian(&dotUBuffer[0],4);
+	if(dotU->header.magic != DOTUMAGIC) return badDotU(dotU,DOTU_EFORMAT,"File is not an AppleDouble encoded file.");
+	dotU->header.versionNum = (uint32_t) toBigEndian(&dotUBuffer[4],4);
+	memcpy(dotU->header.homeFileSystem,&dotUBuffer[8],16);
+	dotU->header.numEntries = (uint16_t) toBigEndian(&dotUBuffer[24],2);
+	if(26+12*(uint32_t)dotU->header.numEntries>length) return badDotU(dotU,DOTU_EFORMAT,"Error.  Dot-Underscore entry list is truncated.");
+
+	/* A look ahead at the Finder entry for how many attrs to make room for */
+	numAttrs=0;
+	for(i=0;i<dotU->header.numEntries;i++){
+		if(toBigEndian(&dotUBuffer[26+12*i],4)!=9) continue;
+		entryHeaderOffset=toBigEndian(&dotUBuffer[30+12*i],4);
+		if(entryHeaderOffset<=length && length-entryHeaderOffset>=70) numAttrs=toBigEndian(&dotUBuffer[entryHeaderOffset+68],2);
+		break;
 	}
-	
-	dotU.header.versionNum = (uint32_t) toBigEndian(&(dotUBuffer[4]),4);
-	for(i=0;i<16;i++) dotU.header.homeFileSystem[i] = (char) dotUBuffer[8+i];
-	dotU.header.numEntries = (uint16_t) toBigEndian(&dotUBuffer[24],2);
-	
-		/* The dotU file has various entries.
-	/ Extended attributes are usually in the Finder Info.*/
-	if(DEBUG==1) printf("Setting up dotu entries\n"); /* DEBUG PRINT */
+	if(dotuArenaOf(dotU,sizeof(struct DotUEntry)*dotU->header.numEntries+sizeof(struct ExtAttr)*numAttrs+2*DOTU_ARENA_ALIGN
+	           + (copying ? length+(2*numAttrs+dotU->header.numEntries)*DOTU_ARENA_ALIGN : 0))==NULL){
+		return badDotU(dotU,DOTU_ENOMEM,"Error allocating entry table.");
+	}
+	dotU->entry=(struct DotUEntry*)dotuArenaAlloc(dotU->arena,sizeof(struct DotUEntry)*dotU->header.numEntries);
+	if(dotU->entry==NULL) return badDotU(dotU,DOTU_ENOMEM,"Error allocating entry table.");
+	memset(dotU->entry,0,sizeof(struct DotUEntry)*dotU->header.numEntries);
 
+	/* The dotU file has various entries.
+	   Extended attributes are usually in the Finder Info.*/
+	DOTU_TRACE(("Setting up dotu entries\n")); /* DEBUG PRINT */
 	dotUOffset=26;
-	for(entryCount=0;entryCount<dotU.header.numEntries;entryCount++){
-		dotU.entry[entryCount].id = (uint32_t) toBigEndian(&dotUBuffer[dotUOffset],4);
-		dotU.entry[entryCount].offset = (uint32_t) toBigEndian(&dotUBuffer[dotUOffset+4],4);
-		dotU.entry[entryCount].length = (uint32_t) toBigEndian(&dotUBuffer[dotUOffset+8],4);
-		
+	for(entryCount=0;entryCount<dotU->header.numEntries;entryCount++){
+		entry=&dotU->entry[entryCount];
+		entry->id     = DOTU_BE32(&dotUBuffer[dotUOffset]);
+		entry->offset = DOTU_BE32(&dotUBuffer[dotUOffset+4]);
+		entry->length = DOTU_BE32(&dotUBuffer[dotUOffset+8]);
+		/* Only the resource fork may lie past the bytes at hand */
+		limit=(entry->id==2) ? fileLength : length;
+		if(entry->offset>limit || entry->length>limit-entry->offset){
+			return badDotU(dotU,DOTU_EFORMAT,"Error.  Dot-Underscore entry runs past end of file.");
+		}
+
+		if((entry->id==2 && seenResource++) || (entry->id==9 && seenFinder++)){
+			return badDotU(dotU,DOTU_EFORMAT,"Error.  Duplicate Dot-Underscore entry.");
+		}
+
 		/* Data set up according to needs of entry type */
-		switch(dotU.entry[entryCount].id){
+		switch(entry->id){
 			case 2:{
-				if(DEBUG==1) printf("Setting up resource fork\n"); /* DEBUG PRINT */
-				data=(char*)malloc(dotU.entry[entryCount].length);
-				for(i=0;i<dotU.entry[entryCount].length;i++) data[i]=(char)dotUBuffer[dotU.entry[entryCount].offset+i];
-				dotU.entry[entryCount].data.resource.data=data;
+				DOTU_TRACE(("Setting up resource fork\n")); /* DEBUG PRINT */
+				/* NULL if it wasn't read - see loadDotUFile */
+				entry->data.resource.data=(entry->offset+entry->length<=length) ? &dotUBuffer[entry->offset] : NULL;
+				entry->data.resource.sourceOffset=entry->offset;
 			}break;
 			case 9:{
-				if(DEBUG==1) printf("Setting up finder info\n");/* DEBUG PRINT */
-				for(i=0;i<32;i++){
-					dotU.entry[entryCount].data.finder.finderHeader[i]          = dotUBuffer[dotU.entry[entryCount].offset+i];
-				}
-				for(i=0;i<2;i++){
-					dotU.entry[entryCount].data.finder.padding[i]               = dotUBuffer[dotU.entry[entryCount].offset+32+i];
-				}
-				dotU.entry[entryCount].data.finder.xattrHdr.headerMagic       = (uint32_t) toBigEndian(&dotUBuffer[dotU.entry[entryCount].offset+34],4);
-				dotU.entry[entryCount].data.finder.xattrHdr.debugTag          = (uint32_t) toBigEndian(&dotUBuffer[dotU.entry[entryCount].offset+38],4);
-				dotU.entry[entryCount].data.finder.xattrHdr.size              = (uint32_t) toBigEndian(&dotUBuffer[dotU.entry[entryCount].offset+42],4);
-				dotU.entry[entryCount].data.finder.xattrHdr.attrDataOffset    = (uint32_t) toBigEndian(&dotUBuffer[dotU.entry[entryCount].offset+46],4);
-				dotU.entry[entryCount].data.finder.xattrHdr.attrDataLength    = (uint32_t) toBigEndian(&dotUBuffer[dotU.entry[entryCount].offset+50],4);
-				for(i=0;i<12;i++){
-					dotU.entry[entryCount].data.finder.xattrHdr.attrReserved[i] = dotUBuffer[dotU.entry[entryCount].offset+54+i];
-				}
-				for(i=0;i<2;i++){
-					dotU.entry[entryCount].data.finder.xattrHdr.attrFlags[i]    = dotUBuffer[dotU.entry[entryCount].offset+66+i];
-				}
-				dotU.entry[entryCount].data.finder.xattrHdr.numAttrs          = (uint16_t) toBigEndian(&dotUBuffer[dotU.entry[entryCount].offset+68],2);
-				
-				if(DEBUG==1) printf("Setting up xattrs\n"); /* DEBUG PRINT */
-				attrs=(struct ExtAttr*)malloc(sizeof(struct ExtAttr) * dotU.entry[entryCount].data.finder.xattrHdr.numAttrs);
-				entryHeaderOffset=dotU.entry[entryCount].offset+70;
-				for(i=0;i<dotU.entry[entryCount].data.finder.xattrHdr.numAttrs;i++){
-					if(DEBUG==1) printf("Setting up xattr %i :\n",i);
-
-					entryValueOffset = toBigEndian(&dotUBuffer[entryHeaderOffset],4);
-					entryValueLength = toBigEndian(&dotUBuffer[entryHeaderOffset+4],4);
-					for(charNum=0;charNum<=1;charNum++){
-						attrFlags[charNum]=dotUBuffer[entryHeaderOffset+8+charNum];
-					}
+				DOTU_TRACE(("Setting up finder info\n"));/* DEBUG PRINT */
+				if(entry->length<70) return badDotU(dotU,DOTU_EFORMAT,"Error.  Finder Info entry is truncated.");
+				memcpy(entry->data.finder.finderHeader,&dotUBuffer[entry->offset],32);
+				memcpy(entry->data.finder.padding,&dotUBuffer[entry->offset+32],2);
+				entry->data.finder.xattrHdr.headerMagic       = (uint32_t) toBigEndian(&dotUBuffer[entry->offset+34],4);
+				entry->data.finder.xattrHdr.debugTag          = (uint32_t) toBigEndian(&dotUBuffer[entry->offset+38],4);
+				entry->data.finder.xattrHdr.size              = (uint32_t) toBigEndian(&dotUBuffer[entry->offset+42],4);
+				entry->data.finder.xattrHdr.attrDataOffset    = (uint32_t) toBigEndian(&dotUBuffer[entry->offset+46],4);
+				entry->data.finder.xattrHdr.attrDataLength    = (uint32_t) toBigEndian(&dotUBuffer[entry->offset+50],4);
+				memcpy(entry->data.finder.xattrHdr.attrReserved,&dotUBuffer[entry->offset+54],12);
+				memcpy(entry->data.finder.xattrHdr.attrFlags,&dotUBuffer[entry->offset+66],2);
+				entry->data.finder.xattrHdr.numAttrs          = (uint16_t) toBigEndian(&dotUBuffer[entry->offset+68],2);
+
+				DOTU_TRACE(("Setting up xattrs\n")); /* DEBUG PRINT */
+				/* Names and values stay in the buffer */
+				attrs=(struct ExtAttr*)dotuArenaAlloc(dotU->arena,sizeof(struct ExtAttr)*entry->data.finder.xattrHdr.numAttrs);
+				if(attrs==NULL) return badDotU(dotU,DOTU_ENOMEM,"Error allocating xattr list.");
+				entry->data.finder.attr=attrs;
+				entry->data.finder.sorted=1;
+				entryHeaderOffset=entry->offset+70;
+				for(i=0;i<entry->data.finder.xattrHdr.numAttrs;i++){
+					DOTU_TRACE(("Setting up xattr %i :\n",i));
+					if(entryHeaderOffset+11>length) return badDotU(dotU,DOTU_EFORMAT,"Error.  Xattr header runs past end of file.");
+					entryValueOffset = DOTU_BE32(&dotUBuffer[entryHeaderOffset]);
+					entryValueLength = DOTU_BE32(&dotUBuffer[entryHeaderOffset+4]);
 					entryNameLength  = dotUBuffer[entryHeaderOffset+10];
-					
+
 					/* Entry name length includes \0, but entry value length does not. */
-					entryName=malloc(sizeof(char)*entryNameLength /* +1 */);
-					entryValue=malloc(sizeof(char)*entryValueLength+1);
-					
-					for(charNum=0;charNum<=entryNameLength;charNum++){
-						entryName[charNum]=dotUBuffer[entryHeaderOffset+11+charNum];
+					if(entryNameLength==0 || entryHeaderOffset+11+entryNameLength>length
+					   || dotUBuffer[entryHeaderOffset+11+entryNameLength-1]!='\0'){
+						return badDotU(dotU,DOTU_EFORMAT,"Error.  Bad xattr name.");
 					}
-					/*entryName[entryNameLength]='\0';  Uneeded - see above*/
-					for(charNum=0;charNum<entryValueLength;charNum++){
-						entryValue[charNum]=dotUBuffer[entryValueOffset+charNum];
+					if(entryValueOffset>length || entryValueLength>length-entryValueOffset){
+						return badDotU(dotU,DOTU_EFORMAT,"Error.  Xattr value runs past end of file.");
 					}
-					entryValue[entryValueLength]='\0';
-					
-					attrs[i].name=entryName;
-					attrs[i].value=entryValue;
+
+					attrs[i].name=&dotUBuffer[entryHeaderOffset+11];
+					attrs[i].value=&dotUBuffer[entryValueOffset];
 					attrs[i].valueOffset=entryValueOffset;
 					attrs[i].valueLength=entryValueLength;
-					for(charNum=0;charNum<2;charNum++) attrs[i].flags[charNum]=attrFlags[charNum];
+					attrs[i].flags[0]=dotUBuffer[entryHeaderOffset+8];
+					attrs[i].flags[1]=dotUBuffer[entryHeaderOffset+9];
 					attrs[i].nameLength=entryNameLength;
-										
+					attrs[i].nameId=dotuNameId(attrs[i].name,entryNameLength-1);
+					if(i>0 && strcmp(attrs[i-1].name,attrs[i].name)>=0) entry->data.finder.sorted=0;
+
 					/* Debug printing */
-					if(DEBUG==1) printf("\tNameOffset:  %li\tNameLength:  %i\t Name:  %s\n",entryHeaderOffset+11,(int) entryNameLength,entryName);
-					if(DEBUG==1) printf("\tValueOffset: %li\tValueLength: %li\t Value: %s\n",entryValueOffset,entryValueLength,entryValue);
-					
+					DOTU_TRACE(("\tNameOffset:  %u\tNameLength:  %i\t Name:  %s\n",entryHeaderOffset+11,(int) entryNameLength,attrs[i].name));
+					DOTU_TRACE(("\tValueOffset: %u\tValueLength: %u\t Value: %.*s\n",entryValueOffset,entryValueLength,(int)entryValueLength,attrs[i].value));
+
 					entryHeaderOffset+=attrHdrSize(entryNameLength);
 				}
-				
-				dotU.entry[entryCount].data.finder.attr=attrs;
-				
 			}break;
 			default:{
-				printf("\nError.  Unknown Dot-Underscore Entry ID type.");
-				return dotU;
+				/* Passed through as it is */
+				DOTU_TRACE(("Keeping entry %u as %u bytes\n",entry->id,entry->length));
+				entry->data.raw.data=&dotUBuffer[entry->offset];
 			}break;
 		}
 		dotUOffset+=12;
 	}
-	return dotU;
-} 
+	return 0;
+}
 
-int 
-createDotUFile(struct DotU dotU, const char * parentFileName){
-	char dotUFileName[MAXFILENAMESIZE];
-	snprintf(dotUFileName,MAXFILENAMESIZE,"._%s",parentFileName);
-	return createDotUFileSpecName(dotU,parentFileName,dotUFileName);
+int
+parseDotUBuffer(const char *buf, uint32_t length, struct DotU *dotU){
+	return parseDotUImage(buf,length,length,dotU,0);
 }
 
+int
+mapDotUFd(int fd, struct DotU *dotU){
+	struct stat statBuffer;
+	void *image;
+	int result;
 
-int 
-createDotUFileSpecName(struct DotU dotU, const char * parentFileName, const char * outputFileName){
-	char *dotUFileName;
-	char *fileBuffer;
-	FILE *dotUFile;
-	uint32_t i,j,k;
-	uint32_t bufferSize;
-	uint32_t bufIndex;
-	
-	/* Make sure all of the offsets are good before going any further */
-	if(setOffsets(&dotU)!=0){
-		printf("Error setting offsets.\n");
-		return -1;
+	memset(dotU,0,sizeof(struct DotU));
+	/* Note: Using fstat() to obtain size based on advice from
+	 https://www.securecoding.cert.org/confluence/display/seccode/FIO19-C.+Do+not+use+fseek%28%29+and+ftell%28%29+to+compute+the+size+of+a+file
+	*/
+	if(fstat(fd,&statBuffer)==-1){
+		return dotuError(DOTU_EIO,NULL,"Error getting dot underscore file stat.");
 	}
-	
-	
-	
-	bufferSize = sizeNeeded(dotU);
-	fileBuffer=(char *)malloc(sizeof(char)*bufferSize);
-	
-	/* Zero the buffer */
-	for(i=0;i<bufferSize;i++){
-		fileBuffer[i]='\0';
+	if(statBuffer.st_size<26 || (uint64_t)statBuffer.st_size>0xFFFFFFFFUL){
+		return dotuError(DOTU_EFORMAT,NULL,"File is not an AppleDouble encoded file.");
 	}
-	
-		/* Writing DotU File Header */
-	/* 4 bytes  - magic num
-	   4 bytes  - version num
-	   16 bytes - home file system
-	   2 bytes  - number of dotU entries (usually 2)
-	*/
-	bufWrite(fileBuffer,0,toSmallEndian((char*)&dotU.header.magic,4),4);
-	bufWrite(fileBuffer,4,toSmallEndian((char*)&dotU.header.versionNum,4),4);
-	bufWrite(fileBuffer,8,dotU.header.homeFileSystem,16);
-	bufWrite(fileBuffer,24,toSmallEndian((char*)&dotU.header.numEntries,2),2);
-	
-	/* DotU entry list - For each:
-	   4 bytes - ID
-	   4 bytes - offset
-	   4 bytes - length
-	*/
-		bufIndex=26;
-	for(i=0;i<dotU.header.numEntries;i++){
-		bufWrite(fileBuffer,bufIndex,toSmallEndian((char*)&dotU.entry[i].id,4),4);
-		bufWrite(fileBuffer,bufIndex+4,toSmallEndian((char*)&dotU.entry[i].offset,4),4);
-		bufWrite(fileBuffer,bufIndex+8,toSmallEndian((char*)&dotU.entry[i].length,4),4);
-		bufIndex+=12;
+
+	image=mmap(NULL,(size_t)statBuffer.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+	if(image==MAP_FAILED){
+		return dotuError(DOTU_EIO,NULL,"Error mapping dot underscore file.");
 	}
-	
-	/* Now write each entry */
-	for(i=0;i<dotU.header.numEntries;i++){
-		switch(dotU.entry[i].id){
-			/* Resource */
+	result=parseDotUBuffer((const char *)image,(uint32_t)statBuffer.st_size,dotU);
+	if(result!=DOTU_OK){
+		munmap(image,(size_t)statBuffer.st_size);
+		return result;
+	}
+	dotU->backing=DOTU_MAPPED;
+	return DOTU_OK;
+}
+
+int
+mapDotUFile(const char *fileName, struct DotU *dotU){
+	int fileDescriptor;
+	int result;
+
+	fileDescriptor=open(fileName,O_RDONLY);
+	if(fileDescriptor==-1){
+		memset(dotU,0,sizeof(struct DotU));
+		return dotuError(DOTU_EIO,fileName,"Error locating dot underscore file.");
+	}
+	/* The mapping outlives the descriptor */
+	result=mapDotUFd(fileDescriptor,dotU);
+	close(fileDescriptor);
+	return result;
+}
+
+void
+freeDotU(struct DotU *dotU){
+	dotuReleaseInterned(dotU->interned);
+	dotuArenaRelease(dotU->arena);
+	if(dotU->backing==DOTU_MAPPED) munmap(dotU->base,dotU->baseLength);
+	memset(dotU,0,sizeof(struct DotU));
+}
+
+void
+unmapDotU(struct DotU *dotU){
+	freeDotU(dotU);
+}
+
+/* Reads the header and up to two entries, so header has to hold the
+   first 50 bytes of the file.  Callers with fewer read the file whole
+   instead of asking. */
+uint32_t
+dotuPrefixNeeded(const char *header, uint32_t fileLength){
+	uint32_t numEntries=toBigEndian((char*)&header[24],2);
+	uint32_t offset[2],length[2],id[2];
+	uint32_t i,resource;
+
+	if(numEntries==0 || numEntries>2) return fileLength;
+	for(i=0,resource=2;i<numEntries;i++){
+		id[i]=toBigEndian((char*)&header[26+12*i],4);
+		offset[i]=toBigEndian((char*)&header[30+12*i],4);
+		length[i]=toBigEndian((char*)&header[34+12*i],4);
+		if(id[i]==2) resource=i;
+	}
+	if(resource==2 || offset[resource]<26+12*numEntries || offset[resource]>fileLength) return fileLength;
+	for(i=0;i<numEntries;i++){
+		if(i!=resource && (offset[i]>offset[resource] || length[i]>offset[resource]-offset[i])) return fileLength;
+	}
+	return offset[resource];
+}
+
+/* Gives a parsed DotU its own copies of every name, value and the
+   resource fork, so the image it was parsed from can be released.
+   The copies go in the DotU's arena, which loadDotUFile sized for them. */
+static int
+detachDotU(struct DotU *dotU){
+	uint32_t i,j;
+	char *data;
+	struct ExtAttr *attr;
+
+	for(i=0;i<dotU->header.numEntries;i++){
+		switch(dotU->entry[i].id){
 			case 2:{
-				/* TODO: pad this if needed with 1's? */
-				bufWrite(fileBuffer,dotU.entry[i].offset,dotU.entry[i].data.resource.data,dotU.entry[i].length);
-			} break;
-			
-			/* Finder Info, where xattrs live */
-			case 9: {
-				/* Next comes the Finder Info and Xattr Header (DotU entry ID == 9)
-				   TODO: Verify that the offset and length of Finder Info are what would be expected.
-				   32 bytes  - header
-				   2 bytes   - padding
-
-				   4 bytes   - xattr Magic Num 
-				   4 bytes   - debug tag (parent file id)
-				   4 bytes   - size of ...?
-				   4 bytes   - file offset for xattr data
-				   4 bytes   - length of xattr data block
-				   12 bytes  - reserved ...?
-				   2 bytes   - attribute flags
-				   2 bytes   - number of xattrs
-				*/
-					bufWrite(fileBuffer,dotU.entry[i].offset,dotU.entry[i].data.finder.finderHeader,32);
-					bufWrite(fileBuffer,dotU.entry[i].offset+32,dotU.entry[i].data.finder.padding,2);
-
-					bufWrite(fileBuffer,dotU.entry[i].offset+34,toSmallEndian((char*)&dotU.entry[i].data.finder.xattrHdr.headerMagic,4),4);
-					bufWrite(fileBuffer,dotU.entry[i].offset+38,toSmallEndian((char*)&dotU.entry[i].data.finder.xattrHdr.debugTag,4),4);
-					bufWrite(fileBuffer,dotU.entry[i].offset+42,toSmallEndian((char*)&dotU.entry[i].data.finder.xattrHdr.size,4),4);
-					bufWrite(fileBuffer,dotU.entry[i].offset+46,toSmallEndian((char*)&dotU.entry[i].data.finder.xattrHdr.attrDataOffset,4),4);
-					bufWrite(fileBuffer,dotU.entry[i].offset+50,toSmallEndian((char*)&dotU.entry[i].data.finder.xattrHdr.attrDataLength,4),4);
-					bufWrite(fileBuffer,dotU.entry[i].offset+54,dotU.entry[i].data.finder.xattrHdr.attrReserved,12);
-					bufWrite(fileBuffer,dotU.entry[i].offset+66,dotU.entry[i].data.finder.xattrHdr.attrFlags,2);
-					bufWrite(fileBuffer,dotU.entry[i].offset+68,toSmallEndian((char*)&dotU.entry[i].data.finder.xattrHdr.numAttrs,2),2);
-					
-					/* Now write the xattrs */
-					bufIndex=dotU.entry[i].offset+70;
-					for(j=0;j<dotU.entry[i].data.finder.xattrHdr.numAttrs;j++){
-						/* Each xattr has a header part and a data part.
-						   The header part is:
-						   4 bytes             - Value offset (from beginning of DotU file)
-						   4 bytes             - value length
-						   2 bytes             - flags 
-						TODO: Figure out what the flags are.
-						   1 byte              - name length (128 byte max)
-						   name length bytes   - name (null-terminated)
-						   padding (if needed) - to nearest word (4-byte) boundary
-						
-						   The value part is in the heap after all of the headers, 
-						   and position is specified by the value's offset and length. */
-							bufWrite(fileBuffer,bufIndex,toSmallEndian((char*)&dotU.entry[i].data.finder.attr[j].valueOffset,4),4);
-							bufWrite(fileBuffer,bufIndex+4,toSmallEndian((char*)&dotU.entry[i].data.finder.attr[j].valueLength,4),4);
-							/* Technically, the nameLength should only be 2 bytes long, but there shouldn't
-							   be harm in padding with 0's. */
-							bufWrite(fileBuffer,bufIndex+8,dotU.entry[i].data.finder.attr[j].flags,2); 
-							bufWrite(fileBuffer,bufIndex+10,(char*)&dotU.entry[i].data.finder.attr[j].nameLength,1); 
-							/* The name is stored in the dot-u file as a null-terminated string, 128 bytes max */
-							bufWrite(fileBuffer,bufIndex+11,dotU.entry[i].data.finder.attr[j].name,dotU.entry[i].data.finder.attr[j].nameLength);
-							if(DEBUG ==1) printf("%s : %s at %u : %u\n",dotU.entry[i].data.finder.attr[j].name,dotU.entry[i].data.finder.attr[j].value,bufIndex+10,dotU.entry[i].data.finder.attr[j].valueOffset);
-							/* Write the value of the attr */
-							bufWrite(fileBuffer,dotU.entry[i].data.finder.attr[j].valueOffset,dotU.entry[i].data.finder.attr[j].value, dotU.entry[i].data.finder.attr[j].valueLength);
-							bufIndex+=attrHdrSize(dotU.entry[i].data.finder.attr[j].nameLength);
-					}
-					
-					
+				if(dotU->entry[i].data.resource.data==NULL) break;
+				if(dotuArenaOf(dotU,dotU->entry[i].length+1)==NULL) return DOTU_ENOMEM;
+				data=dotuArenaCopy(dotU->arena,dotU->entry[i].data.resource.data,dotU->entry[i].length);
+				if(data==NULL) return DOTU_ENOMEM;
+				dotU->entry[i].data.resource.data=data;
+			}break;
+			default:{
+				data=dotuArenaCopy(dotU->arena,dotU->entry[i].data.raw.data,dotU->entry[i].length);
+				if(data==NULL) return DOTU_ENOMEM;
+				dotU->entry[i].data.raw.data=data;
+			}break;
+			case 9:{
+				for(j=0;j<dotU->entry[i].data.finder.xattrHdr.numAttrs;j++){
+					attr=&dotU->entry[i].data.finder.attr[j];
+					/* A name in the name table is already held once for the process */
+					if(attr->nameId!=0) attr->name=(char*)getDotUName(attr->nameId);
+					else attr->name=dotuArenaCopy(dotU->arena,attr->name,attr->nameLength-1);
+					attr->value=dotuArenaCopy(dotU->arena,attr->value,attr->valueLength);
+					if(attr->name==NULL || attr->value==NULL) return DOTU_ENOMEM;
+				}
 			}break;
-			
-			/* Other/Unknown */
-			default:{ 
-				printf("Unknown DotU entry type.  Cannot write.\n");
-				return -1;
-			} break;
 		}
-		
-	
 	}
-	/* Last 2 bytes should be EOF */
-	for(i=1;i<=2;i++) fileBuffer[bufferSize-i]=EOF;
-	
-	/* For debugging - delete or leave commented forever.  It's a dump of the whole buffer.
-	printf("\nBuffer is:\n");
-	for(i=0;i<bufferSize;i++) printChar(fileBuffer[i]);
-	*/
-		
-	
-	if(DEBUG==1) printf("Output file: %s\n",outputFileName);
-	
-	/* Create and write file */
-	dotUFile = fopen(outputFileName, "wb");
-	fwrite(fileBuffer,1,bufferSize,dotUFile);
-	fclose(dotUFile);
-	return 0;
-	
+	dotU->base=NULL;
+	dotU->baseLength=0;
+	dotU->backing=DOTU_OWNED;
+	return DOTU_OK;
+}
+
+/* Enough for the header, two entries and a Finder entry right after
+   them, the way every writer lays them out */
+#define PROBESIZE 128
+
+int
+probeDotUFd(int fd, struct DotUProbe *probe){
+	struct stat statBuffer;
+	char buf[PROBESIZE];
+	char more[PROBESIZE];
+	char finderBuf[70];
+	const char *entryBytes;
+	const char *finder;
+	uint32_t readLength,moreStart,moreLength,id,offset,length,i;
+
+	memset(probe,0,sizeof(struct DotUProbe));
+	if(fstat(fd,&statBuffer)!=0) return dotuError(DOTU_EIO,NULL,"Error getting dot underscore file stat.");
+	if((uint64_t)statBuffer.st_size>0xFFFFFFFFUL) return dotuWarn(DOTU_EFORMAT,NULL,"File is not an AppleDouble encoded file.");
+	probe->fileLength=(uint32_t)statBuffer.st_size;
+	if(probe->fileLength<26) return dotuWarn(DOTU_EFORMAT,NULL,"File is not an AppleDouble encoded file.");
+	readLength=(probe->fileLength<PROBESIZE) ? probe->fileLength : PROBESIZE;
+	if(readFully(fd,buf,readLength,0)!=0) return dotuError(DOTU_EIO,NULL,"Error reading dot underscore file.");
+
+	probe->header.magic=toBigEndian(&buf[0],4);
+	probe->header.versionNum=toBigEndian(&buf[4],4);
+	memcpy(probe->header.homeFileSystem,&buf[8],16);
+	probe->header.numEntries=(uint16_t)toBigEndian(&buf[24],2);
+	probe->magicOK=(probe->header.magic==DOTUMAGIC);
+	probe->versionOK=(probe->header.versionNum==0x00010000 || probe->header.versionNum==0x00020000);
+	if(!probe->magicOK) return dotuWarn(DOTU_EFORMAT,NULL,"File is not an AppleDouble encoded file.");
+	if(26+12*(uint32_t)probe->header.numEntries>probe->fileLength) return dotuWarn(DOTU_EFORMAT,NULL,"Error.  Dot-Underscore entry list is truncated.");
+
+	moreStart=moreLength=0;
+	for(i=0;i<probe->header.numEntries;i++){
+		/* A long entry list is read on a chunk at a time */
+		if(26+12*i+12<=readLength){
+			entryBytes=&buf[26+12*i];
+		} else {
+			if(26+12*i+12>moreStart+moreLength){
+				moreStart=26+12*i;
+				moreLength=(probe->fileLength-moreStart<PROBESIZE) ? probe->fileLength-moreStart : PROBESIZE;
+				if(readFully(fd,more,moreLength,moreStart)!=0) return dotuError(DOTU_EIO,NULL,"Error reading dot underscore file.");
+			}
+			entryBytes=&more[26+12*i-moreStart];
+		}
+		id=toBigEndian((char*)&entryBytes[0],4);
+		offset=toBigEndian((char*)&entryBytes[4],4);
+		length=toBigEndian((char*)&entryBytes[8],4);
+		if(i<DOTU_PROBE_ENTRIES){
+			probe->entry[i].id=id;
+			probe->entry[i].offset=offset;
+			probe->entry[i].length=length;
+		}
+		if(offset>probe->fileLength || length>probe->fileLength-offset){
+			return dotuWarn(DOTU_EFORMAT,NULL,"Error.  Dot-Underscore entry runs past end of file.");
+		}
+		if(id==2) probe->resourceLength=length;
+		if(id!=9) continue;
+		if(length<70) return dotuWarn(DOTU_EFORMAT,NULL,"Error.  Finder Info entry is truncated.");
+		if(offset+70<=readLength){
+			finder=&buf[offset];
+		} else {
+			/* Somewhere unusual - one more small read */
+			if(readFully(fd,finderBuf,70,offset)!=0) return dotuError(DOTU_EIO,NULL,"Error reading dot underscore file.");
+			finder=finderBuf;
+		}
+		if(toBigEndian((char*)&finder[34],4)==ATTRHEADERMAGIC) probe->numAttrs=toBigEndian((char*)&finder[68],2);
+	}
+	return DOTU_OK;
+}
+
+int
+probeDotUFile(const char *fileName, struct DotUProbe *probe){
+	int fileDescriptor;
+	int result;
+
+	fileDescriptor=open(fileName,O_RDONLY);
+	if(fileDescriptor==-1){
+		memset(probe,0,sizeof(struct DotUProbe));
+		return dotuError(DOTU_EIO,fileName,"Error locating dot underscore file.");
+	}
+	result=probeDotUFd(fileDescriptor,probe);
+	close(fileDescriptor);
+	return result;
+}
+
+int
+loadDotUFile(const char *fileName, struct DotU *dotU){
+	char *dotUBuffer;
+	uint32_t fileLength,readLength;
+	ino_t inode;
+	int result;
+
+	memset(dotU,0,sizeof(struct DotU)); /* If it's a bad dotU, magic will be != to DOTUMAGIC */
+
+	result=dotuReadImage(fileName,&dotUBuffer,&readLength,&fileLength,&inode);
+	if(result!=DOTU_OK) return result;
+	result=dotuLoadImage(fileName,dotUBuffer,readLength,fileLength,inode,dotU);
+	dotuFree(dotUBuffer,readLength+1);
+	return result;
+}
+
+int
+dotuReadImage(const char *fileName, char **buf, uint32_t *readLength, uint32_t *fileLength, ino_t *inode){
+	struct stat statBuffer;
+	int fileDescriptor;
+	char header[50];
+	char *dotUBuffer;
+
+	DOTU_TRACE(("Opening File\n")); /* DEBUG PRINT */
+	fileDescriptor = open(fileName,O_RDONLY);
+	if(fileDescriptor==-1){
+		return dotuError(DOTU_EIO,fileName,"Error locating dot underscore file.");
+	}
+	if(fstat(fileDescriptor, &statBuffer)==-1){
+		close(fileDescriptor);
+		return dotuError(DOTU_EIO,fileName,"Error getting dot underscore file stat.");
+	}
+	if((uint64_t)statBuffer.st_size>0xFFFFFFFFUL){
+		close(fileDescriptor);
+		return dotuError(DOTU_EFORMAT,fileName,"File is not an AppleDouble encoded file.");
+	}
+
+	/* Read up to the resource fork, if it comes last - it stays in
+	   the file until someone asks for it. */
+	*fileLength = statBuffer.st_size;
+	*readLength = *fileLength;
+	*inode = statBuffer.st_ino;
+	if(*fileLength>=sizeof(header) && readFully(fileDescriptor,header,sizeof(header),0)==0){
+		/* Not AppleDouble - no need to read the rest to find out */
+		if(toBigEndian(header,4)!=DOTUMAGIC){
+			close(fileDescriptor);
+			return dotuError(DOTU_EFORMAT,fileName,"File is not an AppleDouble encoded file.");
+		}
+		*readLength=dotuPrefixNeeded(header,*fileLength);
+	}
+	DOTU_TRACE(("Creating buffer of size: %u\n",*readLength));
+	dotUBuffer = (char*)dotuAlloc(sizeof(char)**readLength+1);
+	if(dotUBuffer==NULL){
+		close(fileDescriptor);
+		return dotuError(DOTU_ENOMEM,fileName,"Error allocating dot underscore file buffer.");
+	}
+
+	DOTU_TRACE(("Reading File\n")); /* DEBUG PRINT */
+	if(readFully(fileDescriptor,dotUBuffer,*readLength,0)!=0){
+		close(fileDescriptor);
+		dotuFree(dotUBuffer,*readLength+1);
+		return dotuError(DOTU_EIO,fileName,"Error reading dot underscore file.");
+	}
+	close(fileDescriptor);
+	*buf=dotUBuffer;
+	return DOTU_OK;
+}
+
+int
+dotuLoadImage(const char *fileName, char *buf, uint32_t readLength, uint32_t fileLength, ino_t inode, struct DotU *dotU){
+	int result;
+
+	/* Parse in place, then copy out what the DotU keeps so the
+	   buffer can go.  The whole DotU ends up in one arena block. */
+	result=parseDotUImage(buf,readLength,fileLength,dotU,1);
+	if(result==DOTU_OK && detachDotU(dotU)!=DOTU_OK){
+		freeDotU(dotU);
+		result=dotuError(DOTU_ENOMEM,fileName,"Error allocating dot underscore data.");
+	}
+	if(result==DOTU_OK && readLength<fileLength){
+		dotU->source=dotuArenaCopy(dotU->arena,fileName,strlen(fileName));
+		dotU->sourceInode=inode;
+		dotU->sourceLength=fileLength;
+		if(dotU->source==NULL){
+			freeDotU(dotU);
+			result=dotuError(DOTU_ENOMEM,fileName,"Error allocating dot underscore data.");
+		}
+	}
+	return result;
+}
+
+int
+dotuDetach(struct DotU *dotU){
+	char *base=dotU->base;
+	uint32_t baseLength=dotU->baseLength;
+	int backing=dotU->backing;
+	int result;
+
+	if(backing==DOTU_OWNED) return DOTU_OK;
+	result=detachDotU(dotU);
+	if(result!=DOTU_OK) return dotuError(result,NULL,"Error allocating dot underscore data.");
+	if(backing==DOTU_MAPPED) munmap(base,baseLength);
+	return DOTU_OK;
+}
+
+int
+dotuClone(const struct DotU *dotU, struct DotU *clone){
+	const struct FinderEntry *finder;
+	struct ExtAttr *attrs;
+	size_t size;
+	uint32_t i,j;
+
+	/* Everything the copy will hold, so it fits in one block */
+	size=sizeof(struct DotUEntry)*dotU->header.numEntries+2*DOTU_ARENA_ALIGN;
+	if(dotU->source!=NULL) size+=strlen(dotU->source)+DOTU_ARENA_ALIGN;
+	for(i=0;i<dotU->header.numEntries;i++){
+		if(dotU->entry[i].id!=9){
+			size+=dotU->entry[i].length+DOTU_ARENA_ALIGN;
+			continue;
+		}
+		finder=&dotU->entry[i].data.finder;
+		size+=sizeof(struct ExtAttr)*finder->xattrHdr.numAttrs+DOTU_ARENA_ALIGN;
+		for(j=0;j<finder->xattrHdr.numAttrs;j++) size+=finder->attr[j].nameLength+finder->attr[j].valueLength+2*DOTU_ARENA_ALIGN;
+	}
+
+	*clone=*dotU;
+	clone->arena=NULL;
+	clone->index=NULL;
+	clone->interned=NULL;
+	clone->entry=NULL;
+	clone->source=NULL;
+	/* Until the detach below, the bytes are the original's */
+	clone->backing=DOTU_BORROWED;
+	if(dotuArenaOf(clone,size)==NULL) return DOTU_ENOMEM;
+	clone->entry=(struct DotUEntry*)dotuArenaAlloc(clone->arena,sizeof(struct DotUEntry)*dotU->header.numEntries);
+	if(clone->entry==NULL){
+		freeDotU(clone);
+		return DOTU_ENOMEM;
+	}
+	if(dotU->header.numEntries>0) memcpy(clone->entry,dotU->entry,sizeof(struct DotUEntry)*dotU->header.numEntries);
+	for(i=0;i<clone->header.numEntries;i++){
+		if(clone->entry[i].id!=9) continue;
+		finder=&dotU->entry[i].data.finder;
+		attrs=(struct ExtAttr*)dotuArenaAlloc(clone->arena,sizeof(struct ExtAttr)*finder->xattrHdr.numAttrs);
+		if(attrs==NULL){
+			freeDotU(clone);
+			return DOTU_ENOMEM;
+		}
+		if(finder->xattrHdr.numAttrs>0) memcpy(attrs,finder->attr,sizeof(struct ExtAttr)*finder->xattrHdr.numAttrs);
+		clone->entry[i].data.finder.attr=attrs;
+	}
+	if(dotU->source!=NULL) clone->source=dotuArenaCopy(clone->arena,dotU->source,strlen(dotU->source));
+	if((dotU->source!=NULL && clone->source==NULL) || detachDotU(clone)!=DOTU_OK){
+		freeDotU(clone);
+		return DOTU_ENOMEM;
+	}
+	return DOTU_OK;
+}
+
+struct DotU 
+readDotUFile(const char *fileName){
+	struct DotU dotU;
+	loadDotUFile(fileName,&dotU);
+	return dotU;
+} 
+
+int 
+createDotUFile(struct DotU dotU, const char * parentFileName){
+	char dotUFileName[MAXFILENAMESIZE];
+	snprintf(dotUFileName,MAXFILENAMESIZE,"._%s",parentFileName);
+	return createDotUFileSpecName(dotU,parentFileName,dotUFileName);
 }
 
 
+int 
+createDotUFileSpecName(struct DotU dotU, const char * parentFileName, const char * outputFileName){
+	struct DotU copy;
+	int result;
+
+	/* The by-value DotU still shares its tables with the caller's, so
+	   lay out a clone to leave the caller's offsets and resource fork
+	   as they were */
+	if(dotuClone(&dotU,&copy)!=DOTU_OK) return dotuError(DOTU_ENOMEM,outputFileName,"Error copying DotU to write.");
+	result=writeDotUFile(&copy,outputFileName);
+	freeDotU(&copy);
+	return result;
+}
 
 int 
 setOffsets(struct DotU *dotU){
@@ -406,6 +741,7 @@ setOffsets(struct DotU *dotU){
 	uint32_t sizeNeeded;
 	uint32_t sizeResource = 0;
 	uint32_t sizeFinder = 0;
+	uint32_t finderOffset,rawOffset;
 	/* 
 	Set dotU entry  (resource, finder)
 		offsets
@@ -426,7 +762,16 @@ setOffsets(struct DotU *dotU){
 	   Calculate size of finder info
 	*/
 	
-	if(DEBUG ==1) printf("There are %i entries in the dotU file\n",(*dotU).header.numEntries);
+	DOTU_TRACE(("There are %i entries in the dotU file\n",(*dotU).header.numEntries));
+	/* The header and entry list come first, then any entries passed
+	   through, in the order they're listed, then the Finder info.
+	   With the usual two entries that puts the Finder info at 50. */
+	finderOffset=26+12*(uint32_t)(*dotU).header.numEntries;
+	for(i=0;i<(*dotU).header.numEntries;i++){
+		if((*dotU).entry[i].id!=2 && (*dotU).entry[i].id!=9) finderOffset+=(*dotU).entry[i].length;
+	}
+	/* Never before 50, where Mac OS X puts it, even with one entry */
+	if(finderOffset<50) finderOffset=50;
 	/* dot U file size is a multiple of 4096 bytes */
 	/* Resource fork starts at (total file size - resource size) */
 	for(i=0;i<(*dotU).header.numEntries;i++){
@@ -452,38 +797,38 @@ setOffsets(struct DotU *dotU){
 				}
 				/* Now we have the total length of the xattr data */
 				(*dotU).entry[i].data.finder.xattrHdr.attrDataLength = currentValueOffset;
-				if(DEBUG ==1) printf("Attrs data length is %li\n",(*dotU).entry[i].data.finder.xattrHdr.attrDataLength);
-				if(DEBUG ==1) printf("Attrs header length is %li\n",currentNameOffset);
-				listAttrs(*dotU);
+				DOTU_TRACE(("Attrs data length is %u\n",(*dotU).entry[i].data.finder.xattrHdr.attrDataLength));
+				DOTU_TRACE(("Attrs header length is %u\n",currentNameOffset));
 
 				
-					/* Names of xattrs start at byte #120 
-					50 bytes of dotU header + entries
-					70 bytes of Finder Info header   */
-				currentValueOffset=currentNameOffset+120;
+					/* Names of xattrs start 70 bytes into the
+					Finder Info - byte #120 after the usual
+					50 bytes of dotU header + entries */
+				currentValueOffset=currentNameOffset+finderOffset+70;
+				(*dotU).entry[i].data.finder.xattrHdr.attrDataOffset = currentValueOffset;
 				/* Add the right offset ot all of the xattr values */
 				for(j=0;j<(*dotU).entry[i].data.finder.xattrHdr.numAttrs;j++){
 					(*dotU).entry[i].data.finder.attr[j].valueOffset += currentValueOffset;
 				}
 				if((*dotU).entry[i].data.finder.xattrHdr.numAttrs>0){
-					sizeFinder = (*dotU).entry[i].data.finder.attr[(*dotU).entry[i].data.finder.xattrHdr.numAttrs-1].valueOffset + (*dotU).entry[i].data.finder.attr[j].valueLength;
+					sizeFinder = (*dotU).entry[i].data.finder.attr[(*dotU).entry[i].data.finder.xattrHdr.numAttrs-1].valueOffset + (*dotU).entry[i].data.finder.attr[(*dotU).entry[i].data.finder.xattrHdr.numAttrs-1].valueLength;
 				} else {
 					sizeFinder = 70;
 				}
 
 				}break;
 			default:{
-				/* Unknown dotU entry */
-				printf("Unknown entry id in list.\n");
+				/* Passed through - placed below */
 			}break;
 			
 		}
 	}
 
-	/* 50 bytes of dotU header + entry list */
-	sizeNeeded = roundup4096(sizeResource + sizeFinder + 50);
-	if(DEBUG ==1) printf("Total ._ file size will be %u + %u + 50 = %u\n",sizeResource, sizeFinder, sizeNeeded);
+	/* dotU header + entry list + entries passed through */
+	sizeNeeded = roundup4096(sizeResource + sizeFinder + finderOffset);
+	DOTU_TRACE(("Total ._ file size will be %u + %u + %u = %u\n",sizeResource, sizeFinder, finderOffset, sizeNeeded));
 	
+	rawOffset=26+12*(uint32_t)(*dotU).header.numEntries;
 
 	for(i=0;i<(*dotU).header.numEntries;i++){
 		switch((*dotU).entry[i].id){
@@ -494,140 +839,205 @@ setOffsets(struct DotU *dotU){
 			case 9:{
 				/* Finder Info */
 				/* Set the offset for the finder info - first entry */
-				/* Finder Info is always 50 bytes from start of file */
-				/* DotU header + Entry list = 50 bytes. Finder info follows. */
-				(*dotU).entry[i].offset=50;
+				/* Finder Info follows the header, entry list and any
+				   entries passed through - 50 bytes in with just two */
+				(*dotU).entry[i].offset=finderOffset;
 				
 				/* Set the size of the finder entry 
 				   Total size of file minus the resource and minus the 
 				   dotU header and entry list */
-				(*dotU).entry[i].length = sizeNeeded - sizeResource - 50;
+				(*dotU).entry[i].length = sizeNeeded - sizeResource - finderOffset;
 			}break;
 			default:{
-				printf("Unknown entry id.\n");
+				(*dotU).entry[i].offset=rawOffset;
+				rawOffset+=(*dotU).entry[i].length;
 			}break;
 		}
 	}
 	
+	(*dotU).layoutValid=1;
 	return 0;
 }
 
+void
+dotuDropBytes(struct DotU *dotU, const void *ptr, size_t size){
+	if(dotuArenaOwns(dotU->arena,ptr)) dotuArenaDrop(dotU->arena,size);
+}
+
+void
+dotuDropIndex(struct DotU *dotU){
+	struct DotUIndex *index=dotU->index;
+
+	if(index!=NULL && dotuArenaOwns(dotU->arena,index)){
+		dotuArenaDrop(dotU->arena,sizeof(struct DotUIndex));
+		dotuArenaDrop(dotU->arena,sizeof(uint32_t)*(index->mask+1));
+		dotuArenaDrop(dotU->arena,sizeof(uint32_t)*(index->mask+1));
+	}
+	dotU->index=NULL;
+}
+
+/* A copy in arena of size bytes at ptr if old holds them, else ptr
+   itself; sets *failed if out of memory */
+static void *
+moveBytes(struct DotUArena *arena, const struct DotUArena *old, const void *ptr, size_t size, int *failed){
+	void *copy;
+
+	if(!dotuArenaOwns(old,ptr)) return (void*)ptr;
+	copy=dotuArenaAlloc(arena,size);
+	if(copy==NULL){
+		*failed=1;
+		return (void*)ptr;
+	}
+	memcpy(copy,ptr,size);
+	return copy;
+}
+
+void
+dotuCompact(struct DotU *dotU){
+	struct DotUArena *old=dotU->arena;
+	struct DotUArena *arena;
+	struct DotUEntry *entry;
+	struct FinderEntry *finder;
+	struct ExtAttr *attr;
+	char *source;
+	uint32_t numEntries=dotU->header.numEntries;
+	uint32_t i,j;
+	int failed=0;
+
+	if(old==NULL || old->dead<=old->used-old->dead || dotU->interned!=NULL || !dotuArenaOwns(old,dotU->entry)) return;
+	arena=dotuArenaCreate(old->used-old->dead);
+	if(arena==NULL) return;
+	entry=(struct DotUEntry*)moveBytes(arena,old,dotU->entry,sizeof(struct DotUEntry)*numEntries,&failed);
+	for(i=0;!failed && i<numEntries;i++){
+		switch(entry[i].id){
+			case 2:{
+				entry[i].data.resource.data=(char*)moveBytes(arena,old,entry[i].data.resource.data,entry[i].length+1,&failed);
+			}break;
+			case 9:{
+				finder=&entry[i].data.finder;
+				/* Always copied, as the names and values in it are redone */
+				attr=(struct ExtAttr*)dotuArenaAlloc(arena,sizeof(struct ExtAttr)*finder->xattrHdr.numAttrs);
+				if(attr==NULL){
+					failed=1;
+					break;
+				}
+				if(finder->xattrHdr.numAttrs>0) memcpy(attr,finder->attr,sizeof(struct ExtAttr)*finder->xattrHdr.numAttrs);
+				finder->attr=attr;
+				for(j=0;!failed && j<finder->xattrHdr.numAttrs;j++){
+					attr[j].name=(char*)moveBytes(arena,old,attr[j].name,attr[j].nameLength,&failed);
+					attr[j].value=(char*)moveBytes(arena,old,attr[j].value,attr[j].valueLength+1,&failed);
+				}
+			}break;
+			default:{
+				entry[i].data.raw.data=(char*)moveBytes(arena,old,entry[i].data.raw.data,entry[i].length+1,&failed);
+			}break;
+		}
+	}
+	source=(dotU->source!=NULL) ? (char*)moveBytes(arena,old,dotU->source,strlen(dotU->source)+1,&failed) : NULL;
+	if(failed){
+		dotuArenaRelease(arena);
+		return;
+	}
+	dotU->entry=entry;
+	dotU->source=source;
+	dotU->index=NULL;
+	dotU->arena=arena;
+	dotuArenaRelease(old);
+}
+
 /* Add in a new extended attribute.  Return 0 if good, -1 if fail */
 int 
 addAttr(struct DotU *dotU, const char * name, const char * value){
+	return setDotUAttr(dotU,name,value,strlen(value));
+}
+
+int
+setDotUAttr(struct DotU *dotU, const char * name, const char * value, uint32_t valueLength){
 	int index,finderEntry;
-	uint32_t attrNum;
+	uint32_t numAttrs;
 	struct ExtAttr* attrs;
-	int cmpString;
-	int charNum;
+	struct ExtAttr* oldAttrs;
+	char *valueCopy;
 	
 	/* TODO - make sure there's room - if not, what happens? */
+	if(dotU==NULL || name==NULL || (value==NULL && valueLength>0)) return DOTU_EINVAL;
+	/* Name length is stored in one byte and counts the \0 */
+	if(name[0]=='\0' || strlen(name)>254) return dotuError(DOTU_EINVAL,name,"Bad xattr name.");
 
 	/* Check to see if it's a new attr name.  If not, 
 	   just rewrite the existing value and update
 	   the value length. */
-	finderEntry=getFinderInfoEntry((*dotU));
-	index=getAttrIndex((*dotU),name);
-	
-	if(index!=-1){
-		/* Remove the old value */
-		if(DEBUG==1) printf("Found attr %s\n",name);
-		free((*dotU).entry[finderEntry].data.finder.attr[index].value);
-		/* Add in the new one and be sure to set the length of it (length not including the \0). */
-		(*dotU).entry[finderEntry].data.finder.attr[index].value=malloc(sizeof(char)*strlen(value)+1);
-		strcpy((*dotU).entry[finderEntry].data.finder.attr[index].value,value);
-		(*dotU).entry[finderEntry].data.finder.attr[index].valueLength=strlen(value);
-		
-		
+	finderEntry=dotuFinderEntry(dotU);
+	if(finderEntry<0) return dotuError(DOTU_ENOTFOUND,name,"Cannot find FinderInfo, so cannot add xattr.");
+	if(dotuArenaOf(dotU,0)==NULL) return dotuError(DOTU_ENOMEM,name,"Error allocating xattr.");
+	oldAttrs=(*dotU).entry[finderEntry].data.finder.attr;
+	numAttrs=(*dotU).entry[finderEntry].data.finder.xattrHdr.numAttrs;
+	/* Either where it is or where it should go */
+	index=dotuLocateAttr(&(*dotU).entry[finderEntry].data.finder,name,strlen(name)+1);
+
+	if(index>=0){
+		DOTU_TRACE(("Found attr %s\n",name));
+		/* A new value no bigger than the old one's arena copy goes over
+		   it; otherwise the old copy is dead. */
+		if(dotuArenaOwns(dotU->arena,oldAttrs[index].value)
+		   && (valueLength+DOTU_ARENA_ALIGN)/DOTU_ARENA_ALIGN<=(oldAttrs[index].valueLength+DOTU_ARENA_ALIGN)/DOTU_ARENA_ALIGN){
+			valueCopy=oldAttrs[index].value;
+			if(valueLength>0) memmove(valueCopy,value,valueLength);
+			valueCopy[valueLength]='\0';
+		} else {
+			valueCopy=dotuArenaCopy(dotU->arena,value,valueLength);
+			if(valueCopy==NULL) return dotuError(DOTU_ENOMEM,name,"Error allocating xattr value.");
+			dotuDropBytes(dotU,oldAttrs[index].value,oldAttrs[index].valueLength+1);
+		}
+		/* Be sure to set the length of the new value (length not including the \0). */
+		oldAttrs[index].value=valueCopy;
+		oldAttrs[index].valueLength=valueLength;
 	}	else {
 		/* Else if it is new, 
 		   - increment the number of xattrs
 		   - add the xattr name,  
-		   Keep xattrs sorted alphabetically! */
-		if(DEBUG==1) printf("Creating attr %s\n",name);
-		(*dotU).entry[finderEntry].data.finder.xattrHdr.numAttrs++;
-		attrs=(struct ExtAttr*)malloc(sizeof(struct ExtAttr) * (*dotU).entry[finderEntry].data.finder.xattrHdr.numAttrs);
-		attrNum=0;
-		while(index<0 && attrNum<(*dotU).entry[finderEntry].data.finder.xattrHdr.numAttrs-1){
-			cmpString = strcmp((*dotU).entry[finderEntry].data.finder.attr[attrNum].name,name);
-			if(DEBUG ==1) printf("The strcmp value is %i\n",cmpString);
-			if(cmpString<0 && index<0)
-			{
-				/* Alphabetically before the new xattr */
-				if(DEBUG ==1)printf("Not there yet - addxattr\n");
-				attrs[attrNum].name=malloc(sizeof(char)*strlen((*dotU).entry[finderEntry].data.finder.attr[attrNum].name)+1);
-				strcpy(attrs[attrNum].name,(*dotU).entry[finderEntry].data.finder.attr[attrNum].name);
-				attrs[attrNum].value=malloc(sizeof(char)*strlen((*dotU).entry[finderEntry].data.finder.attr[attrNum].value)+1);
-				strcpy(attrs[attrNum].value,(*dotU).entry[finderEntry].data.finder.attr[attrNum].value);
-				attrs[attrNum].nameLength=strlen((*dotU).entry[finderEntry].data.finder.attr[attrNum].name)+1;
-				attrs[attrNum].valueLength=strlen((*dotU).entry[finderEntry].data.finder.attr[attrNum].value);
-				for(charNum=0;charNum<2;charNum++) attrs[attrNum].flags[charNum]=(*dotU).entry[finderEntry].data.finder.attr[attrNum].flags[charNum];
-				if(DEBUG ==1) printf("Listing %s %s\n",attrs[attrNum].name,attrs[attrNum].value);
-				
-				
-				attrNum++;
-				
-			} else {
-				index = attrNum;
-			}
+		   Keep xattrs sorted alphabetically! 
+		   Names and values all live in the arena (or the mapped file),
+		   so the existing attrs can be moved over as they are. */
+		DOTU_TRACE(("Creating attr %s\n",name));
+		if(numAttrs>=0xFFFF) return dotuError(DOTU_EINVAL,name,"Too many xattrs.");
+		valueCopy=dotuArenaCopy(dotU->arena,value,valueLength);
+		if(valueCopy==NULL) return dotuError(DOTU_ENOMEM,name,"Error allocating xattr value.");
+		attrs=(struct ExtAttr*)dotuArenaAlloc(dotU->arena,sizeof(struct ExtAttr)*(numAttrs+1));
+		if(attrs==NULL) return dotuError(DOTU_ENOMEM,name,"Error allocating xattr list.");
+		/* Goes after the ones alphabetically before it */
+		index=-index-1;
+		if(numAttrs>0){
+			memcpy(attrs,oldAttrs,sizeof(struct ExtAttr)*index);
+			/* Keep alphabetical order after the new xattr */
+			memcpy(&attrs[index+1],&oldAttrs[index],sizeof(struct ExtAttr)*(numAttrs-index));
 		}
+
 		/* Insert here */
-		if(DEBUG==1) printf("This is the one - addxattr\n");
-		attrs[attrNum].name=malloc(sizeof(char)*strlen(name)+1);
-		strcpy(attrs[attrNum].name,name);
-		attrs[attrNum].value=malloc(sizeof(char)*strlen(value)+1);		
-		strcpy(attrs[attrNum].value,value);
+		DOTU_TRACE(("This is the one - addxattr\n"));
+		attrs[index].name=dotuNameCopy(dotU->arena,name,&attrs[index].nameId);
+		if(attrs[index].name==NULL) return dotuError(DOTU_ENOMEM,name,"Error allocating xattr name.");
+		attrs[index].value=valueCopy;
 		/* Entry name length includes \0, but entry value length does not. */
-		attrs[attrNum].nameLength=strlen(name)+1;
-		attrs[attrNum].valueLength=strlen(value);
-		index=attrNum;
-		if(DEBUG==1) printf("Adding in %s %s\n",attrs[attrNum].name,attrs[attrNum].value);
-		if(DEBUG==1) printf("Index of attr %s is %i\n",attrs[attrNum].name,attrNum);
+		attrs[index].nameLength=strlen(name)+1;
+		attrs[index].valueLength=valueLength;
+		attrs[index].valueOffset=0;
 		/* Set flags to 0's */
-		for(charNum=0;charNum<2;charNum++) attrs[attrNum].flags[charNum]=0;		
-		attrNum++;
-		
-		/* Finish off the array */
-		while(attrNum<(*dotU).entry[finderEntry].data.finder.xattrHdr.numAttrs){
-			if(DEBUG==1) printf("Finishing up xattr list - addxattr\n");
-			attrs[attrNum]=(*dotU).entry[finderEntry].data.finder.attr[attrNum-1];
-			/* Keep alphabetical order after the new xattr */
-			attrs[attrNum].name=malloc(sizeof(char)*strlen((*dotU).entry[finderEntry].data.finder.attr[attrNum-1].name)+1);
-			strcpy(attrs[attrNum].name,(*dotU).entry[finderEntry].data.finder.attr[attrNum-1].name);
-			attrs[attrNum].value=malloc(sizeof(char)*strlen((*dotU).entry[finderEntry].data.finder.attr[attrNum-1].value)+1);
-			strcpy(attrs[attrNum].value,(*dotU).entry[finderEntry].data.finder.attr[attrNum-1].value);
-			attrs[attrNum].nameLength=strlen((*dotU).entry[finderEntry].data.finder.attr[attrNum-1].name)+1;
-			attrs[attrNum].valueLength=strlen((*dotU).entry[finderEntry].data.finder.attr[attrNum-1].value);
-			/* Set flags to 0's */
-			for(charNum=0;charNum<2;charNum++) attrs[attrNum].flags[charNum]=(*dotU).entry[finderEntry].data.finder.attr[attrNum-1].flags[charNum];
-			if(DEBUG==1) printf("Listing %s %s\n",attrs[attrNum].name,attrs[attrNum].value);
-				
-			attrNum++;
-		}
-		
-		/* List all values - debug */
-		for(attrNum=0;attrNum<(*dotU).entry[finderEntry].data.finder.xattrHdr.numAttrs;attrNum++){
-			if(DEBUG ==1) printf("Attr %s : %s\n",attrs[attrNum].name,attrs[attrNum].value);
-		}
-		if(DEBUG ==1) printf("Setting attr list\n");
+		attrs[index].flags[0]=0;
+		attrs[index].flags[1]=0;
+		DOTU_TRACE(("Index of attr %s is %i\n",name,index));
+
 		/* set attrs in dotU */
-		/* If we didn't add the very first xattr, we need to free the existing memory. */
-		if((*dotU).entry[finderEntry].data.finder.xattrHdr.numAttrs>1){
-			free((*dotU).entry[finderEntry].data.finder.attr);
-			if(DEBUG==1) printf("Freed mem\n");
-		}
+		dotuDropBytes(dotU,oldAttrs,sizeof(struct ExtAttr)*numAttrs);
 		(*dotU).entry[finderEntry].data.finder.attr=attrs;	
-		if(DEBUG==1) printf("Set attr ptr");
-		if(DEBUG==1) printf("New attr is %s \n",(*dotU).entry[finderEntry].data.finder.attr[index].name);
-					
-		if(DEBUG==1) printf("Done Setting attr list\n");
+		(*dotU).entry[finderEntry].data.finder.xattrHdr.numAttrs++;
+		dotuDropIndex(dotU);
 	}
+	(*dotU).layoutValid=0;
 	
 	
-	if(DEBUG==1) printf("New attr %s is %s\n",(*dotU).entry[finderEntry].data.finder.attr[index].name,(*dotU).entry[finderEntry].data.finder.attr[index].value);
-	
-	
-	listAttrs((*dotU));
+	DOTU_TRACE(("New attr %s is %.*s\n",name,(int)valueLength,valueCopy));
+	dotuCompact(dotU);
 	
 	return 0;
 }
@@ -635,172 +1045,383 @@ addAttr(struct DotU *dotU, const char * name, const char * value){
 /* Remove an extended attribute.  Return 0 if good, -1 if fail */
 int 
 rmAttr(struct DotU * dotU, const char * name){
+	return removeDotUAttr(dotU,name);
+}
+
+int
+removeDotUAttr(struct DotU * dotU, const char * name){
 	/* Find xattr */
-	int index=getAttrIndex((*dotU),name);
-	int finderEntry=getFinderInfoEntry((*dotU));
-	uint32_t attrNum,charNum;
+	int index=findAttr(dotU,name);
+	int finderEntry=dotuFinderEntry(dotU);
 	struct ExtAttr* attrs;
 
 	/* If not found, return -1 */
 	if(index==-1) return -1;
 	
-	/* Create new struct, one xattr fewer */
+	/* Close the gap - attrs that come alphabetically after the one
+	   removed move down one.  What they point to stays put. */
+	attrs=(*dotU).entry[finderEntry].data.finder.attr;
+	dotuDropBytes(dotU,attrs[index].name,attrs[index].nameLength);
+	dotuDropBytes(dotU,attrs[index].value,attrs[index].valueLength+1);
 	(*dotU).entry[finderEntry].data.finder.xattrHdr.numAttrs--;
-	attrs=(struct ExtAttr*)malloc(sizeof(struct ExtAttr) * (*dotU).entry[finderEntry].data.finder.xattrHdr.numAttrs);
-	attrNum=0;
-	
-	
-	/* Copy everything except the one we're removing */
-	for(attrNum=0;attrNum<index;attrNum++){
-		/* Copy all attrs that come alphabetically before the one to be removed */
-		if(DEBUG==1) printf("Not there yet - rmAttr\n");
-		attrs[attrNum].name=malloc(sizeof(char)*strlen((*dotU).entry[finderEntry].data.finder.attr[attrNum].name)+1);
-		strcpy(attrs[attrNum].name,(*dotU).entry[finderEntry].data.finder.attr[attrNum].name);
-		attrs[attrNum].value=malloc(sizeof(char)*strlen((*dotU).entry[finderEntry].data.finder.attr[attrNum].value)+1);
-		strcpy(attrs[attrNum].value,(*dotU).entry[finderEntry].data.finder.attr[attrNum].value);
-		attrs[attrNum].nameLength=strlen((*dotU).entry[finderEntry].data.finder.attr[attrNum].name)+1;
-		attrs[attrNum].valueLength=strlen((*dotU).entry[finderEntry].data.finder.attr[attrNum].value);
-		for(charNum=0;charNum<2;charNum++) attrs[attrNum].flags[charNum]=(*dotU).entry[finderEntry].data.finder.attr[attrNum].flags[charNum];
-		if(DEBUG==1) printf("Keeping %s %s\n",attrs[attrNum].name,attrs[attrNum].value);
-	}
-	for(attrNum=index;attrNum<(*dotU).entry[finderEntry].data.finder.xattrHdr.numAttrs;attrNum++){
-		/* Copy all attrs that come alphabetically after the one to be removed */
-		if(DEBUG==1) printf("Copying rest of xattrs - rmAttr\n");
-		attrs[attrNum].name=malloc(sizeof(char)*strlen((*dotU).entry[finderEntry].data.finder.attr[attrNum].name)+1);
-		strcpy(attrs[attrNum].name,(*dotU).entry[finderEntry].data.finder.attr[attrNum].name);
-		attrs[attrNum].value=malloc(sizeof(char)*strlen((*dotU).entry[finderEntry].data.finder.attr[attrNum].value)+1);
-		strcpy(attrs[attrNum].value,(*dotU).entry[finderEntry].data.finder.attr[attrNum].value);
-		attrs[attrNum].nameLength=strlen((*dotU).entry[finderEntry].data.finder.attr[attrNum].name)+1;
-		attrs[attrNum].valueLength=strlen((*dotU).entry[finderEntry].data.finder.attr[attrNum].value);
-		for(charNum=0;charNum<2;charNum++) attrs[attrNum].flags[charNum]=(*dotU).entry[finderEntry].data.finder.attr[attrNum].flags[charNum];
-		if(DEBUG==1) printf("Keeping %s %s\n",attrs[attrNum].name,attrs[attrNum].value);
-	}
-	
-	/* Free the old memory */
-	free((*dotU).entry[finderEntry].data.finder.attr);
-	if(DEBUG==1) printf("Freed mem\n");
-		
-	/* Move the pointer. */
-	(*dotU).entry[finderEntry].data.finder.attr=attrs;	
-	if(DEBUG==1) printf("Set attr ptr");	
+	(*dotU).layoutValid=0;
+	dotuDropIndex(dotU);
+	memmove(&attrs[index],&attrs[index+1],sizeof(struct ExtAttr)*((*dotU).entry[finderEntry].data.finder.xattrHdr.numAttrs-index));
+	DOTU_TRACE(("Removed %s\n",name));
+	dotuCompact(dotU);
 	
 	return 0;
 }
 
+/* Finds name in the Finder entry's attr list, through the hash index
+   if there's a current one, else by binary search. */
+static int
+lookupAttr(const struct DotU *dotU, int finderEntry, const char *name){
+	const struct FinderEntry *finder=&dotU->entry[finderEntry].data.finder;
+	uint32_t nameLength=strlen(name)+1;
+	int index;
+
+	DOTU_TRACE(("Looking for %s\n",name));
+	if(dotuIndexUsable(dotU->index,finder)) return dotuIndexFind(dotU->index,name,nameLength);
+	index=dotuLocateAttr(finder,name,nameLength);
+	return (index<0) ? -1 : index;
+}
+
 char* 
 getAttrValue(struct DotU dotU, const char * name){
-	char * value;
-	int finderEntry = getFinderInfoEntry(dotU);
-	int index = getAttrIndex(dotU,name);
-	
-	if(finderEntry >=0 && index >=0)
-		return dotU.entry[finderEntry].data.finder.attr[index].value;
-	
-	return "";
+	char *value=(char*)getDotUAttr(&dotU,name,NULL);
+	return (value!=NULL) ? value : "";
+}
+
+const char*
+getDotUAttr(const struct DotU *dotU, const char * name, uint32_t *valueLength){
+	int finderEntry = dotuFinderEntry(dotU);
+	int index = (finderEntry>=0) ? lookupAttr(dotU,finderEntry,name) : -1;
+	const struct ExtAttr *attr;
+
+	if(index<0) return NULL;
+	attr=&dotU->entry[finderEntry].data.finder.attr[index];
+	if(valueLength!=NULL) *valueLength=attr->valueLength;
+	return attr->value;
+}
+
+const struct ExtAttr*
+nextDotUAttr(const struct DotU *dotU, uint32_t *cursor){
+	int finderEntry = dotuFinderEntry(dotU);
+	const struct FinderEntry *finder;
+
+	if(finderEntry<0) return NULL;
+	finder=&dotU->entry[finderEntry].data.finder;
+	if(*cursor>=finder->xattrHdr.numAttrs) return NULL;
+	return &finder->attr[(*cursor)++];
 }
 
 /* Returns the index of the attribute in question, -1 if not found. */
 int
 getAttrIndex(struct DotU dotU, const char * name){
-	int i;
-	int finderEntry = getFinderInfoEntry(dotU);
-	if(DEBUG ==1) printf("Looking for %s\n",name);
+	int finderEntry = dotuFinderEntry(&dotU);
 	if(finderEntry<0){
-		printf("Cannot find FinderInfo, so cannot locate xattr.\n");
-		return -1;
+		return dotuWarn(DOTU_ENOTFOUND,name,"Cannot find FinderInfo, so cannot locate xattr.");
 	}
-	
-	for(i=0;i<dotU.entry[finderEntry].data.finder.xattrHdr.numAttrs;i++){
-		if(DEBUG==1) printf("Comparing %s and %s\n",dotU.entry[finderEntry].data.finder.attr[i].name,name);
-		if(DEBUG==1) printf("Strcmp returns %i\n",strcmp(dotU.entry[finderEntry].data.finder.attr[i].name,name));
-		if(strcmp(dotU.entry[finderEntry].data.finder.attr[i].name,name)<0){
-			if(DEBUG==1) printf("Not there yet.\n");
-		} else if(strcmp(dotU.entry[finderEntry].data.finder.attr[i].name,name)==0){
-			if(DEBUG==1) printf("Match!\n"); return i;  
-		} else {
-			if(DEBUG==1) printf("Too far.\n"); return -1; 
-		}
-		
-	}	
-	if(DEBUG==1) printf("Couldn't find %s in attr list.\n",name);
-	return -1;
+	return lookupAttr(&dotU,finderEntry,name);
+}
+
+int
+findAttr(struct DotU *dotU, const char * name){
+	int finderEntry = dotuFinderEntry(dotU);
+	struct FinderEntry *finder;
+
+	if(finderEntry<0){
+		return dotuWarn(DOTU_ENOTFOUND,name,"Cannot find FinderInfo, so cannot locate xattr.");
+	}
+	finder=&dotU->entry[finderEntry].data.finder;
+	/* Worth hashing only once the list is long */
+	if(DOTU_HASHINDEX_MIN>0 && finder->xattrHdr.numAttrs>=DOTU_HASHINDEX_MIN && !dotuIndexUsable(dotU->index,finder)){
+		dotU->index=dotuIndexBuild(dotU,finder);
+	}
+	return lookupAttr(dotU,finderEntry,name);
 }
 
 /* Returns the entry index of the finder info, -1 if not found. */
 int
 getFinderInfoEntry(struct DotU dotU){
+	return dotuFinderEntry(&dotU);
+}
+
+struct DotU*
+openDotU(const char *fileName, int *status){
+	struct DotU *dotU=(struct DotU*)dotuAlloc(sizeof(struct DotU));
+	int result;
+
+	if(dotU==NULL){
+		result=dotuError(DOTU_ENOMEM,fileName,"Error allocating DotU.");
+	} else {
+		result=mapDotUFile(fileName,dotU);
+		if(result!=DOTU_OK){
+			dotuFree(dotU,sizeof(struct DotU));
+			dotU=NULL;
+		}
+	}
+	if(status!=NULL) *status=result;
+	return dotU;
+}
+
+void
+closeDotU(struct DotU *dotU){
+	if(dotU==NULL) return;
+	freeDotU(dotU);
+	dotuFree(dotU,sizeof(struct DotU));
+}
+
+int
+dotuFinderEntry(const struct DotU *dotU){
+	int i;
+	for(i=0;i<dotU->header.numEntries;i++){
+		if(dotU->entry[i].id==9) return i;
+	}
+	return -1;
+}
+
+struct DotUEntry*
+dotuAddEntry(struct DotU *dotU, uint32_t id){
+	struct DotUEntry *table;
+
+	if(dotU->header.numEntries==0xFFFF || dotuArenaOf(dotU,0)==NULL) return NULL;
+	/* Tables are small and rarely grow - a new one each time will do */
+	table=(struct DotUEntry*)dotuArenaAlloc(dotU->arena,sizeof(struct DotUEntry)*(dotU->header.numEntries+1));
+	if(table==NULL) return NULL;
+	if(dotU->header.numEntries>0) memcpy(table,dotU->entry,sizeof(struct DotUEntry)*dotU->header.numEntries);
+	dotU->entry=table;
+	memset(&table[dotU->header.numEntries],0,sizeof(struct DotUEntry));
+	table[dotU->header.numEntries].id=id;
+	dotU->layoutValid=0;
+	return &table[dotU->header.numEntries++];
+}
+
+void
+dotuRemoveEntry(struct DotU *dotU, int i){
+	dotU->header.numEntries--;
+	memmove(&dotU->entry[i],&dotU->entry[i+1],sizeof(struct DotUEntry)*(dotU->header.numEntries-i));
+	dotU->layoutValid=0;
+}
+
+/* Entry index of the entry with this id, -1 if none */
+static int
+findEntry(const struct DotU *dotU, uint32_t id){
 	int i;
-	for(i=0;i<dotU.header.numEntries;i++){
-		if(dotU.entry[i].id==9) return i;
+	for(i=0;i<dotU->header.numEntries;i++){
+		if(dotU->entry[i].id==id) return i;
 	}
 	return -1;
 }
 
+const char*
+getDotUEntry(const struct DotU *dotU, uint32_t id, uint32_t *length){
+	int i=(id==2 || id==9) ? -1 : findEntry(dotU,id);
+
+	if(length!=NULL) *length=(i>=0) ? dotU->entry[i].length : 0;
+	return (i>=0) ? dotU->entry[i].data.raw.data : NULL;
+}
+
+int
+setDotUEntry(struct DotU *dotU, uint32_t id, const char *data, uint32_t length){
+	struct DotUEntry *entry;
+	char *copy;
+	int i;
+
+	if(dotU==NULL || id==2 || id==9) return dotuError(DOTU_EINVAL,NULL,"Not an entry that's kept as bytes.");
+	i=findEntry(dotU,id);
+	if(data==NULL){
+		if(i>=0) dotuRemoveEntry(dotU,i);
+		return DOTU_OK;
+	}
+	if(dotuArenaOf(dotU,length+1)==NULL) return dotuError(DOTU_ENOMEM,NULL,"Error allocating entry.");
+	copy=dotuArenaCopy(dotU->arena,data,length);
+	entry=(i>=0) ? &dotU->entry[i] : dotuAddEntry(dotU,id);
+	if(copy==NULL || entry==NULL) return dotuError(DOTU_ENOMEM,NULL,"Error allocating entry.");
+	entry->length=length;
+	entry->data.raw.data=copy;
+	dotU->layoutValid=0;
+	return DOTU_OK;
+}
+
+/* Entry index of the resource fork, -1 if none */
+static int
+resourceEntry(const struct DotU *dotU){
+	return findEntry(dotU,2);
+}
+
+uint32_t
+getDotUResourceLength(const struct DotU *dotU){
+	int i=resourceEntry(dotU);
+	return (i>=0) ? dotU->entry[i].length : 0;
+}
+
+long
+readDotUResource(const struct DotU *dotU, char *buf, uint32_t offset, uint32_t length){
+	const struct DotUEntry *entry;
+	struct stat statBuffer;
+	int i=resourceEntry(dotU);
+	int fd,result;
+
+	if(i<0) return dotuWarn(DOTU_ENOTFOUND,NULL,"No resource fork.");
+	entry=&dotU->entry[i];
+	if(offset>=entry->length) return 0;
+	if(length>entry->length-offset) length=entry->length-offset;
+	if(entry->data.resource.data!=NULL){
+		memcpy(buf,&entry->data.resource.data[offset],length);
+		return (long)length;
+	}
+
+	if(dotU->source==NULL) return dotuError(DOTU_EINVAL,NULL,"Resource fork has no data.");
+	fd=open(dotU->source,O_RDONLY);
+	if(fd<0) return dotuError(DOTU_EIO,dotU->source,"Error opening dot underscore file.");
+	if(fstat(fd,&statBuffer)!=0 || statBuffer.st_ino!=dotU->sourceInode || (uint64_t)statBuffer.st_size!=dotU->sourceLength){
+		close(fd);
+		return dotuError(DOTU_EIO,dotU->source,"Dot underscore file has changed since it was read.");
+	}
+	result=readFully(fd,buf,length,entry->data.resource.sourceOffset+offset);
+	close(fd);
+	if(result!=0) return dotuError(DOTU_EIO,dotU->source,"Error reading resource fork.");
+	return (long)length;
+}
+
+int
+dotuLoadResource(struct DotU *dotU){
+	struct DotUEntry *entry;
+	char *data;
+	long result;
+	int i=resourceEntry(dotU);
+
+	if(i<0 || dotU->entry[i].data.resource.data!=NULL) return DOTU_OK;
+	entry=&dotU->entry[i];
+	if(dotuArenaOf(dotU,entry->length+1)==NULL) return dotuError(DOTU_ENOMEM,dotU->source,"Error allocating resource fork.");
+	data=(char*)dotuArenaAlloc(dotU->arena,entry->length+1);
+	if(data==NULL) return dotuError(DOTU_ENOMEM,dotU->source,"Error allocating resource fork.");
+	result=readDotUResource(dotU,data,0,entry->length);
+	if(result<0) return (int)result;
+	data[entry->length]='\0';
+	entry->data.resource.data=data;
+	return DOTU_OK;
+}
+
+const char*
+getDotUResource(struct DotU *dotU){
+	int i=resourceEntry(dotU);
+	if(i<0 || dotuLoadResource(dotU)!=DOTU_OK) return NULL;
+	return dotU->entry[i].data.resource.data;
+}
+
+int
+setDotUResource(struct DotU *dotU, const char *data, uint32_t length){
+	struct DotUEntry *entry;
+	int i;
+	char *copy;
+
+	if(dotU==NULL || (data==NULL && length>0)) return DOTU_EINVAL;
+	i=resourceEntry(dotU);
+	if(length==0){
+		if(i<0) return DOTU_OK;
+		dotuDropBytes(dotU,dotU->entry[i].data.resource.data,dotU->entry[i].length+1);
+		dotuRemoveEntry(dotU,i);
+	} else {
+		if(dotuArenaOf(dotU,length+1)==NULL) return dotuError(DOTU_ENOMEM,NULL,"Error allocating resource fork.");
+		copy=dotuArenaCopy(dotU->arena,data,length);
+		if(copy==NULL) return dotuError(DOTU_ENOMEM,NULL,"Error allocating resource fork.");
+		if(i>=0) dotuDropBytes(dotU,dotU->entry[i].data.resource.data,dotU->entry[i].length+1);
+		entry=(i>=0) ? &dotU->entry[i] : dotuAddEntry(dotU,2);
+		if(entry==NULL) return dotuError(DOTU_ENOMEM,NULL,"Error allocating resource fork.");
+		entry->length=length;
+		entry->data.resource.data=copy;
+		entry->data.resource.sourceOffset=0;
+	}
+	dotU->layoutValid=0;
+	dotuCompact(dotU);
+	return DOTU_OK;
+}
+
 void listAttrs(struct DotU dotU){
-	int finderEntry = getFinderInfoEntry(dotU);
-	int j;
+	listDotUAttrs(&dotU);
+}
+
+void
+listDotUAttrs(const struct DotU *dotU){
+	const struct ExtAttr *attr;
+	uint32_t j=0;
 	
-	if(finderEntry<0){
+	if(dotuFinderEntry(dotU)<0){
 		printf("Cannot find FinderInfo, so cannot locate xattr.\n");
 		return;
 	}
 	
-	for(j=0;j<dotU.entry[finderEntry].data.finder.xattrHdr.numAttrs;j++){
-		if(DEBUG==1) printf("\n\t\t\tAttr #%i : %s : %s",j,dotU.entry[finderEntry].data.finder.attr[j].name,dotU.entry[finderEntry].data.finder.attr[j].value);
+	while((attr=nextDotUAttr(dotU,&j))!=NULL){
+		printf("\n\t\t\tAttr #%u : %s : %.*s",j-1,attr->name,(int)attr->valueLength,attr->value);
 	}
-	if(DEBUG==1) printf("\n");
+	printf("\n");
 	return;
 }
 
 void 
 printDotUDetail(struct DotU dotU){
+	printDotU(&dotU);
+}
+
+void
+printDotU(const struct DotU *dotU){
 	uint32_t i,j;
+	char sample[64];
+	long length;
 	
 	/* Printing details of DotU Object */
-	printf("\nFile Magic Number: 0x%.8x",dotU.header.magic);
-	printf("\nFile Version Number: 0x%.8x",dotU.header.versionNum);
-	printf("\nFile Home File System: %16s",dotU.header.homeFileSystem);
-	printf("\nFile Number of entries: %i",dotU.header.numEntries);
+	printf("\nFile Magic Number: 0x%.8x",dotU->header.magic);
+	printf("\nFile Version Number: 0x%.8x",dotU->header.versionNum);
+	printf("\nFile Home File System: %16s",dotU->header.homeFileSystem);
+	printf("\nFile Number of entries: %i",dotU->header.numEntries);
 	
 
-	for(i=0;i<dotU.header.numEntries;i++){
-		printf("\nEntry ID: %i",dotU.entry[i].id);
-		printf("\n\tEntry Offset: %i", dotU.entry[i].offset);
-		printf("\n\tEntry Length: %i", dotU.entry[i].length);
+	for(i=0;i<dotU->header.numEntries;i++){
+		printf("\nEntry ID: %i",dotU->entry[i].id);
+		printf("\n\tEntry Offset: %i", dotU->entry[i].offset);
+		printf("\n\tEntry Length: %i", dotU->entry[i].length);
 		
-		switch(dotU.entry[i].id){
+		switch(dotU->entry[i].id){
 			case 2:{
 				printf("\n\tResource Fork.");
-				/* Shows data in the resource fork */
+				/* Shows the start of the resource fork */
 				printf("\n\t\tData: ");
-				for(j=0;j<dotU.entry[i].length;j++)printChar(dotU.entry[i].data.resource.data[j]);
+				length=readDotUResource(dotU,sample,0,sizeof(sample));
+				for(j=0;length>0 && j<(uint32_t)length;j++) printChar(sample[j]);
+				if(dotU->entry[i].length>sizeof(sample)) printf("... (%u bytes)",dotU->entry[i].length);
 			}break;
 			case 9:{
 				printf("\n\tFinder Info.");
 				printf("\n\tFirst 32 bytes reserved by FinderInfo (16 header, 16 extended): ");
-					for(j=0;j<32;j++) printChar(dotU.entry[i].data.finder.finderHeader[j]);
+					for(j=0;j<32;j++) printChar(dotU->entry[i].data.finder.finderHeader[j]);
 				printf("\n\tPadding (16 bits): ");
-					for(j=0;j<2;j++) printChar(dotU.entry[i].data.finder.padding[j]);				
+					for(j=0;j<2;j++) printChar(dotU->entry[i].data.finder.padding[j]);				
 				printf("\n\tExt Attr Header:");
-				printf("\n\t\tAttr Header Magic: %.8x",dotU.entry[i].data.finder.xattrHdr.headerMagic);				
-				printf("\n\t\tAttr Header Debug tag: %.8x",dotU.entry[i].data.finder.xattrHdr.debugTag);
-				printf("\n\t\tAttr Header Total Size: %i",dotU.entry[i].data.finder.xattrHdr.size);
-				printf("\n\t\tAttr Header Data Start: %i",dotU.entry[i].data.finder.xattrHdr.attrDataOffset);
-				printf("\n\t\tAttr Header Data Length: %i",dotU.entry[i].data.finder.xattrHdr.attrDataLength);
+				printf("\n\t\tAttr Header Magic: %.8x",dotU->entry[i].data.finder.xattrHdr.headerMagic);				
+				printf("\n\t\tAttr Header Debug tag: %.8x",dotU->entry[i].data.finder.xattrHdr.debugTag);
+				printf("\n\t\tAttr Header Total Size: %i",dotU->entry[i].data.finder.xattrHdr.size);
+				printf("\n\t\tAttr Header Data Start: %i",dotU->entry[i].data.finder.xattrHdr.attrDataOffset);
+				printf("\n\t\tAttr Header Data Length: %i",dotU->entry[i].data.finder.xattrHdr.attrDataLength);
 				printf("\n\t\tAttr Header Reserved: ");
-					for(j=0;j<12;j++) printChar(dotU.entry[i].data.finder.xattrHdr.attrReserved[j]);				
+					for(j=0;j<12;j++) printChar(dotU->entry[i].data.finder.xattrHdr.attrReserved[j]);				
 				printf("\n\t\tAttr Header Flags: ");
-					for(j=0;j<2;j++) printChar(dotU.entry[i].data.finder.xattrHdr.attrFlags[j]);				
-				printf("\n\t\tAttr Header Num Attrs: %i",dotU.entry[i].data.finder.xattrHdr.numAttrs);
+					for(j=0;j<2;j++) printChar(dotU->entry[i].data.finder.xattrHdr.attrFlags[j]);				
+				printf("\n\t\tAttr Header Num Attrs: %i",dotU->entry[i].data.finder.xattrHdr.numAttrs);
 				
-				for(j=0;j<dotU.entry[i].data.finder.xattrHdr.numAttrs;j++){
-					printf("\n\t\t\tAttr #%i : %s : %s",j,dotU.entry[i].data.finder.attr[j].name,dotU.entry[i].data.finder.attr[j].value);
+				for(j=0;j<dotU->entry[i].data.finder.xattrHdr.numAttrs;j++){
+					printf("\n\t\t\tAttr #%i : %s : %.*s",j,dotU->entry[i].data.finder.attr[j].name,(int)dotU->entry[i].data.finder.attr[j].valueLength,dotU->entry[i].data.finder.attr[j].value);
 				}
 				
 				
 			}break;
 			default: {
-				printf("Error - Unknown DotU Entry Type in input file.\n");
+				printf("\n\tPassed through.");
+				printf("\n\t\tData: ");
+				for(j=0;j<dotU->entry[i].length && j<sizeof(sample);j++) printChar(dotU->entry[i].data.raw.data[j]);
+				if(dotU->entry[i].length>sizeof(sample)) printf("... (%u bytes)",dotU->entry[i].length);
 			}break;
 			
 		}
@@ -809,98 +1430,153 @@ printDotUDetail(struct DotU dotU){
 
 }
 
-struct DotU iniDotU(const char * parentFileName){
-	/* Create dotU struct */
-	struct DotU dotU;
-	
-	struct stat statBuffer;
+/* A DotU with an empty Finder entry and no resource fork, set up in a
+   zeroed struct that may already have its arena */
+static int
+initBlank(struct DotU *dotU){
 	uint32_t i;
-	uint32_t entryCount,dotUOffset;
-	int fileDescriptor;
-	char *data;
-	FILE *parentFile;
-	char *dotUBuffer;
-	int readChar;
-	uint32_t fileLength;
-	
-	struct ExtAttr *attrs;
-	char *entryName;
-	char *entryValue;
-	uint32_t charNum;
-	uint8_t entryNameLength;
-	uint32_t entryValueLength;
-	uint32_t entryHeaderOffset;
-	uint32_t entryValueOffset;
-	char attrFlags[2];
-	
-	dotU.header.magic=0; /* If it's a bad dotU, magic will be != to DOTUMAGIC */
 
-	
-	if(DEBUG==1) printf("Opening parent file\n"); /* DEBUG PRINT */
-	fileDescriptor = open(parentFileName,O_RDONLY);
-	if(fileDescriptor==-1){
-		printf("Error locating parent file.\n");
-		return dotU;
+	if(dotuAddEntry(dotU,9)==NULL){
+		freeDotU(dotU);
+		return dotuError(DOTU_ENOMEM,NULL,"Error allocating entry table.");
 	}
-		
-	parentFile = fdopen(fileDescriptor, "rb");
-	if(parentFile==NULL){
-		printf("Error opening parent file.\n");
-		return dotU;
-	}
-	
-	
 	/* Fill dotU struct */
-	if(DEBUG==1) printf("Setting up header\n"); /* DEBUG PRINT */
+	DOTU_TRACE(("Setting up header\n")); /* DEBUG PRINT */
 	/* dotU header */
-	dotU.header.magic = 0x00051607;
-	dotU.header.versionNum = 0x00020000;
-	strcpy(dotU.header.homeFileSystem,"Mac OS X        ");
-	dotU.header.numEntries = (uint16_t) 1; /* We don't need the resource fork if it's a brand new dotU file */
+	dotU->header.magic = 0x00051607;
+	dotU->header.versionNum = 0x00020000;
+	memcpy(dotU->header.homeFileSystem,"Mac OS X        ",16);
+	/* numEntries is 1 - we don't need the resource fork if it's a brand new dotU file */
 	
 	
 	
 	/* The dotU file has various entries.
 	/ Extended attributes are usually in the Finder Info.*/
-	if(DEBUG==1) printf("Setting up dotu entries\n"); /* DEBUG PRINT */
+	DOTU_TRACE(("Setting up dotu entries\n")); /* DEBUG PRINT */
 
 	/* Entry 0 will be the Finder Info (where the xattrs will go) */
-	dotU.entry[0].id=9;
-	dotU.entry[0].offset=50;
-	dotU.entry[0].length=4046;
+	dotU->entry[0].id=9;
+	dotU->entry[0].offset=50;
+	dotU->entry[0].length=4046;
 	/* The finder header is all 0's to start. Data in the header includes
 	   file type, file creator, some flag bits, and some stuff about the 
 	   Finder's GUI */
-	if(DEBUG==1) printf("Setting up Finder Info header.\n");
-	for(i=0;i<32;i++) dotU.entry[0].data.finder.finderHeader[i]='\0';
-	for(i=0;i<2;i++)  dotU.entry[0].data.finder.padding[i]     ='\0';      
-	
-	if(DEBUG==1) printf("Setting up Extended Finder Info.\n");   
-	dotU.entry[0].data.finder.xattrHdr.headerMagic = 0x41545452;
+	DOTU_TRACE(("Setting up Finder Info header.\n"));
+	for(i=0;i<32;i++) dotU->entry[0].data.finder.finderHeader[i]='\0';
+	for(i=0;i<2;i++)  dotU->entry[0].data.finder.padding[i]     ='\0';      
 	
+	DOTU_TRACE(("Setting up Extended Finder Info.\n"));   
+	dotU->entry[0].data.finder.xattrHdr.headerMagic = 0x41545452;
 	
 	
 	
 	
-	dotU.entry[0].data.finder.xattrHdr.debugTag=(uint32_t) fileno(parentFile);
 	
-	/* TODO: Get the file id */
-	/* dotU.entry[entryCount].data.finder.xattrHdr.debugTag          = (uint32_t) toBigEndian(&dotUBuffer[dotU.entry[entryCount].offset+38],4); */
-	dotU.entry[0].data.finder.xattrHdr.size              = (uint32_t) 4046;
-	dotU.entry[0].data.finder.xattrHdr.attrDataOffset    = (uint32_t) 120;
-	dotU.entry[0].data.finder.xattrHdr.attrDataLength    = (uint32_t) 0;
-	for(i=0;i<12;i++) dotU.entry[0].data.finder.xattrHdr.attrReserved[i] = 0;
-	for(i=0;i<2;i++)  dotU.entry[0].data.finder.xattrHdr.attrFlags[i]    = 0;
-	dotU.entry[0].data.finder.xattrHdr.numAttrs          = 0;
+	/* debugTag is the parent's file id, if buildDotU is given it */
+	dotU->entry[0].data.finder.xattrHdr.size              = (uint32_t) 4046;
+	dotU->entry[0].data.finder.xattrHdr.attrDataOffset    = (uint32_t) 120;
+	dotU->entry[0].data.finder.xattrHdr.attrDataLength    = (uint32_t) 0;
+	for(i=0;i<12;i++) dotU->entry[0].data.finder.xattrHdr.attrReserved[i] = 0;
+	for(i=0;i<2;i++)  dotU->entry[0].data.finder.xattrHdr.attrFlags[i]    = 0;
+	dotU->entry[0].data.finder.xattrHdr.numAttrs          = 0;
+	dotU->entry[0].data.finder.sorted                     = 1;
 	
 	/* Set up a blank resource fork - No need... */
 	/*printf("Setting up resource fork\n"); /* DEBUG PRINT */
-	/*dotU.entry[1].id = 2;
-	dotU.entry[1].offset = 3810;
-	dotU.entry[1].length = 286;
-	dotU.entry[1].data.resource.data=(char*)malloc(dotU.entry[1].length);
-	dotU.entry[entryCount].data.resource.data= TODO ;
+	/*dotU->entry[1].id = 2;
+	dotU->entry[1].offset = 3810;
+	dotU->entry[1].length = 286;
+	dotU->entry[1].data.resource.data=(char*)malloc(dotU->entry[1].length);
+	dotU->entry[entryCount].data.resource.data= TODO ;
 	*/
+	return DOTU_OK;
+}
+
+int
+dotuInitBlank(struct DotU *dotU){
+	memset(dotU,0,sizeof(struct DotU));
+	return initBlank(dotU);
+}
+
+/* Name order, then list order, so the last of a repeated name is last */
+static int
+compareSpecs(const void *a, const void *b){
+	const struct DotUAttrSpec *x=*(const struct DotUAttrSpec * const *)a;
+	const struct DotUAttrSpec *y=*(const struct DotUAttrSpec * const *)b;
+	int cmp=strcmp(x->name,y->name);
+	if(cmp!=0) return cmp;
+	return (x<y) ? -1 : (x>y);
+}
+
+/* Copies the sorted specs into the Finder entry, dropping all but the
+   last of each name */
+static int
+fillAttrs(struct DotU *dotU, const struct DotUAttrSpec **sorted, uint32_t numAttrs){
+	struct FinderEntry *finder=&dotU->entry[0].data.finder;
+	struct ExtAttr *attr;
+	uint32_t i,n;
 
+	finder->attr=(struct ExtAttr*)dotuArenaAlloc(dotU->arena,sizeof(struct ExtAttr)*numAttrs);
+	if(finder->attr==NULL) return DOTU_ENOMEM;
+	for(i=0,n=0;i<numAttrs;i++){
+		if(i+1<numAttrs && strcmp(sorted[i]->name,sorted[i+1]->name)==0) continue;
+		attr=&finder->attr[n++];
+		memset(attr,0,sizeof(struct ExtAttr));
+		attr->name=dotuNameCopy(dotU->arena,sorted[i]->name,&attr->nameId);
+		attr->nameLength=(uint8_t)(strlen(sorted[i]->name)+1);
+		attr->value=dotuArenaCopy(dotU->arena,(sorted[i]->value!=NULL) ? sorted[i]->value : "",sorted[i]->valueLength);
+		attr->valueLength=sorted[i]->valueLength;
+		if(attr->name==NULL || attr->value==NULL) return DOTU_ENOMEM;
+	}
+	finder->xattrHdr.numAttrs=(uint16_t)n;
+	return DOTU_OK;
+}
+
+int
+buildDotU(const struct DotUAttrSpec *attrs, uint32_t numAttrs, const struct stat *parent, struct DotU *dotU){
+	const struct DotUAttrSpec **sorted=NULL;
+	size_t size,nameLength;
+	uint32_t i;
+	int result;
+
+	memset(dotU,0,sizeof(struct DotU));
+	if(numAttrs>0xFFFF || (numAttrs>0 && attrs==NULL)) return dotuError(DOTU_EINVAL,NULL,"Too many xattrs, or none given.");
+	/* Sized so the whole DotU takes one block */
+	size=2*sizeof(struct DotUEntry)+sizeof(struct ExtAttr)*numAttrs+4*DOTU_ARENA_ALIGN;
+	for(i=0;i<numAttrs;i++){
+		nameLength=(attrs[i].name!=NULL) ? strlen(attrs[i].name) : 0;
+		if(nameLength==0 || nameLength>254) return dotuError(DOTU_EINVAL,attrs[i].name,"Xattr name is empty or too long.");
+		if(attrs[i].value==NULL && attrs[i].valueLength>0) return dotuError(DOTU_EINVAL,attrs[i].name,"Xattr has a length but no value.");
+		size+=nameLength+attrs[i].valueLength+2*DOTU_ARENA_ALIGN;
+	}
+	if(numAttrs>0){
+		sorted=(const struct DotUAttrSpec**)dotuAlloc(sizeof(struct DotUAttrSpec*)*numAttrs);
+		if(sorted==NULL) return dotuError(DOTU_ENOMEM,NULL,"Error allocating xattr list.");
+		for(i=0;i<numAttrs;i++) sorted[i]=&attrs[i];
+		qsort(sorted,numAttrs,sizeof(struct DotUAttrSpec*),compareSpecs);
+	}
+
+	result=(dotuArenaOf(dotU,size)!=NULL) ? initBlank(dotU) : DOTU_ENOMEM;
+	if(result==DOTU_OK) result=fillAttrs(dotU,sorted,numAttrs);
+	dotuFree(sorted,sizeof(struct DotUAttrSpec*)*numAttrs);
+	if(result!=DOTU_OK){
+		freeDotU(dotU);
+		return dotuError(result,NULL,"Error allocating dot underscore data.");
+	}
+	if(parent!=NULL) dotU->entry[0].data.finder.xattrHdr.debugTag=(uint32_t)parent->st_ino;
+	setOffsets(dotU);
+	return DOTU_OK;
+}
+
+struct DotU iniDotU(const char * parentFileName){
+	struct DotU dotU;
+	struct stat statBuffer;
+
+	memset(&dotU,0,sizeof(struct DotU)); /* If it's a bad dotU, magic will be != to DOTUMAGIC */
+	if(stat(parentFileName,&statBuffer)!=0){
+		dotuError(DOTU_EIO,parentFileName,"Error locating parent file.");
+		return dotU;
+	}
+	buildDotU(NULL,0,&statBuffer,&dotU);
 	return dotU;
 }
\ No newline at end of file
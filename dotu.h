@@ -18,6 +18,7 @@
 #include <fcntl.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <sys/types.h>
 
 
 #define MAXCOMMANDSIZE 4095
@@ -26,7 +27,33 @@
 #define DOTUMAGIC 0x00051607
 #define ATTRHEADERMAGIC 0x41545452
 
-#define DEBUG 1
+/* Trace diagnostics are compiled in only when built with DEBUG=1;
+   otherwise they expand to nothing. */
+#ifndef DEBUG
+#define DEBUG 0
+#endif
+
+/* Return codes.  -1 stays "not found" so existing callers that test
+   for -1 or for != 0 keep working. */
+#define DOTU_OK         0
+#define DOTU_ENOTFOUND -1 /* No such attr or entry */
+#define DOTU_EIO       -2 /* open/stat/read/write/mmap failed - see errno */
+#define DOTU_ENOMEM    -3
+#define DOTU_EFORMAT   -4 /* Not an AppleDouble file, or a malformed one */
+#define DOTU_EENTRY    -5 /* Entry id this library can't handle */
+#define DOTU_EINVAL    -6 /* Bad argument */
+
+/* Log levels - a message is delivered if its level <= the current level */
+#define DOTU_LOG_NONE  0
+#define DOTU_LOG_ERROR 1
+#define DOTU_LOG_WARN  2
+#define DOTU_LOG_INFO  3
+#define DOTU_LOG_DEBUG 4
+
+/* Receives every diagnostic at or below the current log level.  code is
+   the DOTU_E* code the failing call returns (DOTU_OK for traces) and
+   subject is the file or attr name it concerns, or NULL. */
+typedef void (*DotULogHandler)(int level, int code, const char *subject, const char *message, void *ctx);
 
 
 struct DotUHeader {
@@ -52,6 +79,9 @@ struct ExtAttr{
 	uint32_t valueLength;
 	char flags[2];
 	uint8_t nameLength;
+	/* The name's id in the name table, 0 if it has none - see
+	   dotuname.h.  Clear it when renaming an attr by hand. */
+	uint32_t nameId;
 	/* The name is stored in the dot-u file as a null-terminated string, 128 bytes max */
 	char * name; 
 	char * value;
@@ -66,16 +96,29 @@ struct FinderEntry {
 	char padding[2];
 	struct ExtAttrHeader xattrHdr;
 	struct ExtAttr * attr;
+	/* attr is in name order, so lookups can binary search */
+	int sorted;
 };
 
 
 struct ResourceEntry {
+	/* NULL until first use for a DotU from readDotUFile - see
+	   getDotUResource and readDotUResource */
+	char * data;
+	/* Where the fork sits in the file it was read from */
+	uint32_t sourceOffset;
+};
+
+/* Any other entry - comment, dates, AFP info and so on - is kept as
+   its bytes and written back as they are */
+struct RawEntry {
 	char * data;
 };
 
 union entryData {
 	struct ResourceEntry resource;
 	struct FinderEntry finder;
+	struct RawEntry raw;
 };
 
 
@@ -87,17 +130,93 @@ struct DotUEntry {
 };
 
 
+/* How the bytes behind attr names, values and the resource fork are held */
+#define DOTU_OWNED    0 /* Copies in the DotU's arena (readDotUFile, iniDotU) */
+#define DOTU_MAPPED   1 /* Pointers into an mmap of the ._ file */
+#define DOTU_BORROWED 2 /* Pointers into a caller-supplied buffer */
+
+/* Private - see dotupriv.h */
+struct DotUArena;
+struct DotUIndex;
+struct DotUInterned;
+
+/* findAttr builds a hash index for attr lists at least this long; 0
+   turns the index off and leaves binary search. */
+#ifndef DOTU_HASHINDEX_MIN
+#define DOTU_HASHINDEX_MIN 32
+#endif
+
 struct DotU {
 	struct DotUHeader header;
-	struct DotUEntry entry[2];
+	/* header.numEntries of them, in the arena */
+	struct DotUEntry * entry;
+	/* The image that names, values and resource data point into,
+	   if backing is DOTU_MAPPED or DOTU_BORROWED. */
+	char * base;
+	uint32_t baseLength;
+	int backing;
+	/* Holds everything the DotU owns; NULL for a DotU built by hand */
+	struct DotUArena * arena;
+	/* Set by setOffsets, cleared by anything that adds, removes or
+	   resizes an attr, so the writer can skip redoing a layout that
+	   still holds.  Clear it after changing attrs by hand. */
+	int layoutValid;
+	/* Hash index over the attr list, built by findAttr */
+	struct DotUIndex * index;
+	/* File a resource fork not yet read is to come from, and the inode
+	   and size it had, so a replaced file is noticed */
+	char * source;
+	ino_t sourceInode;
+	uint32_t sourceLength;
+	/* Store references held in place of owned bytes - see dotuintern.h */
+	struct DotUInterned * interned;
+};
+
+/* What probeDotUFile learns from the start of a file */
+#define DOTU_PROBE_ENTRIES 8
+
+struct DotUProbeEntry {
+	uint32_t id;
+	uint32_t offset;
+	uint32_t length;
+};
+
+struct DotUProbe {
+	int magicOK;               /* header.magic is DOTUMAGIC */
+	int versionOK;             /* AppleDouble version 1 or 2 */
+	struct DotUHeader header;
+	struct DotUProbeEntry entry[DOTU_PROBE_ENTRIES]; /* The first ones */
+	uint32_t fileLength;
+	uint32_t numAttrs;         /* 0 if there's no Finder xattr header */
+	uint32_t resourceLength;   /* 0 if there's no resource fork */
+};
+
+/* Where DotU arenas get their memory.  release gets back the size that
+   was asked of alloc.  Both are called with ctx; to back arenas with
+   per-thread pools, have them pick the calling thread's pool. */
+struct DotUAllocator {
+	void * (*alloc)(size_t size, void *ctx);
+	void (*release)(void *ptr, size_t size, void *ctx);
+	void * ctx;
 };
 
+/* Diagnostics go to stderr at DOTU_LOG_ERROR until told otherwise.
+   A NULL handler discards everything. */
+void setDotULogLevel(int level);
+
+int getDotULogLevel(void);
+
+void setDotULogHandler(DotULogHandler handler, void *ctx);
+
+const char* strDotUError(int code);
+
 void printChar(char thisChar);
 
 void bufWrite(char* buf,uint32_t startIndex,char* data,uint32_t length);
 
 uint32_t toBigEndian(char* charArray, uint32_t numBytes);
 
+/* The returned array is malloc'd - the caller frees it */
 char* toSmallEndian(char* num, uint32_t numBytes);
 
 /* Returns the maximum byte number needed for
@@ -110,6 +229,42 @@ uint32_t attrHdrSize(uint32_t nameLength);
 
 struct DotU readDotUFile(const char *fileName);
 
+/* readDotUFile with the failure reason as a DOTU_E* return code */
+int loadDotUFile(const char *fileName, struct DotU *dotU);
+
+/* Classifies a file from its header, entry table and Finder xattr
+   header alone - usually one read of 128 bytes, however big the file.
+   Returns 0 if it's an AppleDouble file this library can read, else
+   DOTU_EFORMAT (with whatever could be made out filled in) or
+   DOTU_EIO.  Format problems are reported at DOTU_LOG_WARN only, since
+   a scan expects to meet them. */
+int probeDotUFd(int fd, struct DotUProbe *probe);
+
+int probeDotUFile(const char *fileName, struct DotUProbe *probe);
+
+/* Zero-copy readers.  Names, values and the resource fork are left as
+   pointer + length views into the image; the attr array is the only
+   allocation.  Values are NOT null-terminated - use valueLength.
+   Return 0 if good, a DOTU_E* code if fail. */
+int parseDotUBuffer(const char *buf, uint32_t length, struct DotU *dotU);
+
+int mapDotUFd(int fd, struct DotU *dotU);
+
+int mapDotUFile(const char *fileName, struct DotU *dotU);
+
+/* Releases a DotU filled by parseDotUBuffer or mapDotUFd/mapDotUFile.
+   Same as freeDotU. */
+void unmapDotU(struct DotU *dotU);
+
+/* Releases everything a DotU owns in one call and zeroes it.  Works
+   on any DotU this library made; copies made by passing it by value
+   must not be used afterwards. */
+void freeDotU(struct DotU *dotU);
+
+/* Sets the allocator for arenas created from now on.  NULL goes back
+   to malloc/free.  Set it before any DotU is made, not concurrently. */
+void setDotUAllocator(const struct DotUAllocator *allocator);
+
 int createDotUFile(struct DotU dotU, const char * parentFileName);
 
 int createDotUFileSpecName(struct DotU dotU, const char * parentFileName, const char * outputFileName);
@@ -121,16 +276,150 @@ int addAttr(struct DotU * dotU, const char * name, const char * value);
 /* Remove an extended attribute.  Return 0 if good, -1 if fail */
 int rmAttr(struct DotU * dotU, const char * name);
 
+/* Batched edits.  Sets and removes are queued, then applied by
+   commitDotUTxn in one merge pass over the sorted attr list followed
+   by one setOffsets.  Later edits to the same name win.  Removing an
+   attr that isn't there is not an error.  The DotU must not be
+   touched between begin and commit/abort; both free the txn. */
+struct DotUTxn;
+
+struct DotUTxn* beginDotUTxn(struct DotU *dotU);
+
+/* value is valueLength bytes and need not be null-terminated */
+int txnSetAttr(struct DotUTxn *txn, const char *name, const char *value, uint32_t valueLength);
+
+int txnRmAttr(struct DotUTxn *txn, const char *name);
+
+int commitDotUTxn(struct DotUTxn *txn);
+
+void abortDotUTxn(struct DotUTxn *txn);
+
 char* getAttrValue(struct DotU dotU, const char * name);
 
+/* Returns the index of the attribute in question, -1 if not found.
+   Binary search, or the hash index if findAttr has built one. */
 int getAttrIndex(struct DotU dotU, const char * name);
 
+/* getAttrIndex without copying the DotU.  On a big attr list (see
+   DOTU_HASHINDEX_MIN) the first call builds a hash index that later
+   lookups use until the list changes. */
+int findAttr(struct DotU *dotU, const char * name);
+
 int getFinderInfoEntry(struct DotU dotU);
 
 void listAttrs(struct DotU dotU);
 
 void printDotUDetail(struct DotU dotU);
 
+/* A blank DotU for parentFileName, which is only stat'd */
 struct DotU iniDotU(const char * parentFileName);
 
+/* One attr for buildDotU */
+struct DotUAttrSpec {
+	const char * name;
+	const char * value;      /* Need not be null-terminated */
+	uint32_t valueLength;
+};
+
+/* Builds a DotU holding these attrs, ready to write: the list is
+   sorted once - the last of a repeated name wins - and laid out once,
+   where addAttr would copy the list for every attr.  parent, if not
+   NULL, is the stat of the file the ._ file goes with; its inode goes
+   in the attr header's debug tag.  With no attrs it's a blank DotU. */
+int buildDotU(const struct DotUAttrSpec *attrs, uint32_t numAttrs, const struct stat *parent, struct DotU *dotU);
+
+/* Handle API.  These take the DotU by pointer and never copy it; the
+   by-value calls above are kept as wrappers around them.  A handle
+   from openDotU is a mapped DotU on the heap - callers need not look
+   inside it. */
+struct DotU* openDotU(const char *fileName, int *status);
+
+void closeDotU(struct DotU *dotU);
+
+/* Value of name, or NULL if there's no such attr.  Not
+   null-terminated when the DotU is mapped - use *valueLength (which
+   may be NULL if not wanted).  Good until the DotU is next edited. */
+const char* getDotUAttr(const struct DotU *dotU, const char * name, uint32_t *valueLength);
+
+/* addAttr for values of any length, which need not be null-terminated */
+int setDotUAttr(struct DotU *dotU, const char * name, const char * value, uint32_t valueLength);
+
+int removeDotUAttr(struct DotU *dotU, const char * name);
+
+/* Attrs in order, starting from *cursor = 0; NULL after the last one.
+   The attr list must not change while iterating. */
+const struct ExtAttr* nextDotUAttr(const struct DotU *dotU, uint32_t *cursor);
+
+uint32_t sizeDotU(const struct DotU *dotU);
+
+/* Lays the DotU out first if an edit left it stale */
+int writeDotUFile(struct DotU *dotU, const char * outputFileName);
+
+/* The resource fork.  readDotUFile leaves it in the file; these read
+   it from there (or from memory, if it's there already).
+   getDotUResource reads the whole fork in once and keeps it with the
+   DotU; readDotUResource copies up to length bytes from offset within
+   the fork into buf, without keeping anything, and returns how many
+   it copied - 0 past the end - or a DOTU_E* code. */
+uint32_t getDotUResourceLength(const struct DotU *dotU);
+
+const char* getDotUResource(struct DotU *dotU);
+
+long readDotUResource(const struct DotU *dotU, char *buf, uint32_t offset, uint32_t length);
+
+/* Copies length bytes in as the resource fork, adding one if need be;
+   a length of 0 removes it. */
+int setDotUResource(struct DotU *dotU, const char *data, uint32_t length);
+
+/* Entries other than the resource fork and Finder info, which the
+   library keeps as bytes and writes back unchanged.  getDotUEntry
+   gives the bytes of the one with this id, or NULL if there's none.
+   setDotUEntry copies length bytes in as that entry, adding it if
+   need be; NULL data removes it.  Ids 2 and 9 are refused. */
+const char* getDotUEntry(const struct DotU *dotU, uint32_t id, uint32_t *length);
+
+int setDotUEntry(struct DotU *dotU, uint32_t id, const char *data, uint32_t length);
+
+/* Serializer.  The file is written as a list of pieces: encoded
+   headers, plus the values and resource fork where they already are.
+   layoutDotU gives the exact size of the file, laying it out first if
+   stale; serializeDotU copies the file into buf, which must be at
+   least that big; writeDotUFd writes it at fd's current position with
+   writev. */
+int layoutDotU(struct DotU *dotU, uint32_t *size);
+
+int serializeDotU(struct DotU *dotU, char *buf, uint32_t bufLength);
+
+int writeDotUFd(struct DotU *dotU, int fd);
+
+/* Brings fileName up to date with the DotU by writing only the bytes
+   that differ, when the new layout is the same size with the entries
+   where they were - a value changed in place, or grew into the padding
+   before the 4096 boundary.  Otherwise the whole file is rewritten.
+   Only attr edits are picked up; the resource fork is left as it is.
+   A mapped DotU is copied off its mapping first. */
+int patchDotUFile(struct DotU *dotU, const char * fileName);
+
+/* Crash-safe writes.  The file is written to a temp file in the same
+   directory and renamed over fileName, so it is only ever all old or
+   all new.  With a NULL group that happens at once, with an fsync of
+   the file and of the directory.  With a group, the renames wait for
+   commitDotUSyncGroup, which makes the whole group durable with one
+   barrier (a syncfs per filesystem on Linux) before renaming and one
+   after.  abortDotUSyncGroup drops the temp files and leaves the old
+   ones.  Commit and abort free the group; a group is for one thread. */
+struct DotUSyncGroup;
+
+struct DotUSyncGroup* beginDotUSyncGroup(void);
+
+int writeDotUFileAtomic(struct DotU *dotU, const char * fileName, struct DotUSyncGroup *group);
+
+int commitDotUSyncGroup(struct DotUSyncGroup *group);
+
+void abortDotUSyncGroup(struct DotUSyncGroup *group);
+
+void listDotUAttrs(const struct DotU *dotU);
+
+void printDotU(const struct DotU *dotU);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,153 @@
+#include "dotupriv.h"
+
+#define ALIGNED(size) (((size)+DOTU_ARENA_ALIGN-1) & ~((size_t)DOTU_ARENA_ALIGN-1))
+
+/* Smallest block worth asking the allocator for */
+#define ARENA_MINBLOCK 256
+
+static void *
+mallocAlloc(size_t size, void *ctx){
+	return malloc(size);
+}
+
+static void
+mallocRelease(void *ptr, size_t size, void *ctx){
+	free(ptr);
+}
+
+static struct DotUAllocator currentAllocator={mallocAlloc,mallocRelease,NULL};
+
+void
+setDotUAllocator(const struct DotUAllocator *allocator){
+	if(allocator==NULL){
+		currentAllocator.alloc=mallocAlloc;
+		currentAllocator.release=mallocRelease;
+		currentAllocator.ctx=NULL;
+	} else {
+		currentAllocator=*allocator;
+	}
+}
+
+void *
+dotuAlloc(size_t size){
+	return currentAllocator.alloc(size,currentAllocator.ctx);
+}
+
+void
+dotuFree(void *ptr, size_t size){
+	if(ptr!=NULL) currentAllocator.release(ptr,size,currentAllocator.ctx);
+}
+
+void
+dotuCurrentAllocator(struct DotUAllocator *allocator){
+	*allocator=currentAllocator;
+}
+
+/* Gets a block with room for size bytes from the given allocator */
+static struct DotUArenaBlock *
+newBlock(const struct DotUAllocator *allocator, size_t size){
+	struct DotUArenaBlock *block;
+
+	if(size<ARENA_MINBLOCK) size=ARENA_MINBLOCK;
+	size=ALIGNED(size);
+	block=(struct DotUArenaBlock*)allocator->alloc(ALIGNED(sizeof(struct DotUArenaBlock))+size,allocator->ctx);
+	if(block==NULL) return NULL;
+	block->next=NULL;
+	block->size=size;
+	block->used=0;
+	return block;
+}
+
+static char *
+blockData(struct DotUArenaBlock *block){
+	return (char*)block+ALIGNED(sizeof(struct DotUArenaBlock));
+}
+
+struct DotUArena *
+dotuArenaCreate(size_t size){
+	struct DotUArenaBlock *block;
+	struct DotUArena *arena;
+
+	/* The arena lives at the front of its own first block, so a DotU
+	   that fits in one block costs a single allocation. */
+	block=newBlock(&currentAllocator,ALIGNED(sizeof(struct DotUArena))+size);
+	if(block==NULL) return NULL;
+	arena=(struct DotUArena*)blockData(block);
+	block->used=ALIGNED(sizeof(struct DotUArena));
+	arena->current=block;
+	arena->allocator=currentAllocator;
+	arena->used=0;
+	arena->dead=0;
+	return arena;
+}
+
+void *
+dotuArenaAlloc(struct DotUArena *arena, size_t size){
+	struct DotUArenaBlock *block=arena->current;
+	size_t blockSize;
+	void *ptr;
+
+	size=ALIGNED(size);
+	if(block->size-block->used<size){
+		/* Grow geometrically so a DotU being built up attr by attr
+		   takes a handful of blocks, not one per attr. */
+		blockSize=block->size*2;
+		if(blockSize<size) blockSize=size;
+		block=newBlock(&arena->allocator,blockSize);
+		if(block==NULL) return NULL;
+		block->next=arena->current;
+		arena->current=block;
+	}
+	ptr=blockData(block)+block->used;
+	block->used+=size;
+	arena->used+=size;
+	return ptr;
+}
+
+char *
+dotuArenaCopy(struct DotUArena *arena, const char *data, size_t length){
+	char *copy=(char*)dotuArenaAlloc(arena,length+1);
+	if(copy==NULL) return NULL;
+	memcpy(copy,data,length);
+	copy[length]='\0';
+	return copy;
+}
+
+void
+dotuArenaRelease(struct DotUArena *arena){
+	struct DotUAllocator allocator;
+	struct DotUArenaBlock *block;
+	struct DotUArenaBlock *next;
+
+	if(arena==NULL) return;
+	/* The first block holds the arena itself and is freed last */
+	allocator=arena->allocator;
+	for(block=arena->current;block!=NULL;block=next){
+		next=block->next;
+		allocator.release(block,ALIGNED(sizeof(struct DotUArenaBlock))+block->size,allocator.ctx);
+	}
+}
+
+int
+dotuArenaOwns(const struct DotUArena *arena, const void *ptr){
+	const struct DotUArenaBlock *block;
+	const char *data;
+
+	if(arena==NULL || ptr==NULL) return 0;
+	for(block=arena->current;block!=NULL;block=block->next){
+		data=blockData((struct DotUArenaBlock*)block);
+		if((const char*)ptr>=data && (const char*)ptr<data+block->used) return 1;
+	}
+	return 0;
+}
+
+void
+dotuArenaDrop(struct DotUArena *arena, size_t size){
+	arena->dead+=ALIGNED(size);
+}
+
+struct DotUArena *
+dotuArenaOf(struct DotU *dotU, size_t size){
+	if(dotU->arena==NULL) dotU->arena=dotuArenaCreate(size);
+	return dotU->arena;
+}
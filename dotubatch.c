@@ -0,0 +1,570 @@
+/* io_uring needs syscall() and struct statx, which a strict POSIX
+   feature level hides */
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
+#include "dotubatch.h"
+#include "dotupriv.h"
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+/* The probe came in with the open, statx and close operations */
+#if defined(__NR_io_uring_setup) && defined(IO_URING_OP_SUPPORTED)
+#define DOTU_URING 1
+#endif
+#endif
+
+/* Thread pool, for where there's no io_uring */
+
+struct BatchPool {
+	const char * const * fileNames;
+	long numFiles;
+	long next;       /* Next file to hand out */
+	long parsed;
+	DotUBatchCallback callback;
+	void * ctx;
+};
+
+static void
+reportFile(const char *path, long index, struct DotU *dotU, int status, DotUBatchCallback callback, void *ctx){
+	if(callback!=NULL) callback(path,index,dotU,status,ctx);
+	else freeDotU(dotU);
+}
+
+static void *
+batchWorker(void *arg){
+	struct BatchPool *pool=(struct BatchPool*)arg;
+	struct DotU dotU;
+	long i;
+	int status;
+
+	while((i=__sync_fetch_and_add(&pool->next,1))<pool->numFiles){
+		status=loadDotUFile(pool->fileNames[i],&dotU);
+		if(status==DOTU_OK) __sync_fetch_and_add(&pool->parsed,1);
+		reportFile(pool->fileNames[i],i,&dotU,status,pool->callback,pool->ctx);
+	}
+	return NULL;
+}
+
+/* Reads files first to numFiles-1 */
+static long
+readWithThreads(const char * const *fileNames, long first, long numFiles, int depth, DotUBatchCallback callback, void *ctx){
+	struct BatchPool pool;
+	pthread_t *threads;
+	int started,i;
+
+	if(depth>numFiles-first) depth=(int)(numFiles-first);
+	memset(&pool,0,sizeof(struct BatchPool));
+	pool.fileNames=fileNames;
+	pool.next=first;
+	pool.numFiles=numFiles;
+	pool.callback=callback;
+	pool.ctx=ctx;
+	threads=(pthread_t*)malloc(sizeof(pthread_t)*depth);
+	for(started=0;threads!=NULL && started<depth;started++){
+		if(pthread_create(&threads[started],NULL,batchWorker,&pool)!=0) break;
+	}
+	/* If no thread started at all, do it all on this one */
+	if(started==0) batchWorker(&pool);
+	for(i=0;i<started;i++) pthread_join(threads[i],NULL);
+	free(threads);
+	return pool.parsed;
+}
+
+#ifdef DOTU_URING
+
+/* Ring mmap offsets - the header's are long long constants, which
+   C89 hasn't got */
+#define RINGOFF_SQRING 0L
+#define RINGOFF_CQRING 0x8000000L
+#define RINGOFF_SQES   0x10000000L
+
+/* The first read; a file is read further only if it's longer and its
+   entries say more is needed before the resource fork */
+#define FIRSTREAD 4096
+
+/* What a completion is for, in the low bits of its user_data */
+#define OP_OPEN  0
+#define OP_STATX 1
+#define OP_READ  2
+#define OP_CLOSE 3
+
+/* Where a file is up to */
+#define STAGE_OPEN  0 /* Open and statx both out */
+#define STAGE_READ  1
+#define STAGE_CLOSE 2
+
+struct Ring {
+	int fd;
+	unsigned * sqHead;
+	unsigned * sqTail;
+	unsigned sqMask;
+	unsigned sqEntries;
+	unsigned * sqArray;
+	struct io_uring_sqe * sqes;
+	unsigned * cqHead;
+	unsigned * cqTail;
+	unsigned cqMask;
+	struct io_uring_cqe * cqes;
+	void * sqRing;
+	size_t sqRingSize;
+	void * cqRing;
+	size_t cqRingSize;
+	size_t sqesSize;
+	unsigned toSubmit;   /* Queued but not yet handed to the kernel */
+};
+
+struct Slot {
+	int busy;
+	long index;          /* In the file list */
+	int stage;
+	int pending;         /* Completions still to come for this stage */
+	int fd;
+	int status;
+	int statResult;
+	struct statx stx;
+	char * buf;
+	uint32_t bufSize;
+	uint32_t want;       /* Bytes to have read before parsing */
+	uint32_t done;
+	uint32_t fileLength;
+};
+
+struct UringBatch {
+	struct Ring ring;
+	struct Slot * slots;
+	int * freeSlots;
+	int numFree;
+	const char * const * fileNames;
+	DotUBatchCallback callback;
+	void * ctx;
+	long parsed;
+};
+
+static int
+ringSetup(struct Ring *ring, unsigned entries){
+	struct io_uring_params params;
+
+	memset(ring,0,sizeof(struct Ring));
+	memset(&params,0,sizeof(params));
+	ring->fd=(int)syscall(__NR_io_uring_setup,entries,&params);
+	if(ring->fd<0) return DOTU_EIO;
+	ring->sqRingSize=params.sq_off.array+params.sq_entries*sizeof(unsigned);
+	ring->cqRingSize=params.cq_off.cqes+params.cq_entries*sizeof(struct io_uring_cqe);
+	ring->sqesSize=params.sq_entries*sizeof(struct io_uring_sqe);
+	ring->sqRing=mmap(NULL,ring->sqRingSize,PROT_READ|PROT_WRITE,MAP_SHARED,ring->fd,RINGOFF_SQRING);
+	ring->cqRing=mmap(NULL,ring->cqRingSize,PROT_READ|PROT_WRITE,MAP_SHARED,ring->fd,RINGOFF_CQRING);
+	ring->sqes=(struct io_uring_sqe*)mmap(NULL,ring->sqesSize,PROT_READ|PROT_WRITE,MAP_SHARED,ring->fd,RINGOFF_SQES);
+	if(ring->sqRing==MAP_FAILED || ring->cqRing==MAP_FAILED || (void*)ring->sqes==MAP_FAILED){
+		if(ring->sqRing!=MAP_FAILED) munmap(ring->sqRing,ring->sqRingSize);
+		if(ring->cqRing!=MAP_FAILED) munmap(ring->cqRing,ring->cqRingSize);
+		if((void*)ring->sqes!=MAP_FAILED) munmap(ring->sqes,ring->sqesSize);
+		close(ring->fd);
+		return DOTU_EIO;
+	}
+	ring->sqHead=(unsigned*)((char*)ring->sqRing+params.sq_off.head);
+	ring->sqTail=(unsigned*)((char*)ring->sqRing+params.sq_off.tail);
+	ring->sqMask=*(unsigned*)((char*)ring->sqRing+params.sq_off.ring_mask);
+	ring->sqEntries=params.sq_entries;
+	ring->sqArray=(unsigned*)((char*)ring->sqRing+params.sq_off.array);
+	ring->cqHead=(unsigned*)((char*)ring->cqRing+params.cq_off.head);
+	ring->cqTail=(unsigned*)((char*)ring->cqRing+params.cq_off.tail);
+	ring->cqMask=*(unsigned*)((char*)ring->cqRing+params.cq_off.ring_mask);
+	ring->cqes=(struct io_uring_cqe*)((char*)ring->cqRing+params.cq_off.cqes);
+	return DOTU_OK;
+}
+
+static void
+ringTeardown(struct Ring *ring){
+	munmap(ring->sqRing,ring->sqRingSize);
+	munmap(ring->cqRing,ring->cqRingSize);
+	munmap(ring->sqes,ring->sqesSize);
+	close(ring->fd);
+}
+
+/* Whether the kernel has every operation the reader uses */
+static int
+ringSupported(struct Ring *ring){
+	static const int needed[]={IORING_OP_OPENAT,IORING_OP_STATX,IORING_OP_READ,IORING_OP_CLOSE};
+	struct io_uring_probe *probe;
+	size_t size=sizeof(struct io_uring_probe)+256*sizeof(struct io_uring_probe_op);
+	unsigned i;
+	int supported=1;
+
+	probe=(struct io_uring_probe*)malloc(size);
+	if(probe==NULL) return 0;
+	memset(probe,0,size);
+	if(syscall(__NR_io_uring_register,ring->fd,IORING_REGISTER_PROBE,probe,256)<0) supported=0;
+	for(i=0;supported && i<sizeof(needed)/sizeof(needed[0]);i++){
+		if(needed[i]>probe->last_op || !(probe->ops[needed[i]].flags & IO_URING_OP_SUPPORTED)) supported=0;
+	}
+	free(probe);
+	return supported;
+}
+
+/* Hands everything queued to the kernel and, if wait, waits for at
+   least one completion */
+static int
+ringEnter(struct Ring *ring, int wait){
+	long result;
+
+	do {
+		result=syscall(__NR_io_uring_enter,ring->fd,ring->toSubmit,wait ? 1 : 0,wait ? IORING_ENTER_GETEVENTS : 0,NULL,0);
+	} while(result<0 && errno==EINTR);
+	if(result<0) return DOTU_EIO;
+	ring->toSubmit-=(unsigned)result;
+	return DOTU_OK;
+}
+
+/* The next free submission entry, zeroed, flushing the queue to the
+   kernel first if it's full */
+static struct io_uring_sqe *
+ringSqe(struct Ring *ring, int opcode, int slot, int op){
+	struct io_uring_sqe *sqe;
+	unsigned tail=*ring->sqTail;
+	unsigned head;
+
+	head=*(volatile unsigned*)ring->sqHead;
+	__sync_synchronize();
+	if(tail-head>=ring->sqEntries){
+		if(ringEnter(ring,0)!=DOTU_OK) return NULL;
+		head=*(volatile unsigned*)ring->sqHead;
+		__sync_synchronize();
+		if(tail-head>=ring->sqEntries) return NULL;
+	}
+	sqe=&ring->sqes[tail & ring->sqMask];
+	memset(sqe,0,sizeof(struct io_uring_sqe));
+	sqe->opcode=(unsigned char)opcode;
+	sqe->user_data=((uint64_t)slot<<2)|(uint64_t)op;
+	ring->sqArray[tail & ring->sqMask]=tail & ring->sqMask;
+	return sqe;
+}
+
+/* Publishes the entry ringSqe gave out */
+static void
+ringQueue(struct Ring *ring){
+	__sync_synchronize();
+	*(volatile unsigned*)ring->sqTail=*ring->sqTail+1;
+	ring->toSubmit++;
+}
+
+static int
+queueRead(struct UringBatch *batch, int slotNum){
+	struct Slot *slot=&batch->slots[slotNum];
+	struct io_uring_sqe *sqe=ringSqe(&batch->ring,IORING_OP_READ,slotNum,OP_READ);
+
+	if(sqe==NULL) return DOTU_EIO;
+	sqe->fd=slot->fd;
+	sqe->addr=(uint64_t)(size_t)(slot->buf+slot->done);
+	sqe->len=slot->want-slot->done;
+	sqe->off=slot->done;
+	ringQueue(&batch->ring);
+	return DOTU_OK;
+}
+
+/* Reports the file and closes it; the slot is free once the close
+   completes */
+static void
+finishFile(struct UringBatch *batch, int slotNum, struct DotU *dotU){
+	struct Slot *slot=&batch->slots[slotNum];
+	struct io_uring_sqe *sqe;
+	struct DotU failed;
+	const char *path=batch->fileNames[slot->index];
+
+	if(dotU==NULL){
+		memset(&failed,0,sizeof(struct DotU));
+		dotU=&failed;
+		dotuError(slot->status,path,(slot->status==DOTU_EFORMAT) ? "File is not an AppleDouble encoded file." : "Error reading dot underscore file.");
+	}
+	if(slot->buf!=NULL){
+		dotuFree(slot->buf,slot->bufSize);
+		slot->buf=NULL;
+	}
+	if(slot->status==DOTU_OK) batch->parsed++;
+	reportFile(path,slot->index,dotU,slot->status,batch->callback,batch->ctx);
+
+	slot->stage=STAGE_CLOSE;
+	if(slot->fd>=0){
+		sqe=ringSqe(&batch->ring,IORING_OP_CLOSE,slotNum,OP_CLOSE);
+		if(sqe!=NULL){
+			sqe->fd=slot->fd;
+			ringQueue(&batch->ring);
+			slot->pending=1;
+			return;
+		}
+		close(slot->fd);
+	}
+	slot->busy=0;
+	batch->freeSlots[batch->numFree++]=slotNum;
+}
+
+/* Open and stat are both back */
+static void
+opened(struct UringBatch *batch, int slotNum){
+	struct Slot *slot=&batch->slots[slotNum];
+
+	if(slot->fd<0 || slot->statResult<0){
+		slot->status=DOTU_EIO;
+	} else if(slot->stx.stx_size<26 || slot->stx.stx_size>0xFFFFFFFFUL){
+		slot->status=DOTU_EFORMAT;
+	} else {
+		slot->fileLength=(uint32_t)slot->stx.stx_size;
+		slot->want=(slot->fileLength<FIRSTREAD) ? slot->fileLength : FIRSTREAD;
+		slot->bufSize=slot->want+1;
+		slot->buf=(char*)dotuAlloc(slot->bufSize);
+		slot->status=(slot->buf==NULL) ? DOTU_ENOMEM : queueRead(batch,slotNum);
+		if(slot->status==DOTU_OK){
+			slot->stage=STAGE_READ;
+			slot->pending=1;
+			return;
+		}
+	}
+	finishFile(batch,slotNum,NULL);
+}
+
+/* A read is back */
+static void
+readDone(struct UringBatch *batch, int slotNum, int result){
+	struct Slot *slot=&batch->slots[slotNum];
+	struct DotU dotU;
+	uint32_t need;
+	char *buf;
+
+	if(result<=0){
+		slot->status=DOTU_EIO;
+		finishFile(batch,slotNum,NULL);
+		return;
+	}
+	slot->done+=(uint32_t)result;
+	if(slot->done<slot->want){
+		slot->status=queueRead(batch,slotNum);
+		if(slot->status==DOTU_OK) slot->pending=1;
+		else finishFile(batch,slotNum,NULL);
+		return;
+	}
+	if(toBigEndian(slot->buf,4)!=DOTUMAGIC){
+		slot->status=DOTU_EFORMAT;
+		finishFile(batch,slotNum,NULL);
+		return;
+	}
+	/* Under 50 bytes there's no room for two entries: read it all */
+	need=(slot->done>=50) ? dotuPrefixNeeded(slot->buf,slot->fileLength) : slot->fileLength;
+	if(need>slot->done){
+		/* More before the resource fork than the first read took */
+		buf=(char*)dotuAlloc(need+1);
+		if(buf==NULL){
+			slot->status=DOTU_ENOMEM;
+			finishFile(batch,slotNum,NULL);
+			return;
+		}
+		memcpy(buf,slot->buf,slot->done);
+		dotuFree(slot->buf,slot->bufSize);
+		slot->buf=buf;
+		slot->bufSize=need+1;
+		slot->want=need;
+		slot->status=queueRead(batch,slotNum);
+		if(slot->status==DOTU_OK) slot->pending=1;
+		else finishFile(batch,slotNum,NULL);
+		return;
+	}
+	slot->status=dotuLoadImage(batch->fileNames[slot->index],slot->buf,need,slot->fileLength,(ino_t)slot->stx.stx_ino,&dotU);
+	finishFile(batch,slotNum,&dotU);
+}
+
+static void
+completed(struct UringBatch *batch, uint64_t userData, int result){
+	int slotNum=(int)(userData>>2);
+	struct Slot *slot=&batch->slots[slotNum];
+
+	slot->pending--;
+	switch((int)(userData & 3)){
+		case OP_OPEN: slot->fd=result; break;
+		case OP_STATX: slot->statResult=result; break;
+		case OP_READ: readDone(batch,slotNum,result); return;
+		case OP_CLOSE:
+			slot->busy=0;
+			batch->freeSlots[batch->numFree++]=slotNum;
+			return;
+	}
+	if(slot->stage==STAGE_OPEN && slot->pending==0) opened(batch,slotNum);
+}
+
+/* Takes whatever completions are in, passing each to handle */
+static void
+reapRing(struct UringBatch *batch, void (*handle)(struct UringBatch*, uint64_t, int)){
+	struct io_uring_cqe *cqe;
+	unsigned head,tail;
+
+	head=*batch->ring.cqHead;
+	__sync_synchronize();
+	tail=*(volatile unsigned*)batch->ring.cqTail;
+	__sync_synchronize();
+	for(;head!=tail;head++){
+		cqe=&batch->ring.cqes[head & batch->ring.cqMask];
+		handle(batch,cqe->user_data,cqe->res);
+	}
+	__sync_synchronize();
+	*(volatile unsigned*)batch->ring.cqHead=head;
+}
+
+/* A completion after the ring failed: it only settles the slot.  An
+   open that got through leaves an fd to close. */
+static void
+settled(struct UringBatch *batch, uint64_t userData, int result){
+	struct Slot *slot=&batch->slots[userData>>2];
+
+	slot->pending--;
+	if((int)(userData & 3)==OP_OPEN) slot->fd=result;
+}
+
+/* Waits out everything the kernel still has of the batch's - opens,
+   statx into the slots, reads into their buffers - so none of it can
+   land once they're freed */
+static int
+drainRing(struct UringBatch *batch, int depth){
+	int i,outstanding;
+
+	for(;;){
+		for(outstanding=0,i=0;i<depth;i++){
+			if(batch->slots[i].busy) outstanding+=batch->slots[i].pending;
+		}
+		if(outstanding==0) return DOTU_OK;
+		if(ringEnter(&batch->ring,1)!=DOTU_OK) return DOTU_EIO;
+		reapRing(batch,settled);
+	}
+}
+
+/* Queues the open and statx of the next file */
+static int
+startFile(struct UringBatch *batch, long index){
+	int slotNum=batch->freeSlots[--batch->numFree];
+	struct Slot *slot=&batch->slots[slotNum];
+	struct io_uring_sqe *sqe;
+
+	memset(slot,0,sizeof(struct Slot));
+	slot->busy=1;
+	slot->index=index;
+	slot->stage=STAGE_OPEN;
+	slot->fd=-1;
+	/* Counted as each is queued, so a failed start leaves pending
+	   saying what's really out */
+	sqe=ringSqe(&batch->ring,IORING_OP_OPENAT,slotNum,OP_OPEN);
+	if(sqe==NULL) return DOTU_EIO;
+	sqe->fd=AT_FDCWD;
+	sqe->addr=(uint64_t)(size_t)batch->fileNames[index];
+	sqe->open_flags=O_RDONLY;
+	ringQueue(&batch->ring);
+	slot->pending++;
+	sqe=ringSqe(&batch->ring,IORING_OP_STATX,slotNum,OP_STATX);
+	if(sqe==NULL) return DOTU_EIO;
+	sqe->fd=AT_FDCWD;
+	sqe->addr=(uint64_t)(size_t)batch->fileNames[index];
+	sqe->len=STATX_SIZE|STATX_INO;
+	sqe->off=(uint64_t)(size_t)&slot->stx;
+	ringQueue(&batch->ring);
+	slot->pending++;
+	return DOTU_OK;
+}
+
+/* The ring failed under us.  What's still out is waited for before
+   the ring goes; the files that hadn't been reported are read again
+   here, and those not yet started go to the threads.  If the ring
+   can't even be waited on, the slots and buffers the kernel may still
+   write to are left rather than freed. */
+static long
+recoverBatch(struct UringBatch *batch, int depth, long next, long numFiles){
+	struct Slot *slot;
+	struct DotU dotU;
+	int i,status,drained;
+
+	dotuError(DOTU_EIO,NULL,"io_uring failed - finishing the batch on threads.");
+	drained=(drainRing(batch,depth)==DOTU_OK);
+	ringTeardown(&batch->ring);
+	for(i=0;i<depth;i++){
+		slot=&batch->slots[i];
+		if(!slot->busy || slot->stage==STAGE_CLOSE) continue;
+		if(slot->fd>=0) close(slot->fd);
+		if(drained && slot->buf!=NULL) dotuFree(slot->buf,slot->bufSize);
+		status=loadDotUFile(batch->fileNames[slot->index],&dotU);
+		if(status==DOTU_OK) batch->parsed++;
+		reportFile(batch->fileNames[slot->index],slot->index,&dotU,status,batch->callback,batch->ctx);
+	}
+	if(drained) free(batch->slots);
+	free(batch->freeSlots);
+	return batch->parsed+readWithThreads(batch->fileNames,next,numFiles,depth,batch->callback,batch->ctx);
+}
+
+/* Returns the number parsed, -1 to fall back to threads before any
+   file was started */
+static long
+readWithUring(const char * const *fileNames, long numFiles, int depth, DotUBatchCallback callback, void *ctx){
+	struct UringBatch batch;
+	long next=0;
+	int i,failed=0;
+
+	if(depth>numFiles) depth=(int)numFiles;
+	memset(&batch,0,sizeof(batch));
+	/* Two entries for each file in flight, for its open and statx */
+	if(ringSetup(&batch.ring,(unsigned)depth*2)!=DOTU_OK) return -1;
+	if(!ringSupported(&batch.ring)){
+		ringTeardown(&batch.ring);
+		return -1;
+	}
+	batch.slots=(struct Slot*)malloc(sizeof(struct Slot)*depth);
+	batch.freeSlots=(int*)malloc(sizeof(int)*depth);
+	if(batch.slots==NULL || batch.freeSlots==NULL){
+		free(batch.slots);
+		free(batch.freeSlots);
+		ringTeardown(&batch.ring);
+		return -1;
+	}
+	for(i=0;i<depth;i++) batch.freeSlots[i]=depth-1-i;
+	batch.numFree=depth;
+	batch.fileNames=fileNames;
+	batch.callback=callback;
+	batch.ctx=ctx;
+
+	while(!failed && (next<numFiles || batch.numFree<depth)){
+		while(!failed && next<numFiles && batch.numFree>0){
+			if(startFile(&batch,next)!=DOTU_OK) failed=1;
+			next++;
+		}
+		if(failed || ringEnter(&batch.ring,1)!=DOTU_OK){
+			failed=1;
+			break;
+		}
+		reapRing(&batch,completed);
+	}
+	if(failed) return recoverBatch(&batch,depth,next,numFiles);
+	ringTeardown(&batch.ring);
+	free(batch.slots);
+	free(batch.freeSlots);
+	return batch.parsed;
+}
+
+#endif
+
+long
+readDotUFiles(const char * const *fileNames, long numFiles, int depth, int flags, DotUBatchCallback callback, void *ctx){
+	long parsed;
+
+	if((fileNames==NULL && numFiles>0) || numFiles<0){
+		dotuError(DOTU_EINVAL,NULL,"No file list given.");
+		return -1;
+	}
+	if(numFiles==0) return 0;
+	if(depth<=0) depth=DOTU_BATCH_DEPTH;
+#ifdef DOTU_URING
+	if(!(flags & DOTU_BATCH_THREADS)){
+		parsed=readWithUring(fileNames,numFiles,depth,callback,ctx);
+		if(parsed>=0) return parsed;
+	}
+#endif
+	return readWithThreads(fileNames,0,numFiles,depth,callback,ctx);
+}
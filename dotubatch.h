@@ -0,0 +1,34 @@
+/*
+ Batch reader for many small ._ files.
+
+ On Linux the opens, stats, reads and closes for a whole batch go
+ through one io_uring, a bounded number of files at a time, so the
+ per-file syscall round trips overlap instead of adding up.  Where
+ io_uring is missing, disabled or lacks the operations needed, the
+ files are read with loadDotUFile on a pool of threads instead.
+*/
+
+#ifndef DOTUBATCH_H
+#define DOTUBATCH_H
+
+#include "dotu.h"
+
+/* Files in flight at once if 0 is given */
+#define DOTU_BATCH_DEPTH 32
+
+/* Flags */
+#define DOTU_BATCH_THREADS 1 /* Use the thread pool even if io_uring works */
+
+/* Called once per file, as it completes - not in list order.  index
+   is its place in the list.  status is DOTU_OK if it parsed, else the
+   DOTU_E* code saying why not.  The DotU is as loadDotUFile leaves it
+   and the callback's to keep: free it with freeDotU.  With the thread
+   pool, several callbacks can be running at once. */
+typedef void (*DotUBatchCallback)(const char *path, long index, struct DotU *dotU, int status, void *ctx);
+
+/* Reads every file in the list with up to depth (0 for
+   DOTU_BATCH_DEPTH) in flight.  Returns the number that parsed, -1 if
+   the reading couldn't be started. */
+long readDotUFiles(const char * const *fileNames, long numFiles, int depth, int flags, DotUBatchCallback callback, void *ctx);
+
+#endif
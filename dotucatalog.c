@@ -0,0 +1,558 @@
+#include "dotucatalog.h"
+#include "dotuscan.h"
+#include "dotupriv.h"
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+/* File layout.  Every section starts on an 8-byte boundary and every
+   offset is from the start of the file.
+
+     header
+     files     CatFile[numFiles], sorted by path
+     names     CatName[numNames], sorted by name
+     attrs     CatAttr[numAttrs], each file's together and by name ID
+     postings  uint32_t[numAttrs], each name's file IDs together, ascending
+     strings   paths then names, each null-terminated
+     values
+*/
+
+#define CATMAGIC     "DOTUCAT"
+#define CATBYTEORDER 0x01020304UL
+#define CATALIGN(n)  (((n)+7) & ~(uint64_t)7)
+
+/* Building.  The scan callbacks copy what they need into one arena
+   under a lock; sorting and interning wait until the scan is over. */
+
+struct BuildAttr {
+	char * name;
+	char * value;
+	uint32_t valueLength;
+	uint32_t nameId;
+};
+
+struct BuildFile {
+	char * path;
+	uint32_t pathLength;
+	char finderInfo[32];
+	struct BuildAttr * attrs;
+	uint32_t numAttrs;
+};
+
+struct Builder {
+	pthread_mutex_t lock;
+	struct DotUArena * arena;
+	struct BuildFile * files;
+	uint32_t numFiles;
+	uint32_t capacity;
+	uint32_t numAttrs;
+	int result;
+};
+
+static int
+addFile(struct Builder *builder, const char *path, uint32_t pathLength, const struct DotU *dotU){
+	struct BuildFile *files;
+	struct BuildFile *file;
+	const struct ExtAttr *attr;
+	uint32_t cursor,numAttrs,i;
+	int finderEntry=dotuFinderEntry(dotU);
+
+	if(builder->numFiles==0xFFFFFFFFUL) return DOTU_EINVAL;
+	if(builder->numFiles==builder->capacity){
+		files=(struct BuildFile*)dotuArenaAlloc(builder->arena,sizeof(struct BuildFile)*builder->capacity*2);
+		if(files==NULL) return DOTU_ENOMEM;
+		memcpy(files,builder->files,sizeof(struct BuildFile)*builder->numFiles);
+		builder->files=files;
+		builder->capacity*=2;
+	}
+	file=&builder->files[builder->numFiles];
+	memset(file,0,sizeof(struct BuildFile));
+	file->path=dotuArenaCopy(builder->arena,path,pathLength);
+	file->pathLength=pathLength;
+	if(file->path==NULL) return DOTU_ENOMEM;
+	if(finderEntry>=0){
+		memcpy(file->finderInfo,dotU->entry[finderEntry].data.finder.finderHeader,32);
+	}
+
+	for(numAttrs=0,cursor=0;nextDotUAttr(dotU,&cursor)!=NULL;numAttrs++);
+	if(numAttrs>0xFFFFFFFFUL-builder->numAttrs) return DOTU_EINVAL;
+	if(numAttrs>0){
+		file->attrs=(struct BuildAttr*)dotuArenaAlloc(builder->arena,sizeof(struct BuildAttr)*numAttrs);
+		if(file->attrs==NULL) return DOTU_ENOMEM;
+	}
+	for(i=0,cursor=0;(attr=nextDotUAttr(dotU,&cursor))!=NULL;i++){
+		file->attrs[i].name=dotuArenaCopy(builder->arena,attr->name,strlen(attr->name));
+		file->attrs[i].value=dotuArenaCopy(builder->arena,attr->value,attr->valueLength);
+		file->attrs[i].valueLength=attr->valueLength;
+		if(file->attrs[i].name==NULL || file->attrs[i].value==NULL) return DOTU_ENOMEM;
+	}
+	file->numAttrs=numAttrs;
+	builder->numAttrs+=numAttrs;
+	builder->numFiles++;
+	return DOTU_OK;
+}
+
+static void
+catalogScanned(const char *path, struct DotU *dotU, int status, void *ctx){
+	struct Builder *builder=(struct Builder*)ctx;
+	char fileName[MAXDIRNAMESIZE+MAXFILENAMESIZE+2];
+	const char *slash=strrchr(path,'/');
+	const char *base=(slash==NULL) ? path : slash+1;
+	int length;
+
+	if(status!=DOTU_OK || base[2]=='\0') return;
+	/* The file's own path is the ._ file's without the ._ */
+	length=snprintf(fileName,sizeof(fileName),"%.*s%s",(int)(base-path),path,base+2);
+	if(length<0 || (size_t)length>=sizeof(fileName)) return;
+	pthread_mutex_lock(&builder->lock);
+	if(builder->result==DOTU_OK) builder->result=addFile(builder,fileName,(uint32_t)length,dotU);
+	pthread_mutex_unlock(&builder->lock);
+}
+
+static int
+comparePaths(const void *a, const void *b){
+	return strcmp(((const struct BuildFile*)a)->path,((const struct BuildFile*)b)->path);
+}
+
+static int
+compareNames(const void *a, const void *b){
+	return strcmp(*(char * const *)a,*(char * const *)b);
+}
+
+static int
+compareNameIds(const void *a, const void *b){
+	uint32_t x=((const struct BuildAttr*)a)->nameId;
+	uint32_t y=((const struct BuildAttr*)b)->nameId;
+	return (x>y)-(x<y);
+}
+
+/* Interns the attr names: names gets the distinct ones in order, and
+   each attr its index there */
+static int
+internNames(struct Builder *builder, char ***names, uint32_t *numNames){
+	char **all;
+	char **found;
+	uint32_t i,j,n;
+
+	*names=NULL;
+	*numNames=0;
+	if(builder->numAttrs==0) return DOTU_OK;
+	all=(char**)dotuArenaAlloc(builder->arena,sizeof(char*)*builder->numAttrs);
+	if(all==NULL) return DOTU_ENOMEM;
+	for(n=0,i=0;i<builder->numFiles;i++){
+		for(j=0;j<builder->files[i].numAttrs;j++) all[n++]=builder->files[i].attrs[j].name;
+	}
+	qsort(all,n,sizeof(char*),compareNames);
+	for(j=0,i=0;i<n;i++){
+		if(j==0 || strcmp(all[i],all[j-1])!=0) all[j++]=all[i];
+	}
+	for(i=0;i<builder->numFiles;i++){
+		for(n=0;n<builder->files[i].numAttrs;n++){
+			found=(char**)bsearch(&builder->files[i].attrs[n].name,all,j,sizeof(char*),compareNames);
+			builder->files[i].attrs[n].nameId=(uint32_t)(found-all);
+		}
+		qsort(builder->files[i].attrs,builder->files[i].numAttrs,sizeof(struct BuildAttr),compareNameIds);
+	}
+	*names=all;
+	*numNames=j;
+	return DOTU_OK;
+}
+
+static int
+writeOut(FILE *out, const void *data, size_t length){
+	return (length==0 || fwrite(data,1,length,out)==length) ? DOTU_OK : DOTU_EIO;
+}
+
+static int
+padOut(FILE *out, uint64_t length){
+	static const char zeros[8]={0,0,0,0,0,0,0,0};
+	return writeOut(out,zeros,(size_t)(CATALIGN(length)-length));
+}
+
+/* Writes the whole catalog to out in one pass */
+static int
+writeCatalog(struct Builder *builder, char **names, uint32_t numNames, FILE *out){
+	struct CatHeader header;
+	struct CatFile file;
+	struct CatName name;
+	struct CatAttr attr;
+	uint32_t *postings;
+	uint32_t *counts;
+	uint64_t pathsLength,namesLength,valuesLength,offset;
+	uint32_t i,j,k;
+	int result=DOTU_OK;
+
+	/* Postings - counted per name, then filled in file order so each
+	   name's list comes out ascending */
+	postings=(uint32_t*)dotuArenaAlloc(builder->arena,sizeof(uint32_t)*(builder->numAttrs+1));
+	counts=(uint32_t*)dotuArenaAlloc(builder->arena,sizeof(uint32_t)*(numNames+1));
+	if(postings==NULL || counts==NULL) return DOTU_ENOMEM;
+	memset(counts,0,sizeof(uint32_t)*(numNames+1));
+	pathsLength=namesLength=valuesLength=0;
+	for(i=0;i<builder->numFiles;i++){
+		pathsLength+=builder->files[i].pathLength+1;
+		for(j=0;j<builder->files[i].numAttrs;j++){
+			counts[builder->files[i].attrs[j].nameId+1]++;
+			valuesLength+=builder->files[i].attrs[j].valueLength;
+		}
+	}
+	for(i=0;i<numNames;i++){
+		counts[i+1]+=counts[i];
+		namesLength+=strlen(names[i])+1;
+	}
+
+	memset(&header,0,sizeof(header));
+	memcpy(header.magic,CATMAGIC,sizeof(CATMAGIC));
+	header.byteOrder=CATBYTEORDER;
+	header.version=DOTU_CATALOG_VERSION;
+	header.numFiles=builder->numFiles;
+	header.numNames=numNames;
+	header.numAttrs=builder->numAttrs;
+	header.filesOffset=CATALIGN(sizeof(struct CatHeader));
+	header.namesOffset=header.filesOffset+(uint64_t)builder->numFiles*sizeof(struct CatFile);
+	header.attrsOffset=header.namesOffset+(uint64_t)numNames*sizeof(struct CatName);
+	header.postingsOffset=header.attrsOffset+(uint64_t)builder->numAttrs*sizeof(struct CatAttr);
+	header.stringsOffset=CATALIGN(header.postingsOffset+(uint64_t)builder->numAttrs*sizeof(uint32_t));
+	header.valuesOffset=CATALIGN(header.stringsOffset+pathsLength+namesLength);
+	header.size=header.valuesOffset+valuesLength;
+	result=writeOut(out,&header,sizeof(header));
+	if(result==DOTU_OK) result=padOut(out,sizeof(header));
+
+	offset=header.stringsOffset;
+	for(k=0,i=0;result==DOTU_OK && i<builder->numFiles;i++){
+		memset(&file,0,sizeof(file));
+		file.pathOffset=offset;
+		file.pathLength=builder->files[i].pathLength;
+		file.firstAttr=k;
+		file.numAttrs=builder->files[i].numAttrs;
+		memcpy(file.finderInfo,builder->files[i].finderInfo,32);
+		offset+=file.pathLength+1;
+		k+=file.numAttrs;
+		result=writeOut(out,&file,sizeof(file));
+	}
+	for(i=0;result==DOTU_OK && i<numNames;i++){
+		memset(&name,0,sizeof(name));
+		name.nameOffset=offset;
+		name.nameLength=(uint32_t)strlen(names[i]);
+		name.firstPosting=counts[i];
+		name.numPostings=counts[i+1]-counts[i];
+		offset+=name.nameLength+1;
+		result=writeOut(out,&name,sizeof(name));
+	}
+	offset=header.valuesOffset;
+	for(i=0;result==DOTU_OK && i<builder->numFiles;i++){
+		for(j=0;result==DOTU_OK && j<builder->files[i].numAttrs;j++){
+			attr.valueOffset=offset;
+			attr.valueLength=builder->files[i].attrs[j].valueLength;
+			attr.nameId=builder->files[i].attrs[j].nameId;
+			offset+=attr.valueLength;
+			postings[counts[attr.nameId]++]=i;
+			result=writeOut(out,&attr,sizeof(attr));
+		}
+	}
+	if(result==DOTU_OK) result=writeOut(out,postings,sizeof(uint32_t)*builder->numAttrs);
+	if(result==DOTU_OK) result=padOut(out,header.postingsOffset+(uint64_t)builder->numAttrs*sizeof(uint32_t));
+	for(i=0;result==DOTU_OK && i<builder->numFiles;i++){
+		result=writeOut(out,builder->files[i].path,builder->files[i].pathLength+1);
+	}
+	for(i=0;result==DOTU_OK && i<numNames;i++){
+		result=writeOut(out,names[i],strlen(names[i])+1);
+	}
+	if(result==DOTU_OK) result=padOut(out,header.stringsOffset+pathsLength+namesLength);
+	for(i=0;result==DOTU_OK && i<builder->numFiles;i++){
+		for(j=0;result==DOTU_OK && j<builder->files[i].numAttrs;j++){
+			result=writeOut(out,builder->files[i].attrs[j].value,builder->files[i].attrs[j].valueLength);
+		}
+	}
+	return result;
+}
+
+/* Writes the catalog to a temp file beside fileName, syncs it and
+   renames it into place */
+static int
+saveCatalog(struct Builder *builder, char **names, uint32_t numNames, const char *fileName){
+	char tempName[MAXDIRNAMESIZE+MAXFILENAMESIZE+2];
+	char dirName[MAXDIRNAMESIZE+1];
+	const char *slash=strrchr(fileName,'/');
+	FILE *out;
+	int fd,result,dirFd;
+
+	if(slash==NULL){
+		result=snprintf(tempName,sizeof(tempName),".%s.XXXXXX",fileName);
+		strcpy(dirName,".");
+	} else {
+		result=snprintf(tempName,sizeof(tempName),"%.*s/.%s.XXXXXX",(int)(slash-fileName),fileName,slash+1);
+		if((size_t)(slash-fileName)>=sizeof(dirName)) result=-1;
+		else sprintf(dirName,"%.*s",(slash==fileName) ? 1 : (int)(slash-fileName),fileName);
+	}
+	if(result<0 || (size_t)result>=sizeof(tempName)) return dotuError(DOTU_EINVAL,fileName,"File name too long.");
+	fd=mkstemp(tempName);
+	if(fd<0) return dotuError(DOTU_EIO,fileName,"Error creating temp file.");
+	fchmod(fd,0644);
+	out=fdopen(fd,"w");
+	if(out==NULL){
+		close(fd);
+		unlink(tempName);
+		return dotuError(DOTU_EIO,fileName,"Error opening temp file.");
+	}
+
+	result=writeCatalog(builder,names,numNames,out);
+	if(fflush(out)!=0 && result==DOTU_OK) result=DOTU_EIO;
+	if(result==DOTU_OK && fsync(fd)!=0) result=DOTU_EIO;
+	if(fclose(out)!=0 && result==DOTU_OK) result=DOTU_EIO;
+	if(result==DOTU_OK && rename(tempName,fileName)!=0) result=DOTU_EIO;
+	if(result!=DOTU_OK){
+		unlink(tempName);
+		return dotuError(result,fileName,"Error writing catalog.");
+	}
+	dirFd=open(dirName,O_RDONLY);
+	if(dirFd<0 || fsync(dirFd)!=0) result=dotuError(DOTU_EIO,fileName,"Error syncing directory.");
+	if(dirFd>=0) close(dirFd);
+	return result;
+}
+
+long
+buildDotUCatalog(const char *root, const char *catalogFileName, int workers){
+	struct Builder builder;
+	char **names;
+	uint32_t numNames;
+	long found;
+	int result;
+
+	if(root==NULL || catalogFileName==NULL){
+		dotuError(DOTU_EINVAL,NULL,"No tree or catalog given.");
+		return -1;
+	}
+	memset(&builder,0,sizeof(builder));
+	builder.arena=dotuArenaCreate(1<<20);
+	builder.capacity=1024;
+	if(builder.arena!=NULL) builder.files=(struct BuildFile*)dotuArenaAlloc(builder.arena,sizeof(struct BuildFile)*builder.capacity);
+	if(builder.files==NULL){
+		dotuArenaRelease(builder.arena);
+		dotuError(DOTU_ENOMEM,root,"Error allocating catalog.");
+		return -1;
+	}
+	pthread_mutex_init(&builder.lock,NULL);
+
+	found=scanDotUTree(root,workers,catalogScanned,&builder);
+	result=(found<0) ? DOTU_EIO : builder.result;
+	if(result==DOTU_OK){
+		qsort(builder.files,builder.numFiles,sizeof(struct BuildFile),comparePaths);
+		result=internNames(&builder,&names,&numNames);
+	}
+	if(result==DOTU_OK) result=saveCatalog(&builder,names,numNames,catalogFileName);
+	else dotuError(result,root,"Error building catalog.");
+	found=(result==DOTU_OK) ? (long)builder.numFiles : -1;
+	pthread_mutex_destroy(&builder.lock);
+	dotuArenaRelease(builder.arena);
+	return found;
+}
+
+/* Reading.  Opening checks the header and section bounds; each record
+   is checked against the file size only when it's used, so opening
+   stays constant-time however big the catalog. */
+
+static int
+sectionFits(const struct CatHeader *header, uint64_t offset, uint64_t count, size_t recordSize){
+	return offset%8==0 && offset<=header->size && count<=(header->size-offset)/recordSize;
+}
+
+struct DotUCatalog *
+openDotUCatalog(const char *fileName, int *status){
+	struct DotUCatalog *catalog;
+	const struct CatHeader *header;
+	struct stat statBuffer;
+	void *image;
+	int fd,result=DOTU_OK;
+
+	if(status!=NULL) *status=DOTU_EINVAL;
+	if(fileName==NULL) return NULL;
+	fd=open(fileName,O_RDONLY);
+	if(fd<0){
+		if(status!=NULL) *status=dotuError(DOTU_EIO,fileName,"Error opening catalog.");
+		return NULL;
+	}
+	if(fstat(fd,&statBuffer)!=0 || (uint64_t)statBuffer.st_size<sizeof(struct CatHeader)){
+		close(fd);
+		if(status!=NULL) *status=dotuError(DOTU_EFORMAT,fileName,"Not a catalog.");
+		return NULL;
+	}
+	/* The mapping outlives the descriptor */
+	image=mmap(NULL,(size_t)statBuffer.st_size,PROT_READ,MAP_SHARED,fd,0);
+	close(fd);
+	if(image==MAP_FAILED){
+		if(status!=NULL) *status=dotuError(DOTU_EIO,fileName,"Error mapping catalog.");
+		return NULL;
+	}
+
+	header=(const struct CatHeader*)image;
+	if(memcmp(header->magic,CATMAGIC,sizeof(CATMAGIC))!=0 || header->version!=DOTU_CATALOG_VERSION){
+		result=dotuError(DOTU_EFORMAT,fileName,"Not a catalog, or one of another version.");
+	} else if(header->byteOrder!=CATBYTEORDER){
+		result=dotuError(DOTU_EFORMAT,fileName,"Catalog was built with the other byte order.");
+	} else if(header->size!=(uint64_t)statBuffer.st_size
+	          || !sectionFits(header,header->filesOffset,header->numFiles,sizeof(struct CatFile))
+	          || !sectionFits(header,header->namesOffset,header->numNames,sizeof(struct CatName))
+	          || !sectionFits(header,header->attrsOffset,header->numAttrs,sizeof(struct CatAttr))
+	          || !sectionFits(header,header->postingsOffset,header->numAttrs,sizeof(uint32_t))
+	          || header->stringsOffset>header->size || header->valuesOffset>header->size){
+		result=dotuError(DOTU_EFORMAT,fileName,"Catalog is truncated or damaged.");
+	}
+	catalog=(result==DOTU_OK) ? (struct DotUCatalog*)dotuAlloc(sizeof(struct DotUCatalog)) : NULL;
+	if(result==DOTU_OK && catalog==NULL) result=dotuError(DOTU_ENOMEM,fileName,"Error allocating catalog.");
+	if(result!=DOTU_OK){
+		munmap(image,(size_t)statBuffer.st_size);
+		if(status!=NULL) *status=result;
+		return NULL;
+	}
+	catalog->image=(const char*)image;
+	catalog->size=(size_t)statBuffer.st_size;
+	catalog->header=header;
+	catalog->files=(const struct CatFile*)(catalog->image+header->filesOffset);
+	catalog->names=(const struct CatName*)(catalog->image+header->namesOffset);
+	catalog->attrs=(const struct CatAttr*)(catalog->image+header->attrsOffset);
+	catalog->postings=(const uint32_t*)(catalog->image+header->postingsOffset);
+	if(status!=NULL) *status=DOTU_OK;
+	return catalog;
+}
+
+void
+closeDotUCatalog(struct DotUCatalog *catalog){
+	if(catalog==NULL) return;
+	munmap((void*)catalog->image,catalog->size);
+	dotuFree(catalog,sizeof(struct DotUCatalog));
+}
+
+uint32_t
+getDotUCatalogFileCount(const struct DotUCatalog *catalog){
+	return (catalog==NULL) ? 0 : catalog->header->numFiles;
+}
+
+/* A string in the image, NULL unless it lies inside and ends in \0 */
+static const char *
+catString(const struct DotUCatalog *catalog, uint64_t offset, uint32_t length){
+	if(offset>=catalog->size || length>=catalog->size-offset || catalog->image[offset+length]!='\0') return NULL;
+	return catalog->image+offset;
+}
+
+const char *
+dotuCatalogName(const struct DotUCatalog *catalog, uint32_t nameId){
+	return catString(catalog,catalog->names[nameId].nameOffset,catalog->names[nameId].nameLength);
+}
+
+long
+dotuCatalogFindName(const struct DotUCatalog *catalog, const char *name){
+	const char *here;
+	uint32_t low=0,high=catalog->header->numNames,mid;
+	int order;
+
+	while(low<high){
+		mid=low+(high-low)/2;
+		here=dotuCatalogName(catalog,mid);
+		if(here==NULL) return -1;
+		order=strcmp(name,here);
+		if(order==0) return (long)mid;
+		if(order<0) high=mid;
+		else low=mid+1;
+	}
+	return -1;
+}
+
+const struct CatFile *
+dotuCatalogFile(const struct DotUCatalog *catalog, uint32_t fileId){
+	const struct CatFile *file;
+
+	if(catalog==NULL || fileId>=catalog->header->numFiles) return NULL;
+	file=&catalog->files[fileId];
+	if(file->firstAttr>catalog->header->numAttrs || file->numAttrs>catalog->header->numAttrs-file->firstAttr) return NULL;
+	return file;
+}
+
+const char *
+getDotUCatalogPath(const struct DotUCatalog *catalog, uint32_t fileId){
+	if(catalog==NULL || fileId>=catalog->header->numFiles) return NULL;
+	return catString(catalog,catalog->files[fileId].pathOffset,catalog->files[fileId].pathLength);
+}
+
+const char *
+getDotUCatalogFinderInfo(const struct DotUCatalog *catalog, uint32_t fileId){
+	if(catalog==NULL || fileId>=catalog->header->numFiles) return NULL;
+	return catalog->files[fileId].finderInfo;
+}
+
+long
+findDotUCatalogPath(const struct DotUCatalog *catalog, const char *path){
+	const char *here;
+	uint32_t low=0,high,mid;
+	int order;
+
+	if(catalog==NULL || path==NULL) return -1;
+	high=catalog->header->numFiles;
+	while(low<high){
+		mid=low+(high-low)/2;
+		here=getDotUCatalogPath(catalog,mid);
+		if(here==NULL) return -1;
+		order=strcmp(path,here);
+		if(order==0) return (long)mid;
+		if(order<0) high=mid;
+		else low=mid+1;
+	}
+	return -1;
+}
+
+long
+findDotUCatalogFiles(const struct DotUCatalog *catalog, const char *name, const uint32_t **fileIds){
+	const struct CatName *entry;
+	long nameId;
+
+	*fileIds=NULL;
+	if(catalog==NULL || name==NULL) return 0;
+	nameId=dotuCatalogFindName(catalog,name);
+	if(nameId<0) return 0;
+	entry=&catalog->names[nameId];
+	if(entry->firstPosting>catalog->header->numAttrs || entry->numPostings>catalog->header->numAttrs-entry->firstPosting) return 0;
+	*fileIds=catalog->postings+entry->firstPosting;
+	return (long)entry->numPostings;
+}
+
+const char *
+dotuCatalogValue(const struct DotUCatalog *catalog, const struct CatAttr *attr, uint32_t *valueLength){
+	if(attr->valueOffset>catalog->size || attr->valueLength>catalog->size-attr->valueOffset) return NULL;
+	if(valueLength!=NULL) *valueLength=attr->valueLength;
+	return catalog->image+attr->valueOffset;
+}
+
+const char *
+getDotUCatalogAttr(const struct DotUCatalog *catalog, uint32_t fileId, const char *name, uint32_t *valueLength){
+	const struct CatFile *file=dotuCatalogFile(catalog,fileId);
+	const struct CatAttr *attrs;
+	uint32_t low=0,high,mid;
+	long nameId;
+
+	if(file==NULL || name==NULL) return NULL;
+	nameId=dotuCatalogFindName(catalog,name);
+	if(nameId<0) return NULL;
+	attrs=catalog->attrs+file->firstAttr;
+	high=file->numAttrs;
+	while(low<high){
+		mid=low+(high-low)/2;
+		if(attrs[mid].nameId==(uint32_t)nameId) return dotuCatalogValue(catalog,&attrs[mid],valueLength);
+		if(attrs[mid].nameId>(uint32_t)nameId) high=mid;
+		else low=mid+1;
+	}
+	return NULL;
+}
+
+const char *
+nextDotUCatalogAttr(const struct DotUCatalog *catalog, uint32_t fileId, uint32_t *cursor, const char **value, uint32_t *valueLength){
+	const struct CatFile *file=dotuCatalogFile(catalog,fileId);
+	const struct CatAttr *attr;
+
+	if(file==NULL || *cursor>=file->numAttrs) return NULL;
+	attr=&catalog->attrs[file->firstAttr+*cursor];
+	(*cursor)++;
+	if(attr->nameId>=catalog->header->numNames) return NULL;
+	if(value!=NULL) *value=dotuCatalogValue(catalog,attr,valueLength);
+	return dotuCatalogName(catalog,attr->nameId);
+}
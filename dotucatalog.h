@@ -0,0 +1,58 @@
+/*
+ Volume catalog - every ._ file under a tree boiled down into one file
+ that readers mmap and query where it lies, with no parsing.
+
+ The catalog holds the files the ._ files belong to, sorted by path,
+ each with its FinderInfo and attrs; the attr names, interned once
+ into a sorted table; for each name, the files that carry it; and the
+ values.  Numbers are in the byte order of the machine that built it
+ and a catalog in the other order is refused.  Rebuilding replaces
+ the file atomically, so readers that have the old one open carry on
+ with it undisturbed.
+*/
+
+#ifndef DOTUCATALOG_H
+#define DOTUCATALOG_H
+
+#include "dotu.h"
+
+#define DOTU_CATALOG_VERSION 1
+
+/* Private - an open, mapped catalog */
+struct DotUCatalog;
+
+/* Scans the tree under root with scanDotUTree (workers as there) and
+   writes the catalog to catalogFileName.  ._ files that don't parse
+   are left out.  Returns the number of files catalogued, -1 if fail. */
+long buildDotUCatalog(const char *root, const char *catalogFileName, int workers);
+
+/* Maps a catalog read-only.  status (may be NULL) gets DOTU_OK or the
+   DOTU_E* code saying why NULL was returned. */
+struct DotUCatalog* openDotUCatalog(const char *fileName, int *status);
+
+void closeDotUCatalog(struct DotUCatalog *catalog);
+
+uint32_t getDotUCatalogFileCount(const struct DotUCatalog *catalog);
+
+/* Files are numbered 0 to count-1 in path order.  The path is the
+   file's own, not its ._ file's.  NULL if fileId is out of range. */
+const char* getDotUCatalogPath(const struct DotUCatalog *catalog, uint32_t fileId);
+
+/* The 32 bytes of FinderInfo */
+const char* getDotUCatalogFinderInfo(const struct DotUCatalog *catalog, uint32_t fileId);
+
+/* File ID of path, -1 if not in the catalog */
+long findDotUCatalogPath(const struct DotUCatalog *catalog, const char *path);
+
+/* Points fileIds at the IDs, ascending, of the files carrying attr
+   name and returns how many there are - 0 if none. */
+long findDotUCatalogFiles(const struct DotUCatalog *catalog, const char *name, const uint32_t **fileIds);
+
+/* Value of attr name on a file, NULL if it hasn't got one */
+const char* getDotUCatalogAttr(const struct DotUCatalog *catalog, uint32_t fileId, const char *name, uint32_t *valueLength);
+
+/* Walks a file's attrs in name order.  Start with *cursor 0; returns
+   the next name and its value, NULL after the last. */
+const char* nextDotUCatalogAttr(const struct DotUCatalog *catalog, uint32_t fileId, uint32_t *cursor, const char **value, uint32_t *valueLength);
+
+#endif
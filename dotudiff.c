@@ -0,0 +1,294 @@
+#include "dotudiff.h"
+#include "dotupriv.h"
+
+/* Resource forks are compared and hashed this much at a time */
+#define DIFFCHUNK 4096
+
+static const char zeroFinder[32];
+
+struct DiffRun {
+	DotUDiffCallback callback;
+	void * ctx;
+	long count;
+};
+
+/* Hands one difference to the callback; non-zero if it says stop */
+static int
+report(struct DiffRun *run, int what, int how, const char *name, uint32_t id){
+	struct DotUDiff diff;
+
+	run->count++;
+	if(run->callback==NULL) return 0;
+	diff.what=what;
+	diff.how=how;
+	diff.name=name;
+	diff.id=id;
+	return run->callback(&diff,run->ctx);
+}
+
+static const struct FinderEntry *
+finderOf(const struct DotU *dotU){
+	int finderEntry=dotuFinderEntry(dotU);
+	return (finderEntry>=0) ? &dotU->entry[finderEntry].data.finder : NULL;
+}
+
+static uint32_t
+numAttrsOf(const struct FinderEntry *finder){
+	return (finder!=NULL) ? finder->xattrHdr.numAttrs : 0;
+}
+
+static int
+isRaw(const struct DotUEntry *entry){
+	return entry->id!=2 && entry->id!=9;
+}
+
+/* Pairs up the attrs of two lists by name.  When both lists are in
+   name order it's one merge; otherwise each name is looked up in the
+   other list, a's names first and then b's that a lacks. */
+struct AttrWalk {
+	const struct FinderEntry * a;
+	const struct FinderEntry * b;
+	uint32_t i;
+	uint32_t j;
+	int merge;
+};
+
+static void
+startWalk(struct AttrWalk *walk, const struct FinderEntry *a, const struct FinderEntry *b){
+	walk->a=a;
+	walk->b=b;
+	walk->i=0;
+	walk->j=0;
+	walk->merge=(a==NULL || a->sorted) && (b==NULL || b->sorted);
+}
+
+/* The next pair, with NULL for the side that lacks the name; 0 at the end */
+static int
+nextPair(struct AttrWalk *walk, const struct ExtAttr **x, const struct ExtAttr **y){
+	uint32_t numA=numAttrsOf(walk->a);
+	uint32_t numB=numAttrsOf(walk->b);
+	const struct ExtAttr *attr;
+	int at,order;
+
+	if(walk->merge){
+		if(walk->i==numA && walk->j==numB) return 0;
+		if(walk->i==numA) order=1;
+		else if(walk->j==numB) order=-1;
+		else if(walk->a->attr[walk->i].nameId!=0 && walk->a->attr[walk->i].nameId==walk->b->attr[walk->j].nameId) order=0;
+		else order=strcmp(walk->a->attr[walk->i].name,walk->b->attr[walk->j].name);
+		*x=(order<=0) ? &walk->a->attr[walk->i++] : NULL;
+		*y=(order>=0) ? &walk->b->attr[walk->j++] : NULL;
+		return 1;
+	}
+	if(walk->i<numA){
+		*x=&walk->a->attr[walk->i++];
+		at=(numB>0) ? dotuLocateAttr(walk->b,(*x)->name,(*x)->nameLength) : -1;
+		*y=(at>=0) ? &walk->b->attr[at] : NULL;
+		return 1;
+	}
+	while(walk->j<numB){
+		attr=&walk->b->attr[walk->j++];
+		if(numA>0 && dotuLocateAttr(walk->a,attr->name,attr->nameLength)>=0) continue;
+		*x=NULL;
+		*y=attr;
+		return 1;
+	}
+	return 0;
+}
+
+/* Everything about two attrs of the same name but their values */
+static int
+sameShape(const struct ExtAttr *x, const struct ExtAttr *y){
+	return x->valueLength==y->valueLength && memcmp(x->flags,y->flags,2)==0;
+}
+
+/* 1 if the forks are the same, 0 if not, or a DOTU_E* code */
+static int
+sameResource(const struct DotU *a, const struct DotU *b){
+	char chunkA[DIFFCHUNK];
+	char chunkB[DIFFCHUNK];
+	uint32_t length=getDotUResourceLength(a);
+	uint32_t offset;
+	long gotA,gotB;
+
+	if(getDotUResourceLength(b)!=length) return 0;
+	for(offset=0;offset<length;offset+=(uint32_t)gotA){
+		gotA=readDotUResource(a,chunkA,offset,DIFFCHUNK);
+		if(gotA<0) return (int)gotA;
+		gotB=readDotUResource(b,chunkB,offset,DIFFCHUNK);
+		if(gotB<0) return (int)gotB;
+		if(gotA==0 || gotA!=gotB) return dotuError(DOTU_EIO,NULL,"Resource fork ended early.");
+		if(memcmp(chunkA,chunkB,(size_t)gotA)!=0) return 0;
+	}
+	return 1;
+}
+
+long
+diffDotU(const struct DotU *a, const struct DotU *b, DotUDiffCallback callback, void *ctx){
+	const struct FinderEntry *finderA=finderOf(a);
+	const struct FinderEntry *finderB=finderOf(b);
+	const struct ExtAttr *x,*y;
+	const struct DotUEntry *entry;
+	const char *other;
+	struct AttrWalk walk;
+	struct DiffRun run;
+	uint32_t length;
+	int i,result;
+
+	run.callback=callback;
+	run.ctx=ctx;
+	run.count=0;
+
+	if(memcmp((finderA!=NULL) ? finderA->finderHeader : zeroFinder,(finderB!=NULL) ? finderB->finderHeader : zeroFinder,32)!=0
+	   && report(&run,DOTU_DIFF_FINDERINFO,DOTU_DIFF_CHANGED,NULL,9)) return run.count;
+
+	startWalk(&walk,finderA,finderB);
+	while(nextPair(&walk,&x,&y)){
+		if(y==NULL) result=report(&run,DOTU_DIFF_ATTR,DOTU_DIFF_REMOVED,x->name,9);
+		else if(x==NULL) result=report(&run,DOTU_DIFF_ATTR,DOTU_DIFF_ADDED,y->name,9);
+		else if(!sameShape(x,y) || memcmp(x->value,y->value,x->valueLength)!=0) result=report(&run,DOTU_DIFF_ATTR,DOTU_DIFF_CHANGED,x->name,9);
+		else result=0;
+		if(result) return run.count;
+	}
+
+	for(i=0;i<a->header.numEntries;i++){
+		entry=&a->entry[i];
+		if(!isRaw(entry)) continue;
+		other=getDotUEntry(b,entry->id,&length);
+		if(other==NULL) result=report(&run,DOTU_DIFF_ENTRY,DOTU_DIFF_REMOVED,NULL,entry->id);
+		else if(length!=entry->length || memcmp(other,entry->data.raw.data,length)!=0) result=report(&run,DOTU_DIFF_ENTRY,DOTU_DIFF_CHANGED,NULL,entry->id);
+		else result=0;
+		if(result) return run.count;
+	}
+	for(i=0;i<b->header.numEntries;i++){
+		entry=&b->entry[i];
+		if(isRaw(entry) && getDotUEntry(a,entry->id,NULL)==NULL && report(&run,DOTU_DIFF_ENTRY,DOTU_DIFF_ADDED,NULL,entry->id)) return run.count;
+	}
+
+	/* Last, as it may mean reading both forks */
+	if(getDotUResourceLength(a)==0 && getDotUResourceLength(b)>0){
+		report(&run,DOTU_DIFF_RESOURCE,DOTU_DIFF_ADDED,NULL,2);
+	} else if(getDotUResourceLength(a)>0 && getDotUResourceLength(b)==0){
+		report(&run,DOTU_DIFF_RESOURCE,DOTU_DIFF_REMOVED,NULL,2);
+	} else {
+		result=sameResource(a,b);
+		if(result<0) return result;
+		if(result==0) report(&run,DOTU_DIFF_RESOURCE,DOTU_DIFF_CHANGED,NULL,2);
+	}
+	return run.count;
+}
+
+static uint32_t
+numRawOf(const struct DotU *dotU){
+	uint32_t count=0;
+	int i;
+
+	for(i=0;i<dotU->header.numEntries;i++) count+=isRaw(&dotU->entry[i]);
+	return count;
+}
+
+int
+equalDotU(const struct DotU *a, const struct DotU *b){
+	const struct FinderEntry *finderA=finderOf(a);
+	const struct FinderEntry *finderB=finderOf(b);
+	const struct ExtAttr *x,*y;
+	const struct DotUEntry *entry;
+	const char *other;
+	struct AttrWalk walk;
+	uint32_t length;
+	int i;
+
+	/* Counts and lengths first - nothing here touches a value */
+	if(numAttrsOf(finderA)!=numAttrsOf(finderB) || numRawOf(a)!=numRawOf(b)
+	   || getDotUResourceLength(a)!=getDotUResourceLength(b)) return 0;
+	if(memcmp((finderA!=NULL) ? finderA->finderHeader : zeroFinder,(finderB!=NULL) ? finderB->finderHeader : zeroFinder,32)!=0) return 0;
+	startWalk(&walk,finderA,finderB);
+	while(nextPair(&walk,&x,&y)){
+		if(x==NULL || y==NULL || !sameShape(x,y)) return 0;
+	}
+	for(i=0;i<a->header.numEntries;i++){
+		entry=&a->entry[i];
+		if(isRaw(entry) && (getDotUEntry(b,entry->id,&length)==NULL || length!=entry->length)) return 0;
+	}
+
+	/* Then the bytes */
+	startWalk(&walk,finderA,finderB);
+	while(nextPair(&walk,&x,&y)){
+		if(memcmp(x->value,y->value,x->valueLength)!=0) return 0;
+	}
+	for(i=0;i<a->header.numEntries;i++){
+		entry=&a->entry[i];
+		if(!isRaw(entry)) continue;
+		other=getDotUEntry(b,entry->id,&length);
+		if(memcmp(other,entry->data.raw.data,length)!=0) return 0;
+	}
+	return sameResource(a,b);
+}
+
+/* 64-bit FNV-1a, its constants put together from 32-bit halves */
+#define FNVBASIS ((((uint64_t)0xCBF29CE4UL)<<32) | 0x84222325UL)
+#define FNVPRIME ((((uint64_t)0x00000100UL)<<32) | 0x000001B3UL)
+
+static uint64_t
+hashBytes(uint64_t hash, const char *bytes, uint32_t length){
+	uint32_t i;
+
+	for(i=0;i<length;i++){
+		hash^=(unsigned char)bytes[i];
+		hash*=FNVPRIME;
+	}
+	return hash;
+}
+
+static uint64_t
+hashNumber(uint64_t hash, uint64_t value, uint32_t numBytes){
+	char bytes[8];
+	uint32_t i;
+
+	for(i=0;i<numBytes;i++) bytes[i]=(char)((value>>(8*(numBytes-1-i))) & 0xFF);
+	return hashBytes(hash,bytes,numBytes);
+}
+
+int
+fingerprintDotU(const struct DotU *dotU, uint64_t *fingerprint){
+	const struct FinderEntry *finder=finderOf(dotU);
+	const struct ExtAttr *attr;
+	const struct DotUEntry *entry;
+	char chunk[DIFFCHUNK];
+	uint64_t hash,attrSum=0,entrySum=0,one;
+	uint32_t length,offset,i;
+	long got;
+
+	if(dotU==NULL || fingerprint==NULL) return dotuError(DOTU_EINVAL,NULL,"No DotU or fingerprint given.");
+	/* Attrs and entries are hashed on their own and summed, so their
+	   order in the file doesn't matter */
+	for(i=0;i<numAttrsOf(finder);i++){
+		attr=&finder->attr[i];
+		one=hashBytes(FNVBASIS,attr->name,attr->nameLength);
+		one=hashBytes(one,attr->flags,2);
+		one=hashNumber(one,attr->valueLength,4);
+		attrSum+=hashBytes(one,attr->value,attr->valueLength);
+	}
+	for(i=0;i<dotU->header.numEntries;i++){
+		entry=&dotU->entry[i];
+		if(!isRaw(entry)) continue;
+		one=hashNumber(FNVBASIS,entry->id,4);
+		one=hashNumber(one,entry->length,4);
+		entrySum+=hashBytes(one,entry->data.raw.data,entry->length);
+	}
+
+	hash=hashBytes(FNVBASIS,(finder!=NULL) ? finder->finderHeader : zeroFinder,32);
+	hash=hashNumber(hash,numAttrsOf(finder),4);
+	hash=hashNumber(hash,attrSum,8);
+	hash=hashNumber(hash,entrySum,8);
+	length=getDotUResourceLength(dotU);
+	hash=hashNumber(hash,length,4);
+	for(offset=0;offset<length;offset+=(uint32_t)got){
+		got=readDotUResource(dotU,chunk,offset,DIFFCHUNK);
+		if(got<0) return (int)got;
+		if(got==0) return dotuError(DOTU_EIO,NULL,"Resource fork ended early.");
+		hash=hashBytes(hash,chunk,(uint32_t)got);
+	}
+	*fingerprint=hash;
+	return DOTU_OK;
+}
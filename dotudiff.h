@@ -0,0 +1,52 @@
+/*
+ Structural comparison of two DotUs.
+
+ Two ._ files carry the same metadata if they have the same FinderInfo,
+ the same attrs - name, flags and value, in any order - the same
+ resource fork and the same other entries, wherever each one sits in
+ the file.  The header's version and home file system are ignored.
+*/
+
+#ifndef DOTUDIFF_H
+#define DOTUDIFF_H
+
+#include "dotu.h"
+
+/* What differs */
+#define DOTU_DIFF_FINDERINFO 0 /* The 32 bytes of FinderInfo; a missing Finder entry counts as zeros */
+#define DOTU_DIFF_ATTR       1
+#define DOTU_DIFF_RESOURCE   2 /* An empty fork counts as none */
+#define DOTU_DIFF_ENTRY      3 /* Another entry, by id */
+
+/* How, going from a to b */
+#define DOTU_DIFF_ADDED   1
+#define DOTU_DIFF_REMOVED 2
+#define DOTU_DIFF_CHANGED 3
+
+struct DotUDiff {
+	int what;
+	int how;
+	const char * name;   /* The attr's, for DOTU_DIFF_ATTR */
+	uint32_t id;         /* The entry it's in - 9 for FinderInfo and attrs, 2 for the fork */
+};
+
+/* Called once per difference.  Returning non-zero stops the diff. */
+typedef int (*DotUDiffCallback)(const struct DotUDiff *diff, void *ctx);
+
+/* Reports each difference between a and b: FinderInfo first, then
+   attrs in name order if both lists are sorted, then other entries and
+   the resource fork.  Returns how many were reported, or a DOTU_E*
+   code if a resource fork couldn't be read. */
+long diffDotU(const struct DotU *a, const struct DotU *b, DotUDiffCallback callback, void *ctx);
+
+/* 1 if a and b carry the same metadata, 0 if not, or a DOTU_E* code.
+   Counts, FinderInfo and every attr's name, flags and length are
+   checked before any value is, and the resource fork goes last. */
+int equalDotU(const struct DotU *a, const struct DotU *b);
+
+/* A 64-bit hash of the metadata equalDotU compares, the same whatever
+   the layout or attr order, to keep in place of a file to compare
+   against later.  Equal DotUs always hash the same. */
+int fingerprintDotU(const struct DotU *dotU, uint64_t *fingerprint);
+
+#endif
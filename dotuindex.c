@@ -0,0 +1,93 @@
+#include "dotupriv.h"
+
+/* FNV-1a */
+uint32_t
+dotuHash32(const char *bytes, uint32_t length){
+	uint32_t hash=2166136261UL;
+	uint32_t i;
+	for(i=0;i<length;i++){
+		hash^=(unsigned char)bytes[i];
+		hash*=16777619UL;
+	}
+	return hash;
+}
+
+int
+dotuSearchAttrs(const struct ExtAttr *attrs, uint32_t numAttrs, const char *name, uint32_t nameLength){
+	uint32_t low=0;
+	uint32_t high=numAttrs;
+	uint32_t middle,length;
+	int cmp;
+
+	while(low<high){
+		middle=low+(high-low)/2;
+		/* Both lengths count the \0, so comparing the shorter length's
+		   worth of bytes orders names the way strcmp does. */
+		length=(attrs[middle].nameLength<nameLength) ? attrs[middle].nameLength : nameLength;
+		cmp=memcmp(attrs[middle].name,name,length);
+		if(cmp==0) return (int)middle;
+		if(cmp<0) low=middle+1;
+		else high=middle;
+	}
+	return -(int)low-1;
+}
+
+int
+dotuLocateAttr(const struct FinderEntry *finder, const char *name, uint32_t nameLength){
+	uint32_t i;
+
+	if(finder->sorted) return dotuSearchAttrs(finder->attr,finder->xattrHdr.numAttrs,name,nameLength);
+	for(i=0;i<finder->xattrHdr.numAttrs;i++){
+		if(finder->attr[i].nameLength==nameLength && memcmp(finder->attr[i].name,name,nameLength)==0) return (int)i;
+	}
+	return -(int)finder->xattrHdr.numAttrs-1;
+}
+
+int
+dotuIndexUsable(const struct DotUIndex *index, const struct FinderEntry *finder){
+	return index!=NULL && index->attrs==finder->attr && index->numAttrs==finder->xattrHdr.numAttrs;
+}
+
+struct DotUIndex *
+dotuIndexBuild(struct DotU *dotU, const struct FinderEntry *finder){
+	struct DotUIndex *index;
+	uint32_t numSlots,slot,i;
+	uint32_t hash;
+
+	/* At most half full, so probes stay short */
+	for(numSlots=16;numSlots<2*(uint32_t)finder->xattrHdr.numAttrs;numSlots*=2);
+	if(dotuArenaOf(dotU,0)==NULL) return NULL;
+	index=(struct DotUIndex*)dotuArenaAlloc(dotU->arena,sizeof(struct DotUIndex));
+	if(index==NULL) return NULL;
+	index->slots=(uint32_t*)dotuArenaAlloc(dotU->arena,sizeof(uint32_t)*numSlots);
+	index->hashes=(uint32_t*)dotuArenaAlloc(dotU->arena,sizeof(uint32_t)*numSlots);
+	if(index->slots==NULL || index->hashes==NULL) return NULL;
+	memset(index->slots,0,sizeof(uint32_t)*numSlots);
+	index->attrs=finder->attr;
+	index->numAttrs=finder->xattrHdr.numAttrs;
+	index->mask=numSlots-1;
+
+	for(i=0;i<index->numAttrs;i++){
+		hash=dotuHash32(finder->attr[i].name,finder->attr[i].nameLength-1);
+		for(slot=hash & index->mask;index->slots[slot]!=0;slot=(slot+1) & index->mask);
+		index->slots[slot]=i+1;
+		index->hashes[slot]=hash;
+	}
+	return index;
+}
+
+int
+dotuIndexFind(const struct DotUIndex *index, const char *name, uint32_t nameLength){
+	uint32_t hash=dotuHash32(name,nameLength-1);
+	uint32_t slot;
+	const struct ExtAttr *attr;
+
+	for(slot=hash & index->mask;index->slots[slot]!=0;slot=(slot+1) & index->mask){
+		if(index->hashes[slot]!=hash) continue;
+		attr=&index->attrs[index->slots[slot]-1];
+		if(attr->nameLength==nameLength && memcmp(attr->name,name,nameLength)==0){
+			return (int)index->slots[slot]-1;
+		}
+	}
+	return -1;
+}
@@ -0,0 +1,300 @@
+#include "dotuintern.h"
+#include "dotupriv.h"
+#include <pthread.h>
+#include <sys/mman.h>
+
+/* Starting number of hash buckets; doubles as the store fills */
+#define STOREBUCKETS 1024
+
+/* One distinct run of bytes, followed by the bytes and a \0 */
+struct StoredValue {
+	struct StoredValue * next;  /* In the same bucket */
+	uint32_t hash;
+	uint32_t length;
+	long refs;
+};
+
+struct DotUValueStore {
+	pthread_mutex_t lock;
+	struct DotUAllocator allocator;
+	struct StoredValue ** buckets;
+	uint32_t mask;              /* Number of buckets - 1 */
+	long values;
+	long references;
+	size_t bytes;
+	size_t bytesReferenced;
+};
+
+/* What an interned DotU holds, in its arena */
+struct DotUInterned {
+	struct DotUValueStore * store;
+	uint32_t numValues;
+	struct StoredValue ** values;
+};
+
+static char *
+bytesOf(struct StoredValue *value){
+	return (char*)(value+1);
+}
+
+struct DotUValueStore *
+createDotUValueStore(void){
+	struct DotUValueStore *store;
+	struct DotUAllocator allocator;
+
+	dotuCurrentAllocator(&allocator);
+	store=(struct DotUValueStore*)allocator.alloc(sizeof(struct DotUValueStore),allocator.ctx);
+	if(store==NULL){
+		dotuError(DOTU_ENOMEM,NULL,"Error allocating value store.");
+		return NULL;
+	}
+	memset(store,0,sizeof(struct DotUValueStore));
+	store->allocator=allocator;
+	store->mask=STOREBUCKETS-1;
+	store->buckets=(struct StoredValue**)allocator.alloc(STOREBUCKETS*sizeof(struct StoredValue*),allocator.ctx);
+	if(store->buckets==NULL){
+		allocator.release(store,sizeof(struct DotUValueStore),allocator.ctx);
+		dotuError(DOTU_ENOMEM,NULL,"Error allocating value store.");
+		return NULL;
+	}
+	memset(store->buckets,0,STOREBUCKETS*sizeof(struct StoredValue*));
+	pthread_mutex_init(&store->lock,NULL);
+	return store;
+}
+
+void
+destroyDotUValueStore(struct DotUValueStore *store){
+	struct StoredValue *value,*next;
+	uint32_t i;
+
+	if(store==NULL) return;
+	for(i=0;i<=store->mask;i++){
+		for(value=store->buckets[i];value!=NULL;value=next){
+			next=value->next;
+			store->allocator.release(value,sizeof(struct StoredValue)+value->length+1,store->allocator.ctx);
+		}
+	}
+	store->allocator.release(store->buckets,(store->mask+1)*sizeof(struct StoredValue*),store->allocator.ctx);
+	pthread_mutex_destroy(&store->lock);
+	store->allocator.release(store,sizeof(struct DotUValueStore),store->allocator.ctx);
+}
+
+/* Doubles the buckets.  Lookups still work if there's no memory for
+   it, just with longer chains, so that isn't an error. */
+static void
+growStore(struct DotUValueStore *store){
+	struct StoredValue **buckets;
+	struct StoredValue *value,*next;
+	uint32_t mask=store->mask*2+1;
+	uint32_t i;
+
+	buckets=(struct StoredValue**)store->allocator.alloc((mask+1)*sizeof(struct StoredValue*),store->allocator.ctx);
+	if(buckets==NULL) return;
+	memset(buckets,0,(mask+1)*sizeof(struct StoredValue*));
+	for(i=0;i<=store->mask;i++){
+		for(value=store->buckets[i];value!=NULL;value=next){
+			next=value->next;
+			value->next=buckets[value->hash & mask];
+			buckets[value->hash & mask]=value;
+		}
+	}
+	store->allocator.release(store->buckets,(store->mask+1)*sizeof(struct StoredValue*),store->allocator.ctx);
+	store->buckets=buckets;
+	store->mask=mask;
+}
+
+/* A reference to the stored copy of these bytes, added if new; NULL
+   if out of memory.  Called with the lock held. */
+static struct StoredValue *
+refValue(struct DotUValueStore *store, const char *bytes, uint32_t length){
+	uint32_t hash=dotuHash32(bytes,length);
+	struct StoredValue *value;
+
+	for(value=store->buckets[hash & store->mask];value!=NULL;value=value->next){
+		if(value->hash==hash && value->length==length && memcmp(bytesOf(value),bytes,length)==0) break;
+	}
+	if(value==NULL){
+		value=(struct StoredValue*)store->allocator.alloc(sizeof(struct StoredValue)+length+1,store->allocator.ctx);
+		if(value==NULL) return NULL;
+		value->hash=hash;
+		value->length=length;
+		value->refs=0;
+		memcpy(bytesOf(value),bytes,length);
+		bytesOf(value)[length]='\0';
+		value->next=store->buckets[hash & store->mask];
+		store->buckets[hash & store->mask]=value;
+		store->values++;
+		store->bytes+=length;
+		if((uint32_t)store->values>store->mask) growStore(store);
+	}
+	value->refs++;
+	store->references++;
+	store->bytesReferenced+=length;
+	return value;
+}
+
+/* Drops a reference, freeing the bytes with the last.  Called with the
+   lock held. */
+static void
+unrefValue(struct DotUValueStore *store, struct StoredValue *value){
+	struct StoredValue **link;
+
+	store->references--;
+	store->bytesReferenced-=value->length;
+	if(--value->refs>0) return;
+	for(link=&store->buckets[value->hash & store->mask];*link!=value;link=&(*link)->next);
+	*link=value->next;
+	store->values--;
+	store->bytes-=value->length;
+	store->allocator.release(value,sizeof(struct StoredValue)+value->length+1,store->allocator.ctx);
+}
+
+static void
+unrefAll(struct DotUValueStore *store, struct StoredValue **values, uint32_t numValues){
+	uint32_t i;
+
+	for(i=0;i<numValues;i++) unrefValue(store,values[i]);
+}
+
+void
+dotuReleaseInterned(struct DotUInterned *interned){
+	if(interned==NULL) return;
+	pthread_mutex_lock(&interned->store->lock);
+	unrefAll(interned->store,interned->values,interned->numValues);
+	pthread_mutex_unlock(&interned->store->lock);
+}
+
+/* Swaps *bytes for the stored copy, recording the reference */
+static int
+internBytes(struct DotUValueStore *store, struct DotUInterned *interned, char **bytes, uint32_t length){
+	struct StoredValue *value=refValue(store,*bytes,length);
+
+	if(value==NULL) return DOTU_ENOMEM;
+	interned->values[interned->numValues++]=value;
+	*bytes=bytesOf(value);
+	return DOTU_OK;
+}
+
+/* Interns everything the new entry table points at.  Called with the
+   lock held. */
+static int
+internEntries(struct DotUValueStore *store, struct DotUInterned *interned, struct DotUEntry *entry, uint32_t numEntries){
+	struct ExtAttr *attr;
+	uint32_t i,j;
+
+	for(i=0;i<numEntries;i++){
+		switch(entry[i].id){
+			case 2:{
+				if(entry[i].data.resource.data==NULL) break;
+				if(internBytes(store,interned,&entry[i].data.resource.data,entry[i].length)!=DOTU_OK) return DOTU_ENOMEM;
+			}break;
+			case 9:{
+				for(j=0;j<entry[i].data.finder.xattrHdr.numAttrs;j++){
+					attr=&entry[i].data.finder.attr[j];
+					/* Names in the name table are already shared */
+					if((attr->nameId==0 && internBytes(store,interned,&attr->name,attr->nameLength-1)!=DOTU_OK)
+					   || internBytes(store,interned,&attr->value,attr->valueLength)!=DOTU_OK) return DOTU_ENOMEM;
+				}
+			}break;
+			default:{
+				if(internBytes(store,interned,&entry[i].data.raw.data,entry[i].length)!=DOTU_OK) return DOTU_ENOMEM;
+			}break;
+		}
+	}
+	return DOTU_OK;
+}
+
+/* Copies the DotU's entry and attr tables and its source name into
+   the new arena, with room for the references the copy will hold */
+static int
+copyTables(struct DotUArena *arena, const struct DotU *dotU, uint32_t numValues, struct DotUEntry **entry, struct DotUInterned **interned, char **source){
+	uint32_t numEntries=dotU->header.numEntries;
+	struct FinderEntry *finder;
+	struct ExtAttr *attrs;
+	uint32_t i;
+
+	*entry=(struct DotUEntry*)dotuArenaAlloc(arena,numEntries*sizeof(struct DotUEntry));
+	*interned=(struct DotUInterned*)dotuArenaAlloc(arena,sizeof(struct DotUInterned));
+	if(*entry==NULL || *interned==NULL) return DOTU_ENOMEM;
+	(*interned)->numValues=0;
+	(*interned)->values=(struct StoredValue**)dotuArenaAlloc(arena,numValues*sizeof(struct StoredValue*));
+	if((*interned)->values==NULL) return DOTU_ENOMEM;
+	if(numEntries>0) memcpy(*entry,dotU->entry,numEntries*sizeof(struct DotUEntry));
+	for(i=0;i<numEntries;i++){
+		if((*entry)[i].id!=9) continue;
+		finder=&(*entry)[i].data.finder;
+		attrs=(struct ExtAttr*)dotuArenaAlloc(arena,finder->xattrHdr.numAttrs*sizeof(struct ExtAttr));
+		if(attrs==NULL) return DOTU_ENOMEM;
+		if(finder->xattrHdr.numAttrs>0) memcpy(attrs,finder->attr,finder->xattrHdr.numAttrs*sizeof(struct ExtAttr));
+		finder->attr=attrs;
+	}
+	*source=NULL;
+	if(dotU->source!=NULL){
+		*source=dotuArenaCopy(arena,dotU->source,strlen(dotU->source));
+		if(*source==NULL) return DOTU_ENOMEM;
+	}
+	return DOTU_OK;
+}
+
+int
+internDotU(struct DotUValueStore *store, struct DotU *dotU){
+	uint32_t numEntries=dotU->header.numEntries;
+	uint32_t numAttrs=0,numValues=0;
+	struct DotUInterned *interned;
+	struct DotUArena *arena;
+	struct DotUEntry *entry;
+	char *source;
+	size_t size;
+	uint32_t i;
+	int result;
+
+	if(store==NULL) return dotuError(DOTU_EINVAL,NULL,"No value store given.");
+	for(i=0;i<numEntries;i++){
+		if(dotU->entry[i].id==9) numAttrs+=dotU->entry[i].data.finder.xattrHdr.numAttrs;
+		else if(dotU->entry[i].id!=2 || dotU->entry[i].data.resource.data!=NULL) numValues++;
+	}
+	numValues+=2*numAttrs;
+
+	/* The new arena holds only the tables, sized to fit in one block */
+	size=numEntries*sizeof(struct DotUEntry)+numAttrs*sizeof(struct ExtAttr)+sizeof(struct DotUInterned)
+	     +numValues*sizeof(struct StoredValue*)+5*DOTU_ARENA_ALIGN;
+	if(dotU->source!=NULL) size+=strlen(dotU->source)+1;
+	arena=dotuArenaCreate(size);
+	if(arena==NULL) return dotuError(DOTU_ENOMEM,NULL,"Error allocating interned DotU.");
+	result=copyTables(arena,dotU,numValues,&entry,&interned,&source);
+	if(result==DOTU_OK){
+		interned->store=store;
+		pthread_mutex_lock(&store->lock);
+		result=internEntries(store,interned,entry,numEntries);
+		if(result!=DOTU_OK) unrefAll(store,interned->values,interned->numValues);
+		pthread_mutex_unlock(&store->lock);
+	}
+	if(result!=DOTU_OK){
+		dotuArenaRelease(arena);
+		return dotuError(result,NULL,"Error allocating interned DotU.");
+	}
+
+	/* The new copy is complete; let go of the old one */
+	dotuReleaseInterned(dotU->interned);
+	dotuArenaRelease(dotU->arena);
+	if(dotU->backing==DOTU_MAPPED) munmap(dotU->base,dotU->baseLength);
+	dotU->entry=entry;
+	dotU->arena=arena;
+	dotU->interned=interned;
+	dotU->index=NULL;
+	dotU->source=source;
+	dotU->base=NULL;
+	dotU->baseLength=0;
+	dotU->backing=DOTU_OWNED;
+	return DOTU_OK;
+}
+
+void
+getDotUValueStoreStats(struct DotUValueStore *store, struct DotUValueStoreStats *stats){
+	pthread_mutex_lock(&store->lock);
+	stats->values=store->values;
+	stats->references=store->references;
+	stats->bytes=store->bytes;
+	stats->bytesReferenced=store->bytesReferenced;
+	pthread_mutex_unlock(&store->lock);
+}
@@ -0,0 +1,43 @@
+/*
+ Shared value store for caches holding many DotUs.
+
+ Across a large tree the same bytes turn up in ._ file after ._ file:
+ the same attr names, the same quarantine strings, the same tag
+ plists.  internDotU moves a DotU's names, values, other entries and
+ in-memory resource fork into a store that keeps one reference
+ counted copy of each distinct run of bytes, and shrinks the DotU's
+ own arena down to its tables.  The DotU reads and edits as before;
+ freeDotU drops its references.
+*/
+
+#ifndef DOTUINTERN_H
+#define DOTUINTERN_H
+
+#include "dotu.h"
+
+struct DotUValueStore;
+
+struct DotUValueStoreStats {
+	long values;             /* Distinct byte runs held */
+	long references;         /* Held on them by interned DotUs */
+	size_t bytes;            /* Held, counting each run once */
+	size_t bytesReferenced;  /* What the DotUs would hold between them without the store */
+};
+
+/* NULL if out of memory.  The store takes its memory from the
+   allocator current when it is created. */
+struct DotUValueStore* createDotUValueStore(void);
+
+/* Only once every DotU interned in the store has been freed */
+void destroyDotUValueStore(struct DotUValueStore *store);
+
+/* Moves the DotU's bytes into the store.  A mapped or borrowed DotU
+   comes out owning what it holds, as after a detach, and a DotU can
+   be interned again to take in values set since.  Safe to call from
+   several threads on one store, each with its own DotU.  On failure
+   the DotU is left as it was. */
+int internDotU(struct DotUValueStore *store, struct DotU *dotU);
+
+void getDotUValueStoreStats(struct DotUValueStore *store, struct DotUValueStoreStats *stats);
+
+#endif
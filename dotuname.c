@@ -0,0 +1,117 @@
+#include "dotuname.h"
+#include "dotupriv.h"
+#include <pthread.h>
+
+/* Open addressing, never more than half full */
+#define NAMESLOTS (2*DOTU_NAMES_MAX)
+#define NAMEMASK  (NAMESLOTS-1)
+
+/* A slot is filled in and then published by a release store of name,
+   so a reader that loads the name sees the rest of the slot. */
+struct NameSlot {
+	const char * name;
+	uint32_t hash;
+	uint32_t length;  /* Without the \0 */
+	uint32_t id;
+};
+
+static struct NameSlot slots[NAMESLOTS];
+static const char *names[DOTU_NAMES_MAX+1];
+static uint32_t numNames;  /* Published the same way, after names[numNames] */
+static pthread_mutex_t namesLock=PTHREAD_MUTEX_INITIALIZER;
+
+static uint32_t
+lookupName(const char *name, uint32_t length, uint32_t hash){
+	const char *stored;
+	uint32_t slot;
+
+	for(slot=hash & NAMEMASK;(stored=__atomic_load_n(&slots[slot].name,__ATOMIC_ACQUIRE))!=NULL;slot=(slot+1) & NAMEMASK){
+		if(slots[slot].hash==hash && slots[slot].length==length && memcmp(stored,name,length)==0) return slots[slot].id;
+	}
+	return 0;
+}
+
+/* The copies live as long as the process, so they come from malloc
+   rather than an allocator that may be torn down before then. */
+static uint32_t
+addName(const char *name, uint32_t length, uint32_t hash){
+	char *copy;
+	uint32_t id,slot;
+
+	pthread_mutex_lock(&namesLock);
+	/* Another thread may have added it since the lookup */
+	id=lookupName(name,length,hash);
+	if(id==0 && numNames<DOTU_NAMES_MAX && (copy=(char*)malloc(length+1))!=NULL){
+		memcpy(copy,name,length);
+		copy[length]='\0';
+		id=numNames+1;
+		names[id]=copy;
+		__atomic_store_n(&numNames,id,__ATOMIC_RELEASE);
+		for(slot=hash & NAMEMASK;slots[slot].name!=NULL;slot=(slot+1) & NAMEMASK);
+		slots[slot].hash=hash;
+		slots[slot].length=length;
+		slots[slot].id=id;
+		__atomic_store_n(&slots[slot].name,copy,__ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&namesLock);
+	return id;
+}
+
+uint32_t
+dotuNameId(const char *name, uint32_t length){
+	uint32_t hash,id;
+
+	if(length==0 || length>254) return 0;
+	hash=dotuHash32(name,length);
+	id=lookupName(name,length,hash);
+	if(id!=0 || __atomic_load_n(&numNames,__ATOMIC_ACQUIRE)>=DOTU_NAMES_MAX) return id;
+	return addName(name,length,hash);
+}
+
+char *
+dotuNameCopy(struct DotUArena *arena, const char *name, uint32_t *nameId){
+	size_t length=strlen(name);
+
+	*nameId=dotuNameId(name,(uint32_t)length);
+	if(*nameId!=0) return (char*)names[*nameId];
+	return dotuArenaCopy(arena,name,length);
+}
+
+uint32_t
+getDotUNameId(const char *name){
+	return dotuNameId(name,(uint32_t)strlen(name));
+}
+
+uint32_t
+findDotUNameId(const char *name){
+	uint32_t length=(uint32_t)strlen(name);
+	return lookupName(name,length,dotuHash32(name,length));
+}
+
+const char *
+getDotUName(uint32_t nameId){
+	if(nameId==0 || nameId>__atomic_load_n(&numNames,__ATOMIC_ACQUIRE)) return NULL;
+	return names[nameId];
+}
+
+const char *
+getDotUAttrById(const struct DotU *dotU, uint32_t nameId, uint32_t *valueLength){
+	int finderEntry=dotuFinderEntry(dotU);
+	const struct FinderEntry *finder;
+	const struct ExtAttr *attr;
+	const char *name=getDotUName(nameId);
+	uint32_t i;
+
+	if(finderEntry<0 || name==NULL) return NULL;
+	finder=&dotU->entry[finderEntry].data.finder;
+	for(i=0;i<finder->xattrHdr.numAttrs;i++){
+		attr=&finder->attr[i];
+		/* Attrs without an id - made by hand, or seen after the table
+		   filled - are checked by name */
+		if(attr->nameId==nameId || (attr->nameId==0 && strcmp(attr->name,name)==0)){
+			if(valueLength!=NULL) *valueLength=attr->valueLength;
+			return attr->value;
+		}
+	}
+	return NULL;
+}
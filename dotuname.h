@@ -0,0 +1,39 @@
+/*
+ Process-wide table of attr names.
+
+ The same few dozen names - com.apple.quarantine,
+ com.apple.metadata:_kMDItemUserTags and so on - turn up in nearly
+ every ._ file.  Each distinct name gets a small integer id the first
+ time it is seen, and one copy of it is kept for the life of the
+ process.  Parsed attrs carry their name's id and point at that copy,
+ so a caller looking for the same attr across many files can resolve
+ the name once and compare integers from then on.
+
+ Lookups take no lock.  Adding a name takes a lock, and only the first
+ time that name is seen.
+*/
+
+#ifndef DOTUNAME_H
+#define DOTUNAME_H
+
+#include "dotu.h"
+
+/* Most names the table will hold.  Names seen after it fills get no
+   id and are handled by name as before, so a volume full of odd names
+   can't grow the table without bound. */
+#define DOTU_NAMES_MAX 4096
+
+/* The name's id, adding it if it's new; 0 if the table is full or the
+   name is empty or too long for an attr */
+uint32_t getDotUNameId(const char *name);
+
+/* The name's id, 0 if it isn't in the table */
+uint32_t findDotUNameId(const char *name);
+
+/* The table's copy of the name, NULL for an id it didn't hand out */
+const char* getDotUName(uint32_t nameId);
+
+/* getDotUAttr for a name already turned into an id */
+const char* getDotUAttrById(const struct DotU *dotU, uint32_t nameId, uint32_t *valueLength);
+
+#endif
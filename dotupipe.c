@@ -0,0 +1,276 @@
+#include "dotupipe.h"
+#include "dotupriv.h"
+#include <pthread.h>
+#include <unistd.h>
+
+/* Files an atomic writer puts in one sync group before committing it,
+   so its temp files don't pile up over a long run */
+#define PIPEGROUP 256
+
+/* One file on its way through */
+struct PipeItem {
+	long index;
+	char * buf;            /* Read stage: the bytes read */
+	uint32_t readLength;
+	uint32_t fileLength;
+	ino_t inode;
+	struct DotU dotU;      /* Transform stage on */
+};
+
+/* Bounded queue between two stages.  Pushing blocks while it's full;
+   popping blocks while it's empty and anything could still push. */
+struct PipeQueue {
+	pthread_mutex_t lock;
+	pthread_cond_t notEmpty;
+	pthread_cond_t notFull;
+	struct PipeItem * items;
+	int capacity;
+	int head;
+	int count;
+	int producers;         /* Threads that may still push */
+	int cancelled;
+};
+
+struct Pipe {
+	const char * const * fileNames;
+	long numFiles;
+	long next;             /* Next file for a reader */
+	const struct DotUPipeline * config;
+	struct DotUPipeStats totals;
+	struct PipeQueue readQueue;    /* Readers to transformers */
+	struct PipeQueue writeQueue;   /* Transformers to writers */
+};
+
+static int
+queueInit(struct PipeQueue *queue, int capacity, int producers){
+	memset(queue,0,sizeof(struct PipeQueue));
+	queue->items=(struct PipeItem*)malloc(sizeof(struct PipeItem)*capacity);
+	if(queue->items==NULL) return DOTU_ENOMEM;
+	queue->capacity=capacity;
+	queue->producers=producers;
+	pthread_mutex_init(&queue->lock,NULL);
+	pthread_cond_init(&queue->notEmpty,NULL);
+	pthread_cond_init(&queue->notFull,NULL);
+	return DOTU_OK;
+}
+
+static void
+queueDestroy(struct PipeQueue *queue){
+	pthread_mutex_destroy(&queue->lock);
+	pthread_cond_destroy(&queue->notEmpty);
+	pthread_cond_destroy(&queue->notFull);
+	free(queue->items);
+}
+
+/* 0 if the queue was cancelled and the item not taken */
+static int
+queuePush(struct PipeQueue *queue, const struct PipeItem *item){
+	pthread_mutex_lock(&queue->lock);
+	while(queue->count==queue->capacity && !queue->cancelled) pthread_cond_wait(&queue->notFull,&queue->lock);
+	if(queue->cancelled){
+		pthread_mutex_unlock(&queue->lock);
+		return 0;
+	}
+	queue->items[(queue->head+queue->count)%queue->capacity]=*item;
+	queue->count++;
+	pthread_cond_signal(&queue->notEmpty);
+	pthread_mutex_unlock(&queue->lock);
+	return 1;
+}
+
+/* 0 once the queue is empty for good */
+static int
+queuePop(struct PipeQueue *queue, struct PipeItem *item){
+	pthread_mutex_lock(&queue->lock);
+	while(queue->count==0 && queue->producers>0 && !queue->cancelled) pthread_cond_wait(&queue->notEmpty,&queue->lock);
+	if(queue->count==0 || queue->cancelled){
+		pthread_mutex_unlock(&queue->lock);
+		return 0;
+	}
+	*item=queue->items[queue->head];
+	queue->head=(queue->head+1)%queue->capacity;
+	queue->count--;
+	pthread_cond_signal(&queue->notFull);
+	pthread_mutex_unlock(&queue->lock);
+	return 1;
+}
+
+static void
+queueProducerDone(struct PipeQueue *queue){
+	pthread_mutex_lock(&queue->lock);
+	if(--queue->producers==0) pthread_cond_broadcast(&queue->notEmpty);
+	pthread_mutex_unlock(&queue->lock);
+}
+
+static void
+queueCancel(struct PipeQueue *queue){
+	pthread_mutex_lock(&queue->lock);
+	queue->cancelled=1;
+	pthread_cond_broadcast(&queue->notEmpty);
+	pthread_cond_broadcast(&queue->notFull);
+	pthread_mutex_unlock(&queue->lock);
+}
+
+static void
+addStat(long *counter){
+	__sync_fetch_and_add(counter,1);
+}
+
+static void *
+readWorker(void *arg){
+	struct Pipe *pipe=(struct Pipe*)arg;
+	struct PipeItem item;
+	long i;
+
+	while((i=__sync_fetch_and_add(&pipe->next,1))<pipe->numFiles){
+		memset(&item,0,sizeof(item));
+		item.index=i;
+		if(dotuReadImage(pipe->fileNames[i],&item.buf,&item.readLength,&item.fileLength,&item.inode)!=DOTU_OK){
+			addStat(&pipe->totals.failed);
+			continue;
+		}
+		addStat(&pipe->totals.read);
+		if(!queuePush(&pipe->readQueue,&item)){
+			dotuFree(item.buf,item.readLength+1);
+			break;
+		}
+	}
+	queueProducerDone(&pipe->readQueue);
+	return NULL;
+}
+
+static void *
+transformWorker(void *arg){
+	struct Pipe *pipe=(struct Pipe*)arg;
+	struct PipeItem item;
+	const char *path;
+	int result;
+
+	while(queuePop(&pipe->readQueue,&item)){
+		path=pipe->fileNames[item.index];
+		result=dotuLoadImage(path,item.buf,item.readLength,item.fileLength,item.inode,&item.dotU);
+		dotuFree(item.buf,item.readLength+1);
+		item.buf=NULL;
+		if(result==DOTU_OK && pipe->config->transform!=NULL) result=pipe->config->transform(path,&item.dotU,pipe->config->ctx);
+		if(result!=DOTU_OK){
+			addStat((result==DOTU_PIPE_SKIP) ? &pipe->totals.unchanged : &pipe->totals.failed);
+			freeDotU(&item.dotU);
+			continue;
+		}
+		if(!queuePush(&pipe->writeQueue,&item)){
+			freeDotU(&item.dotU);
+			break;
+		}
+	}
+	queueProducerDone(&pipe->writeQueue);
+	return NULL;
+}
+
+static void *
+writeWorker(void *arg){
+	struct Pipe *pipe=(struct Pipe*)arg;
+	struct DotUSyncGroup *group=NULL;
+	struct PipeItem item;
+	long inGroup=0;
+	int result;
+
+	while(queuePop(&pipe->writeQueue,&item)){
+		if(pipe->config->atomic && group==NULL) group=beginDotUSyncGroup();
+		if(pipe->config->atomic){
+			result=writeDotUFileAtomic(&item.dotU,pipe->fileNames[item.index],group);
+		} else {
+			result=writeDotUFile(&item.dotU,pipe->fileNames[item.index]);
+		}
+		freeDotU(&item.dotU);
+		addStat((result==DOTU_OK) ? &pipe->totals.written : &pipe->totals.failed);
+		if(group!=NULL && ++inGroup==PIPEGROUP){
+			if(commitDotUSyncGroup(group)!=DOTU_OK) addStat(&pipe->totals.failed);
+			group=NULL;
+			inGroup=0;
+		}
+	}
+	/* One barrier for what's left of this writer's files */
+	if(group!=NULL && commitDotUSyncGroup(group)!=DOTU_OK) addStat(&pipe->totals.failed);
+	return NULL;
+}
+
+static int
+defaultCount(int count, int fallback){
+	if(count>0) return count;
+	if(fallback>0) return fallback;
+	count=(int)sysconf(_SC_NPROCESSORS_ONLN);
+	return (count>0) ? count : 1;
+}
+
+/* Starts count threads; returns how many started */
+static int
+startStage(pthread_t *threads, int count, void *(*worker)(void*), struct Pipe *pipe){
+	int started;
+
+	for(started=0;started<count;started++){
+		if(pthread_create(&threads[started],NULL,worker,pipe)!=0) break;
+	}
+	return started;
+}
+
+long
+runDotUPipeline(const char * const *fileNames, long numFiles, const struct DotUPipeline *pipeline, struct DotUPipeStats *stats){
+	struct Pipe pipe;
+	pthread_t *threads;
+	int readers,transformers,writers,depth;
+	int numReaders,numTransformers,numWriters,i;
+
+	if((fileNames==NULL && numFiles>0) || numFiles<0 || pipeline==NULL){
+		dotuError(DOTU_EINVAL,NULL,"No file list or pipeline given.");
+		return -1;
+	}
+	readers=defaultCount(pipeline->readers,DOTU_PIPE_READERS);
+	transformers=defaultCount(pipeline->transformers,0);
+	writers=defaultCount(pipeline->writers,DOTU_PIPE_WRITERS);
+	depth=defaultCount(pipeline->queueDepth,DOTU_PIPE_QUEUE);
+
+	memset(&pipe,0,sizeof(pipe));
+	pipe.fileNames=fileNames;
+	pipe.numFiles=numFiles;
+	pipe.config=pipeline;
+	threads=(pthread_t*)malloc(sizeof(pthread_t)*(readers+transformers+writers));
+	if(threads==NULL) return -1;
+	if(queueInit(&pipe.readQueue,depth,readers)!=DOTU_OK){
+		free(threads);
+		return -1;
+	}
+	if(queueInit(&pipe.writeQueue,depth,transformers)!=DOTU_OK){
+		queueDestroy(&pipe.readQueue);
+		free(threads);
+		return -1;
+	}
+
+	/* Downstream first, so every queue has a consumer before anything
+	   is pushed into it.  A thread that didn't start won't push, and a
+	   stage with none at all stops the pipeline. */
+	numWriters=startStage(threads,writers,writeWorker,&pipe);
+	numTransformers=(numWriters>0) ? startStage(threads+numWriters,transformers,transformWorker,&pipe) : 0;
+	for(i=numTransformers;i<transformers;i++) queueProducerDone(&pipe.writeQueue);
+	numReaders=(numTransformers>0) ? startStage(threads+numWriters+numTransformers,readers,readWorker,&pipe) : 0;
+	for(i=numReaders;i<readers;i++) queueProducerDone(&pipe.readQueue);
+	if(numReaders==0){
+		queueCancel(&pipe.readQueue);
+		queueCancel(&pipe.writeQueue);
+	}
+	for(i=0;i<numWriters+numTransformers+numReaders;i++) pthread_join(threads[i],NULL);
+
+	queueDestroy(&pipe.readQueue);
+	queueDestroy(&pipe.writeQueue);
+	free(threads);
+	if(numReaders==0){
+		dotuError(DOTU_EIO,NULL,"Error starting pipeline threads.");
+		return -1;
+	}
+	if(stats!=NULL){
+		__sync_fetch_and_add(&stats->read,pipe.totals.read);
+		__sync_fetch_and_add(&stats->written,pipe.totals.written);
+		__sync_fetch_and_add(&stats->unchanged,pipe.totals.unchanged);
+		__sync_fetch_and_add(&stats->failed,pipe.totals.failed);
+	}
+	return pipe.totals.failed;
+}
@@ -0,0 +1,54 @@
+/*
+ Bulk conversion pipeline: read, transform and write ._ files in three
+ stages, each on its own threads and joined by bounded queues.
+
+ Reading, parsing and editing, and writing overlap, and a stage that
+ falls behind holds the one before it up once the queue between them
+ is full, so memory stays bounded by the queue sizes and worker
+ counts however many files go through.
+*/
+
+#ifndef DOTUPIPE_H
+#define DOTUPIPE_H
+
+#include "dotu.h"
+
+/* A transform's return when it changed nothing and the file needn't
+   be written */
+#define DOTU_PIPE_SKIP 1
+
+/* Edits one file's DotU in place - addAttr, rmAttr, a DotUTxn and so
+   on.  Returns DOTU_OK to have it written back, DOTU_PIPE_SKIP to
+   leave the file as it is, or a DOTU_E* code to count it failed.
+   Runs on the transform threads, so several can be running at once. */
+typedef int (*DotUTransform)(const char *path, struct DotU *dotU, void *ctx);
+
+struct DotUPipeline {
+	int readers;         /* Threads per stage - 0 for the defaults below */
+	int transformers;
+	int writers;
+	int queueDepth;      /* Files each queue holds - 0 for DOTU_PIPE_QUEUE */
+	int atomic;          /* Replace files with writeDotUFileAtomic, synced in groups */
+	DotUTransform transform;
+	void * ctx;
+};
+
+#define DOTU_PIPE_READERS 4
+#define DOTU_PIPE_WRITERS 4
+/* Transformers default to one per online CPU */
+#define DOTU_PIPE_QUEUE   64
+
+/* Running totals - several threads add to them */
+struct DotUPipeStats {
+	long read;
+	long written;
+	long unchanged;      /* Skipped by the transform */
+	long failed;
+};
+
+/* Runs every file in the list through the pipeline and writes it back
+   to where it came from.  stats may be NULL.  Returns the number of
+   files that failed, -1 if the pipeline couldn't be started. */
+long runDotUPipeline(const char * const *fileNames, long numFiles, const struct DotUPipeline *pipeline, struct DotUPipeStats *stats);
+
+#endif
@@ -0,0 +1,244 @@
+/*
+ Internals shared by the library's source files.  Not installed and
+ not part of the API.
+*/
+
+#ifndef DOTUPRIV_H
+#define DOTUPRIV_H
+
+#include "dotu.h"
+
+/* Trace diagnostics.  Takes its printf arguments in an extra set of
+   parentheses - DOTU_TRACE(("Found attr %s\n",name)); - so that with
+   DEBUG 0 the whole call, arguments included, compiles away. */
+#if DEBUG
+#define DOTU_TRACE(args) dotuTrace args
+#else
+#define DOTU_TRACE(args) ((void)0)
+#endif
+
+void dotuTrace(const char *format, ...);
+
+/* Reports an error or warning through the log handler and returns code,
+   so failures read:  return dotuError(DOTU_EIO,fileName,"..."); */
+int dotuError(int code, const char *subject, const char *message);
+
+int dotuWarn(int code, const char *subject, const char *message);
+
+/* Big-endian loads.  Written as shifts of whole bytes so the compiler
+   can turn each into one load and a byte swap, where toBigEndian goes
+   round a loop a byte at a time. */
+#define DOTU_BE16(p) ((uint32_t)(((unsigned char)(p)[0]<<8) | (unsigned char)(p)[1]))
+#define DOTU_BE32(p) (((uint32_t)(unsigned char)(p)[0]<<24) | ((uint32_t)(unsigned char)(p)[1]<<16) \
+                      | ((uint32_t)(unsigned char)(p)[2]<<8) | (uint32_t)(unsigned char)(p)[3])
+
+/* Per-DotU arenas.  Everything a DotU owns - attr arrays, names,
+   values, resource data - is carved out of its arena, and freeDotU()
+   hands the whole arena back in one go.  Blocks come from the
+   allocator that was current when the arena was created. */
+/* Arena allocations are rounded up to this so any struct can live in one */
+#define DOTU_ARENA_ALIGN 16
+
+struct DotUArenaBlock {
+	struct DotUArenaBlock * next; /* Older block */
+	size_t size;                  /* Usable bytes after the header */
+	size_t used;
+};
+
+struct DotUArena {
+	struct DotUArenaBlock * current; /* Newest block - allocations come from here */
+	struct DotUAllocator allocator;
+	size_t used;                     /* Bytes handed out */
+	size_t dead;                     /* Of those, bytes nothing points at any more */
+};
+
+/* size is a hint for the first block */
+struct DotUArena* dotuArenaCreate(size_t size);
+
+void* dotuArenaAlloc(struct DotUArena *arena, size_t size);
+
+/* Copies length bytes and null-terminates the copy */
+char* dotuArenaCopy(struct DotUArena *arena, const char *data, size_t length);
+
+void dotuArenaRelease(struct DotUArena *arena);
+
+/* Whether ptr was handed out by the arena */
+int dotuArenaOwns(const struct DotUArena *arena, const void *ptr);
+
+/* Records that an allocation of size bytes is no longer used.  The
+   bytes stay put; the count says when the arena is worth compacting. */
+void dotuArenaDrop(struct DotUArena *arena, size_t size);
+
+/* The DotU's arena, created on first use (with a first block of
+   about size bytes) for a DotU that has none yet */
+struct DotUArena* dotuArenaOf(struct DotU *dotU, size_t size);
+
+/* Copies whatever a mapped or borrowed DotU points at into its arena
+   and drops the mapping, so the file underneath can change */
+int dotuDetach(struct DotU *dotU);
+
+/* Counts bytes an edit let go of as dead, if the DotU's arena holds
+   them - mapped, borrowed, interned and name table bytes aren't its to
+   count */
+void dotuDropBytes(struct DotU *dotU, const void *ptr, size_t size);
+
+/* Clears the hash index, counting it as dead */
+void dotuDropIndex(struct DotU *dotU);
+
+/* Once the arena holds more dead bytes than live ones, moves what the
+   DotU still uses into a fresh arena and lets the old one go, so a
+   DotU edited over and over stays within twice its size.  Leaves an
+   interned DotU (whose arena also holds its store references) and one
+   whose entry table isn't in the arena alone.  Nothing changes if
+   there's no memory for it.  Call it after an edit. */
+void dotuCompact(struct DotU *dotU);
+
+/* A copy of the DotU that shares nothing with it - tables and bytes
+   all go in a new arena.  A resource fork not yet read stays in the
+   file, as it was. */
+int dotuClone(const struct DotU *dotU, struct DotU *clone);
+
+/* How much of a file starting with these 50 bytes has to be read:
+   all of it, unless there is a resource fork with every other entry
+   before it, in which case just up to the fork. */
+uint32_t dotuPrefixNeeded(const char *header, uint32_t fileLength);
+
+/* The start of loadDotUFile: reads fileName up to its resource fork,
+   if that comes last, into a dotuAlloc'd buffer of readLength+1
+   bytes for the caller to free */
+int dotuReadImage(const char *fileName, char **buf, uint32_t *readLength, uint32_t *fileLength, ino_t *inode);
+
+/* The end of loadDotUFile: parses readLength bytes read from the
+   start of fileName into a DotU that owns everything it holds.  buf
+   is left for the caller to free. */
+int dotuLoadImage(const char *fileName, char *buf, uint32_t readLength, uint32_t fileLength, ino_t inode, struct DotU *dotU);
+
+/* Reads in a resource fork left in the file, for the writer */
+int dotuLoadResource(struct DotU *dotU);
+
+/* Fills in an empty DotU - a Finder entry with no attrs.  The entry
+   table goes in a new arena, so this can fail with DOTU_ENOMEM. */
+int dotuInitBlank(struct DotU *dotU);
+
+/* Entry index of the Finder info, -1 if none */
+int dotuFinderEntry(const struct DotU *dotU);
+
+/* Appends a zeroed entry with this id, growing the table in the
+   arena; NULL if out of memory.  Pointers to other entries go stale. */
+struct DotUEntry* dotuAddEntry(struct DotU *dotU, uint32_t id);
+
+void dotuRemoveEntry(struct DotU *dotU, int i);
+
+/* The name's id in the name table, adding it if there's room; 0 if
+   there isn't.  length doesn't count the \0. */
+uint32_t dotuNameId(const char *name, uint32_t length);
+
+/* The name table's copy of name, with its id, or an arena copy with
+   id 0 if the table has no room; NULL if out of memory */
+char* dotuNameCopy(struct DotUArena *arena, const char *name, uint32_t *nameId);
+
+/* Binary search of a sorted attr list; nameLength counts the \0.
+   Returns the index of name, or -(where it would go)-1. */
+int dotuSearchAttrs(const struct ExtAttr *attrs, uint32_t numAttrs, const char *name, uint32_t nameLength);
+
+/* dotuSearchAttrs if the list is sorted, else a scan that reports a
+   missing name as going on the end. */
+int dotuLocateAttr(const struct FinderEntry *finder, const char *name, uint32_t nameLength);
+
+/* 32-bit FNV-1a of length bytes, for the attr index, the name table
+   and the value store */
+uint32_t dotuHash32(const char *bytes, uint32_t length);
+
+/* Hash index over a Finder entry's attr list.  It remembers which list
+   it was built over and is only used while that list is unchanged, so
+   an index left over from before an edit is never trusted. */
+struct DotUIndex {
+	const struct ExtAttr * attrs;
+	uint32_t numAttrs;
+	uint32_t mask;       /* Number of slots - 1 */
+	uint32_t * slots;    /* Attr index + 1, 0 if empty */
+	uint32_t * hashes;   /* Name hash for each slot, checked before the name */
+};
+
+int dotuIndexUsable(const struct DotUIndex *index, const struct FinderEntry *finder);
+
+/* Builds in the DotU's arena; NULL if out of memory */
+struct DotUIndex* dotuIndexBuild(struct DotU *dotU, const struct FinderEntry *finder);
+
+int dotuIndexFind(const struct DotUIndex *index, const char *name, uint32_t nameLength);
+
+/* Catalog records, as laid out in the file - see dotucatalog.c */
+struct CatHeader {
+	char magic[8];
+	uint32_t byteOrder;   /* CATBYTEORDER as the builder stored it */
+	uint32_t version;
+	uint32_t numFiles;
+	uint32_t numNames;
+	uint32_t numAttrs;
+	uint32_t reserved;
+	uint64_t filesOffset;
+	uint64_t namesOffset;
+	uint64_t attrsOffset;
+	uint64_t postingsOffset;
+	uint64_t stringsOffset;
+	uint64_t valuesOffset;
+	uint64_t size;
+};
+
+struct CatFile {
+	uint64_t pathOffset;
+	uint32_t pathLength;  /* Without the \0 */
+	uint32_t firstAttr;
+	uint32_t numAttrs;
+	uint32_t reserved;
+	char finderInfo[32];
+};
+
+struct CatName {
+	uint64_t nameOffset;
+	uint32_t nameLength;  /* Without the \0 */
+	uint32_t firstPosting;
+	uint32_t numPostings;
+	uint32_t reserved;
+};
+
+struct CatAttr {
+	uint64_t valueOffset;
+	uint32_t valueLength;
+	uint32_t nameId;
+};
+
+struct DotUCatalog {
+	const char * image;
+	size_t size;
+	const struct CatHeader * header;
+	const struct CatFile * files;
+	const struct CatName * names;
+	const struct CatAttr * attrs;
+	const uint32_t * postings;
+};
+
+/* Name nameId, NULL if the record is damaged */
+const char* dotuCatalogName(const struct DotUCatalog *catalog, uint32_t nameId);
+
+/* Index of name in the name table, -1 if absent */
+long dotuCatalogFindName(const struct DotUCatalog *catalog, const char *name);
+
+/* The file's record, NULL if out of range or its attrs aren't */
+const struct CatFile* dotuCatalogFile(const struct DotUCatalog *catalog, uint32_t fileId);
+
+/* The attr's value, NULL if it lies outside the image */
+const char* dotuCatalogValue(const struct DotUCatalog *catalog, const struct CatAttr *attr, uint32_t *valueLength);
+
+/* Drops a DotU's references into a value store - see dotuintern.c */
+void dotuReleaseInterned(struct DotUInterned *interned);
+
+/* One-off allocations through the current allocator */
+void* dotuAlloc(size_t size);
+
+void dotuFree(void *ptr, size_t size);
+
+/* A copy of the current allocator, for memory kept outside any arena */
+void dotuCurrentAllocator(struct DotUAllocator *allocator);
+
+#endif
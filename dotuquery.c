@@ -0,0 +1,346 @@
+#include "dotuquery.h"
+#include "dotuscan.h"
+#include "dotupriv.h"
+#include <pthread.h>
+#include <unistd.h>
+
+/* Files handed to a catalog worker at a time */
+#define QUERYCHUNK 64
+
+static int
+termsValid(const struct DotUQueryTerm *terms, uint32_t numTerms){
+	const struct DotUQueryTerm *term;
+	uint32_t i;
+
+	if(terms==NULL && numTerms>0) return 0;
+	for(i=0;i<numTerms;i++){
+		term=&terms[i];
+		if(term->test<DOTU_Q_EXISTS || term->test>DOTU_Q_FINDERINFO) return 0;
+		if(term->match<DOTU_Q_EXACT || term->match>DOTU_Q_ANY) return 0;
+		if(term->match!=DOTU_Q_ANY && term->test!=DOTU_Q_FINDERINFO && term->name==NULL) return 0;
+		if(term->length>0 && term->bytes==NULL) return 0;
+		if(term->test==DOTU_Q_FINDERINFO && (term->offset>32 || term->length>32-term->offset)) return 0;
+	}
+	return 1;
+}
+
+/* Terms that don't read values go first */
+static int
+readsValue(const struct DotUQueryTerm *term){
+	return term->test==DOTU_Q_VALUE_EQUALS || term->test==DOTU_Q_VALUE_CONTAINS || term->test==DOTU_Q_VALUE_LENGTH;
+}
+
+static int
+containsBytes(const char *data, uint32_t length, const char *bytes, uint32_t bytesLength){
+	const char *end;
+	const char *here;
+
+	if(bytesLength==0) return 1;
+	if(data==NULL || bytesLength>length) return 0;
+	end=data+(length-bytesLength);
+	for(here=data;here<=end;here++){
+		here=(const char*)memchr(here,bytes[0],(size_t)(end-here)+1);
+		if(here==NULL) return 0;
+		if(memcmp(here,bytes,bytesLength)==0) return 1;
+	}
+	return 0;
+}
+
+static int
+testValue(const struct DotUQueryTerm *term, const char *value, uint32_t valueLength){
+	switch(term->test){
+	case DOTU_Q_VALUE_EQUALS:
+		return value!=NULL && valueLength==term->length && memcmp(value,term->bytes,valueLength)==0;
+	case DOTU_Q_VALUE_CONTAINS:
+		return containsBytes(value,valueLength,term->bytes,term->length);
+	case DOTU_Q_VALUE_LENGTH:
+		return valueLength>=term->minLength && valueLength<=term->maxLength;
+	}
+	return 1;
+}
+
+static int
+testFinder(const struct DotUQueryTerm *term, const char *finderInfo){
+	uint32_t i;
+
+	for(i=0;i<term->length;i++){
+		if(term->mask==NULL){
+			if(finderInfo[term->offset+i]!=term->bytes[i]) return 0;
+		} else if(((finderInfo[term->offset+i]^term->bytes[i]) & term->mask[i])!=0){
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static int
+hasPrefix(const char *name, const char *prefix, size_t prefixLength){
+	return name!=NULL && strncmp(name,prefix,prefixLength)==0;
+}
+
+/* One term against a DotU's Finder entry.  Picks by name off the
+   sorted list when it can: an exact name is one lookup and a prefix a
+   run starting where a binary search lands. */
+static int
+termHolds(const struct DotUQueryTerm *term, const struct FinderEntry *finder){
+	static const char noFinderInfo[32];
+	const struct ExtAttr *attr;
+	uint32_t numAttrs=(finder==NULL) ? 0 : finder->xattrHdr.numAttrs;
+	uint32_t i;
+	size_t prefixLength=0;
+	int at;
+
+	if(term->test==DOTU_Q_FINDERINFO){
+		return testFinder(term,(finder==NULL) ? noFinderInfo : finder->finderHeader);
+	}
+	if(numAttrs==0) return 0;
+	i=0;
+	if(term->match==DOTU_Q_EXACT){
+		at=dotuLocateAttr(finder,term->name,(uint32_t)strlen(term->name)+1);
+		if(at<0) return 0;
+		attr=&finder->attr[at];
+		return testValue(term,attr->value,attr->valueLength);
+	}
+	if(term->match==DOTU_Q_PREFIX){
+		prefixLength=strlen(term->name);
+		if(finder->sorted){
+			at=dotuSearchAttrs(finder->attr,numAttrs,term->name,(uint32_t)prefixLength+1);
+			i=(at>=0) ? (uint32_t)at : (uint32_t)(-at-1);
+		}
+	}
+	for(;i<numAttrs;i++){
+		attr=&finder->attr[i];
+		if(term->match==DOTU_Q_PREFIX && !hasPrefix(attr->name,term->name,prefixLength)){
+			/* Past the run of names with the prefix */
+			if(finder->sorted) return 0;
+			continue;
+		}
+		if(testValue(term,attr->value,attr->valueLength)) return 1;
+	}
+	return 0;
+}
+
+int
+matchDotUQuery(const struct DotU *dotU, const struct DotUQueryTerm *terms, uint32_t numTerms){
+	const struct FinderEntry *finder;
+	int finderEntry,pass;
+	uint32_t i;
+
+	if(dotU==NULL || !termsValid(terms,numTerms)) return 0;
+	finderEntry=dotuFinderEntry(dotU);
+	finder=(finderEntry<0) ? NULL : &dotU->entry[finderEntry].data.finder;
+	for(pass=0;pass<2;pass++){
+		for(i=0;i<numTerms;i++){
+			if(readsValue(&terms[i])!=pass) continue;
+			if((termHolds(&terms[i],finder)!=0)==(terms[i].negate!=0)) return 0;
+		}
+	}
+	return 1;
+}
+
+/* Trees */
+
+struct TreeQuery {
+	const struct DotUQueryTerm * terms;
+	uint32_t numTerms;
+	DotUQueryCallback callback;
+	void * ctx;
+	long matches;
+};
+
+static void
+queryScanned(const char *path, struct DotU *dotU, int status, void *ctx){
+	struct TreeQuery *query=(struct TreeQuery*)ctx;
+
+	if(status!=DOTU_OK || !matchDotUQuery(dotU,query->terms,query->numTerms)) return;
+	__sync_fetch_and_add(&query->matches,1);
+	if(query->callback!=NULL) query->callback(path,dotU,query->ctx);
+}
+
+long
+queryDotUTree(const char *root, const struct DotUQueryTerm *terms, uint32_t numTerms, int workers, DotUQueryCallback callback, void *ctx){
+	struct TreeQuery query;
+
+	if(root==NULL || !termsValid(terms,numTerms)){
+		dotuError(DOTU_EINVAL,root,"Bad query.");
+		return -1;
+	}
+	query.terms=terms;
+	query.numTerms=numTerms;
+	query.callback=callback;
+	query.ctx=ctx;
+	query.matches=0;
+	if(scanDotUTree(root,workers,queryScanned,&query)<0) return -1;
+	return query.matches;
+}
+
+/* Catalogs.  Each term's names are looked up once, as a range of name
+   IDs; a file's attrs are in name ID order, so picking them is a
+   binary search to the start of the range. */
+
+struct CatalogTerm {
+	const struct DotUQueryTerm * term;
+	uint32_t firstName;   /* Picks name IDs firstName to lastName-1 */
+	uint32_t lastName;
+};
+
+struct CatalogQuery {
+	const struct DotUCatalog * catalog;
+	struct CatalogTerm * terms;  /* Those that don't read values first */
+	uint32_t numTerms;
+	const uint32_t * candidates; /* File IDs to look at, NULL for all */
+	uint32_t numCandidates;
+	DotUCatalogQueryCallback callback;
+	void * ctx;
+	long next;
+	long matches;
+};
+
+/* First name ID in [low,high) whose name's first prefixLength bytes
+   sort at or after prefix - or strictly after it, with after set, to
+   find the end of the run of names that start with prefix */
+static uint32_t
+firstNameFrom(const struct DotUCatalog *catalog, uint32_t low, uint32_t high, const char *prefix, size_t prefixLength, int after){
+	const char *name;
+	uint32_t mid;
+	int order;
+
+	while(low<high){
+		mid=low+(high-low)/2;
+		name=dotuCatalogName(catalog,mid);
+		if(name==NULL) return high;
+		order=strncmp(name,prefix,prefixLength);
+		if(after ? order<=0 : order<0) low=mid+1;
+		else high=mid;
+	}
+	return low;
+}
+
+static void
+resolveTerm(const struct DotUCatalog *catalog, const struct DotUQueryTerm *term, struct CatalogTerm *resolved){
+	uint32_t numNames=catalog->header->numNames;
+	size_t prefixLength;
+	long nameId;
+
+	resolved->term=term;
+	resolved->firstName=0;
+	resolved->lastName=numNames;
+	if(term->test==DOTU_Q_FINDERINFO || term->match==DOTU_Q_ANY) return;
+	if(term->match==DOTU_Q_EXACT){
+		nameId=dotuCatalogFindName(catalog,term->name);
+		resolved->firstName=(nameId<0) ? 0 : (uint32_t)nameId;
+		resolved->lastName=(nameId<0) ? 0 : (uint32_t)nameId+1;
+		return;
+	}
+	prefixLength=strlen(term->name);
+	resolved->firstName=firstNameFrom(catalog,0,numNames,term->name,prefixLength,0);
+	resolved->lastName=firstNameFrom(catalog,resolved->firstName,numNames,term->name,prefixLength,1);
+}
+
+static int
+catalogTermHolds(const struct DotUCatalog *catalog, const struct CatalogTerm *resolved, const struct CatFile *file){
+	const struct CatAttr *attrs=catalog->attrs+file->firstAttr;
+	const char *value;
+	uint32_t valueLength;
+	uint32_t low=0,high=file->numAttrs,mid;
+
+	if(resolved->term->test==DOTU_Q_FINDERINFO) return testFinder(resolved->term,file->finderInfo);
+	if(resolved->firstName>=resolved->lastName) return 0;
+	while(low<high){
+		mid=low+(high-low)/2;
+		if(attrs[mid].nameId<resolved->firstName) low=mid+1;
+		else high=mid;
+	}
+	for(;low<file->numAttrs && attrs[low].nameId<resolved->lastName;low++){
+		valueLength=0;
+		value=dotuCatalogValue(catalog,&attrs[low],&valueLength);
+		if(value!=NULL && testValue(resolved->term,value,valueLength)) return 1;
+	}
+	return 0;
+}
+
+static void *
+catalogWorker(void *arg){
+	struct CatalogQuery *query=(struct CatalogQuery*)arg;
+	const struct CatFile *file;
+	uint32_t fileId;
+	long start,end,i;
+	uint32_t t;
+
+	while((start=__sync_fetch_and_add(&query->next,QUERYCHUNK))<(long)query->numCandidates){
+		end=start+QUERYCHUNK;
+		if(end>(long)query->numCandidates) end=(long)query->numCandidates;
+		for(i=start;i<end;i++){
+			fileId=(query->candidates==NULL) ? (uint32_t)i : query->candidates[i];
+			file=dotuCatalogFile(query->catalog,fileId);
+			if(file==NULL) continue;
+			for(t=0;t<query->numTerms;t++){
+				if((catalogTermHolds(query->catalog,&query->terms[t],file)!=0)==(query->terms[t].term->negate!=0)) break;
+			}
+			if(t<query->numTerms) continue;
+			__sync_fetch_and_add(&query->matches,1);
+			if(query->callback!=NULL) query->callback(query->catalog,fileId,query->ctx);
+		}
+	}
+	return NULL;
+}
+
+long
+queryDotUCatalog(const struct DotUCatalog *catalog, const struct DotUQueryTerm *terms, uint32_t numTerms, int workers, DotUCatalogQueryCallback callback, void *ctx){
+	struct CatalogQuery query;
+	const struct CatName *name;
+	pthread_t *threads;
+	uint32_t i,n;
+	int started,pass;
+
+	if(catalog==NULL || !termsValid(terms,numTerms)){
+		dotuError(DOTU_EINVAL,NULL,"Bad query.");
+		return -1;
+	}
+	memset(&query,0,sizeof(query));
+	query.catalog=catalog;
+	query.callback=callback;
+	query.ctx=ctx;
+	query.numCandidates=catalog->header->numFiles;
+	query.terms=(struct CatalogTerm*)malloc(sizeof(struct CatalogTerm)*(numTerms+1));
+	if(query.terms==NULL) return -1;
+	for(n=0,pass=0;pass<2;pass++){
+		for(i=0;i<numTerms;i++){
+			if(readsValue(&terms[i])==pass) resolveTerm(catalog,&terms[i],&query.terms[n++]);
+		}
+	}
+	query.numTerms=n;
+
+	/* A term that needs one name to exist limits the files to that
+	   name's list - the shortest such list if there are several */
+	for(i=0;i<n;i++){
+		if(query.terms[i].term->negate || query.terms[i].term->match!=DOTU_Q_EXACT || query.terms[i].term->test==DOTU_Q_FINDERINFO) continue;
+		if(query.terms[i].firstName>=query.terms[i].lastName){
+			free(query.terms);
+			return 0;
+		}
+		name=&catalog->names[query.terms[i].firstName];
+		if(name->firstPosting>catalog->header->numAttrs || name->numPostings>catalog->header->numAttrs-name->firstPosting) continue;
+		if(query.candidates==NULL || name->numPostings<query.numCandidates){
+			query.candidates=catalog->postings+name->firstPosting;
+			query.numCandidates=name->numPostings;
+		}
+	}
+
+	if(workers<=0){
+		workers=(int)sysconf(_SC_NPROCESSORS_ONLN);
+		if(workers<=0) workers=1;
+	}
+	if((uint32_t)workers>query.numCandidates/QUERYCHUNK+1) workers=(int)(query.numCandidates/QUERYCHUNK+1);
+	threads=(pthread_t*)malloc(sizeof(pthread_t)*workers);
+	started=0;
+	for(;threads!=NULL && started<workers;started++){
+		if(pthread_create(&threads[started],NULL,catalogWorker,&query)!=0) break;
+	}
+	/* If no thread started at all, do it all on this one */
+	if(started==0) catalogWorker(&query);
+	for(i=0;i<(uint32_t)started;i++) pthread_join(threads[i],NULL);
+	free(threads);
+	free(query.terms);
+	return query.matches;
+}
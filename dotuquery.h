@@ -0,0 +1,68 @@
+/*
+ Attr queries over a DotU, a tree of ._ files or a catalog.
+
+ A query is an array of terms, all of which must hold.  Each term
+ picks attrs by name - one name, every name with a prefix, or every
+ attr - and holds if any picked attr passes its test.  Terms on names
+ and FinderInfo are tried before terms that read values, and lookups
+ go by the attr list's name order, so a file is usually turned down
+ without a value being looked at.
+*/
+
+#ifndef DOTUQUERY_H
+#define DOTUQUERY_H
+
+#include "dotu.h"
+#include "dotucatalog.h"
+
+/* How a term picks attrs by name */
+#define DOTU_Q_EXACT  0
+#define DOTU_Q_PREFIX 1
+#define DOTU_Q_ANY    2
+
+/* Tests */
+#define DOTU_Q_EXISTS         0 /* A picked attr exists */
+#define DOTU_Q_VALUE_EQUALS   1 /* Its value is the bytes */
+#define DOTU_Q_VALUE_CONTAINS 2 /* Its value holds the bytes somewhere */
+#define DOTU_Q_VALUE_LENGTH   3 /* minLength <= its value length <= maxLength */
+#define DOTU_Q_FINDERINFO     4 /* FinderInfo at offset matches the bytes under mask - ignores the name */
+
+/* FinderInfo fields, for DOTU_Q_FINDERINFO offset and length */
+#define DOTU_FINDER_TYPE     0 /* 4 bytes */
+#define DOTU_FINDER_CREATOR  4 /* 4 bytes */
+#define DOTU_FINDER_FLAGS    8 /* 2 bytes, big-endian */
+
+struct DotUQueryTerm {
+	int test;
+	int match;
+	int negate;          /* Holds if the test doesn't */
+	const char * name;   /* Name or prefix, for DOTU_Q_EXACT and DOTU_Q_PREFIX */
+	const char * bytes;  /* For the value and FinderInfo tests */
+	uint32_t length;
+	const char * mask;   /* DOTU_Q_FINDERINFO only; NULL compares every bit */
+	uint32_t offset;     /* DOTU_Q_FINDERINFO only */
+	uint32_t minLength;  /* DOTU_Q_VALUE_LENGTH only */
+	uint32_t maxLength;
+};
+
+/* Called once per match, on the worker threads - several can be
+   running at once.  The DotU is the zero-copy view the scanner made. */
+typedef void (*DotUQueryCallback)(const char *path, struct DotU *dotU, void *ctx);
+
+typedef void (*DotUCatalogQueryCallback)(const struct DotUCatalog *catalog, uint32_t fileId, void *ctx);
+
+/* 1 if dotU matches every term, 0 if not */
+int matchDotUQuery(const struct DotU *dotU, const struct DotUQueryTerm *terms, uint32_t numTerms);
+
+/* Runs the query over every ._ file under root, with scanDotUTree's
+   workers.  callback may be NULL.  Returns the number of matches, -1
+   if fail. */
+long queryDotUTree(const char *root, const struct DotUQueryTerm *terms, uint32_t numTerms, int workers, DotUQueryCallback callback, void *ctx);
+
+/* Runs the query over a catalog's files with a pool of worker threads
+   (0 for one per online CPU).  If a term needs a name to exist, only
+   the files on that name's list are looked at.  Returns the number of
+   matches, -1 if fail. */
+long queryDotUCatalog(const struct DotUCatalog *catalog, const struct DotUQueryTerm *terms, uint32_t numTerms, int workers, DotUCatalogQueryCallback callback, void *ctx);
+
+#endif
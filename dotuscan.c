@@ -0,0 +1,267 @@
+#include "dotuscan.h"
+#include <dirent.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SCAN_DIR  0
+#define SCAN_FILE 1
+
+struct ScanTask {
+	char * path;
+	int type;
+};
+
+/* One per worker.  The owner pushes and pops at the tail, thieves
+   take from the head. */
+struct ScanDeque {
+	pthread_mutex_t lock;
+	struct ScanTask * tasks;
+	uint32_t head;
+	uint32_t tail;
+	uint32_t capacity;
+};
+
+struct ScanPool {
+	struct ScanDeque * deques;
+	int workers;
+	long pending;   /* Tasks queued or running - 0 means the walk is done */
+	long found;
+	int sleepers;
+	pthread_mutex_t idleLock;
+	pthread_cond_t idleCond;
+	DotUScanCallback callback;
+	void * ctx;
+};
+
+struct ScanWorker {
+	struct ScanPool * pool;
+	int id;
+};
+
+static int
+pushTask(struct ScanPool *pool, int id, char *path, int type){
+	struct ScanDeque *deque=&pool->deques[id];
+	struct ScanTask *tasks;
+	uint32_t newCapacity;
+
+	/* Count it before it's visible so pending can't touch 0 early */
+	__sync_fetch_and_add(&pool->pending,1);
+	pthread_mutex_lock(&deque->lock);
+	if(deque->tail==deque->capacity){
+		if(deque->head>0){
+			/* Slide the live tasks down over the stolen ones */
+			memmove(deque->tasks,&deque->tasks[deque->head],sizeof(struct ScanTask)*(deque->tail-deque->head));
+			deque->tail-=deque->head;
+			deque->head=0;
+		} else {
+			newCapacity=(deque->capacity==0) ? 64 : deque->capacity*2;
+			tasks=(struct ScanTask*)realloc(deque->tasks,sizeof(struct ScanTask)*newCapacity);
+			if(tasks==NULL){
+				pthread_mutex_unlock(&deque->lock);
+				__sync_fetch_and_sub(&pool->pending,1);
+				free(path);
+				return -1;
+			}
+			deque->tasks=tasks;
+			deque->capacity=newCapacity;
+		}
+	}
+	deque->tasks[deque->tail].path=path;
+	deque->tasks[deque->tail].type=type;
+	deque->tail++;
+	pthread_mutex_unlock(&deque->lock);
+
+	if(__sync_fetch_and_add(&pool->sleepers,0)>0){
+		pthread_mutex_lock(&pool->idleLock);
+		pthread_cond_broadcast(&pool->idleCond);
+		pthread_mutex_unlock(&pool->idleLock);
+	}
+	return 0;
+}
+
+/* Newest task from our own deque - keeps the walk depth-first and warm */
+static int
+popTask(struct ScanDeque *deque, struct ScanTask *task){
+	int got=0;
+	pthread_mutex_lock(&deque->lock);
+	if(deque->tail>deque->head){
+		*task=deque->tasks[--deque->tail];
+		got=1;
+	}
+	pthread_mutex_unlock(&deque->lock);
+	return got;
+}
+
+/* Oldest task from someone else's deque - usually a whole subtree */
+static int
+stealTask(struct ScanPool *pool, int thief, struct ScanTask *task){
+	int i,victim;
+	struct ScanDeque *deque;
+
+	for(i=1;i<pool->workers;i++){
+		victim=(thief+i)%pool->workers;
+		deque=&pool->deques[victim];
+		pthread_mutex_lock(&deque->lock);
+		if(deque->tail>deque->head){
+			*task=deque->tasks[deque->head++];
+			pthread_mutex_unlock(&deque->lock);
+			return 1;
+		}
+		pthread_mutex_unlock(&deque->lock);
+	}
+	return 0;
+}
+
+static char *
+joinPath(const char *dir, const char *name){
+	size_t dirLength=strlen(dir);
+	char *path=(char*)malloc(dirLength+strlen(name)+2);
+	if(path==NULL) return NULL;
+	memcpy(path,dir,dirLength);
+	path[dirLength]='/';
+	strcpy(&path[dirLength+1],name);
+	return path;
+}
+
+static void
+scanDir(struct ScanPool *pool, int id, const char *dirPath){
+	DIR *dir;
+	struct dirent *dirEntry;
+	struct stat statBuffer;
+	char *path;
+
+	dir=opendir(dirPath);
+	if(dir==NULL) return;
+	while((dirEntry=readdir(dir))!=NULL){
+		if(strcmp(dirEntry->d_name,".")==0 || strcmp(dirEntry->d_name,"..")==0) continue;
+		path=joinPath(dirPath,dirEntry->d_name);
+		if(path==NULL) continue;
+		if(lstat(path,&statBuffer)==0){
+			if(S_ISDIR(statBuffer.st_mode)){
+				pushTask(pool,id,path,SCAN_DIR);
+				continue;
+			}
+			if(S_ISREG(statBuffer.st_mode) && strncmp(dirEntry->d_name,"._",2)==0){
+				pushTask(pool,id,path,SCAN_FILE);
+				continue;
+			}
+		}
+		free(path);
+	}
+	closedir(dir);
+}
+
+static void
+scanFile(struct ScanPool *pool, const char *path){
+	struct DotU dotU;
+	int status;
+
+	status=mapDotUFile(path,&dotU);
+	__sync_fetch_and_add(&pool->found,1);
+	pool->callback(path,&dotU,status,pool->ctx);
+	if(status==0) freeDotU(&dotU);
+}
+
+static void *
+scanWorker(void *arg){
+	struct ScanWorker *worker=(struct ScanWorker*)arg;
+	struct ScanPool *pool=worker->pool;
+	struct ScanTask task;
+	struct timespec wait;
+
+	for(;;){
+		if(popTask(&pool->deques[worker->id],&task) || stealTask(pool,worker->id,&task)){
+			if(task.type==SCAN_DIR) scanDir(pool,worker->id,task.path);
+			else scanFile(pool,task.path);
+			free(task.path);
+			if(__sync_sub_and_fetch(&pool->pending,1)==0){
+				pthread_mutex_lock(&pool->idleLock);
+				pthread_cond_broadcast(&pool->idleCond);
+				pthread_mutex_unlock(&pool->idleLock);
+			}
+			continue;
+		}
+		if(__sync_fetch_and_add(&pool->pending,0)==0) break;
+
+		/* Nothing to steal yet but others are still walking.  The
+		   timeout covers a push that lands between the check and
+		   the wait. */
+		pthread_mutex_lock(&pool->idleLock);
+		__sync_fetch_and_add(&pool->sleepers,1);
+		if(__sync_fetch_and_add(&pool->pending,0)!=0){
+			clock_gettime(CLOCK_REALTIME,&wait);
+			wait.tv_nsec+=1000000L;
+			if(wait.tv_nsec>=1000000000L){
+				wait.tv_sec++;
+				wait.tv_nsec-=1000000000L;
+			}
+			pthread_cond_timedwait(&pool->idleCond,&pool->idleLock,&wait);
+		}
+		__sync_fetch_and_sub(&pool->sleepers,1);
+		pthread_mutex_unlock(&pool->idleLock);
+	}
+	return NULL;
+}
+
+long
+scanDotUTree(const char *root, int workers, DotUScanCallback callback, void *ctx){
+	struct ScanPool pool;
+	struct ScanWorker *workerArgs;
+	pthread_t *threads;
+	struct stat statBuffer;
+	char *rootPath;
+	int i,started;
+
+	if(root==NULL || callback==NULL || lstat(root,&statBuffer)!=0) return -1;
+	if(workers<=0){
+		workers=(int)sysconf(_SC_NPROCESSORS_ONLN);
+		if(workers<=0) workers=1;
+	}
+
+	memset(&pool,0,sizeof(struct ScanPool));
+	pool.workers=workers;
+	pool.callback=callback;
+	pool.ctx=ctx;
+	pool.deques=(struct ScanDeque*)calloc(workers,sizeof(struct ScanDeque));
+	threads=(pthread_t*)malloc(sizeof(pthread_t)*workers);
+	workerArgs=(struct ScanWorker*)malloc(sizeof(struct ScanWorker)*workers);
+	rootPath=(char*)malloc(strlen(root)+1);
+	if(pool.deques==NULL || threads==NULL || workerArgs==NULL || rootPath==NULL){
+		free(pool.deques);
+		free(threads);
+		free(workerArgs);
+		free(rootPath);
+		return -1;
+	}
+	strcpy(rootPath,root);
+	pthread_mutex_init(&pool.idleLock,NULL);
+	pthread_cond_init(&pool.idleCond,NULL);
+	for(i=0;i<workers;i++) pthread_mutex_init(&pool.deques[i].lock,NULL);
+
+	/* Seed worker 0; the rest start out stealing */
+	pushTask(&pool,0,rootPath,S_ISDIR(statBuffer.st_mode) ? SCAN_DIR : SCAN_FILE);
+
+	for(started=0;started<workers;started++){
+		workerArgs[started].pool=&pool;
+		workerArgs[started].id=started;
+		if(pthread_create(&threads[started],NULL,scanWorker,&workerArgs[started])!=0) break;
+	}
+	/* If no thread started at all, walk the tree on this one */
+	if(started==0){
+		pool.workers=1;
+		scanWorker(&workerArgs[0]);
+	}
+	for(i=0;i<started;i++) pthread_join(threads[i],NULL);
+
+	for(i=0;i<workers;i++){
+		pthread_mutex_destroy(&pool.deques[i].lock);
+		free(pool.deques[i].tasks);
+	}
+	pthread_cond_destroy(&pool.idleCond);
+	pthread_mutex_destroy(&pool.idleLock);
+	free(pool.deques);
+	free(threads);
+	free(workerArgs);
+	return pool.found;
+}
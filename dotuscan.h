@@ -0,0 +1,28 @@
+/*
+ Parallel tree scanner for dot-underscore (._) files.
+
+ The tree is walked on a pool of worker threads, each with its own
+ deque of pending directories and files.  A worker takes from the
+ bottom of its own deque and, when that runs dry, steals from the top
+ of another worker's, so one huge directory doesn't leave the other
+ workers idle.
+*/
+
+#ifndef DOTUSCAN_H
+#define DOTUSCAN_H
+
+#include "dotu.h"
+
+/* Called once per ._ file found.  status is DOTU_OK if the file
+   parsed, else the DOTU_E* code saying why not (and then
+   dotU->header.magic != DOTUMAGIC).  The DotU is a zero-copy
+   view that is released as soon as the callback returns.  Callbacks
+   run on the worker threads, so several can be running at once. */
+typedef void (*DotUScanCallback)(const char *path, struct DotU *dotU, int status, void *ctx);
+
+/* Walks the tree under root with the given number of worker threads
+   (0 for one per online CPU) and hands every ._ file to callback.
+   Returns the number of ._ files found, -1 if fail. */
+long scanDotUTree(const char *root, int workers, DotUScanCallback callback, void *ctx);
+
+#endif
@@ -0,0 +1,148 @@
+#include "dotusnap.h"
+#include "dotupriv.h"
+#include <pthread.h>
+#include <sched.h>
+
+/* Keeps the counters every reader writes off the line holding the
+   fields every reader only reads */
+#define CACHELINE 64
+
+struct Version {
+	struct DotU dotU;
+	unsigned long version;
+};
+
+/* Readers count themselves in under the current epoch.  Publishing
+   swaps the version, then flips the epoch and waits for the old
+   epoch's count to drain: a reader that could have seen the old
+   version counted itself in before the flip, and any reader counting
+   in after it sees the new version. */
+struct DotUShared {
+	struct Version * current;
+	int epoch;
+	struct Version * draft;       /* The open update's copy - writer only */
+	pthread_mutex_t writer;
+	char padding[CACHELINE];
+	long readers[2];
+};
+
+static void
+freeVersion(struct Version *version){
+	if(version==NULL) return;
+	freeDotU(&version->dotU);
+	dotuFree(version,sizeof(struct Version));
+}
+
+/* Builds what findAttr would otherwise build on the first lookup, so
+   readers never write to a published version */
+static void
+freeze(struct Version *version){
+	struct DotU *dotU=&version->dotU;
+	int finderEntry=dotuFinderEntry(dotU);
+	struct FinderEntry *finder;
+
+	if(finderEntry<0) return;
+	finder=&dotU->entry[finderEntry].data.finder;
+	if(DOTU_HASHINDEX_MIN>0 && finder->xattrHdr.numAttrs>=DOTU_HASHINDEX_MIN && !dotuIndexUsable(dotU->index,finder)){
+		/* Without it lookups binary search instead */
+		dotU->index=dotuIndexBuild(dotU,finder);
+	}
+}
+
+struct DotUShared *
+shareDotU(struct DotU *dotU){
+	struct DotUShared *shared=(struct DotUShared*)dotuAlloc(sizeof(struct DotUShared));
+	struct Version *version=(struct Version*)dotuAlloc(sizeof(struct Version));
+
+	if(shared==NULL || version==NULL){
+		dotuFree(shared,sizeof(struct DotUShared));
+		dotuFree(version,sizeof(struct Version));
+		dotuError(DOTU_ENOMEM,NULL,"Error allocating shared DotU.");
+		return NULL;
+	}
+	memset(shared,0,sizeof(struct DotUShared));
+	version->dotU=*dotU;
+	version->version=1;
+	memset(dotU,0,sizeof(struct DotU));
+	freeze(version);
+	shared->current=version;
+	pthread_mutex_init(&shared->writer,NULL);
+	return shared;
+}
+
+void
+freeDotUShared(struct DotUShared *shared){
+	if(shared==NULL) return;
+	freeVersion(shared->current);
+	freeVersion(shared->draft);
+	pthread_mutex_destroy(&shared->writer);
+	dotuFree(shared,sizeof(struct DotUShared));
+}
+
+void
+acquireDotUSnapshot(struct DotUShared *shared, struct DotUSnapshot *snapshot){
+	struct Version *current;
+	int epoch;
+
+	/* If a publish flips the epoch between reading it and counting in,
+	   the count may already have been waited out; count in again under
+	   the new one. */
+	for(;;){
+		epoch=__atomic_load_n(&shared->epoch,__ATOMIC_SEQ_CST);
+		__sync_fetch_and_add(&shared->readers[epoch],1);
+		if(__atomic_load_n(&shared->epoch,__ATOMIC_SEQ_CST)==epoch) break;
+		__sync_fetch_and_sub(&shared->readers[epoch],1);
+	}
+	current=__atomic_load_n(&shared->current,__ATOMIC_SEQ_CST);
+	snapshot->dotU=&current->dotU;
+	snapshot->version=current->version;
+	snapshot->shared=shared;
+	snapshot->epoch=epoch;
+}
+
+void
+releaseDotUSnapshot(struct DotUSnapshot *snapshot){
+	if(snapshot->dotU==NULL) return;
+	__sync_fetch_and_sub(&snapshot->shared->readers[snapshot->epoch],1);
+	snapshot->dotU=NULL;
+}
+
+struct DotU *
+beginDotUUpdate(struct DotUShared *shared){
+	struct Version *draft;
+
+	pthread_mutex_lock(&shared->writer);
+	draft=(struct Version*)dotuAlloc(sizeof(struct Version));
+	if(draft==NULL || dotuClone(&shared->current->dotU,&draft->dotU)!=DOTU_OK){
+		dotuFree(draft,sizeof(struct Version));
+		pthread_mutex_unlock(&shared->writer);
+		dotuError(DOTU_ENOMEM,NULL,"Error allocating DotU update.");
+		return NULL;
+	}
+	draft->version=shared->current->version+1;
+	shared->draft=draft;
+	return &draft->dotU;
+}
+
+int
+publishDotUUpdate(struct DotUShared *shared){
+	struct Version *old=shared->current;
+	int epoch=shared->epoch;
+
+	if(shared->draft==NULL) return dotuError(DOTU_EINVAL,NULL,"No update open.");
+	freeze(shared->draft);
+	__atomic_store_n(&shared->current,shared->draft,__ATOMIC_SEQ_CST);
+	shared->draft=NULL;
+	__atomic_store_n(&shared->epoch,1-epoch,__ATOMIC_SEQ_CST);
+	while(__atomic_load_n(&shared->readers[epoch],__ATOMIC_SEQ_CST)!=0) sched_yield();
+	freeVersion(old);
+	pthread_mutex_unlock(&shared->writer);
+	return DOTU_OK;
+}
+
+void
+abortDotUUpdate(struct DotUShared *shared){
+	freeVersion(shared->draft);
+	shared->draft=NULL;
+	pthread_mutex_unlock(&shared->writer);
+}
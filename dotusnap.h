@@ -0,0 +1,56 @@
+/*
+ A DotU shared between threads: any number of readers, one writer.
+
+ Readers take a snapshot - a version of the DotU that never changes
+ while they hold it - and look it up through the const calls
+ (getDotUAttr, nextDotUAttr, readDotUResource, equalDotU and so on)
+ without taking a lock.  The writer edits a private copy of the
+ current version with the usual calls and publishes it in one atomic
+ step; readers that come after see the new version, readers already
+ holding the old one keep it until they let go.
+
+ Publishing waits for readers still holding the version it replaces
+ before freeing it, so hold a snapshot for a lookup or a pass over
+ the attrs, not indefinitely - and never publish from a thread that
+ is holding a snapshot of the same DotU.
+*/
+
+#ifndef DOTUSNAP_H
+#define DOTUSNAP_H
+
+#include "dotu.h"
+
+struct DotUShared;
+
+struct DotUSnapshot {
+	const struct DotU * dotU;
+	unsigned long version;   /* 1 for the DotU as shared, then one more per publish */
+	/* Private */
+	struct DotUShared * shared;
+	int epoch;
+};
+
+/* Takes over the DotU, which is left empty; NULL if out of memory, in
+   which case the DotU is untouched. */
+struct DotUShared* shareDotU(struct DotU *dotU);
+
+/* Once no reader holds a snapshot and no update is open */
+void freeDotUShared(struct DotUShared *shared);
+
+void acquireDotUSnapshot(struct DotUShared *shared, struct DotUSnapshot *snapshot);
+
+void releaseDotUSnapshot(struct DotUSnapshot *snapshot);
+
+/* Opens an update: a private copy of the current version for the
+   caller to edit.  Blocks while another update is open.  NULL if out
+   of memory, with no update left open. */
+struct DotU* beginDotUUpdate(struct DotUShared *shared);
+
+/* Makes the copy the current version, then waits out the readers of
+   the old one and frees it.  The copy is no longer the caller's to
+   touch. */
+int publishDotUUpdate(struct DotUShared *shared);
+
+void abortDotUUpdate(struct DotUShared *shared);
+
+#endif
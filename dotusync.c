@@ -0,0 +1,273 @@
+/* syncfs is Linux-only and hidden by a strict POSIX feature level */
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
+#include "dotupriv.h"
+#include <errno.h>
+#include <unistd.h>
+
+/* Atomic writes.  Each file goes to a temp file next to it; the
+   rename over the real name happens at commit, after one barrier that
+   makes every temp file durable and before a second that makes the
+   renames durable.  Until the commit the old files are untouched, and
+   a crash at any point leaves each file either all old or all new. */
+
+struct SyncFile {
+	char * tempName;    /* Copies in the group's arena */
+	char * fileName;
+	char * dirName;
+	uint32_t sequence;  /* Order queued in - see compareDirs */
+};
+
+struct DotUSyncGroup {
+	struct DotUArena * arena; /* Holds the group itself and its list */
+	struct SyncFile * files;
+	uint32_t numFiles;
+	uint32_t capacity;
+};
+
+struct DotUSyncGroup *
+beginDotUSyncGroup(void){
+	struct DotUArena *arena;
+	struct DotUSyncGroup *group;
+
+	arena=dotuArenaCreate(sizeof(struct DotUSyncGroup)+16*sizeof(struct SyncFile)+1024);
+	if(arena==NULL) return NULL;
+	group=(struct DotUSyncGroup*)dotuArenaAlloc(arena,sizeof(struct DotUSyncGroup));
+	group->arena=arena;
+	group->capacity=16;
+	group->numFiles=0;
+	group->files=(struct SyncFile*)dotuArenaAlloc(arena,sizeof(struct SyncFile)*group->capacity);
+	return group;
+}
+
+/* Directory part of fileName, "." if none, into buf */
+static char *
+dirPart(const char *fileName, char *buf, size_t bufSize){
+	const char *slash=strrchr(fileName,'/');
+	size_t length;
+
+	if(slash==NULL) return strcpy(buf,".");
+	length=(slash==fileName) ? 1 : (size_t)(slash-fileName);
+	if(length>=bufSize) return NULL;
+	memcpy(buf,fileName,length);
+	buf[length]='\0';
+	return buf;
+}
+
+static int
+fsyncDir(const char *dirName){
+	int fd=open(dirName,O_RDONLY);
+	int result=DOTU_OK;
+
+	if(fd<0) return DOTU_EIO;
+	if(fsync(fd)!=0) result=DOTU_EIO;
+	close(fd);
+	return result;
+}
+
+/* Makes what's been written under dirName durable.  On Linux that's a
+   syncfs of the whole filesystem - one flush however many files; else
+   an fsync of the directory, which the caller has already preceded
+   with fsyncs of the files. */
+static int
+syncDir(const char *dirName){
+#ifdef __linux__
+	int fd=open(dirName,O_RDONLY);
+	int result=DOTU_OK;
+
+	if(fd<0) return DOTU_EIO;
+	if(syncfs(fd)!=0) result=DOTU_EIO;
+	close(fd);
+	return result;
+#else
+	return fsyncDir(dirName);
+#endif
+}
+
+#ifndef __linux__
+static int
+syncFile(const char *fileName){
+	int fd=open(fileName,O_RDONLY);
+	int result=DOTU_OK;
+
+	if(fd<0) return DOTU_EIO;
+	if(fsync(fd)!=0) result=DOTU_EIO;
+	close(fd);
+	return result;
+}
+#endif
+
+/* By directory, then in the order queued, since qsort isn't stable: a
+   file written twice in a group is renamed over twice, and the later
+   write has to land last. */
+static int
+compareDirs(const void *a, const void *b){
+	const struct SyncFile *fileA=(const struct SyncFile*)a;
+	const struct SyncFile *fileB=(const struct SyncFile*)b;
+	int cmp=strcmp(fileA->dirName,fileB->dirName);
+
+	if(cmp!=0) return cmp;
+	return (fileA->sequence<fileB->sequence) ? -1 : (fileA->sequence>fileB->sequence);
+}
+
+/* One barrier over every directory the group wrote into.  Files are
+   sorted by directory. */
+static int
+syncGroup(struct DotUSyncGroup *group, int syncFiles){
+#ifdef __linux__
+	struct stat statBuffer;
+	dev_t *devices;
+	uint32_t numDevices,k;
+#endif
+	uint32_t i;
+	int result=DOTU_OK;
+
+#ifdef __linux__
+	(void)syncFiles;
+	/* syncfs covers a whole filesystem, so once per device will do */
+	devices=(dev_t*)dotuArenaAlloc(group->arena,sizeof(dev_t)*group->numFiles);
+	if(devices==NULL) return DOTU_ENOMEM;
+	numDevices=0;
+	for(i=0;i<group->numFiles;i++){
+		if(i>0 && strcmp(group->files[i].dirName,group->files[i-1].dirName)==0) continue;
+		if(stat(group->files[i].dirName,&statBuffer)!=0) return DOTU_EIO;
+		for(k=0;k<numDevices && devices[k]!=statBuffer.st_dev;k++);
+		if(k<numDevices) continue;
+		devices[numDevices++]=statBuffer.st_dev;
+		if(syncDir(group->files[i].dirName)!=DOTU_OK) result=DOTU_EIO;
+	}
+#else
+	for(i=0;syncFiles && i<group->numFiles;i++){
+		if(syncFile(group->files[i].tempName)!=DOTU_OK) result=DOTU_EIO;
+	}
+	for(i=0;i<group->numFiles;i++){
+		if(i>0 && strcmp(group->files[i].dirName,group->files[i-1].dirName)==0) continue;
+		if(syncDir(group->files[i].dirName)!=DOTU_OK) result=DOTU_EIO;
+	}
+#endif
+	return result;
+}
+
+/* Writes to a new temp file beside fileName and returns its name */
+static int
+writeTemp(struct DotU *dotU, const char *fileName, char *tempName, size_t tempSize, int syncNow){
+	struct stat statBuffer;
+	const char *slash=strrchr(fileName,'/');
+	int fd,result;
+
+	/* .<name>.XXXXXX in the same directory, so the rename can't cross
+	   filesystems */
+	if(slash==NULL){
+		result=snprintf(tempName,tempSize,".%s.XXXXXX",fileName);
+	} else {
+		result=snprintf(tempName,tempSize,"%.*s/.%s.XXXXXX",(int)(slash-fileName),fileName,slash+1);
+	}
+	if(result<0 || (size_t)result>=tempSize) return dotuError(DOTU_EINVAL,fileName,"File name too long.");
+	fd=mkstemp(tempName);
+	if(fd<0) return dotuError(DOTU_EIO,fileName,"Error creating temp file.");
+
+	/* mkstemp makes it 0600 - a replacement keeps the old file's mode */
+	fchmod(fd,(stat(fileName,&statBuffer)==0) ? (statBuffer.st_mode & 07777) : 0644);
+	result=writeDotUFd(dotU,fd);
+	if(result==DOTU_OK && syncNow && fsync(fd)!=0) result=DOTU_EIO;
+	if(close(fd)!=0 && result==DOTU_OK) result=DOTU_EIO;
+	if(result!=DOTU_OK){
+		unlink(tempName);
+		return dotuError(result,fileName,"Error writing temp file.");
+	}
+	return DOTU_OK;
+}
+
+int
+writeDotUFileAtomic(struct DotU *dotU, const char *fileName, struct DotUSyncGroup *group){
+	char tempName[MAXDIRNAMESIZE+MAXFILENAMESIZE+2];
+	char dirName[MAXDIRNAMESIZE+1];
+	struct SyncFile *files;
+	struct SyncFile *file;
+	int result;
+
+	if(dotU==NULL || fileName==NULL) return DOTU_EINVAL;
+	result=writeTemp(dotU,fileName,tempName,sizeof(tempName),group==NULL);
+	if(result!=DOTU_OK) return result;
+
+	if(group==NULL){
+		/* On its own: the file is already synced, so rename it and
+		   sync the directory entry */
+		if(rename(tempName,fileName)!=0){
+			unlink(tempName);
+			return dotuError(DOTU_EIO,fileName,"Error renaming temp file.");
+		}
+		if(dirPart(fileName,dirName,sizeof(dirName))==NULL || fsyncDir(dirName)!=DOTU_OK){
+			return dotuError(DOTU_EIO,fileName,"Error syncing directory.");
+		}
+		return DOTU_OK;
+	}
+
+	if(group->numFiles==group->capacity){
+		files=(struct SyncFile*)dotuArenaAlloc(group->arena,sizeof(struct SyncFile)*group->capacity*2);
+		if(files==NULL){
+			unlink(tempName);
+			return dotuError(DOTU_ENOMEM,fileName,"Error allocating sync group.");
+		}
+		memcpy(files,group->files,sizeof(struct SyncFile)*group->numFiles);
+		group->files=files;
+		group->capacity*=2;
+	}
+	file=&group->files[group->numFiles];
+	file->tempName=dotuArenaCopy(group->arena,tempName,strlen(tempName));
+	file->fileName=dotuArenaCopy(group->arena,fileName,strlen(fileName));
+	file->dirName=(dirPart(fileName,dirName,sizeof(dirName))!=NULL) ? dotuArenaCopy(group->arena,dirName,strlen(dirName)) : NULL;
+	if(file->tempName==NULL || file->fileName==NULL || file->dirName==NULL){
+		unlink(tempName);
+		return dotuError(DOTU_ENOMEM,fileName,"Error allocating sync group.");
+	}
+	file->sequence=group->numFiles++;
+	return DOTU_OK;
+}
+
+/* Frees the group, first removing any temp files still left */
+void
+abortDotUSyncGroup(struct DotUSyncGroup *group){
+	uint32_t i;
+
+	if(group==NULL) return;
+	for(i=0;i<group->numFiles;i++){
+		if(group->files[i].tempName!=NULL) unlink(group->files[i].tempName);
+	}
+	dotuArenaRelease(group->arena);
+}
+
+int
+commitDotUSyncGroup(struct DotUSyncGroup *group){
+	uint32_t i;
+	int result;
+
+	if(group==NULL) return DOTU_EINVAL;
+	if(group->numFiles==0){
+		abortDotUSyncGroup(group);
+		return DOTU_OK;
+	}
+	qsort(group->files,group->numFiles,sizeof(struct SyncFile),compareDirs);
+
+	/* Everything written is on disk before any name changes... */
+	result=syncGroup(group,1);
+	if(result!=DOTU_OK){
+		abortDotUSyncGroup(group);
+		return dotuError(result,NULL,"Error syncing sync group - nothing replaced.");
+	}
+	for(i=0;i<group->numFiles;i++){
+		if(rename(group->files[i].tempName,group->files[i].fileName)!=0){
+			result=dotuError(DOTU_EIO,group->files[i].fileName,"Error renaming temp file.");
+			continue;
+		}
+		group->files[i].tempName=NULL;
+	}
+	/* ...and then the new names are */
+	if(syncGroup(group,0)!=DOTU_OK && result==DOTU_OK){
+		result=dotuError(DOTU_EIO,NULL,"Error syncing sync group renames.");
+	}
+	abortDotUSyncGroup(group);
+	return result;
+}
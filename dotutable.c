@@ -0,0 +1,102 @@
+#include "dotutable.h"
+#include "dotuname.h"
+#include "dotupriv.h"
+
+/* Bytes of columns per attr */
+#define COLUMNBYTES (4*sizeof(uint32_t)+sizeof(uint16_t)+sizeof(uint8_t))
+
+/* Carves the columns out of one block, widest first so each is aligned */
+static int
+allocColumns(struct DotUAttrTable *table, uint32_t numAttrs){
+	char *block;
+
+	if(numAttrs==0) return DOTU_OK;
+	block=(char*)dotuAlloc(numAttrs*COLUMNBYTES);
+	if(block==NULL) return DOTU_ENOMEM;
+	table->nameOffset=(uint32_t*)block;
+	table->valueOffset=table->nameOffset+numAttrs;
+	table->valueLength=table->valueOffset+numAttrs;
+	table->nameId=table->valueLength+numAttrs;
+	table->flags=(uint16_t*)(table->nameId+numAttrs);
+	table->nameLength=(uint8_t*)(table->flags+numAttrs);
+	return DOTU_OK;
+}
+
+/* Offset of the Finder entry, 0 if there is none, or a DOTU_E* code */
+static long
+findFinder(const char *buf, uint32_t length){
+	uint32_t numEntries,i,offset;
+
+	if(length<26 || DOTU_BE32(buf)!=DOTUMAGIC) return DOTU_EFORMAT;
+	numEntries=DOTU_BE16(&buf[24]);
+	if(26+12*numEntries>length) return DOTU_EFORMAT;
+	for(i=0;i<numEntries;i++){
+		if(DOTU_BE32(&buf[26+12*i])!=9) continue;
+		offset=DOTU_BE32(&buf[30+12*i]);
+		if(DOTU_BE32(&buf[34+12*i])<70 || offset<26 || offset>length || length-offset<70) return DOTU_EFORMAT;
+		return (long)offset;
+	}
+	return 0;
+}
+
+int
+decodeDotUAttrs(const char *buf, uint32_t length, struct DotUAttrTable *table){
+	uint32_t numAttrs,i,header;
+	uint32_t valueOffset,valueLength;
+	uint8_t nameLength;
+	long finder;
+
+	memset(table,0,sizeof(struct DotUAttrTable));
+	table->image=buf;
+	finder=findFinder(buf,length);
+	if(finder<0) return dotuError((int)finder,NULL,"Not an AppleDouble file, or a malformed one.");
+	if(finder==0) return DOTU_OK;
+	numAttrs=DOTU_BE16(&buf[finder+68]);
+	if(allocColumns(table,numAttrs)!=DOTU_OK) return dotuError(DOTU_ENOMEM,NULL,"Error allocating attr table.");
+
+	/* The headers are packed one after another, each as long as its
+	   name, so they're walked in order; every field is a swapped load. */
+	header=(uint32_t)finder+70;
+	for(i=0;i<numAttrs;i++){
+		if(header+11>length) break;
+		valueOffset=DOTU_BE32(&buf[header]);
+		valueLength=DOTU_BE32(&buf[header+4]);
+		nameLength=(uint8_t)buf[header+10];
+		if(nameLength==0 || header+11+nameLength>length || buf[header+11+nameLength-1]!='\0') break;
+		if(valueOffset>length || valueLength>length-valueOffset) break;
+		table->valueOffset[i]=valueOffset;
+		table->valueLength[i]=valueLength;
+		table->flags[i]=(uint16_t)DOTU_BE16(&buf[header+8]);
+		table->nameLength[i]=nameLength;
+		table->nameOffset[i]=header+11;
+		table->nameId[i]=dotuNameId(&buf[header+11],nameLength-1u);
+		header+=attrHdrSize(nameLength);
+	}
+	if(i<numAttrs){
+		table->numAttrs=numAttrs;
+		freeDotUAttrTable(table);
+		return dotuError(DOTU_EFORMAT,NULL,"Error.  Bad xattr header.");
+	}
+	table->numAttrs=numAttrs;
+	return DOTU_OK;
+}
+
+void
+freeDotUAttrTable(struct DotUAttrTable *table){
+	if(table->numAttrs>0) dotuFree(table->nameOffset,table->numAttrs*COLUMNBYTES);
+	memset(table,0,sizeof(struct DotUAttrTable));
+}
+
+long
+findDotUTableAttr(const struct DotUAttrTable *table, uint32_t nameId){
+	const char *name=getDotUName(nameId);
+	uint32_t i;
+
+	if(name==NULL) return -1;
+	for(i=0;i<table->numAttrs;i++){
+		if(table->nameId[i]==nameId) return (long)i;
+		/* A name that got no id is matched by name */
+		if(table->nameId[i]==0 && strcmp(table->image+table->nameOffset[i],name)==0) return (long)i;
+	}
+	return -1;
+}
@@ -0,0 +1,38 @@
+/*
+ Column view of a ._ file's attrs, for scanning and filtering attrs
+ across many files.
+
+ decodeDotUAttrs reads the attr headers of a ._ image straight into
+ parallel arrays - one per field, one allocation for them all - without
+ building a DotU.  Names and values stay where they are in the image
+ and are found by offset, so a pass over one field of every attr walks
+ one small array instead of a list of structs and the pointers in them.
+*/
+
+#ifndef DOTUTABLE_H
+#define DOTUTABLE_H
+
+#include "dotu.h"
+
+struct DotUAttrTable {
+	const char * image;       /* Names and values are at offsets into this */
+	uint32_t numAttrs;
+	uint32_t * nameOffset;
+	uint32_t * valueOffset;
+	uint32_t * valueLength;
+	uint32_t * nameId;        /* In the name table, 0 if it had no room - see dotuname.h */
+	uint16_t * flags;         /* As stored - big-endian bytes read as a number */
+	uint8_t * nameLength;     /* Counting the \0 */
+};
+
+/* Decodes the attrs in length bytes of a whole ._ file.  The table
+   points into buf, which has to outlive it.  A file with no Finder
+   entry gives an empty table. */
+int decodeDotUAttrs(const char *buf, uint32_t length, struct DotUAttrTable *table);
+
+void freeDotUAttrTable(struct DotUAttrTable *table);
+
+/* Index of the attr with this name id, -1 if none */
+long findDotUTableAttr(const struct DotUAttrTable *table, uint32_t nameId);
+
+#endif
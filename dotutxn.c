@@ -0,0 +1,234 @@
+#include "dotupriv.h"
+
+#define TXN_SET 0
+#define TXN_RM  1
+
+struct TxnOp {
+	const char * name;     /* Copies in the txn's arena */
+	const char * value;
+	uint32_t valueLength;
+	uint32_t seq;          /* Queue order - the last edit to a name wins */
+	int type;
+};
+
+struct DotUTxn {
+	struct DotU * dotU;
+	struct DotUArena * arena; /* Holds the txn itself and its queue */
+	struct TxnOp * ops;
+	uint32_t numOps;
+	uint32_t capacity;
+};
+
+struct DotUTxn *
+beginDotUTxn(struct DotU *dotU){
+	struct DotUArena *arena;
+	struct DotUTxn *txn;
+
+	if(dotU==NULL) return NULL;
+	arena=dotuArenaCreate(sizeof(struct DotUTxn)+16*sizeof(struct TxnOp)+512);
+	if(arena==NULL) return NULL;
+	txn=(struct DotUTxn*)dotuArenaAlloc(arena,sizeof(struct DotUTxn));
+	if(txn==NULL){
+		dotuArenaRelease(arena);
+		return NULL;
+	}
+	txn->dotU=dotU;
+	txn->arena=arena;
+	txn->capacity=16;
+	txn->numOps=0;
+	txn->ops=(struct TxnOp*)dotuArenaAlloc(arena,sizeof(struct TxnOp)*txn->capacity);
+	if(txn->ops==NULL){
+		dotuArenaRelease(arena);
+		return NULL;
+	}
+	return txn;
+}
+
+static int
+queueOp(struct DotUTxn *txn, int type, const char *name, const char *value, uint32_t valueLength){
+	struct TxnOp *ops;
+	struct TxnOp *op;
+	size_t nameLength;
+
+	if(txn==NULL || name==NULL) return DOTU_EINVAL;
+	/* Name length is stored in one byte and counts the \0 */
+	nameLength=strlen(name);
+	if(nameLength==0 || nameLength>254) return dotuError(DOTU_EINVAL,name,"Xattr name is empty or too long.");
+
+	if(txn->numOps==txn->capacity){
+		ops=(struct TxnOp*)dotuArenaAlloc(txn->arena,sizeof(struct TxnOp)*txn->capacity*2);
+		if(ops==NULL) return dotuError(DOTU_ENOMEM,name,"Error queueing xattr edit.");
+		memcpy(ops,txn->ops,sizeof(struct TxnOp)*txn->numOps);
+		txn->ops=ops;
+		txn->capacity*=2;
+	}
+	op=&txn->ops[txn->numOps];
+	op->name=dotuArenaCopy(txn->arena,name,nameLength);
+	op->value=(type==TXN_SET) ? dotuArenaCopy(txn->arena,value,valueLength) : NULL;
+	if(op->name==NULL || (type==TXN_SET && op->value==NULL)){
+		return dotuError(DOTU_ENOMEM,name,"Error queueing xattr edit.");
+	}
+	op->valueLength=valueLength;
+	op->seq=txn->numOps;
+	op->type=type;
+	txn->numOps++;
+	return DOTU_OK;
+}
+
+int
+txnSetAttr(struct DotUTxn *txn, const char *name, const char *value, uint32_t valueLength){
+	if(value==NULL && valueLength>0) return DOTU_EINVAL;
+	return queueOp(txn,TXN_SET,name,value==NULL ? "" : value,valueLength);
+}
+
+int
+txnRmAttr(struct DotUTxn *txn, const char *name){
+	return queueOp(txn,TXN_RM,name,NULL,0);
+}
+
+void
+abortDotUTxn(struct DotUTxn *txn){
+	if(txn!=NULL) dotuArenaRelease(txn->arena);
+}
+
+/* Same order as the attr list, then queue order */
+static int
+compareOps(const void *a, const void *b){
+	const struct TxnOp *x=(const struct TxnOp*)a;
+	const struct TxnOp *y=(const struct TxnOp*)b;
+	int cmp=strcmp(x->name,y->name);
+	if(cmp!=0) return cmp;
+	return (x->seq<y->seq) ? -1 : (x->seq>y->seq);
+}
+
+static int
+compareAttrs(const void *a, const void *b){
+	return strcmp(((const struct ExtAttr*)a)->name,((const struct ExtAttr*)b)->name);
+}
+
+int
+commitDotUTxn(struct DotUTxn *txn){
+	struct DotU *dotU;
+	struct FinderEntry *finder;
+	struct ExtAttr *oldAttrs;
+	struct ExtAttr *attrs;
+	struct TxnOp *ops;
+	uint32_t *replaced;   /* Old attr, then the op that replaced or removed it */
+	uint32_t numOps,numSets,numAttrs,numReplaced;
+	uint32_t i,j,n;
+	int finderEntry,cmp,result;
+
+	if(txn==NULL) return DOTU_EINVAL;
+	dotU=txn->dotU;
+	finderEntry=dotuFinderEntry(dotU);
+	if(finderEntry<0){
+		abortDotUTxn(txn);
+		return dotuError(DOTU_ENOTFOUND,NULL,"Cannot find FinderInfo, so cannot edit xattrs.");
+	}
+	finder=&dotU->entry[finderEntry].data.finder;
+	if(txn->numOps==0){
+		abortDotUTxn(txn);
+		return DOTU_OK;
+	}
+
+	/* Sort the queue into attr order and keep only the last edit to
+	   each name. */
+	ops=txn->ops;
+	qsort(ops,txn->numOps,sizeof(struct TxnOp),compareOps);
+	for(i=0,numOps=0,numSets=0;i<txn->numOps;i++){
+		if(i+1<txn->numOps && strcmp(ops[i].name,ops[i+1].name)==0) continue;
+		ops[numOps]=ops[i];
+		if(ops[numOps].type==TXN_SET) numSets++;
+		numOps++;
+	}
+
+	numAttrs=finder->xattrHdr.numAttrs;
+	oldAttrs=finder->attr;
+	if(!finder->sorted && numAttrs>0){
+		/* The merge needs a sorted list; the batch relays out the file
+		   anyway, so it may as well go back in name order. */
+		oldAttrs=(struct ExtAttr*)dotuArenaAlloc(txn->arena,sizeof(struct ExtAttr)*numAttrs);
+		if(oldAttrs==NULL){
+			abortDotUTxn(txn);
+			return dotuError(DOTU_ENOMEM,NULL,"Error allocating xattr list.");
+		}
+		memcpy(oldAttrs,finder->attr,sizeof(struct ExtAttr)*numAttrs);
+		qsort(oldAttrs,numAttrs,sizeof(struct ExtAttr),compareAttrs);
+	}
+	if(dotuArenaOf(dotU,sizeof(struct ExtAttr)*(numAttrs+numSets))==NULL){
+		abortDotUTxn(txn);
+		return dotuError(DOTU_ENOMEM,NULL,"Error allocating xattr list.");
+	}
+	attrs=(struct ExtAttr*)dotuArenaAlloc(dotU->arena,sizeof(struct ExtAttr)*(numAttrs+numSets+1));
+	replaced=(uint32_t*)dotuArenaAlloc(txn->arena,2*sizeof(uint32_t)*numOps);
+	if(attrs==NULL || replaced==NULL){
+		abortDotUTxn(txn);
+		return dotuError(DOTU_ENOMEM,NULL,"Error allocating xattr list.");
+	}
+
+	/* One merge pass over two sorted lists */
+	i=0;
+	j=0;
+	n=0;
+	numReplaced=0;
+	while(i<numAttrs || j<numOps){
+		if(i==numAttrs) cmp=1;
+		else if(j==numOps) cmp=-1;
+		else cmp=strcmp(oldAttrs[i].name,ops[j].name);
+
+		if(cmp<0){
+			attrs[n++]=oldAttrs[i++];
+			continue;
+		}
+		if(ops[j].type==TXN_SET){
+			if(cmp==0){
+				/* Existing attr keeps its name and flags */
+				attrs[n]=oldAttrs[i];
+			} else {
+				attrs[n].name=dotuNameCopy(dotU->arena,ops[j].name,&attrs[n].nameId);
+				attrs[n].nameLength=strlen(ops[j].name)+1;
+				attrs[n].flags[0]=0;
+				attrs[n].flags[1]=0;
+			}
+			attrs[n].value=dotuArenaCopy(dotU->arena,ops[j].value,ops[j].valueLength);
+			attrs[n].valueLength=ops[j].valueLength;
+			attrs[n].valueOffset=0;
+			if(attrs[n].name==NULL || attrs[n].value==NULL){
+				abortDotUTxn(txn);
+				return dotuError(DOTU_ENOMEM,ops[j].name,"Error allocating xattr.");
+			}
+			n++;
+		}
+		/* A remove just doesn't carry the old attr over */
+		if(cmp==0){
+			replaced[2*numReplaced]=i++;
+			replaced[2*numReplaced+1]=j;
+			numReplaced++;
+		}
+		j++;
+	}
+	if(n>0xFFFF){
+		abortDotUTxn(txn);
+		return dotuError(DOTU_EINVAL,NULL,"Too many xattrs.");
+	}
+
+	/* Only now is anything the old list held let go of - a set keeps
+	   the old name, a remove drops it too */
+	for(i=0;i<numReplaced;i++){
+		j=replaced[2*i];
+		dotuDropBytes(dotU,oldAttrs[j].value,oldAttrs[j].valueLength+1);
+		if(ops[replaced[2*i+1]].type==TXN_RM) dotuDropBytes(dotU,oldAttrs[j].name,oldAttrs[j].nameLength);
+	}
+	dotuDropBytes(dotU,finder->attr,sizeof(struct ExtAttr)*numAttrs);
+	finder->attr=attrs;
+	finder->xattrHdr.numAttrs=(uint16_t)n;
+	finder->sorted=1;
+	dotU->layoutValid=0;
+	dotuDropIndex(dotU);
+	abortDotUTxn(txn);
+	dotuCompact(dotU);
+
+	/* One layout for the whole batch */
+	result=setOffsets(dotU);
+	return result;
+}
@@ -0,0 +1,436 @@
+#include "dotupriv.h"
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+/* The writer lays the file out as a list of (offset, bytes) segments
+   in file order.  The header, entry list, Finder header and attr
+   headers are encoded into one scratch block; values and the resource
+   fork are pointed at where they are.  Gaps point at zeros.  The same
+   list feeds a memcpy into a buffer or a writev to a file. */
+
+/* Gaps longer than this take more than one segment */
+#define ZEROSIZE 4096
+
+static const char zeros[ZEROSIZE];
+
+/* The file always ends in two 0xFF bytes */
+static const char fileEnd[2]={(char)0xFF,(char)0xFF};
+
+struct WritePlan {
+	struct PlanEntry * order;
+	struct iovec * iov;   /* NULL while only counting */
+	uint32_t numSegments;
+	uint32_t offset;      /* End of what has been laid out so far */
+	char * scratch;
+	uint32_t scratchLength;
+};
+
+/* Writes the low numBytes of value to buf, most significant first */
+static void
+putBigEndian(char *buf, uint32_t value, uint32_t numBytes){
+	while(numBytes>0){
+		buf[--numBytes]=(char)(value & 0xFF);
+		value>>=8;
+	}
+}
+
+static void
+addSegment(struct WritePlan *plan, const char *data, uint32_t length){
+	if(length==0) return;
+	if(plan->iov!=NULL){
+		plan->iov[plan->numSegments].iov_base=(void*)data;
+		plan->iov[plan->numSegments].iov_len=length;
+	}
+	plan->numSegments++;
+	plan->offset+=length;
+}
+
+/* Zero-fills up to offset; fails if the layout has already gone past it */
+static int
+seekPlan(struct WritePlan *plan, uint32_t offset){
+	uint32_t gap;
+	if(offset<plan->offset) return DOTU_EFORMAT;
+	while(plan->offset<offset){
+		gap=offset-plan->offset;
+		addSegment(plan,zeros,(gap<ZEROSIZE) ? gap : ZEROSIZE);
+	}
+	return DOTU_OK;
+}
+
+/* Bytes of scratch needed for everything that has to be encoded */
+static uint32_t
+scratchNeeded(const struct DotU *dotU){
+	uint32_t length=26+12*dotU->header.numEntries;
+	int finderEntry=dotuFinderEntry(dotU);
+	const struct FinderEntry *finder;
+	uint32_t j;
+
+	if(finderEntry>=0){
+		finder=&dotU->entry[finderEntry].data.finder;
+		length+=70;
+		for(j=0;j<finder->xattrHdr.numAttrs;j++) length+=attrHdrSize(finder->attr[j].nameLength);
+	}
+	return length;
+}
+
+static uint32_t
+encodeHeader(const struct DotU *dotU, char *buf){
+	uint32_t i;
+
+	/* 4 bytes  - magic num
+	   4 bytes  - version num
+	   16 bytes - home file system
+	   2 bytes  - number of dotU entries (usually 2)
+	   Then for each entry, 4 bytes each of id, offset and length */
+	putBigEndian(&buf[0],dotU->header.magic,4);
+	putBigEndian(&buf[4],dotU->header.versionNum,4);
+	memcpy(&buf[8],dotU->header.homeFileSystem,16);
+	putBigEndian(&buf[24],dotU->header.numEntries,2);
+	for(i=0;i<dotU->header.numEntries;i++){
+		putBigEndian(&buf[26+12*i],dotU->entry[i].id,4);
+		putBigEndian(&buf[30+12*i],dotU->entry[i].offset,4);
+		putBigEndian(&buf[34+12*i],dotU->entry[i].length,4);
+	}
+	return 26+12*dotU->header.numEntries;
+}
+
+/* Finder header, xattr header and the attr headers - names included,
+   as they sit between fixed fields - in file order */
+static uint32_t
+encodeFinder(const struct FinderEntry *finder, char *buf){
+	const struct ExtAttr *attr;
+	uint32_t length,j;
+
+	memcpy(&buf[0],finder->finderHeader,32);
+	memcpy(&buf[32],finder->padding,2);
+	putBigEndian(&buf[34],finder->xattrHdr.headerMagic,4);
+	putBigEndian(&buf[38],finder->xattrHdr.debugTag,4);
+	putBigEndian(&buf[42],finder->xattrHdr.size,4);
+	putBigEndian(&buf[46],finder->xattrHdr.attrDataOffset,4);
+	putBigEndian(&buf[50],finder->xattrHdr.attrDataLength,4);
+	memcpy(&buf[54],finder->xattrHdr.attrReserved,12);
+	memcpy(&buf[66],finder->xattrHdr.attrFlags,2);
+	putBigEndian(&buf[68],finder->xattrHdr.numAttrs,2);
+
+	length=70;
+	for(j=0;j<finder->xattrHdr.numAttrs;j++){
+		attr=&finder->attr[j];
+		putBigEndian(&buf[length],attr->valueOffset,4);
+		putBigEndian(&buf[length+4],attr->valueLength,4);
+		memcpy(&buf[length+8],attr->flags,2);
+		buf[length+10]=(char)attr->nameLength;
+		memcpy(&buf[length+11],attr->name,attr->nameLength);
+		memset(&buf[length+11+attr->nameLength],0,attrHdrSize(attr->nameLength)-11-attr->nameLength);
+		length+=attrHdrSize(attr->nameLength);
+	}
+	return length;
+}
+
+/* Entries in file order - by offset, then by place in the list */
+struct PlanEntry {
+	uint32_t offset;
+	int index;
+};
+
+/* Entry tables this long are ordered without an allocation */
+#define SMALLTABLE 8
+
+static int
+comparePlanEntries(const void *a, const void *b){
+	const struct PlanEntry *x=(const struct PlanEntry*)a;
+	const struct PlanEntry *y=(const struct PlanEntry*)b;
+	if(x->offset!=y->offset) return (x->offset>y->offset) ? 1 : -1;
+	return x->index-y->index;
+}
+
+/* Lays out the segments; with plan->iov NULL it only counts them.
+   Entries go in offset order, and each one's parts must come in file
+   order without overlapping - which setOffsets always gives. */
+static int
+planDotU(const struct DotU *dotU, struct WritePlan *plan){
+	const struct DotUEntry *entry;
+	const struct FinderEntry *finder;
+	uint32_t size=sizeDotU(dotU);
+	uint32_t scratchUsed,length,j;
+	int i,result;
+
+	plan->numSegments=0;
+	plan->offset=0;
+
+	scratchUsed=(plan->iov!=NULL) ? encodeHeader(dotU,plan->scratch) : 26+12*dotU->header.numEntries;
+	addSegment(plan,plan->scratch,scratchUsed);
+
+	for(i=0;i<dotU->header.numEntries;i++){
+		entry=&dotU->entry[plan->order[i].index];
+		result=seekPlan(plan,entry->offset);
+		if(result!=DOTU_OK) return result;
+		switch(entry->id){
+			/* Resource */
+			case 2:{
+				addSegment(plan,entry->data.resource.data,entry->length);
+			}break;
+
+			/* Finder Info, where xattrs live */
+			case 9:{
+				finder=&entry->data.finder;
+				if(plan->iov!=NULL){
+					length=encodeFinder(finder,&plan->scratch[scratchUsed]);
+				} else {
+					for(length=70,j=0;j<finder->xattrHdr.numAttrs;j++) length+=attrHdrSize(finder->attr[j].nameLength);
+				}
+				addSegment(plan,&plan->scratch[scratchUsed],length);
+				scratchUsed+=length;
+				for(j=0;j<finder->xattrHdr.numAttrs;j++){
+					result=seekPlan(plan,finder->attr[j].valueOffset);
+					if(result!=DOTU_OK) return result;
+					addSegment(plan,finder->attr[j].value,finder->attr[j].valueLength);
+				}
+			}break;
+
+			/* Anything else goes back as it came */
+			default:{
+				addSegment(plan,entry->data.raw.data,entry->length);
+			}break;
+		}
+	}
+	if(size<plan->offset || size<2) return DOTU_EFORMAT;
+	seekPlan(plan,size);
+
+	/* Last 2 bytes are 0xFF, whatever was laid out there */
+	length=2;
+	while(length>0){
+		j=(plan->iov!=NULL) ? plan->iov[plan->numSegments-1].iov_len : 0;
+		if(plan->iov==NULL || j>length){
+			if(plan->iov!=NULL) plan->iov[plan->numSegments-1].iov_len-=length;
+			break;
+		}
+		plan->numSegments--;
+		length-=j;
+	}
+	plan->offset=size-2;
+	addSegment(plan,fileEnd,2);
+	return DOTU_OK;
+}
+
+/* Lays the DotU out (if stale) and builds its segment list.  The
+   scratch block and the iovecs come from one allocation, which the
+   caller hands back with dotuFree(plan->scratch,plan->scratchLength).
+   A resource fork still in the file is read in first, unless the
+   caller won't be going as far as the fork. */
+static int
+buildPlan(struct DotU *dotU, struct WritePlan *plan, int wholeFile){
+	struct PlanEntry small[SMALLTABLE];
+	uint32_t scratchLength;
+	int i,result;
+
+	memset(plan,0,sizeof(struct WritePlan));
+	result=dotU->layoutValid ? DOTU_OK : setOffsets(dotU);
+	if(result!=DOTU_OK) return result;
+	result=wholeFile ? dotuLoadResource(dotU) : DOTU_OK;
+	if(result!=DOTU_OK) return result;
+
+	/* Only needed while planning */
+	plan->order=(dotU->header.numEntries<=SMALLTABLE) ? small
+	           : (struct PlanEntry*)dotuAlloc(sizeof(struct PlanEntry)*dotU->header.numEntries);
+	if(plan->order==NULL) return dotuError(DOTU_ENOMEM,NULL,"Error allocating write plan.");
+	for(i=0;i<dotU->header.numEntries;i++){
+		plan->order[i].offset=dotU->entry[i].offset;
+		plan->order[i].index=i;
+	}
+	qsort(plan->order,dotU->header.numEntries,sizeof(struct PlanEntry),comparePlanEntries);
+
+	/* Counting first gives an upper bound - trimming for the 0xFF
+	   bytes only ever drops segments. */
+	result=planDotU(dotU,plan);
+	if(result!=DOTU_OK){
+		result=dotuError(result,NULL,"Cannot lay out the ._ file for writing.");
+	} else {
+		scratchLength=scratchNeeded(dotU);
+		scratchLength=(scratchLength+DOTU_ARENA_ALIGN-1) & ~(uint32_t)(DOTU_ARENA_ALIGN-1);
+		plan->scratchLength=scratchLength+sizeof(struct iovec)*plan->numSegments;
+		plan->scratch=(char*)dotuAlloc(plan->scratchLength);
+		if(plan->scratch==NULL) result=dotuError(DOTU_ENOMEM,NULL,"Error allocating write plan.");
+	}
+	if(result==DOTU_OK){
+		plan->iov=(struct iovec*)&plan->scratch[scratchLength];
+		result=planDotU(dotU,plan);
+	}
+	if(plan->order!=small) dotuFree(plan->order,sizeof(struct PlanEntry)*dotU->header.numEntries);
+	plan->order=NULL;
+	return result;
+}
+
+/* Copies bytes [start, end) of the planned file into buf */
+static void
+copyPlan(const struct WritePlan *plan, char *buf, uint32_t start, uint32_t end){
+	uint32_t i,at,from,to;
+
+	for(i=0,at=0;i<plan->numSegments && at<end;i++){
+		from=(start>at) ? start-at : 0;
+		to=(end-at<plan->iov[i].iov_len) ? end-at : (uint32_t)plan->iov[i].iov_len;
+		if(from<to) memcpy(&buf[at+from-start],(const char*)plan->iov[i].iov_base+from,to-from);
+		at+=plan->iov[i].iov_len;
+	}
+}
+
+int
+layoutDotU(struct DotU *dotU, uint32_t *size){
+	int result=dotU->layoutValid ? DOTU_OK : setOffsets(dotU);
+	if(result!=DOTU_OK) return result;
+	if(size!=NULL) *size=sizeDotU(dotU);
+	return DOTU_OK;
+}
+
+int
+serializeDotU(struct DotU *dotU, char *buf, uint32_t bufLength){
+	struct WritePlan plan;
+	int result;
+
+	result=buildPlan(dotU,&plan,1);
+	if(result!=DOTU_OK){
+		if(plan.scratch!=NULL) dotuFree(plan.scratch,plan.scratchLength);
+		return result;
+	}
+	if(plan.offset>bufLength){
+		dotuFree(plan.scratch,plan.scratchLength);
+		return dotuError(DOTU_EINVAL,NULL,"Buffer too small for the ._ file.");
+	}
+	copyPlan(&plan,buf,0,plan.offset);
+	dotuFree(plan.scratch,plan.scratchLength);
+	return DOTU_OK;
+}
+
+int
+writeDotUFd(struct DotU *dotU, int fd){
+	struct WritePlan plan;
+	struct iovec *iov;
+	uint32_t numSegments,batch;
+	long maxBatch;
+	ssize_t written;
+	int result;
+
+	result=buildPlan(dotU,&plan,1);
+	if(result!=DOTU_OK){
+		if(plan.scratch!=NULL) dotuFree(plan.scratch,plan.scratchLength);
+		return result;
+	}
+
+	/* POSIX promises at least 16 iovecs a call */
+	maxBatch=sysconf(_SC_IOV_MAX);
+	if(maxBatch<16) maxBatch=16;
+	iov=plan.iov;
+	numSegments=plan.numSegments;
+	while(numSegments>0){
+		batch=(numSegments<(uint32_t)maxBatch) ? numSegments : (uint32_t)maxBatch;
+		written=writev(fd,iov,(int)batch);
+		if(written<0){
+			if(errno==EINTR) continue;
+			result=DOTU_EIO;
+			break;
+		}
+		/* Step over what went out, splitting a half-written segment */
+		while(numSegments>0 && (size_t)written>=iov->iov_len){
+			written-=iov->iov_len;
+			iov++;
+			numSegments--;
+		}
+		if(numSegments>0){
+			iov->iov_base=(char*)iov->iov_base+written;
+			iov->iov_len-=written;
+		}
+	}
+	dotuFree(plan.scratch,plan.scratchLength);
+	return result;
+}
+
+int
+writeDotUFile(struct DotU *dotU, const char * outputFileName){
+	int fd;
+	int result;
+
+	DOTU_TRACE(("Output file: %s\n",outputFileName));
+	/* Before the truncate, in case the fork is to come from this file */
+	result=dotuLoadResource(dotU);
+	if(result!=DOTU_OK) return result;
+	fd=open(outputFileName,O_WRONLY|O_CREAT|O_TRUNC,0666);
+	if(fd<0) return dotuError(DOTU_EIO,outputFileName,"Error creating dot underscore file.");
+	result=writeDotUFd(dotU,fd);
+	if(close(fd)!=0 && result==DOTU_OK) result=DOTU_EIO;
+	if(result!=DOTU_OK) return dotuError(result,outputFileName,"Error writing dot underscore file.");
+	return DOTU_OK;
+}
+
+/* Differences closer together than this go out in one pwrite */
+#define PATCHGAP 64
+
+int
+patchDotUFile(struct DotU *dotU, const char * fileName){
+	struct WritePlan plan;
+	struct stat statBuffer;
+	char *newBytes,*oldBytes;
+	uint32_t size,end,start,last,i;
+	int finderEntry,fd,result;
+
+	/* The file is about to change under anything still pointing into it */
+	result=dotuDetach(dotU);
+	if(result!=DOTU_OK) return result;
+	result=buildPlan(dotU,&plan,0);
+	if(result!=DOTU_OK){
+		if(plan.scratch!=NULL) dotuFree(plan.scratch,plan.scratchLength);
+		return result;
+	}
+	size=plan.offset;
+	finderEntry=dotuFinderEntry(dotU);
+
+	fd=open(fileName,O_RDWR);
+	if(fd<0 || fstat(fd,&statBuffer)!=0 || (uint64_t)statBuffer.st_size!=size || finderEntry<0){
+		/* Different size, so a different layout - write it all */
+		if(fd>=0) close(fd);
+		dotuFree(plan.scratch,plan.scratchLength);
+		DOTU_TRACE(("%s: layout changed, rewriting\n",fileName));
+		return writeDotUFile(dotU,fileName);
+	}
+
+	/* Everything up to the end of the Finder entry: headers, entry
+	   list, attr headers and values.  The resource fork isn't looked
+	   at - attr edits never touch it. */
+	end=dotU->entry[finderEntry].offset+dotU->entry[finderEntry].length;
+	if(end>size) end=size;
+	newBytes=(char*)dotuAlloc(2*(size_t)end);
+	if(newBytes==NULL){
+		close(fd);
+		dotuFree(plan.scratch,plan.scratchLength);
+		return dotuError(DOTU_ENOMEM,fileName,"Error allocating patch buffer.");
+	}
+	oldBytes=&newBytes[end];
+	copyPlan(&plan,newBytes,0,end);
+	dotuFree(plan.scratch,plan.scratchLength);
+	if(pread(fd,oldBytes,end,0)!=(ssize_t)end){
+		result=DOTU_EIO;
+	} else if(memcmp(oldBytes,newBytes,26+12*dotU->header.numEntries)!=0){
+		/* Same size but the entries moved */
+		result=DOTU_EFORMAT;
+	}
+
+	for(i=0;result==DOTU_OK && i<end;){
+		if(oldBytes[i]==newBytes[i]){
+			i++;
+			continue;
+		}
+		/* Run from the first difference to the last one with no
+		   stretch of PATCHGAP equal bytes in between */
+		start=i;
+		for(last=i;i<end && i-last<=PATCHGAP;i++){
+			if(oldBytes[i]!=newBytes[i]) last=i;
+		}
+		DOTU_TRACE(("%s: patching %u bytes at %u\n",fileName,last+1-start,start));
+		if(pwrite(fd,&newBytes[start],last+1-start,start)!=(ssize_t)(last+1-start)) result=DOTU_EIO;
+	}
+	dotuFree(newBytes,2*(size_t)end);
+	if(close(fd)!=0 && result==DOTU_OK) result=DOTU_EIO;
+	if(result==DOTU_EFORMAT) return writeDotUFile(dotU,fileName);
+	if(result!=DOTU_OK) return dotuError(result,fileName,"Error patching dot underscore file.");
+	return DOTU_OK;
+}
@@ -0,0 +1,404 @@
+#include "dotuxattr.h"
+#include "dotuscan.h"
+#include "dotupriv.h"
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/xattr.h>
+
+/* Native xattrs are read and written with the l* calls, so a symlink
+   in the tree is never followed out of it. */
+
+#define PREFIXLENGTH 5 /* strlen(DOTU_XATTR_PREFIX) */
+
+static void
+addStat(long *counter, long amount){
+	if(amount!=0) __sync_fetch_and_add(counter,amount);
+}
+
+static void
+countFile(struct DotUXattrStats *stats, int result, long set, long removed){
+	if(stats==NULL) return;
+	addStat(&stats->files,1);
+	addStat(&stats->set,set);
+	addStat(&stats->removed,removed);
+	if(result!=DOTU_OK) addStat(&stats->failed,1);
+	else if(set==0 && removed==0) addStat(&stats->unchanged,1);
+}
+
+/* The user.* xattr names of fileName, sorted, in arena */
+static int
+listNative(struct DotUArena *arena, const char *fileName, char ***names, uint32_t *numNames){
+	char *list;
+	ssize_t length,got;
+	uint32_t n;
+	char *name;
+
+	*names=NULL;
+	*numNames=0;
+	do {
+		length=llistxattr(fileName,NULL,0);
+		if(length<0) return dotuError(DOTU_EIO,fileName,"Error listing xattrs.");
+		list=(char*)dotuArenaAlloc(arena,length+1);
+		if(list==NULL) return dotuError(DOTU_ENOMEM,fileName,"Error allocating xattr list.");
+		got=(length>0) ? llistxattr(fileName,list,length) : 0;
+	} while(got<0 && errno==ERANGE); /* Grew in between - try again */
+	if(got<0) return dotuError(DOTU_EIO,fileName,"Error listing xattrs.");
+
+	for(n=0,name=list;name<list+got;name+=strlen(name)+1) n++;
+	*names=(char**)dotuArenaAlloc(arena,sizeof(char*)*(n+1));
+	if(*names==NULL) return dotuError(DOTU_ENOMEM,fileName,"Error allocating xattr list.");
+	for(name=list;name<list+got;name+=strlen(name)+1){
+		if(strncmp(name,DOTU_XATTR_PREFIX,PREFIXLENGTH)==0) (*names)[(*numNames)++]=name;
+	}
+	return DOTU_OK;
+}
+
+static int
+compareNames(const void *a, const void *b){
+	return strcmp(*(char * const *)a,*(char * const *)b);
+}
+
+static int
+hasNative(char **names, uint32_t numNames, const char *name){
+	return bsearch(&name,names,numNames,sizeof(char*),compareNames)!=NULL;
+}
+
+/* Reads a native value into the arena.  NULL with *length 0 if it
+   went away in the meantime. */
+static char *
+getNative(struct DotUArena *arena, const char *fileName, const char *name, uint32_t *length){
+	char *value;
+	ssize_t size,got;
+
+	*length=0;
+	do {
+		size=lgetxattr(fileName,name,NULL,0);
+		if(size<0) return NULL;
+		value=(char*)dotuArenaAlloc(arena,size+1);
+		if(value==NULL) return NULL;
+		got=(size>0) ? lgetxattr(fileName,name,value,size) : 0;
+	} while(got<0 && errno==ERANGE);
+	if(got<0) return NULL;
+	*length=(uint32_t)got;
+	return value;
+}
+
+/* Whether name already holds exactly length bytes of value.  Asking
+   for exactly length bytes makes a longer native value fail with
+   ERANGE, so one call settles it. */
+static int
+sameNative(struct DotUArena *arena, const char *fileName, const char *name, const char *value, uint32_t length){
+	char *buf=(char*)dotuArenaAlloc(arena,length+1);
+	ssize_t got;
+
+	if(buf==NULL) return 0;
+	got=lgetxattr(fileName,name,(length>0) ? buf : NULL,length);
+	return got==(ssize_t)length && memcmp(buf,value,length)==0;
+}
+
+static int
+finderInfoBlank(const struct FinderEntry *finder){
+	int i;
+	for(i=0;i<32;i++){
+		if(finder->finderHeader[i]!='\0') return 0;
+	}
+	return 1;
+}
+
+/* Makes fileName's user.* xattrs match the DotU */
+static int
+importDotU(struct DotU *dotU, const char *fileName, struct DotUXattrStats *stats){
+	struct DotUArena *arena;
+	const struct ExtAttr *attr;
+	struct FinderEntry *finder;
+	char nativeName[PREFIXLENGTH+256];
+	char **names;
+	const char *resource;
+	uint32_t numNames,i,resourceLength;
+	long set=0,removed=0;
+	int finderEntry,result;
+
+	finderEntry=dotuFinderEntry(dotU);
+	finder=(finderEntry>=0) ? &dotU->entry[finderEntry].data.finder : NULL;
+	arena=dotuArenaCreate(4096);
+	if(arena==NULL) return dotuError(DOTU_ENOMEM,fileName,"Error allocating sync buffers.");
+	result=listNative(arena,fileName,&names,&numNames);
+	if(result!=DOTU_OK){
+		dotuArenaRelease(arena);
+		countFile(stats,result,0,0);
+		return result;
+	}
+	qsort(names,numNames,sizeof(char*),compareNames);
+
+	/* Remove what the ._ file doesn't have */
+	for(i=0;i<numNames;i++){
+		if(strcmp(names[i],DOTU_XATTR_FINDERINFO)==0){
+			if(finder!=NULL && !finderInfoBlank(finder)) continue;
+		} else if(strcmp(names[i],DOTU_XATTR_RESOURCEFORK)==0){
+			if(getDotUResourceLength(dotU)>0) continue;
+		} else if(finder!=NULL && findAttr(dotU,names[i]+PREFIXLENGTH)>=0){
+			continue;
+		}
+		if(lremovexattr(fileName,names[i])!=0 && errno!=ENODATA){
+			result=dotuError(DOTU_EIO,names[i],"Error removing xattr.");
+		} else {
+			removed++;
+		}
+	}
+
+	/* Set what's missing or different */
+	for(i=0;finder!=NULL && i<finder->xattrHdr.numAttrs;i++){
+		attr=&finder->attr[i];
+		snprintf(nativeName,sizeof(nativeName),"%s%s",DOTU_XATTR_PREFIX,attr->name);
+		if(hasNative(names,numNames,nativeName) && sameNative(arena,fileName,nativeName,attr->value,attr->valueLength)) continue;
+		if(lsetxattr(fileName,nativeName,attr->value,attr->valueLength,0)!=0){
+			result=dotuError(DOTU_EIO,nativeName,"Error setting xattr.");
+		} else {
+			set++;
+		}
+	}
+	if(finder!=NULL && !finderInfoBlank(finder)
+	   && !(hasNative(names,numNames,DOTU_XATTR_FINDERINFO) && sameNative(arena,fileName,DOTU_XATTR_FINDERINFO,finder->finderHeader,32))){
+		if(lsetxattr(fileName,DOTU_XATTR_FINDERINFO,finder->finderHeader,32,0)!=0){
+			result=dotuError(DOTU_EIO,DOTU_XATTR_FINDERINFO,"Error setting xattr.");
+		} else {
+			set++;
+		}
+	}
+	resourceLength=getDotUResourceLength(dotU);
+	if(resourceLength>0){
+		resource=getDotUResource(dotU);
+		if(resource==NULL){
+			result=DOTU_EIO;
+		} else if(!(hasNative(names,numNames,DOTU_XATTR_RESOURCEFORK) && sameNative(arena,fileName,DOTU_XATTR_RESOURCEFORK,resource,resourceLength))){
+			if(lsetxattr(fileName,DOTU_XATTR_RESOURCEFORK,resource,resourceLength,0)!=0){
+				result=dotuError(DOTU_EIO,DOTU_XATTR_RESOURCEFORK,"Error setting xattr.");
+			} else {
+				set++;
+			}
+		}
+	}
+	dotuArenaRelease(arena);
+	countFile(stats,result,set,removed);
+	return result;
+}
+
+/* ._<name> beside fileName */
+static int
+dotUNameOf(const char *fileName, char *buf, size_t bufSize){
+	const char *slash=strrchr(fileName,'/');
+	int length;
+
+	if(slash==NULL) length=snprintf(buf,bufSize,"._%s",fileName);
+	else length=snprintf(buf,bufSize,"%.*s/._%s",(int)(slash-fileName),fileName,slash+1);
+	return (length<0 || (size_t)length>=bufSize) ? DOTU_EINVAL : DOTU_OK;
+}
+
+/* Makes the ._ file match fileName's user.* xattrs */
+static int
+exportDotU(const char *fileName, struct DotUSyncGroup *group, struct DotUXattrStats *stats){
+	char dotUName[MAXDIRNAMESIZE+MAXFILENAMESIZE+2];
+	struct DotUArena *arena;
+	struct DotUTxn *txn;
+	struct FinderEntry *finder;
+	struct DotU dotU;
+	struct stat statBuffer;
+	char nativeName[PREFIXLENGTH+256];
+	char **names;
+	const char *current;
+	char *value;
+	uint32_t numNames,i,length,currentLength;
+	long set=0,removed=0;
+	int exists,finderEntry,result;
+
+	if(dotUNameOf(fileName,dotUName,sizeof(dotUName))!=DOTU_OK){
+		countFile(stats,DOTU_EINVAL,0,0);
+		return dotuError(DOTU_EINVAL,fileName,"File name too long.");
+	}
+	arena=dotuArenaCreate(4096);
+	if(arena==NULL) return dotuError(DOTU_ENOMEM,fileName,"Error allocating sync buffers.");
+	result=listNative(arena,fileName,&names,&numNames);
+	exists=(lstat(dotUName,&statBuffer)==0);
+	if(result==DOTU_OK && !exists && numNames==0){
+		/* Nothing on either side */
+		dotuArenaRelease(arena);
+		countFile(stats,DOTU_OK,0,0);
+		return DOTU_OK;
+	}
+	memset(&dotU,0,sizeof(dotU));
+	if(result==DOTU_OK){
+		if(exists) result=loadDotUFile(dotUName,&dotU);
+		else result=dotuInitBlank(&dotU);
+	}
+	finderEntry=(result==DOTU_OK) ? dotuFinderEntry(&dotU) : -1;
+	if(result==DOTU_OK && finderEntry<0) result=dotuError(DOTU_ENOTFOUND,dotUName,"Cannot find FinderInfo, so cannot sync xattrs.");
+	if(result!=DOTU_OK){
+		freeDotU(&dotU);
+		dotuArenaRelease(arena);
+		countFile(stats,result,0,0);
+		return result;
+	}
+	finder=&dotU.entry[finderEntry].data.finder;
+	qsort(names,numNames,sizeof(char*),compareNames);
+
+	/* FinderInfo and the resource fork */
+	value=hasNative(names,numNames,DOTU_XATTR_FINDERINFO) ? getNative(arena,fileName,DOTU_XATTR_FINDERINFO,&length) : NULL;
+	if(value!=NULL && length==32){
+		if(memcmp(finder->finderHeader,value,32)!=0){
+			memcpy(finder->finderHeader,value,32);
+			set++;
+		}
+	} else if(!finderInfoBlank(finder)){
+		memset(finder->finderHeader,0,32);
+		removed++;
+	}
+	value=hasNative(names,numNames,DOTU_XATTR_RESOURCEFORK) ? getNative(arena,fileName,DOTU_XATTR_RESOURCEFORK,&length) : NULL;
+	if(value==NULL) length=0;
+	currentLength=getDotUResourceLength(&dotU);
+	current=(currentLength>0) ? getDotUResource(&dotU) : NULL;
+	if(currentLength!=length || (length>0 && (current==NULL || memcmp(current,value,length)!=0))){
+		result=setDotUResource(&dotU,value,length);
+		if(length>0) set++;
+		else removed++;
+		/* Adding or dropping the fork may have moved the entry table */
+		finder=&dotU.entry[dotuFinderEntry(&dotU)].data.finder;
+	}
+
+	/* Then the attrs, as one batch */
+	txn=beginDotUTxn(&dotU);
+	if(txn==NULL) result=DOTU_ENOMEM;
+	for(i=0;txn!=NULL && i<numNames;i++){
+		if(strcmp(names[i],DOTU_XATTR_FINDERINFO)==0 || strcmp(names[i],DOTU_XATTR_RESOURCEFORK)==0) continue;
+		value=getNative(arena,fileName,names[i],&length);
+		if(value==NULL) continue;
+		current=getDotUAttr(&dotU,names[i]+PREFIXLENGTH,&currentLength);
+		if(current!=NULL && currentLength==length && memcmp(current,value,length)==0) continue;
+		if(txnSetAttr(txn,names[i]+PREFIXLENGTH,value,length)==DOTU_OK) set++;
+		else result=DOTU_EINVAL;
+	}
+	for(i=0;txn!=NULL && i<finder->xattrHdr.numAttrs;i++){
+		snprintf(nativeName,sizeof(nativeName),"%s%s",DOTU_XATTR_PREFIX,finder->attr[i].name);
+		if(hasNative(names,numNames,nativeName)) continue;
+		txnRmAttr(txn,finder->attr[i].name);
+		removed++;
+	}
+	if(txn!=NULL && commitDotUTxn(txn)!=DOTU_OK) result=DOTU_EIO;
+
+	if(result==DOTU_OK && (set>0 || removed>0 || !exists)){
+		result=writeDotUFileAtomic(&dotU,dotUName,group);
+	}
+	freeDotU(&dotU);
+	dotuArenaRelease(arena);
+	countFile(stats,result,set,removed);
+	return result;
+}
+
+int
+syncDotUXattrs(const char *fileName, int direction, struct DotUXattrStats *stats){
+	char dotUName[MAXDIRNAMESIZE+MAXFILENAMESIZE+2];
+	struct DotU dotU;
+	int result;
+
+	if(fileName==NULL) return DOTU_EINVAL;
+	if(direction==DOTU_FROM_XATTR) return exportDotU(fileName,NULL,stats);
+	if(direction!=DOTU_TO_XATTR) return DOTU_EINVAL;
+
+	result=dotUNameOf(fileName,dotUName,sizeof(dotUName));
+	if(result==DOTU_OK) result=mapDotUFile(dotUName,&dotU);
+	if(result!=DOTU_OK){
+		countFile(stats,result,0,0);
+		return result;
+	}
+	result=importDotU(&dotU,fileName,stats);
+	freeDotU(&dotU);
+	return result;
+}
+
+/* Shared by the workers of syncDotUXattrFiles */
+struct XattrPool {
+	const char * const * fileNames;
+	long numFiles;
+	long next;       /* Next file to hand out */
+	long failed;
+	int direction;
+	struct DotUXattrStats * stats;
+};
+
+static void *
+xattrWorker(void *arg){
+	struct XattrPool *pool=(struct XattrPool*)arg;
+	struct DotUSyncGroup *group=NULL;
+	long i;
+	int result;
+
+	if(pool->direction==DOTU_FROM_XATTR) group=beginDotUSyncGroup();
+	while((i=__sync_fetch_and_add(&pool->next,1))<pool->numFiles){
+		if(pool->direction==DOTU_FROM_XATTR && group!=NULL){
+			result=exportDotU(pool->fileNames[i],group,pool->stats);
+		} else {
+			result=syncDotUXattrs(pool->fileNames[i],pool->direction,pool->stats);
+		}
+		if(result!=DOTU_OK) __sync_fetch_and_add(&pool->failed,1);
+	}
+	/* One barrier for everything this worker wrote */
+	if(group!=NULL && commitDotUSyncGroup(group)!=DOTU_OK) __sync_fetch_and_add(&pool->failed,1);
+	return NULL;
+}
+
+long
+syncDotUXattrFiles(const char * const *fileNames, long numFiles, int direction, int workers, struct DotUXattrStats *stats){
+	struct XattrPool pool;
+	pthread_t *threads;
+	int started,i;
+
+	if(fileNames==NULL || numFiles<0 || (direction!=DOTU_TO_XATTR && direction!=DOTU_FROM_XATTR)) return -1;
+	if(workers<=0){
+		workers=(int)sysconf(_SC_NPROCESSORS_ONLN);
+		if(workers<=0) workers=1;
+	}
+	if(workers>numFiles) workers=(numFiles>0) ? (int)numFiles : 1;
+
+	memset(&pool,0,sizeof(struct XattrPool));
+	pool.fileNames=fileNames;
+	pool.numFiles=numFiles;
+	pool.direction=direction;
+	pool.stats=stats;
+	threads=(pthread_t*)malloc(sizeof(pthread_t)*workers);
+	if(threads==NULL) return -1;
+	for(started=0;started<workers;started++){
+		if(pthread_create(&threads[started],NULL,xattrWorker,&pool)!=0) break;
+	}
+	/* If no thread started at all, do it all on this one */
+	if(started==0) xattrWorker(&pool);
+	for(i=0;i<started;i++) pthread_join(threads[i],NULL);
+	free(threads);
+	return pool.failed;
+}
+
+/* scanDotUTree callback: path is the ._ file, so the file it belongs
+   to is the same path without the ._ */
+static void
+importScanned(const char *path, struct DotU *dotU, int status, void *ctx){
+	struct DotUXattrStats *stats=(struct DotUXattrStats*)ctx;
+	char fileName[MAXDIRNAMESIZE+MAXFILENAMESIZE+2];
+	const char *slash=strrchr(path,'/');
+	const char *base=(slash==NULL) ? path : slash+1;
+	int length;
+
+	if(status!=DOTU_OK || base[2]=='\0'){
+		countFile(stats,(status!=DOTU_OK) ? status : DOTU_EINVAL,0,0);
+		return;
+	}
+	length=snprintf(fileName,sizeof(fileName),"%.*s%s",(int)(base-path),path,base+2);
+	if(length<0 || (size_t)length>=sizeof(fileName)){
+		countFile(stats,DOTU_EINVAL,0,0);
+		return;
+	}
+	importDotU(dotU,fileName,stats);
+}
+
+long
+importDotUXattrTree(const char *root, int workers, struct DotUXattrStats *stats){
+	return scanDotUTree(root,workers,importScanned,stats);
+}
@@ -0,0 +1,52 @@
+/*
+ Sync between ._ files and the native extended attributes of the file
+ they belong to, on Linux filesystems with user xattrs.
+
+ Each Finder xattr <name> in the ._ file is the native xattr
+ user.<name>.  The 32-byte FinderInfo is user.com.apple.FinderInfo
+ (left out while it's all zeros) and the resource fork is
+ user.com.apple.ResourceFork, the names macOS gives them.  Syncing
+ makes the target side match the source side exactly, so user xattrs
+ with no counterpart on the source side are removed.
+*/
+
+#ifndef DOTUXATTR_H
+#define DOTUXATTR_H
+
+#include "dotu.h"
+
+#define DOTU_XATTR_PREFIX       "user."
+#define DOTU_XATTR_FINDERINFO   "user.com.apple.FinderInfo"
+#define DOTU_XATTR_RESOURCEFORK "user.com.apple.ResourceFork"
+
+/* Directions */
+#define DOTU_TO_XATTR   0 /* ._ file -> native xattrs */
+#define DOTU_FROM_XATTR 1 /* native xattrs -> ._ file */
+
+/* Running totals; the bulk calls add to them from several threads */
+struct DotUXattrStats {
+	long files;      /* Files looked at */
+	long unchanged;  /* Already in sync - nothing written */
+	long failed;
+	long set;        /* xattrs written (setxattr calls, or attrs set in ._ files) */
+	long removed;    /* xattrs removed */
+};
+
+/* Syncs one file - fileName is the file itself, not its ._ file,
+   which sits beside it as ._<name>.  Only what differs is written; a
+   ._ file is replaced atomically, with its own fsync.  stats may be
+   NULL.  Returns 0 if good, a DOTU_E* code if fail. */
+int syncDotUXattrs(const char *fileName, int direction, struct DotUXattrStats *stats);
+
+/* syncDotUXattrs over a list of files with a pool of worker threads
+   (0 for one per online CPU).  ._ files written by a worker are made
+   durable together when it finishes.  Returns the number of files
+   that failed, -1 if the workers couldn't be started. */
+long syncDotUXattrFiles(const char * const *fileNames, long numFiles, int direction, int workers, struct DotUXattrStats *stats);
+
+/* Finds every ._ file under root with scanDotUTree and copies it into
+   the native xattrs of the file it belongs to.  Returns the number of
+   ._ files found, -1 if fail. */
+long importDotUXattrTree(const char *root, int workers, struct DotUXattrStats *stats);
+
+#endif
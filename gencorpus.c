@@ -0,0 +1,162 @@
+/*
+ Writes a synthetic corpus of ._ files for the benchmark.
+
+ Usage: dotUGen [-n files] [-a attrs] [-s nameSize] [-v valueSize]
+                [-r resourceSize] [-d uniform|log] [-S seed] dir
+
+ Counts and sizes are min:max ranges (or a single number).  Sizes are
+ drawn uniformly, or with -d log log-uniformly - as many small values
+ as big ones per power of two, closer to what real files carry.  The
+ same seed always gives the same corpus.
+*/
+
+#include "dotu.h"
+#include <errno.h>
+#include <unistd.h>
+
+struct Range {
+	unsigned long min;
+	unsigned long max;
+};
+
+static uint32_t seed=12345;
+static int logSizes=0;
+
+/* xorshift32 - the same sequence on every platform */
+static uint32_t
+nextRandom(void){
+	seed^=seed<<13;
+	seed^=seed>>17;
+	seed^=seed<<5;
+	return seed;
+}
+
+static unsigned long
+uniform(unsigned long min, unsigned long max){
+	if(max<=min) return min;
+	return min+(unsigned long)(nextRandom()%(uint32_t)(max-min+1));
+}
+
+static int
+bitLength(unsigned long n){
+	int bits=0;
+
+	while(n!=0){
+		bits++;
+		n>>=1;
+	}
+	return bits;
+}
+
+/* A size in range; log-uniform picks the power of two first */
+static unsigned long
+drawSize(const struct Range *range){
+	unsigned long low,high;
+	int bits;
+
+	if(!logSizes || range->max<=range->min) return uniform(range->min,range->max);
+	bits=(int)uniform((unsigned long)bitLength(range->min+1)-1,(unsigned long)bitLength(range->max+1)-1);
+	low=1UL<<bits;
+	high=(low<<1)-1;
+	if(low<range->min+1) low=range->min+1;
+	if(high>range->max+1) high=range->max+1;
+	return uniform(low,high)-1;
+}
+
+static int
+parseRange(const char *arg, struct Range *range){
+	if(sscanf(arg,"%lu:%lu",&range->min,&range->max)==2) return range->max>=range->min;
+	if(sscanf(arg,"%lu",&range->min)==1){
+		range->max=range->min;
+		return 1;
+	}
+	return 0;
+}
+
+static void
+usage(void){
+	fprintf(stderr,"usage: dotUGen [-n files] [-a attrs] [-s nameSize] [-v valueSize] [-r resourceSize] [-d uniform|log] [-S seed] dir\n");
+	exit(2);
+}
+
+int
+main(int argc, char **argv){
+	struct Range files={1000,1000};
+	struct Range attrs={1,32};
+	struct Range nameSize={8,40};
+	struct Range valueSize={0,1024};
+	struct Range resourceSize={0,0};
+	static const char letters[]="abcdefghijklmnopqrstuvwxyz0123456789";
+	struct DotUAttrSpec *specs;
+	char *names;
+	char *name;
+	char fileName[MAXDIRNAMESIZE+MAXFILENAMESIZE+2];
+	char *buf;
+	unsigned long numFiles,numAttrs,length,maxLength,i,j,k;
+	unsigned long written=0;
+	struct DotU dotU;
+	int option,prefix;
+
+	while((option=getopt(argc,argv,"n:a:s:v:r:d:S:"))!=-1){
+		switch(option){
+		case 'n': if(!parseRange(optarg,&files)) usage(); break;
+		case 'a': if(!parseRange(optarg,&attrs)) usage(); break;
+		case 's': if(!parseRange(optarg,&nameSize)) usage(); break;
+		case 'v': if(!parseRange(optarg,&valueSize)) usage(); break;
+		case 'r': if(!parseRange(optarg,&resourceSize)) usage(); break;
+		case 'd': logSizes=(strcmp(optarg,"log")==0); break;
+		case 'S': seed=(uint32_t)strtoul(optarg,NULL,10); if(seed==0) seed=1; break;
+		default: usage();
+		}
+	}
+	if(optind!=argc-1) usage();
+	/* Names are stored with a \0 and a one-byte length */
+	if(nameSize.min<1) nameSize.min=1;
+	if(nameSize.max>254) nameSize.max=254;
+	if(mkdir(argv[optind],0755)!=0 && errno!=EEXIST){
+		perror(argv[optind]);
+		return 1;
+	}
+
+	maxLength=(valueSize.max>resourceSize.max) ? valueSize.max : resourceSize.max;
+	buf=(char*)malloc(maxLength+1);
+	if(buf==NULL) return 1;
+	for(i=0;i<=maxLength;i++) buf[i]=(char)nextRandom();
+
+	/* Room for the most attrs a file can get, each name in its own 256 bytes */
+	specs=(struct DotUAttrSpec*)malloc(sizeof(struct DotUAttrSpec)*(attrs.max+1));
+	names=(char*)malloc(256*(attrs.max+1));
+	if(specs==NULL || names==NULL) return 1;
+
+	numFiles=uniform(files.min,files.max);
+	for(i=0;i<numFiles;i++){
+		numAttrs=uniform(attrs.min,attrs.max);
+		for(j=0;j<numAttrs;j++){
+			/* A unique lead-in, then letters up to the drawn size */
+			name=&names[256*j];
+			prefix=sprintf(name,"b%lu.",j);
+			length=drawSize(&nameSize);
+			if(length<(unsigned long)prefix) length=(unsigned long)prefix;
+			for(k=(unsigned long)prefix;k<length;k++) name[k]=letters[nextRandom()%(sizeof(letters)-1)];
+			name[length]='\0';
+			length=drawSize(&valueSize);
+			/* Values come from anywhere in the random block */
+			k=uniform(0,maxLength-length);
+			specs[j].name=name;
+			specs[j].value=buf+k;
+			specs[j].valueLength=(uint32_t)length;
+		}
+		if(buildDotU(specs,(uint32_t)numAttrs,NULL,&dotU)!=DOTU_OK) return 1;
+		length=drawSize(&resourceSize);
+		if(setDotUResource(&dotU,buf,(uint32_t)length)!=DOTU_OK) return 1;
+		snprintf(fileName,sizeof(fileName),"%s/._bench-%06lu",argv[optind],i);
+		if(writeDotUFile(&dotU,fileName)!=DOTU_OK) return 1;
+		written+=sizeDotU(&dotU);
+		freeDotU(&dotU);
+	}
+	printf("Wrote %lu ._ files, %lu bytes, to %s\n",numFiles,written,argv[optind]);
+	free(specs);
+	free(names);
+	free(buf);
+	return 0;
+}
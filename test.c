@@ -7,18 +7,156 @@
 */
 
 #include "dotu.h"
+#include "dotuscan.h"
+#include "dotuxattr.h"
+#include "dotucatalog.h"
+#include "dotuquery.h"
+#include "dotubatch.h"
+#include "dotupipe.h"
+#include "dotudiff.h"
+#include "dotuintern.h"
+#include "dotuname.h"
+#include "dotutable.h"
+#include "dotusnap.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <libgen.h>
+#include <unistd.h>
 
+/* Last diagnostic the log handler test saw */
+static int loggedLevel=DOTU_LOG_NONE;
+static int loggedCode=DOTU_OK;
+static long loggedCount=0;
+
+static void
+recordLog(int level, int code, const char *subject, const char *message, void *ctx){
+	loggedLevel=level;
+	loggedCode=code;
+	loggedCount++;
+}
+
+/* Allocator that counts what the arenas ask for */
+static long liveAllocs=0;
+static long totalAllocs=0;
+static size_t liveBytes=0;
+
+static void *
+countingAlloc(size_t size, void *ctx){
+	totalAllocs++;
+	liveAllocs++;
+	liveBytes+=size;
+	return malloc(size);
+}
+
+static void
+countingRelease(void *ptr, size_t size, void *ctx){
+	liveAllocs--;
+	liveBytes-=size;
+	free(ptr);
+}
+
+/* What the batch reader test's callback saw, by list index */
+static int batchStatus[5];
+static uint32_t batchAttrs[5];
+static uint32_t batchResource[5];
+
+static void
+recordBatch(const char *path, long index, struct DotU *dotU, int status, void *ctx){
+	uint32_t cursor;
+
+	batchStatus[index]=status;
+	for(batchAttrs[index]=0,cursor=0;nextDotUAttr(dotU,&cursor)!=NULL;batchAttrs[index]++);
+	batchResource[index]=getDotUResourceLength(dotU);
+	freeDotU(dotU);
+}
+
+/* The pipeline test's transform: tags every file but the one named
+   to be skipped */
+static int
+tagPiped(const char *path, struct DotU *dotU, void *ctx){
+	if(strstr(path,".skip")!=NULL) return DOTU_PIPE_SKIP;
+	return setDotUAttr(dotU,"com.example.piped","converted",9);
+}
+
+/* What the diff test's callback saw, by what and how; with a ctx it
+   asks to stop after the first */
+static long diffCounts[4][4];
+static char diffChanged[MAXFILENAMESIZE];
+
+static int
+countDiff(const struct DotUDiff *diff, void *ctx){
+	diffCounts[diff->what][diff->how]++;
+	if(diff->what==DOTU_DIFF_ATTR && diff->how==DOTU_DIFF_CHANGED) snprintf(diffChanged,sizeof(diffChanged),"%s",diff->name);
+	return ctx!=NULL;
+}
+
+/* Tallies for the tree scanner test */
+static long scanParsed=0;
+static long scanFailed=0;
+
+static void
+countScanned(const char *path, struct DotU *dotU, int status, void *ctx){
+	if(status==0 && dotU->header.magic==DOTUMAGIC) __sync_fetch_and_add(&scanParsed,1);
+	else __sync_fetch_and_add(&scanFailed,1);
+}
 
 
 
 
 int main(int argc, char *argv[]){
 	struct DotU myDotU;
+	struct DotU mappedDotU;
+	struct DotU txnDotU;
+	struct DotUTxn *txn;
+	char firstAttr[MAXFILENAMESIZE];
+	char bigValue[4096];
+	size_t loadedBytes;
+	struct DotUAllocator countingAllocator={countingAlloc,countingRelease,NULL};
+	int k;
+	char *imageBuf;
+	FILE *imageFile;
+	struct stat imageStat;
+	uint32_t imageLength;
 	int i,j,testFileNum;
+	int finderEntry,lookupErrors;
+	uint32_t attrNum,cursor;
+	char *name;
+	struct DotU *handle;
+	const struct ExtAttr *attr,*otherAttr;
+	const char *value;
+	uint32_t valueLength;
+	int status;
+	struct DotUXattrStats xattrStats;
+	struct DotUCatalog *catalog;
+	const uint32_t *fileIds;
+	long fileId;
+	struct DotUQueryTerm queryTerms[7];
+	uint32_t numTerms;
+	struct DotUProbe probe;
+	const char *batchList[5];
+	char batchNames[4][MAXFILENAMESIZE];
+	/* An AppleDouble header claiming two entries, cut off after 30 bytes */
+	static const char shortHeader[30]={0,5,0x16,7,0,2,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,2,0,0,0,9};
+	struct DotUPipeline pipeline;
+	struct DotUPipeStats pipeStats;
+	const char *pipeList[8];
+	char pipeNames[8][MAXFILENAMESIZE];
+	uint64_t fingerprint[2];
+	struct DotUValueStore *valueStore;
+	struct DotUValueStoreStats storeStats[2];
+	uint32_t nameId;
+	struct DotUAttrTable attrTable;
+	struct DotUShared *shared;
+	struct DotUSnapshot snapshot[2];
+	struct DotU *draft;
+	struct DotUAttrSpec specs[5];
+	int fd;
+	const char *testFileNameList;
+	char chunk[100];
+	char mappedChunk[100];
+	struct DotUSyncGroup *syncGroup;
+	static char zeroValue[6000];
 	long ok=0;
 	long nok=0;
 	char testCommand[MAXCOMMANDSIZE];
@@ -39,8 +177,11 @@ int main(int argc, char *argv[]){
 	/* Initializing DotU struct with data from file*/
 	myDotU = readDotUFile(argv[1]);
 	printDotUDetail(myDotU);
-	strcpy(dirName,dirname(argv[1]));
-	strcpy(fileName,basename(argv[1]));
+	/* dirname() and basename() may modify their argument */
+	strcpy(testFileName,argv[1]);
+	strcpy(dirName,dirname(testFileName));
+	strcpy(testFileName,argv[1]);
+	strcpy(fileName,basename(testFileName));
 	printf("\n\nFile is %s/%s\n",dirName,fileName);	
 	
 	testFileNum=0;
@@ -112,6 +253,15 @@ int main(int argc, char *argv[]){
 		printf("OK - Created DotU File from struct.\n");
 		ok++;
 	}
+	/* Writing a by-value DotU lays out a copy - the new attr the
+	   caller holds has no offset yet */
+	if(myDotU.layoutValid || myDotU.entry[getFinderInfoEntry(myDotU)].data.finder.attr[findAttr(&myDotU,"test1")].valueOffset!=0){
+		printf("NOK - Creating a file from the struct changed the caller's layout.\n");
+		nok++;
+	} else {
+		printf("OK - Creating a file from the struct left the caller's layout alone.\n");
+		ok++;
+	}
 	/* TODO - add diff but take into account expected difference */
 
 	
@@ -194,6 +344,7 @@ int main(int argc, char *argv[]){
 	}
 	
 	/* Create brand-new dotu struct */
+	freeDotU(&myDotU);
 	myDotU = iniDotU(argv[1]);
 	/* Create dotU file - should have 0 xattrs */
 	testFileNum++;
@@ -227,6 +378,987 @@ int main(int argc, char *argv[]){
 	/* TODO - add diff but take into account expected difference */
 	
 
+	/* Test the zero-copy reader */
+	freeDotU(&myDotU);
+	myDotU = readDotUFile(argv[1]);
+	if(mapDotUFile(argv[1],&mappedDotU)!=0){
+		printf("NOK - Error mapping DotU File.\n");
+		nok++;
+	} else {
+		printf("OK - Mapped DotU File.\n");
+		ok++;
+	}
+	/* Every name and value should match what readDotUFile copied out */
+	i=getFinderInfoEntry(myDotU);
+	k=getFinderInfoEntry(mappedDotU);
+	if(i<0 || k<0 || myDotU.entry[i].data.finder.xattrHdr.numAttrs!=mappedDotU.entry[k].data.finder.xattrHdr.numAttrs){
+		printf("NOK - Mapped DotU has a different xattr list.\n");
+		nok++;
+	} else {
+		for(j=0;j<myDotU.entry[i].data.finder.xattrHdr.numAttrs;j++){
+			if(strcmp(myDotU.entry[i].data.finder.attr[j].name,mappedDotU.entry[k].data.finder.attr[j].name)!=0
+			   || myDotU.entry[i].data.finder.attr[j].valueLength!=mappedDotU.entry[k].data.finder.attr[j].valueLength
+			   || memcmp(myDotU.entry[i].data.finder.attr[j].value,mappedDotU.entry[k].data.finder.attr[j].value,myDotU.entry[i].data.finder.attr[j].valueLength)!=0){
+				break;
+			}
+		}
+		if(j!=myDotU.entry[i].data.finder.xattrHdr.numAttrs){
+			printf("NOK - Mapped xattr %i does not match.\n",j);
+			nok++;
+		} else {
+			printf("OK - Mapped xattrs match.\n");
+			ok++;
+		}
+	}
+	/* Create file from the mapped struct - should match the first one we wrote. */
+	testFileNum++;
+	snprintf(testFileName,MAXFILENAMESIZE,"%s/t%i-%s",dirName,testFileNum,fileName);
+	if(createDotUFileSpecName(mappedDotU,argv[1],testFileName)!=0){
+		printf("NOK - Error creating DotU File from mapped struct.\n");
+		nok++;
+	} else {
+		printf("OK - Created DotU File from mapped struct.\n");
+		ok++;
+	}
+	snprintf(testCommand, MAXCOMMANDSIZE, "cmp -bl %s/t1-%s %s",dirName,fileName,testFileName);
+	if(system(testCommand)!=0){
+		printf("NOK - File written from mapped struct does not match.\n");
+		nok++;
+	} else {
+		printf("OK - File written from mapped struct matches.\n");
+		ok++;
+	}
+	unmapDotU(&mappedDotU);
+
+	/* A truncated image should be refused rather than read past */
+	imageLength=(stat(argv[1],&imageStat)==0) ? (uint32_t)imageStat.st_size : 0;
+	imageBuf=(char*)malloc(imageLength+1);
+	imageFile=fopen(argv[1],"rb");
+	if(imageFile==NULL || fread(imageBuf,1,imageLength,imageFile)!=imageLength) imageLength=0;
+	if(imageFile!=NULL) fclose(imageFile);
+	if(parseDotUBuffer(imageBuf,imageLength,&mappedDotU)!=0){
+		printf("NOK - Error parsing DotU image from buffer.\n");
+		nok++;
+	} else {
+		printf("OK - Parsed DotU image from buffer.\n");
+		ok++;
+		unmapDotU(&mappedDotU);
+	}
+	/* ...and reported to the log handler with the same code it returns */
+	setDotULogHandler(recordLog,NULL);
+	k=parseDotUBuffer(imageBuf,100,&mappedDotU);
+	if(k==DOTU_OK){
+		printf("NOK - Parsed a truncated DotU image.\n");
+		nok++;
+		unmapDotU(&mappedDotU);
+	} else if(k!=DOTU_EFORMAT || loggedCode!=DOTU_EFORMAT || loggedLevel!=DOTU_LOG_ERROR){
+		printf("NOK - Truncated DotU image gave code %i (%s), logged %i.\n",k,strDotUError(k),loggedCode);
+		nok++;
+	} else {
+		printf("OK - Refused a truncated DotU image.\n");
+		ok++;
+	}
+	/* Nothing should reach the handler with logging off */
+	setDotULogLevel(DOTU_LOG_NONE);
+	loggedCount=0;
+	parseDotUBuffer(imageBuf,100,&mappedDotU);
+	if(loggedCount!=0){
+		printf("NOK - Log handler called with logging off.\n");
+		nok++;
+	} else {
+		printf("OK - Log handler quiet with logging off.\n");
+		ok++;
+	}
+	setDotULogLevel(DOTU_LOG_ERROR);
+	setDotULogHandler(NULL,NULL);
+	free(imageBuf);
+
+
+	freeDotU(&myDotU);
+
+	/* Test the arena - a mapped DotU should cost one allocation, and
+	   freeDotU should give back everything, edits included. */
+	setDotUAllocator(&countingAllocator);
+	totalAllocs=0;
+	if(mapDotUFile(argv[1],&mappedDotU)!=DOTU_OK || totalAllocs!=1){
+		printf("NOK - Mapped DotU took %li allocations.\n",totalAllocs);
+		nok++;
+	} else {
+		printf("OK - Mapped DotU took one allocation.\n");
+		ok++;
+	}
+	freeDotU(&mappedDotU);
+	if(loadDotUFile(argv[1],&myDotU)!=DOTU_OK || liveAllocs!=1){
+		printf("NOK - Loaded DotU holds %li allocations.\n",liveAllocs);
+		nok++;
+	} else {
+		printf("OK - Loaded DotU holds one allocation.\n");
+		ok++;
+	}
+	for(i=0;i<40;i++){
+		snprintf(testFileName,MAXFILENAMESIZE,"arena-test-%i",i);
+		addAttr(&myDotU,testFileName,testFileName);
+	}
+	rmAttr(&myDotU,"arena-test-7");
+	freeDotU(&myDotU);
+	if(liveAllocs!=0){
+		printf("NOK - freeDotU left %li allocations behind.\n",liveAllocs);
+		nok++;
+	} else {
+		printf("OK - freeDotU released everything.\n");
+		ok++;
+	}
+
+	/* Rewriting a value over and over, longer and shorter, should keep
+	   the arena within a few times what it took to load the DotU. */
+	loadDotUFile(argv[1],&myDotU);
+	loadedBytes=liveBytes;
+	memset(bigValue,'v',sizeof(bigValue));
+	for(i=0;i<2000;i++) setDotUAttr(&myDotU,"arena-rewrite",bigValue,(uint32_t)((i*37)%sizeof(bigValue)));
+	value=getDotUAttr(&myDotU,"arena-rewrite",&valueLength);
+	if(value==NULL || valueLength!=(1999*37)%sizeof(bigValue) || liveBytes>4*(loadedBytes+sizeof(bigValue))){
+		printf("NOK - Rewritten DotU holds %lu bytes, loaded it held %lu.\n",(unsigned long)liveBytes,(unsigned long)loadedBytes);
+		nok++;
+	} else {
+		printf("OK - Rewriting a value doesn't grow the arena without bound.\n");
+		ok++;
+	}
+	freeDotU(&myDotU);
+
+	/* The same through transactions, each also adding an attr and
+	   removing the one the last added */
+	loadDotUFile(argv[1],&myDotU);
+	loadedBytes=liveBytes;
+	lookupErrors=0;
+	for(i=0;i<1000;i++){
+		txn=beginDotUTxn(&myDotU);
+		txnSetAttr(txn,"arena-rewrite",bigValue,(uint32_t)((i*37)%sizeof(bigValue)));
+		snprintf(testFileName,MAXFILENAMESIZE,"arena-txn-%i",i);
+		txnSetAttr(txn,testFileName,bigValue,(uint32_t)((i*53)%sizeof(bigValue)));
+		snprintf(testFileName,MAXFILENAMESIZE,"arena-txn-%i",i-1);
+		if(i>0) txnRmAttr(txn,testFileName);
+		if(commitDotUTxn(txn)!=DOTU_OK) lookupErrors++;
+	}
+	value=getDotUAttr(&myDotU,"arena-rewrite",&valueLength);
+	if(value==NULL || valueLength!=(999*37)%sizeof(bigValue)) lookupErrors++;
+	if(getDotUAttr(&myDotU,"arena-txn-998",NULL)!=NULL || getDotUAttr(&myDotU,"arena-txn-999",NULL)==NULL) lookupErrors++;
+	if(lookupErrors!=0 || liveBytes>4*(loadedBytes+2*sizeof(bigValue))){
+		printf("NOK - Txn-edited DotU holds %lu bytes, loaded it held %lu, %i wrong.\n",(unsigned long)liveBytes,(unsigned long)loadedBytes,lookupErrors);
+		nok++;
+	} else {
+		printf("OK - Committing txns doesn't grow the arena without bound.\n");
+		ok++;
+	}
+	freeDotU(&myDotU);
+	setDotUAllocator(NULL);
+
+	/* Test batched edits - a txn should leave the DotU just as the
+	   same addAttr/rmAttr calls would. */
+	myDotU=readDotUFile(argv[1]);
+	txnDotU=readDotUFile(argv[1]);
+	i=getFinderInfoEntry(myDotU);
+	firstAttr[0]='\0';
+	if(i>=0 && myDotU.entry[i].data.finder.xattrHdr.numAttrs>0) strcpy(firstAttr,myDotU.entry[i].data.finder.attr[0].name);
+	addAttr(&myDotU,"test1","value1");
+	addAttr(&myDotU,"aaa","x");
+	addAttr(&myDotU,"test1","value1-B");
+	if(firstAttr[0]!='\0') rmAttr(&myDotU,firstAttr);
+	txn=beginDotUTxn(&txnDotU);
+	txnSetAttr(txn,"test1","value1",6);
+	txnSetAttr(txn,"aaa","x",1);
+	txnRmAttr(txn,"test-does-not-exist");
+	txnSetAttr(txn,"test1","value1-B",8);
+	if(firstAttr[0]!='\0') txnRmAttr(txn,firstAttr);
+	if(commitDotUTxn(txn)!=DOTU_OK){
+		printf("NOK - Error committing xattr txn.\n");
+		nok++;
+	} else {
+		printf("OK - Committed xattr txn.\n");
+		ok++;
+	}
+	testFileNum++;
+	snprintf(testFileName,MAXFILENAMESIZE,"%s/t%i-%s",dirName,testFileNum,fileName);
+	createDotUFileSpecName(myDotU,argv[1],testFileName);
+	testFileNum++;
+	snprintf(testFileName,MAXFILENAMESIZE,"%s/t%i-%s",dirName,testFileNum,fileName);
+	createDotUFileSpecName(txnDotU,argv[1],testFileName);
+	snprintf(testCommand, MAXCOMMANDSIZE, "cmp -bl %s/t%i-%s %s",dirName,testFileNum-1,fileName,testFileName);
+	if(system(testCommand)!=0){
+		printf("NOK - File written after txn doesn't match addAttr/rmAttr.\n");
+		nok++;
+	} else {
+		printf("OK - File written after txn matches addAttr/rmAttr.\n");
+		ok++;
+	}
+	freeDotU(&myDotU);
+	freeDotU(&txnDotU);
+
+	/* Test the tree scanner - two copies of the file in a small tree,
+	   plus a file it should pass over. */
+	snprintf(testCommand, MAXCOMMANDSIZE, "rm -rf %s/scan-%s && mkdir -p %s/scan-%s/a/b && cp %s %s/scan-%s/._one && cp %s %s/scan-%s/a/b/._two && cp %s %s/scan-%s/a/plain",
+	         dirName,fileName,dirName,fileName,argv[1],dirName,fileName,argv[1],dirName,fileName,argv[1],dirName,fileName);
+	system(testCommand);
+	snprintf(testFileName,MAXFILENAMESIZE,"%s/scan-%s",dirName,fileName);
+	if(scanDotUTree(testFileName,4,countScanned,NULL)!=2 || scanParsed!=2 || scanFailed!=0){
+		printf("NOK - Tree scan found %li good and %li bad ._ files, expected 2 and 0.\n",scanParsed,scanFailed);
+		nok++;
+	} else {
+		printf("OK - Tree scan found both ._ files.\n");
+		ok++;
+	}
+
+	/* Test indexed lookup - every attr is found where it sits, through
+	   both the hash index and binary search, and a missing one isn't. */
+	myDotU=readDotUFile(argv[1]);
+	finderEntry=getFinderInfoEntry(myDotU);
+	lookupErrors=0;
+	if(finderEntry>=0){
+		for(attrNum=0;attrNum<myDotU.entry[finderEntry].data.finder.xattrHdr.numAttrs;attrNum++){
+			name=myDotU.entry[finderEntry].data.finder.attr[attrNum].name;
+			if(findAttr(&myDotU,name)!=(int)attrNum || getAttrIndex(myDotU,name)!=(int)attrNum) lookupErrors++;
+		}
+		if(findAttr(&myDotU,"no.such.attr")!=-1 || getAttrIndex(myDotU,"no.such.attr")!=-1) lookupErrors++;
+	}
+	if(lookupErrors!=0){
+		printf("NOK - %i xattr lookups went wrong.\n",lookupErrors);
+		nok++;
+	} else {
+		printf("OK - Every xattr found by findAttr and getAttrIndex.\n");
+		ok++;
+	}
+	freeDotU(&myDotU);
+
+	/* Test the handle API - walk the attrs through an opened handle and
+	   look each one up, then set, read back and remove a value with a
+	   \0 inside it. */
+	handle=openDotU(argv[1],&status);
+	lookupErrors=0;
+	if(handle==NULL){
+		lookupErrors++;
+	} else {
+		attrNum=0;
+		while((attr=nextDotUAttr(handle,&attrNum))!=NULL){
+			if(getDotUAttr(handle,attr->name,&valueLength)!=attr->value || valueLength!=attr->valueLength) lookupErrors++;
+		}
+		if(setDotUAttr(handle,"com.example.binary","a\0b",3)!=DOTU_OK) lookupErrors++;
+		value=getDotUAttr(handle,"com.example.binary",&valueLength);
+		if(value==NULL || valueLength!=3 || memcmp(value,"a\0b",3)!=0) lookupErrors++;
+		if(removeDotUAttr(handle,"com.example.binary")!=DOTU_OK || getDotUAttr(handle,"com.example.binary",NULL)!=NULL) lookupErrors++;
+		closeDotU(handle);
+	}
+	if(lookupErrors!=0){
+		printf("NOK - Handle API got %i things wrong.\n",lookupErrors);
+		nok++;
+	} else {
+		printf("OK - Handle API gets, sets, removes and iterates.\n");
+		ok++;
+	}
+
+	/* Test the memory serializer - the image it builds must match what
+	   went to disk. */
+	myDotU=readDotUFile(argv[1]);
+	imageBuf=NULL;
+	if(layoutDotU(&myDotU,&imageLength)==DOTU_OK) imageBuf=(char*)malloc(imageLength);
+	snprintf(testFileName,MAXFILENAMESIZE,"%s/t%i-%s",dirName,testFileNum++,fileName);
+	writeDotUFile(&myDotU,testFileName);
+	imageFile=fopen(testFileName,"rb");
+	lookupErrors=1;
+	if(imageBuf!=NULL && imageFile!=NULL && stat(testFileName,&imageStat)==0 && imageStat.st_size==imageLength
+	   && serializeDotU(&myDotU,imageBuf,imageLength)==DOTU_OK){
+		for(lookupErrors=0,attrNum=0;attrNum<imageLength;attrNum++){
+			if(fgetc(imageFile)!=(unsigned char)imageBuf[attrNum]) lookupErrors++;
+		}
+	}
+	if(imageFile!=NULL) fclose(imageFile);
+	free(imageBuf);
+	freeDotU(&myDotU);
+	if(lookupErrors!=0){
+		printf("NOK - Serialized image doesn't match the file written.\n");
+		nok++;
+	} else {
+		printf("OK - Serialized image matches the file written.\n");
+		ok++;
+	}
+
+	/* Test in-place patching - a same-length change, one that grows
+	   into the padding and one too big to fit must each leave the file
+	   as a full write would. */
+	myDotU=readDotUFile(argv[1]);
+	snprintf(testFileName,MAXFILENAMESIZE,"%s/t%i-%s",dirName,testFileNum++,fileName);
+	snprintf(testFilePrefix,MAXFILENAMESIZE,"%s/t%i-%s",dirName,testFileNum++,fileName);
+	writeDotUFile(&myDotU,testFileName);
+	lookupErrors=0;
+	for(k=0;k<3;k++){
+		if(k==0) setDotUAttr(&myDotU,"com.example.patch","0123456789",10);
+		if(k==1) setDotUAttr(&myDotU,"com.example.patch","9876543210",10);
+		if(k==2) setDotUAttr(&myDotU,"com.example.patch",zeroValue,sizeof(zeroValue));
+		if(k>0 && patchDotUFile(&myDotU,testFileName)!=DOTU_OK) lookupErrors++;
+		if(k==0) writeDotUFile(&myDotU,testFileName);
+		writeDotUFile(&myDotU,testFilePrefix);
+		snprintf(testCommand, MAXCOMMANDSIZE, "cmp -s %s %s",testFileName,testFilePrefix);
+		if(system(testCommand)!=0) lookupErrors++;
+	}
+	freeDotU(&myDotU);
+	if(lookupErrors!=0){
+		printf("NOK - %i patched files don't match a full write.\n",lookupErrors);
+		nok++;
+	} else {
+		printf("OK - Patched files match a full write.\n");
+		ok++;
+	}
+
+	/* Test atomic writes - grouped files appear only at commit, an
+	   aborted one never does, and no temp files are left behind. */
+	myDotU=readDotUFile(argv[1]);
+	snprintf(testFilePrefix,MAXFILENAMESIZE,"%s/t%i-%s",dirName,testFileNum++,fileName);
+	writeDotUFile(&myDotU,testFilePrefix);
+	lookupErrors=0;
+	syncGroup=beginDotUSyncGroup();
+	for(k=0;k<3;k++){
+		snprintf(testFileName,MAXFILENAMESIZE,"%s/t%i-%s",dirName,testFileNum+k,fileName);
+		remove(testFileName);
+		if(writeDotUFileAtomic(&myDotU,testFileName,(k<2) ? syncGroup : NULL)!=DOTU_OK) lookupErrors++;
+		if(k<2 && stat(testFileName,&imageStat)==0) lookupErrors++;
+	}
+	if(commitDotUSyncGroup(syncGroup)!=DOTU_OK) lookupErrors++;
+	syncGroup=beginDotUSyncGroup();
+	snprintf(testFileName,MAXFILENAMESIZE,"%s/t%i-%s",dirName,testFileNum+3,fileName);
+	remove(testFileName);
+	writeDotUFileAtomic(&myDotU,testFileName,syncGroup);
+	abortDotUSyncGroup(syncGroup);
+	if(stat(testFileName,&imageStat)==0) lookupErrors++;
+	for(k=0;k<3;k++){
+		snprintf(testCommand, MAXCOMMANDSIZE, "cmp -s %s/t%i-%s %s",dirName,testFileNum+k,fileName,testFilePrefix);
+		if(system(testCommand)!=0) lookupErrors++;
+	}
+	testFileNum+=4;
+	snprintf(testCommand, MAXCOMMANDSIZE, "ls -a %s | grep -q '^\\.t[0-9]*-%s\\.'",dirName,fileName);
+	if(system(testCommand)==0) lookupErrors++;
+	freeDotU(&myDotU);
+	if(lookupErrors!=0){
+		printf("NOK - Atomic writes got %i things wrong.\n",lookupErrors);
+		nok++;
+	} else {
+		printf("OK - Atomic writes land at commit and only then.\n");
+		ok++;
+	}
+
+	/* A file written again in the same group gets the later write,
+	   however many other files in its directory are sorted with it */
+	myDotU=readDotUFile(argv[1]);
+	lookupErrors=0;
+	syncGroup=beginDotUSyncGroup();
+	snprintf(testFilePrefix,MAXFILENAMESIZE,"%s/t%i-%s",dirName,testFileNum,fileName);
+	for(k=0;k<24;k++){
+		snprintf(testFileName,MAXFILENAMESIZE,"%i",k);
+		addAttr(&myDotU,"sync-order",testFileName);
+		if(k%3==0) snprintf(testFileName,MAXFILENAMESIZE,"%s",testFilePrefix);
+		else snprintf(testFileName,MAXFILENAMESIZE,"%s/t%i-%s",dirName,testFileNum+k,fileName);
+		if(writeDotUFileAtomic(&myDotU,testFileName,syncGroup)!=DOTU_OK) lookupErrors++;
+	}
+	if(commitDotUSyncGroup(syncGroup)!=DOTU_OK) lookupErrors++;
+	freeDotU(&myDotU);
+	myDotU=readDotUFile(testFilePrefix);
+	value=getDotUAttr(&myDotU,"sync-order",&valueLength);
+	if(value==NULL || valueLength!=2 || memcmp(value,"21",2)!=0) lookupErrors++;
+	freeDotU(&myDotU);
+	testFileNum+=24;
+	if(lookupErrors!=0){
+		printf("NOK - A file written twice in a sync group got %i things wrong.\n",lookupErrors);
+		nok++;
+	} else {
+		printf("OK - A file written twice in a sync group ends up with the later write.\n");
+		ok++;
+	}
+
+	/* Test the lazy resource fork - left in the file by readDotUFile,
+	   then read in small chunks and all at once, matching the mapped
+	   copy either way. */
+	myDotU=readDotUFile(argv[1]);
+	mapDotUFile(argv[1],&mappedDotU);
+	lookupErrors=0;
+	i=getDotUResourceLength(&myDotU);
+	if(i!=(int)getDotUResourceLength(&mappedDotU)) lookupErrors++;
+	for(j=0;j<myDotU.header.numEntries;j++){
+		if(myDotU.entry[j].id==2 && myDotU.entry[j].data.resource.data!=NULL) lookupErrors++;
+	}
+	for(k=0;k<i;k+=100){
+		if(readDotUResource(&myDotU,chunk,k,100)!=((i-k<100) ? i-k : 100)) lookupErrors++;
+		if(readDotUResource(&mappedDotU,mappedChunk,k,100)!=((i-k<100) ? i-k : 100)) lookupErrors++;
+		if(memcmp(chunk,mappedChunk,(i-k<100) ? i-k : 100)!=0) lookupErrors++;
+	}
+	if(i>0 && (getDotUResource(&myDotU)==NULL || memcmp(getDotUResource(&myDotU),getDotUResource(&mappedDotU),i)!=0)) lookupErrors++;
+	freeDotU(&myDotU);
+	freeDotU(&mappedDotU);
+	if(lookupErrors!=0){
+		printf("NOK - Resource fork reads got %i things wrong.\n",lookupErrors);
+		nok++;
+	} else {
+		printf("OK - Resource fork read lazily matches the mapped one.\n");
+		ok++;
+	}
+
+	/* Test setting the resource fork - replaced, written and read back,
+	   then removed */
+	myDotU=readDotUFile(argv[1]);
+	lookupErrors=0;
+	memset(bigValue,'r',sizeof(bigValue));
+	/* The writer ends every file in two 0xFF bytes */
+	bigValue[sizeof(bigValue)-2]=(char)0xFF;
+	bigValue[sizeof(bigValue)-1]=(char)0xFF;
+	if(setDotUResource(&myDotU,bigValue,sizeof(bigValue))!=DOTU_OK) lookupErrors++;
+	snprintf(testFileName,MAXFILENAMESIZE,"%s/t%i-%s",dirName,testFileNum++,fileName);
+	if(writeDotUFile(&myDotU,testFileName)!=DOTU_OK) lookupErrors++;
+	freeDotU(&myDotU);
+	myDotU=readDotUFile(testFileName);
+	value=getDotUResource(&myDotU);
+	if(getDotUResourceLength(&myDotU)!=sizeof(bigValue) || value==NULL || memcmp(value,bigValue,sizeof(bigValue))!=0) lookupErrors++;
+	if(getDotUAttr(&myDotU,firstAttr,NULL)==NULL && firstAttr[0]!='\0') lookupErrors++;
+	if(setDotUResource(&myDotU,NULL,0)!=DOTU_OK || getDotUResourceLength(&myDotU)!=0) lookupErrors++;
+	freeDotU(&myDotU);
+	if(lookupErrors!=0){
+		printf("NOK - Setting the resource fork got %i things wrong.\n",lookupErrors);
+		nok++;
+	} else {
+		printf("OK - Resource fork set, written, read back and removed.\n");
+		ok++;
+	}
+
+	/* Test xattr sync - a cut-down ._ file (ext4 holds only a block of
+	   xattrs) goes into the native xattrs of an empty file, comes back
+	   out as an identical ._ file, and a second pass each way finds
+	   nothing to do. */
+	myDotU=readDotUFile(argv[1]);
+	finderEntry=getFinderInfoEntry(myDotU);
+	txn=beginDotUTxn(&myDotU);
+	for(attrNum=8;finderEntry>=0 && attrNum<myDotU.entry[finderEntry].data.finder.xattrHdr.numAttrs;attrNum++){
+		txnRmAttr(txn,myDotU.entry[finderEntry].data.finder.attr[attrNum].name);
+	}
+	commitDotUTxn(txn);
+	snprintf(testFileName,MAXFILENAMESIZE,"%s/t%i-%s",dirName,testFileNum,fileName);
+	snprintf(testFilePrefix,MAXFILENAMESIZE,"%s/._t%i-%s",dirName,testFileNum++,fileName);
+	remove(testFileName);
+	imageFile=fopen(testFileName,"w");
+	if(imageFile!=NULL) fclose(imageFile);
+	writeDotUFile(&myDotU,testFilePrefix);
+	memset(&xattrStats,0,sizeof(xattrStats));
+	lookupErrors=0;
+	testFileNameList=testFileName;
+	if(syncDotUXattrs(testFileName,DOTU_TO_XATTR,&xattrStats)!=DOTU_OK || xattrStats.set==0) lookupErrors++;
+	if(syncDotUXattrFiles(&testFileNameList,1,DOTU_TO_XATTR,2,&xattrStats)!=0 || xattrStats.unchanged!=1) lookupErrors++;
+	remove(testFilePrefix);
+	if(syncDotUXattrs(testFileName,DOTU_FROM_XATTR,&xattrStats)!=DOTU_OK) lookupErrors++;
+	if(syncDotUXattrFiles(&testFileNameList,1,DOTU_FROM_XATTR,2,&xattrStats)!=0 || xattrStats.unchanged!=2 || xattrStats.failed!=0) lookupErrors++;
+	txnDotU=readDotUFile(testFilePrefix);
+	for(attrNum=0;(attr=nextDotUAttr(&myDotU,&attrNum))!=NULL;){
+		value=getDotUAttr(&txnDotU,attr->name,&valueLength);
+		if(value==NULL || valueLength!=attr->valueLength || memcmp(value,attr->value,valueLength)!=0) lookupErrors++;
+	}
+	for(attrNum=0;nextDotUAttr(&txnDotU,&attrNum)!=NULL;);
+	for(k=0;nextDotUAttr(&myDotU,(uint32_t*)&k)!=NULL;);
+	if((int)attrNum!=k || getFinderInfoEntry(txnDotU)<0
+	   || memcmp(txnDotU.entry[getFinderInfoEntry(txnDotU)].data.finder.finderHeader,myDotU.entry[finderEntry].data.finder.finderHeader,32)!=0) lookupErrors++;
+	if(getDotUResourceLength(&txnDotU)!=getDotUResourceLength(&myDotU)
+	   || (getDotUResourceLength(&myDotU)>0 && memcmp(getDotUResource(&txnDotU),getDotUResource(&myDotU),getDotUResourceLength(&myDotU))!=0)) lookupErrors++;
+	freeDotU(&myDotU);
+	freeDotU(&txnDotU);
+	if(lookupErrors!=0){
+		printf("NOK - Xattr sync got %i things wrong.\n",lookupErrors);
+		nok++;
+	} else {
+		printf("OK - Xattr sync round trip matches and second passes do nothing.\n");
+		ok++;
+	}
+
+
+	/* Test the catalog - built over the scanner's tree, it holds both
+	   files with every attr and value, and each attr lists both. */
+	myDotU=readDotUFile(argv[1]);
+	finderEntry=getFinderInfoEntry(myDotU);
+	snprintf(testFileName,MAXFILENAMESIZE,"%s/scan-%s",dirName,fileName);
+	snprintf(testFilePrefix,MAXFILENAMESIZE,"%s/t%i-%s.cat",dirName,testFileNum++,fileName);
+	lookupErrors=0;
+	if(buildDotUCatalog(testFileName,testFilePrefix,4)!=2 || (catalog=openDotUCatalog(testFilePrefix,&status))==NULL){
+		lookupErrors++;
+	} else {
+		snprintf(testFileName,MAXFILENAMESIZE,"%s/scan-%s/one",dirName,fileName);
+		fileId=findDotUCatalogPath(catalog,testFileName);
+		snprintf(testFileName,MAXFILENAMESIZE,"%s/scan-%s/a/b/two",dirName,fileName);
+		if(getDotUCatalogFileCount(catalog)!=2 || fileId<0 || findDotUCatalogPath(catalog,testFileName)<0
+		   || findDotUCatalogPath(catalog,"plain")>=0) lookupErrors++;
+		if(fileId>=0 && finderEntry>=0
+		   && memcmp(getDotUCatalogFinderInfo(catalog,(uint32_t)fileId),myDotU.entry[finderEntry].data.finder.finderHeader,32)!=0) lookupErrors++;
+		for(attrNum=0;fileId>=0 && (attr=nextDotUAttr(&myDotU,&attrNum))!=NULL;){
+			value=getDotUCatalogAttr(catalog,(uint32_t)fileId,attr->name,&valueLength);
+			if(value==NULL || valueLength!=attr->valueLength || memcmp(value,attr->value,valueLength)!=0) lookupErrors++;
+			if(findDotUCatalogFiles(catalog,attr->name,&fileIds)!=2 || fileIds[0]>=fileIds[1]) lookupErrors++;
+		}
+		for(k=0,attrNum=0;fileId>=0 && nextDotUCatalogAttr(catalog,(uint32_t)fileId,&attrNum,&value,&valueLength)!=NULL;k++);
+		for(attrNum=0;nextDotUAttr(&myDotU,&attrNum)!=NULL;k--);
+		if(k!=0 || findDotUCatalogFiles(catalog,"no.such.attr",&fileIds)!=0) lookupErrors++;
+		closeDotUCatalog(catalog);
+	}
+	freeDotU(&myDotU);
+	if(lookupErrors!=0){
+		printf("NOK - Catalog got %i things wrong.\n",lookupErrors);
+		nok++;
+	} else {
+		printf("OK - Catalog holds both files and every attr.\n");
+		ok++;
+	}
+
+	/* Test queries - name, prefix, value and FinderInfo terms each pick
+	   out the file, together too, on its own, over the scanner's tree and
+	   over the catalog of it; add a missing name and nothing matches. */
+	myDotU=readDotUFile(argv[1]);
+	finderEntry=getFinderInfoEntry(myDotU);
+	memset(queryTerms,0,sizeof(queryTerms));
+	numTerms=0;
+	queryTerms[numTerms].test=DOTU_Q_FINDERINFO;
+	queryTerms[numTerms].offset=DOTU_FINDER_TYPE;
+	queryTerms[numTerms].bytes=(finderEntry>=0) ? myDotU.entry[finderEntry].data.finder.finderHeader : zeroValue;
+	queryTerms[numTerms++].length=4;
+	attrNum=0;
+	attr=nextDotUAttr(&myDotU,&attrNum);
+	if(attr!=NULL){
+		queryTerms[numTerms].name=attr->name;
+		queryTerms[numTerms++].test=DOTU_Q_EXISTS;
+		queryTerms[numTerms].name="no.such.attr";
+		queryTerms[numTerms].negate=1;
+		queryTerms[numTerms++].test=DOTU_Q_EXISTS;
+		queryTerms[numTerms].name=attr->name;
+		queryTerms[numTerms].test=DOTU_Q_VALUE_EQUALS;
+		queryTerms[numTerms].bytes=attr->value;
+		queryTerms[numTerms++].length=attr->valueLength;
+		snprintf(firstAttr,4,"%s",attr->name);
+		queryTerms[numTerms].name=firstAttr;
+		queryTerms[numTerms].match=DOTU_Q_PREFIX;
+		queryTerms[numTerms].test=DOTU_Q_VALUE_CONTAINS;
+		queryTerms[numTerms].bytes=attr->value+attr->valueLength/2;
+		queryTerms[numTerms++].length=attr->valueLength-attr->valueLength/2;
+		queryTerms[numTerms].match=DOTU_Q_ANY;
+		queryTerms[numTerms].test=DOTU_Q_VALUE_LENGTH;
+		queryTerms[numTerms].minLength=attr->valueLength;
+		queryTerms[numTerms++].maxLength=attr->valueLength;
+	}
+	lookupErrors=0;
+	for(k=0;k<(int)numTerms;k++){
+		if(matchDotUQuery(&myDotU,&queryTerms[k],1)!=1) lookupErrors++;
+	}
+	snprintf(testFileName,MAXFILENAMESIZE,"%s/scan-%s",dirName,fileName);
+	catalog=openDotUCatalog(testFilePrefix,&status);
+	if(matchDotUQuery(&myDotU,queryTerms,numTerms)!=1 || queryDotUTree(testFileName,queryTerms,numTerms,4,NULL,NULL)!=2
+	   || catalog==NULL || queryDotUCatalog(catalog,queryTerms,numTerms,4,NULL,NULL)!=2) lookupErrors++;
+	queryTerms[numTerms].name="no.such.attr";
+	queryTerms[numTerms].test=DOTU_Q_EXISTS;
+	if(matchDotUQuery(&myDotU,queryTerms,numTerms+1)!=0 || queryDotUTree(testFileName,queryTerms,numTerms+1,4,NULL,NULL)!=0
+	   || catalog==NULL || queryDotUCatalog(catalog,queryTerms,numTerms+1,4,NULL,NULL)!=0) lookupErrors++;
+	closeDotUCatalog(catalog);
+	freeDotU(&myDotU);
+	if(lookupErrors!=0){
+		printf("NOK - Queries got %i things wrong.\n",lookupErrors);
+		nok++;
+	} else {
+		printf("OK - Queries match the file by every kind of term.\n");
+		ok++;
+	}
+
+	/* Test the probe - it sees what a full read sees, and turns down a
+	   file that isn't AppleDouble without reading it all. */
+	myDotU=readDotUFile(argv[1]);
+	finderEntry=getFinderInfoEntry(myDotU);
+	lookupErrors=0;
+	if(probeDotUFile(argv[1],&probe)!=DOTU_OK || !probe.magicOK || !probe.versionOK
+	   || probe.header.numEntries!=myDotU.header.numEntries || probe.resourceLength!=getDotUResourceLength(&myDotU)
+	   || probe.numAttrs!=((finderEntry>=0) ? myDotU.entry[finderEntry].data.finder.xattrHdr.numAttrs : 0)) lookupErrors++;
+	for(k=0;k<(int)probe.header.numEntries && k<2;k++){
+		if(probe.entry[k].id!=myDotU.entry[k].id || probe.entry[k].offset!=myDotU.entry[k].offset
+		   || probe.entry[k].length!=myDotU.entry[k].length) lookupErrors++;
+	}
+	snprintf(testFileName,MAXFILENAMESIZE,"%s/t%i-%s",dirName,testFileNum++,fileName);
+	imageFile=fopen(testFileName,"w");
+	if(imageFile!=NULL){
+		fprintf(imageFile,"Plain text that only has a dot-underscore name.\n");
+		fclose(imageFile);
+	}
+	if(probeDotUFile(testFileName,&probe)!=DOTU_EFORMAT || probe.magicOK || loadDotUFile(testFileName,&txnDotU)!=DOTU_EFORMAT) lookupErrors++;
+	freeDotU(&myDotU);
+	if(lookupErrors!=0){
+		printf("NOK - Probe got %i things wrong.\n",lookupErrors);
+		nok++;
+	} else {
+		printf("OK - Probe matches a full read and turns down a non-AppleDouble file.\n");
+		ok++;
+	}
+
+	/* Test the batch reader - through io_uring where there is one and
+	   through the thread pool, every file gets the status and contents
+	   a plain read would give it. */
+	myDotU=readDotUFile(argv[1]);
+	for(attrNum=0;nextDotUAttr(&myDotU,&attrNum)!=NULL;);
+	snprintf(batchNames[0],MAXFILENAMESIZE,"%s/scan-%s/._one",dirName,fileName);
+	snprintf(batchNames[1],MAXFILENAMESIZE,"%s/t%i-%s",dirName,testFileNum++,fileName);
+	snprintf(batchNames[2],MAXFILENAMESIZE,"%s/t%i-%s.missing",dirName,testFileNum++,fileName);
+	imageFile=fopen(batchNames[1],"w");
+	if(imageFile!=NULL){
+		fprintf(imageFile,"Plain text that only has a dot-underscore name.\n");
+		fclose(imageFile);
+	}
+	remove(batchNames[2]);
+	snprintf(batchNames[3],MAXFILENAMESIZE,"%s/t%i-%s.short",dirName,testFileNum++,fileName);
+	imageFile=fopen(batchNames[3],"wb");
+	if(imageFile!=NULL){
+		fwrite(shortHeader,1,sizeof(shortHeader),imageFile);
+		fclose(imageFile);
+	}
+	batchList[0]=argv[1];
+	batchList[1]=batchNames[0];
+	batchList[2]=batchNames[1];
+	batchList[3]=batchNames[2];
+	batchList[4]=batchNames[3];
+	lookupErrors=0;
+	for(k=0;k<2;k++){
+		memset(batchStatus,1,sizeof(batchStatus));
+		if(readDotUFiles(batchList,5,(k==0) ? 3 : 2,(k==0) ? 0 : DOTU_BATCH_THREADS,recordBatch,NULL)!=2) lookupErrors++;
+		for(i=0;i<2;i++){
+			if(batchStatus[i]!=DOTU_OK || batchAttrs[i]!=attrNum || batchResource[i]!=getDotUResourceLength(&myDotU)) lookupErrors++;
+		}
+		if(batchStatus[2]!=DOTU_EFORMAT || batchStatus[3]!=DOTU_EIO || batchStatus[4]!=DOTU_EFORMAT) lookupErrors++;
+	}
+	freeDotU(&myDotU);
+	if(lookupErrors!=0){
+		printf("NOK - Batch reader got %i things wrong.\n",lookupErrors);
+		nok++;
+	} else {
+		printf("OK - Batch reader reads every file as a plain read does, both ways.\n");
+		ok++;
+	}
+
+	/* Test the pipeline - with one-deep queues and two threads a stage,
+	   every copy gets tagged and replaced, the skipped one is left be
+	   and the missing one counts as failed. */
+	myDotU=readDotUFile(argv[1]);
+	for(attrNum=0;nextDotUAttr(&myDotU,&attrNum)!=NULL;);
+	lookupErrors=0;
+	for(i=0;i<8;i++){
+		snprintf(pipeNames[i],MAXFILENAMESIZE,"%s/t%i-%s%s",dirName,testFileNum++,fileName,(i==6) ? ".skip" : "");
+		remove(pipeNames[i]);
+		if(i<7 && writeDotUFile(&myDotU,pipeNames[i])!=DOTU_OK) lookupErrors++;
+		pipeList[i]=pipeNames[i];
+	}
+	memset(&pipeline,0,sizeof(pipeline));
+	pipeline.readers=2;
+	pipeline.transformers=2;
+	pipeline.writers=2;
+	pipeline.queueDepth=1;
+	pipeline.atomic=1;
+	pipeline.transform=tagPiped;
+	memset(&pipeStats,0,sizeof(pipeStats));
+	if(runDotUPipeline(pipeList,8,&pipeline,&pipeStats)!=1) lookupErrors++;
+	if(pipeStats.read!=7 || pipeStats.written!=6 || pipeStats.unchanged!=1 || pipeStats.failed!=1) lookupErrors++;
+	for(i=0;i<7;i++){
+		if(loadDotUFile(pipeNames[i],&txnDotU)!=DOTU_OK){
+			lookupErrors++;
+			continue;
+		}
+		value=getDotUAttr(&txnDotU,"com.example.piped",&valueLength);
+		if((i<6) != (value!=NULL && valueLength==9 && memcmp(value,"converted",9)==0)) lookupErrors++;
+		for(k=0,cursor=0;nextDotUAttr(&txnDotU,&cursor)!=NULL;k++);
+		if(k!=(int)attrNum+(i<6) || getDotUResourceLength(&txnDotU)!=getDotUResourceLength(&myDotU)) lookupErrors++;
+		freeDotU(&txnDotU);
+	}
+	freeDotU(&myDotU);
+	if(lookupErrors!=0){
+		printf("NOK - Pipeline got %i things wrong.\n",lookupErrors);
+		nok++;
+	} else {
+		printf("OK - Pipeline converts every file through bounded queues.\n");
+		ok++;
+	}
+
+	/* Test entries the library doesn't interpret - a comment and a
+	   real name added to the file come back from a read and a map as
+	   they went in, and survive an attr edit and a rewrite. */
+	myDotU=readDotUFile(argv[1]);
+	for(attrNum=0;nextDotUAttr(&myDotU,&attrNum)!=NULL;);
+	lookupErrors=0;
+	if(setDotUEntry(&myDotU,4,"A comment kept as it is.",24)!=DOTU_OK || setDotUEntry(&myDotU,3,"Real Name.txt",13)!=DOTU_OK
+	   || setDotUEntry(&myDotU,9,"",0)!=DOTU_EINVAL) lookupErrors++;
+	snprintf(testFileName,MAXFILENAMESIZE,"%s/t%i-%s",dirName,testFileNum++,fileName);
+	if(writeDotUFile(&myDotU,testFileName)!=DOTU_OK) lookupErrors++;
+	for(k=0;k<2;k++){
+		if(k==0) status=loadDotUFile(testFileName,&txnDotU);
+		else status=mapDotUFile(testFileName,&txnDotU);
+		if(status!=DOTU_OK){
+			lookupErrors++;
+			continue;
+		}
+		value=getDotUEntry(&txnDotU,4,&valueLength);
+		if(value==NULL || valueLength!=24 || memcmp(value,"A comment kept as it is.",24)!=0) lookupErrors++;
+		value=getDotUEntry(&txnDotU,3,&valueLength);
+		if(value==NULL || valueLength!=13 || memcmp(value,"Real Name.txt",13)!=0) lookupErrors++;
+		for(cursor=0;nextDotUAttr(&txnDotU,&cursor)!=NULL;);
+		if(txnDotU.header.numEntries!=myDotU.header.numEntries || cursor!=attrNum+k
+		   || getDotUResourceLength(&txnDotU)!=getDotUResourceLength(&myDotU)
+		   || (getDotUResourceLength(&myDotU)>0 && memcmp(getDotUResource(&txnDotU),getDotUResource(&myDotU),getDotUResourceLength(&myDotU))!=0)) lookupErrors++;
+		if(k==0 && (addAttr(&txnDotU,"com.example.entries","kept") || writeDotUFile(&txnDotU,testFileName)!=DOTU_OK)) lookupErrors++;
+		freeDotU(&txnDotU);
+	}
+	if(loadDotUFile(testFileName,&txnDotU)!=DOTU_OK) lookupErrors++;
+	value=getDotUEntry(&txnDotU,4,&valueLength);
+	if(value==NULL || valueLength!=24 || getDotUAttr(&txnDotU,"com.example.entries",&valueLength)==NULL) lookupErrors++;
+	if(probeDotUFile(testFileName,&probe)!=DOTU_OK || probe.header.numEntries!=txnDotU.header.numEntries || probe.numAttrs!=attrNum+1) lookupErrors++;
+	freeDotU(&txnDotU);
+	freeDotU(&myDotU);
+	if(lookupErrors!=0){
+		printf("NOK - Passthrough entries got %i things wrong.\n",lookupErrors);
+		nok++;
+	} else {
+		printf("OK - Entries the library doesn't know are kept and written back.\n");
+		ok++;
+	}
+
+	/* Test the structural compare - a loaded and a mapped copy of the
+	   same file are equal and hash the same, the diff names each kind
+	   of edit, and a rewrite with a new layout still compares equal. */
+	myDotU=readDotUFile(argv[1]);
+	for(attrNum=0;nextDotUAttr(&myDotU,&attrNum)!=NULL;);
+	lookupErrors=0;
+	if(mapDotUFile(argv[1],&mappedDotU)!=DOTU_OK || loadDotUFile(argv[1],&txnDotU)!=DOTU_OK) lookupErrors++;
+	if(equalDotU(&myDotU,&mappedDotU)!=1 || diffDotU(&myDotU,&mappedDotU,countDiff,NULL)!=0) lookupErrors++;
+	if(fingerprintDotU(&myDotU,&fingerprint[0])!=DOTU_OK || fingerprintDotU(&mappedDotU,&fingerprint[1])!=DOTU_OK
+	   || fingerprint[0]!=fingerprint[1]) lookupErrors++;
+	cursor=0;
+	if(attrNum>=1 && setDotUAttr(&txnDotU,nextDotUAttr(&myDotU,&cursor)->name,"changed",7)!=DOTU_OK) lookupErrors++;
+	if(attrNum>=2 && removeDotUAttr(&txnDotU,nextDotUAttr(&myDotU,&cursor)->name)!=DOTU_OK) lookupErrors++;
+	if(addAttr(&txnDotU,"com.example.diff","added")!=DOTU_OK || setDotUEntry(&txnDotU,4,"A comment.",10)!=DOTU_OK) lookupErrors++;
+	txnDotU.entry[getFinderInfoEntry(txnDotU)].data.finder.finderHeader[0]^=1;
+	memset(diffCounts,0,sizeof(diffCounts));
+	if(diffDotU(&myDotU,&txnDotU,countDiff,NULL)!=(attrNum>=1)+(attrNum>=2)+3) lookupErrors++;
+	if(diffCounts[DOTU_DIFF_FINDERINFO][DOTU_DIFF_CHANGED]!=1 || diffCounts[DOTU_DIFF_ATTR][DOTU_DIFF_ADDED]!=1
+	   || diffCounts[DOTU_DIFF_ATTR][DOTU_DIFF_CHANGED]!=(attrNum>=1) || diffCounts[DOTU_DIFF_ATTR][DOTU_DIFF_REMOVED]!=(attrNum>=2)
+	   || diffCounts[DOTU_DIFF_ENTRY][DOTU_DIFF_ADDED]!=1 || diffCounts[DOTU_DIFF_RESOURCE][DOTU_DIFF_CHANGED]!=0) lookupErrors++;
+	cursor=0;
+	if(attrNum>=1 && strcmp(diffChanged,nextDotUAttr(&myDotU,&cursor)->name)!=0) lookupErrors++;
+	if(diffDotU(&myDotU,&txnDotU,countDiff,&ok)!=1 || equalDotU(&myDotU,&txnDotU)!=0) lookupErrors++;
+	if(fingerprintDotU(&txnDotU,&fingerprint[1])!=DOTU_OK || fingerprint[0]==fingerprint[1]) lookupErrors++;
+	snprintf(testFileName,MAXFILENAMESIZE,"%s/t%i-%s",dirName,testFileNum++,fileName);
+	if(writeDotUFile(&txnDotU,testFileName)!=DOTU_OK) lookupErrors++;
+	freeDotU(&mappedDotU);
+	if(loadDotUFile(testFileName,&mappedDotU)!=DOTU_OK || equalDotU(&txnDotU,&mappedDotU)!=1
+	   || fingerprintDotU(&mappedDotU,&fingerprint[0])!=DOTU_OK || fingerprint[0]!=fingerprint[1]) lookupErrors++;
+	freeDotU(&mappedDotU);
+	freeDotU(&txnDotU);
+	freeDotU(&myDotU);
+	if(lookupErrors!=0){
+		printf("NOK - Structural compare got %i things wrong.\n",lookupErrors);
+		nok++;
+	} else {
+		printf("OK - Structural compare sees through layout and names every difference.\n");
+		ok++;
+	}
+
+	/* Test the value store - two loaded copies interned in one store
+	   share every name and value, an edit and a second intern
+	   keep them apart, and freeing both leaves the store empty. */
+	lookupErrors=0;
+	valueStore=createDotUValueStore();
+	if(valueStore==NULL || loadDotUFile(argv[1],&myDotU)!=DOTU_OK || loadDotUFile(argv[1],&mappedDotU)!=DOTU_OK) lookupErrors++;
+	if(internDotU(valueStore,&myDotU)!=DOTU_OK) lookupErrors++;
+	getDotUValueStoreStats(valueStore,&storeStats[0]);
+	if(internDotU(valueStore,&mappedDotU)!=DOTU_OK) lookupErrors++;
+	getDotUValueStoreStats(valueStore,&storeStats[1]);
+	if(storeStats[1].values!=storeStats[0].values || storeStats[1].bytes!=storeStats[0].bytes
+	   || storeStats[1].references!=2*storeStats[0].references || storeStats[1].bytesReferenced!=2*storeStats[0].bytesReferenced) lookupErrors++;
+	cursor=0;
+	attrNum=0;
+	while((attr=nextDotUAttr(&myDotU,&cursor))!=NULL){
+		otherAttr=nextDotUAttr(&mappedDotU,&attrNum);
+		if(otherAttr==NULL || otherAttr->name!=attr->name || otherAttr->value!=attr->value) lookupErrors++;
+	}
+	if(equalDotU(&myDotU,&mappedDotU)!=1) lookupErrors++;
+	if(setDotUAttr(&mappedDotU,"com.example.interned","changed",7)!=DOTU_OK || internDotU(valueStore,&mappedDotU)!=DOTU_OK) lookupErrors++;
+	value=getDotUAttr(&mappedDotU,"com.example.interned",&valueLength);
+	if(value==NULL || valueLength!=7 || memcmp(value,"changed",7)!=0 || getDotUAttr(&myDotU,"com.example.interned",NULL)!=NULL) lookupErrors++;
+	snprintf(testFileName,MAXFILENAMESIZE,"%s/t%i-%s",dirName,testFileNum++,fileName);
+	if(writeDotUFile(&mappedDotU,testFileName)!=DOTU_OK || loadDotUFile(testFileName,&txnDotU)!=DOTU_OK || equalDotU(&txnDotU,&mappedDotU)!=1) lookupErrors++;
+	freeDotU(&txnDotU);
+	freeDotU(&myDotU);
+	getDotUValueStoreStats(valueStore,&storeStats[1]);
+	if(storeStats[1].references!=storeStats[0].references+1) lookupErrors++;
+	freeDotU(&mappedDotU);
+	getDotUValueStoreStats(valueStore,&storeStats[1]);
+	if(storeStats[1].values!=0 || storeStats[1].references!=0 || storeStats[1].bytes!=0) lookupErrors++;
+	destroyDotUValueStore(valueStore);
+	if(lookupErrors!=0){
+		printf("NOK - Value store got %i things wrong.\n",lookupErrors);
+		nok++;
+	} else {
+		printf("OK - Interned DotUs share their values and give them back when freed.\n");
+		ok++;
+	}
+
+	/* Test the name table - a loaded and a mapped copy give each attr
+	   the same id, the loaded one keeps no name copies of its own, and
+	   lookups by id agree with lookups by name, including for an attr
+	   made by hand with no id. */
+	lookupErrors=0;
+	if(loadDotUFile(argv[1],&myDotU)!=DOTU_OK || mapDotUFile(argv[1],&mappedDotU)!=DOTU_OK) lookupErrors++;
+	cursor=0;
+	attrNum=0;
+	while((attr=nextDotUAttr(&myDotU,&cursor))!=NULL){
+		otherAttr=nextDotUAttr(&mappedDotU,&attrNum);
+		if(attr->nameId==0 || otherAttr==NULL || otherAttr->nameId!=attr->nameId || getDotUName(attr->nameId)!=attr->name
+		   || getDotUNameId(attr->name)!=attr->nameId || findDotUNameId(otherAttr->name)!=attr->nameId) lookupErrors++;
+		if(getDotUAttrById(&mappedDotU,attr->nameId,&valueLength)!=otherAttr->value || valueLength!=otherAttr->valueLength) lookupErrors++;
+	}
+	if(findDotUNameId("com.example.named")!=0 || getDotUName(0)!=NULL || getDotUNameId("")!=0) lookupErrors++;
+	nameId=getDotUNameId("com.example.named");
+	if(nameId==0 || findDotUNameId("com.example.named")!=nameId || strcmp(getDotUName(nameId),"com.example.named")!=0) lookupErrors++;
+	if(setDotUAttr(&myDotU,"com.example.named","by id",5)!=DOTU_OK) lookupErrors++;
+	value=getDotUAttrById(&myDotU,nameId,&valueLength);
+	if(value==NULL || valueLength!=5 || memcmp(value,"by id",5)!=0 || getDotUAttrById(&mappedDotU,nameId,NULL)!=NULL) lookupErrors++;
+	myDotU.entry[getFinderInfoEntry(myDotU)].data.finder.attr[getAttrIndex(myDotU,"com.example.named")].nameId=0;
+	if(getDotUAttrById(&myDotU,nameId,NULL)!=value) lookupErrors++;
+	freeDotU(&mappedDotU);
+	freeDotU(&myDotU);
+	if(lookupErrors!=0){
+		printf("NOK - Name table got %i things wrong.\n",lookupErrors);
+		nok++;
+	} else {
+		printf("OK - Attr names map to shared ids and lookups by id match lookups by name.\n");
+		ok++;
+	}
+
+	/* Test the column decode - every column agrees with the attrs of a
+	   loaded copy, in file order, and a cut off image is turned down. */
+	lookupErrors=0;
+	imageLength=(stat(argv[1],&imageStat)==0) ? (uint32_t)imageStat.st_size : 0;
+	imageBuf=(char*)malloc(imageLength+1);
+	imageFile=fopen(argv[1],"rb");
+	if(imageFile==NULL || fread(imageBuf,1,imageLength,imageFile)!=imageLength) lookupErrors++;
+	if(imageFile!=NULL) fclose(imageFile);
+	if(loadDotUFile(argv[1],&myDotU)!=DOTU_OK || decodeDotUAttrs(imageBuf,imageLength,&attrTable)!=DOTU_OK) lookupErrors++;
+	for(cursor=0;(attr=nextDotUAttr(&myDotU,&cursor))!=NULL;){
+		i=(int)cursor-1;
+		if((uint32_t)i>=attrTable.numAttrs || attrTable.nameId[i]!=attr->nameId || attrTable.nameLength[i]!=attr->nameLength
+		   || strcmp(attrTable.image+attrTable.nameOffset[i],attr->name)!=0 || attrTable.valueLength[i]!=attr->valueLength
+		   || memcmp(attrTable.image+attrTable.valueOffset[i],attr->value,attr->valueLength)!=0
+		   || attrTable.flags[i]!=(((unsigned char)attr->flags[0]<<8) | (unsigned char)attr->flags[1])
+		   || findDotUTableAttr(&attrTable,attr->nameId)!=i) lookupErrors++;
+	}
+	if(cursor!=attrTable.numAttrs) lookupErrors++;
+	if(attrTable.numAttrs>0){
+		j=(int)attrTable.nameOffset[attrTable.numAttrs-1];
+		freeDotUAttrTable(&attrTable);
+		if(decodeDotUAttrs(imageBuf,(uint32_t)j,&attrTable)!=DOTU_EFORMAT || attrTable.numAttrs!=0) lookupErrors++;
+	}
+	if(decodeDotUAttrs(imageBuf,20,&attrTable)!=DOTU_EFORMAT) lookupErrors++;
+	freeDotUAttrTable(&attrTable);
+	freeDotU(&myDotU);
+	free(imageBuf);
+	if(lookupErrors!=0){
+		printf("NOK - Attr columns got %i things wrong.\n",lookupErrors);
+		nok++;
+	} else {
+		printf("OK - Attr headers decode into columns that match the parsed attrs.\n");
+		ok++;
+	}
+
+	/* Test snapshots - a reader's version doesn't change under it while
+	   an update is edited, readers after the publish see the edit, and
+	   an aborted update leaves the current version as it was. */
+	lookupErrors=0;
+	shared=NULL;
+	if(mapDotUFile(argv[1],&mappedDotU)!=DOTU_OK || (shared=shareDotU(&mappedDotU))==NULL || mappedDotU.entry!=NULL) lookupErrors++;
+	if(shared!=NULL){
+		acquireDotUSnapshot(shared,&snapshot[0]);
+		for(attrNum=0;nextDotUAttr(snapshot[0].dotU,&attrNum)!=NULL;);
+		draft=beginDotUUpdate(shared);
+		if(draft==NULL || setDotUAttr(draft,"com.example.snapshot","new",3)!=DOTU_OK) lookupErrors++;
+		cursor=0;
+		if(draft!=NULL && attrNum>0 && removeDotUAttr(draft,nextDotUAttr(snapshot[0].dotU,&cursor)->name)!=DOTU_OK) lookupErrors++;
+		acquireDotUSnapshot(shared,&snapshot[1]);
+		if(snapshot[1].dotU!=snapshot[0].dotU || getDotUAttr(snapshot[0].dotU,"com.example.snapshot",NULL)!=NULL) lookupErrors++;
+		releaseDotUSnapshot(&snapshot[1]);
+		for(cursor=0;nextDotUAttr(snapshot[0].dotU,&cursor)!=NULL;);
+		if(cursor!=attrNum || snapshot[0].version!=1) lookupErrors++;
+		releaseDotUSnapshot(&snapshot[0]);
+		if(publishDotUUpdate(shared)!=DOTU_OK) lookupErrors++;
+		acquireDotUSnapshot(shared,&snapshot[0]);
+		value=getDotUAttr(snapshot[0].dotU,"com.example.snapshot",&valueLength);
+		for(cursor=0;nextDotUAttr(snapshot[0].dotU,&cursor)!=NULL;);
+		if(value==NULL || valueLength!=3 || memcmp(value,"new",3)!=0 || cursor!=attrNum+(attrNum==0) || snapshot[0].version!=2
+		   || (getDotUResourceLength(snapshot[0].dotU)>0 && readDotUResource(snapshot[0].dotU,chunk,0,sizeof(chunk))<=0)) lookupErrors++;
+		releaseDotUSnapshot(&snapshot[0]);
+		draft=beginDotUUpdate(shared);
+		if(draft==NULL || removeDotUAttr(draft,"com.example.snapshot")!=DOTU_OK) lookupErrors++;
+		abortDotUUpdate(shared);
+		acquireDotUSnapshot(shared,&snapshot[0]);
+		if(getDotUAttr(snapshot[0].dotU,"com.example.snapshot",NULL)==NULL || snapshot[0].version!=2) lookupErrors++;
+		releaseDotUSnapshot(&snapshot[0]);
+		freeDotUShared(shared);
+	}
+	if(lookupErrors!=0){
+		printf("NOK - Snapshots got %i things wrong.\n",lookupErrors);
+		nok++;
+	} else {
+		printf("OK - Snapshots hold still while an update is made and published.\n");
+		ok++;
+	}
+
+	/* Test the bulk builder - out of order names with a repeat come out
+	   sorted with the last value winning, laid out and the same as the
+	   one addAttr builds, and iniDotU leaves no descriptor open. */
+	lookupErrors=0;
+	specs[0].name="com.example.zeta";
+	specs[1].name="com.example.alpha";
+	specs[2].name="com.example.mid";
+	specs[3].name="com.example.alpha";
+	specs[4].name="com.example.binary";
+	specs[0].value="last";
+	specs[1].value="first";
+	specs[2].value="";
+	specs[3].value="second";
+	specs[4].value="a\0b";
+	for(i=0;i<5;i++) specs[i].valueLength=strlen(specs[i].value);
+	specs[4].valueLength=3;
+	if(stat(argv[1],&imageStat)!=0 || buildDotU(specs,5,&imageStat,&myDotU)!=DOTU_OK) lookupErrors++;
+	if(!myDotU.layoutValid || myDotU.entry[0].data.finder.xattrHdr.debugTag!=(uint32_t)imageStat.st_ino) lookupErrors++;
+	for(cursor=0,name=NULL;(attr=nextDotUAttr(&myDotU,&cursor))!=NULL;name=attr->name){
+		if(name!=NULL && strcmp(name,attr->name)>=0) lookupErrors++;
+	}
+	value=getDotUAttr(&myDotU,"com.example.alpha",&valueLength);
+	if(cursor!=4 || value==NULL || valueLength!=6 || memcmp(value,"second",6)!=0) lookupErrors++;
+	value=getDotUAttr(&myDotU,"com.example.binary",&valueLength);
+	if(value==NULL || valueLength!=3 || memcmp(value,"a\0b",3)!=0) lookupErrors++;
+	txnDotU=iniDotU(argv[1]);
+	for(i=0;i<5;i++){
+		if(setDotUAttr(&txnDotU,specs[i].name,specs[i].value,specs[i].valueLength)!=DOTU_OK) lookupErrors++;
+	}
+	if(equalDotU(&myDotU,&txnDotU)!=1) lookupErrors++;
+	snprintf(testFileName,MAXFILENAMESIZE,"%s/t%i-%s",dirName,testFileNum++,fileName);
+	if(writeDotUFile(&myDotU,testFileName)!=DOTU_OK || loadDotUFile(testFileName,&mappedDotU)!=DOTU_OK || equalDotU(&myDotU,&mappedDotU)!=1) lookupErrors++;
+	freeDotU(&mappedDotU);
+	freeDotU(&txnDotU);
+	freeDotU(&myDotU);
+	specs[0].name="";
+	if(buildDotU(specs,5,NULL,&myDotU)!=DOTU_EINVAL || buildDotU(NULL,0,NULL,&myDotU)!=DOTU_OK || getFinderInfoEntry(myDotU)!=0) lookupErrors++;
+	freeDotU(&myDotU);
+	fd=dup(0);
+	close(fd);
+	myDotU=iniDotU(argv[1]);
+	freeDotU(&myDotU);
+	k=dup(0);
+	if(k!=fd) lookupErrors++;
+	close(k);
+	if(lookupErrors!=0){
+		printf("NOK - Bulk builder got %i things wrong.\n",lookupErrors);
+		nok++;
+	} else {
+		printf("OK - Bulk builder sorts once and matches a DotU built attr by attr.\n");
+		ok++;
+	}
 
 	/* Print summary of tests */
 	if(nok==0) printf("All %u tests OK!\n",ok);